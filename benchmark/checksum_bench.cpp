@@ -0,0 +1,96 @@
+/****************************************************************************************
+ * @file checksum_bench.cpp
+ * @brief throughput of crc32c and XXH64
+ * @author Liu Hua Jun
+ * @email wojiaoliuhuajun@126.com
+ * @license Use of this source code is governed by The GNU Affero General Public License Version 3
+ *          which can be found in the LICENSE file
+ *
+ * Checks known values, then reports GB/s of each implementation for several buffer sizes
+ * and for a read task scattered over 4KB buffers.
+ * usage: checksum_bench [-t total_mb_per_case]
+ ***************************************************************************************/
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <functional>
+#include "encrypt/crc32c.h"
+#include "encrypt/xxhash64.h"
+#include "util/util.h"
+
+using namespace stable_infra::encrypt;
+
+static volatile uint64_t sink = 0;
+
+static double measure(uint64_t total, size_t len, const std::function<uint64_t()>& func)
+{
+    uint64_t rounds = total / len + 1;
+    uint64_t begin = stable_infra::util::monotonic_ns();
+    for (uint64_t i = 0; i < rounds; ++i) {
+        sink = sink + func();
+    }
+    uint64_t ns = stable_infra::util::monotonic_ns() - begin;
+    return (double)(rounds * len) / (ns > 0 ? ns : 1);
+}
+
+static bool check()
+{
+    const char* digits = "123456789";
+    bool is_ok = crc32c(digits, 9) == 0xE3069283u && crc32c_software(digits, 9) == 0xE3069283u
+        && xxh64("", 0) == 0xEF46DB3751D8E999ull;
+    // hardware, software, scattered and streaming results must agree on odd sizes and offsets
+    std::vector<char> buf(100000);
+    for (size_t i = 0; i < buf.size(); ++i) {
+        buf[i] = (char)(i * 131 + 7);
+    }
+    for (size_t len = 0; len < buf.size() && is_ok; len = len * 3 + 1) {
+        const char* p = buf.data() + 3;
+        size_t n = std::min(len, buf.size() - 3);
+        ::iovec iov[3] = { { (void*)p, n / 3 }, { (void*)(p + n / 3), n / 5 }, { (void*)(p + n / 3 + n / 5), n - n / 3 - n / 5 } };
+        uint32_t crc = crc32c(p, n);
+        uint64_t hash = xxh64(p, n, 7);
+        is_ok = crc == crc32c_software(p, n) && crc == crc32c(iov, 3)
+            && crc == crc32c(p + n / 2, n - n / 2, crc32c(p, n / 2)) && hash == xxh64(iov, 3, 7);
+    }
+    return is_ok;
+}
+
+int main(int argc, char** argv)
+{
+    uint64_t total_mb = 512;
+    int32_t opt = 0;
+    while ((opt = getopt(argc, argv, "t:")) != -1) {
+        if (opt == 't') {
+            total_mb = strtoull(optarg, nullptr, 10);
+        }
+    }
+    uint64_t total = total_mb << 20;
+    if (! check()) {
+        printf("checksum mismatch\n");
+        return 1;
+    }
+    printf("crc32c implementation: %s\n", crc32c_impl_name());
+    printf("%10s %16s %16s %16s\n", "bytes", "crc32c GB/s", "crc32c sw GB/s", "xxh64 GB/s");
+    std::vector<char> buf(1 << 20, 'x');
+    const size_t sizes[] = { 64, 1024, 16384, 1 << 20 };
+    for (size_t len : sizes) {
+        const char* p = buf.data();
+        double hw = measure(total, len, [p, len]() { return (uint64_t)crc32c(p, len); });
+        double sw = measure(total / 4, len, [p, len]() { return (uint64_t)crc32c_software(p, len); });
+        double xx = measure(total, len, [p, len]() { return xxh64(p, len); });
+        printf("%10zu %16.2f %16.2f %16.2f\n", len, hw, sw, xx);
+    }
+    // a 64KB read task scattered over 4KB buffers
+    std::vector<::iovec> iov(16);
+    for (size_t i = 0; i < iov.size(); ++i) {
+        iov[i].iov_base = buf.data() + i * 8192;
+        iov[i].iov_len = 4096;
+    }
+    const ::iovec* v = iov.data();
+    double hw = measure(total, 65536, [v]() { return (uint64_t)crc32c(v, 16); });
+    double xx = measure(total, 65536, [v]() { return xxh64(v, 16); });
+    printf("%10s %16.2f %16s %16.2f\n", "16x4KB iov", hw, "-", xx);
+    return 0;
+}
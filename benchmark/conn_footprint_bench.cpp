@@ -0,0 +1,153 @@
+/****************************************************************************************
+ * @file conn_footprint_bench.cpp
+ * @brief memory footprint of idle connections registered in one loop
+ * @author Liu Hua Jun
+ * @email wojiaoliuhuajun@126.com
+ * @license Use of this source code is governed by The GNU Affero General Public License Version 3
+ *          which can be found in the LICENSE file
+ *
+ * Opens n loopback tcp connections, registers one read on the accepted side of each of them
+ * and reports growth of RSS and memory_stats of the loop per connection.
+ * usage: conn_footprint_bench [-n connection_count]
+ ***************************************************************************************/
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include "event/epoll.h"
+
+/// connections of each listen port, below the ephemeral port range
+#define CONN_PER_PORT 20000
+
+using namespace stable_infra::event;
+
+static uint64_t get_rss()
+{
+    long pages = 0;
+    long resident = 0;
+    FILE* fp = fopen("/proc/self/statm", "r");
+    if (fp == nullptr) {
+        return 0;
+    }
+    if (fscanf(fp, "%ld %ld", &pages, &resident) != 2) {
+        resident = 0;
+    }
+    fclose(fp);
+    return (uint64_t)resident * sysconf(_SC_PAGESIZE);
+}
+
+static fd_t create_listener(uint16_t& port)
+{
+    fd_t fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    if (fd < 0 || bind(fd, (sockaddr*)&addr, len) != 0 || listen(fd, 4096) != 0
+        || getsockname(fd, (sockaddr*)&addr, &len) != 0) {
+        return INVALID_FD;
+    }
+    port = ntohs(addr.sin_port);
+    return fd;
+}
+
+int main(int argc, char** argv)
+{
+    uint32_t conn_cnt = 100000;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        if (opt == 'n') {
+            conn_cnt = (uint32_t)strtoul(optarg, nullptr, 10);
+        }
+    }
+
+    rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max = 2 * (rlim_t)conn_cnt + 1024;
+    if (setrlimit(RLIMIT_NOFILE, &limit) != 0) {
+        getrlimit(RLIMIT_NOFILE, &limit);
+        if (limit.rlim_cur < 2 * (rlim_t)conn_cnt + 64) {
+            conn_cnt = (uint32_t)((limit.rlim_cur - 64) / 2);
+            printf("RLIMIT_NOFILE is %lu, connection count is reduced to %u\n", (unsigned long)limit.rlim_cur, conn_cnt);
+        }
+    }
+
+    std::vector<fd_t> clients;
+    std::vector<fd_t> servers;
+    clients.reserve(conn_cnt);
+    servers.reserve(conn_cnt);
+    fd_t listen_fd = INVALID_FD;
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    for (uint32_t i = 0; i < conn_cnt; ++i) {
+        if (i % CONN_PER_PORT == 0) {
+            STABLE_INFRA_SAFE_CLOSE_FD(listen_fd);
+            uint16_t port = 0;
+            listen_fd = create_listener(port);
+            if (listen_fd == INVALID_FD) {
+                printf("create listener failed\n");
+                return -1;
+            }
+            addr.sin_port = htons(port);
+        }
+        fd_t client = socket(AF_INET, SOCK_STREAM, 0);
+        if (client < 0 || connect(client, (sockaddr*)&addr, sizeof(addr)) != 0) {
+            printf("connect failed after %u connections\n", i);
+            conn_cnt = i;
+            break;
+        }
+        fd_t server = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (server < 0) {
+            printf("accept failed after %u connections\n", i);
+            conn_cnt = i;
+            break;
+        }
+        clients.push_back(client);
+        servers.push_back(server);
+    }
+    STABLE_INFRA_SAFE_CLOSE_FD(listen_fd);
+
+    epoll loop;
+    loop.init();
+    memory_stats stats;
+    loop.get_memory_stats(stats);
+    auto rss_before = get_rss();
+    auto loop_before = stats.total_bytes_;
+
+    // idle connections: every read shares one buffer and never completes
+    static char buffer[64];
+    ::iovec iov{ buffer, sizeof(buffer) };
+    auto cb = [](int32_t ret) {};
+    for (auto fd : servers) {
+        loop.submit_async_read(fd, &iov, 1, cb);
+    }
+    loop.dispatch(0);
+
+    auto rss_after = get_rss();
+    loop.get_memory_stats(stats);
+    printf("connections:          %u\n", conn_cnt);
+    printf("rss growth:           %lu bytes, %.1f bytes/conn\n",
+           (unsigned long)(rss_after - rss_before), conn_cnt == 0 ? 0.0 : (double)(rss_after - rss_before) / conn_cnt);
+    printf("loop accounted:       %lu bytes, %.1f bytes/conn\n",
+           (unsigned long)(stats.total_bytes_ - loop_before), conn_cnt == 0 ? 0.0 : (double)(stats.total_bytes_ - loop_before) / conn_cnt);
+    printf("  fd table:           %lu\n", (unsigned long)stats.fd_table_bytes_);
+    printf("  event objects:      %lu\n", (unsigned long)stats.event_bytes_);
+    printf("  task queues:        %lu\n", (unsigned long)stats.task_queue_bytes_);
+    printf("  iov buffers:        %lu\n", (unsigned long)stats.iov_buffer_bytes_);
+    printf("  loop:               %lu\n", (unsigned long)stats.loop_bytes_);
+
+    loop.close();
+    for (auto fd : servers) {
+        ::close(fd);
+    }
+    for (auto fd : clients) {
+        ::close(fd);
+    }
+    return 0;
+}
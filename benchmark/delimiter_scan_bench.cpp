@@ -0,0 +1,148 @@
+/****************************************************************************************
+ * @file delimiter_scan_bench.cpp
+ * @brief throughput of find_delimiter against memchr
+ * @author Liu Hua Jun
+ * @email wojiaoliuhuajun@126.com
+ * @license Use of this source code is governed by The GNU Affero General Public License Version 3
+ *          which can be found in the LICENSE file
+ *
+ * Checks results against the scalar implementation, then reports GB/s of splitting a buffer
+ * into lines of several sizes by "\r\n", with find_delimiter and with memchr plus a check of
+ * the following byte, the usual scalar way, and of one search over a read task scattered
+ * over 4KB buffers.
+ * usage: delimiter_scan_bench [-t total_mb_per_case]
+ ***************************************************************************************/
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <functional>
+#include "util/delimiter_scanner.h"
+#include "util/util.h"
+
+using namespace stable_infra::util;
+
+static volatile uint64_t sink = 0;
+
+static double measure(uint64_t total, size_t len, const std::function<uint64_t()>& func)
+{
+    uint64_t rounds = total / len + 1;
+    uint64_t begin = stable_infra::util::monotonic_ns();
+    for (uint64_t i = 0; i < rounds; ++i) {
+        sink = sink + func();
+    }
+    uint64_t ns = stable_infra::util::monotonic_ns() - begin;
+    return (double)(rounds * len) / (ns > 0 ? ns : 1);
+}
+
+static uint64_t count_simd(const char* p, size_t len)
+{
+    uint64_t cnt = 0;
+    const char* end = p + len;
+    while (const char* found = find_delimiter(p, end - p, "\r\n", 2)) {
+        ++cnt;
+        p = found + 2;
+    }
+    return cnt;
+}
+
+static uint64_t count_memchr(const char* p, size_t len)
+{
+    uint64_t cnt = 0;
+    const char* end = p + len;
+    while (p < end) {
+        const char* found = static_cast<const char*>(memchr(p, '\r', end - p));
+        if (found == nullptr || found + 1 == end) {
+            break;
+        }
+        if (found[1] == '\n') {
+            ++cnt;
+            p = found + 2;
+        } else {
+            p = found + 1;
+        }
+    }
+    return cnt;
+}
+
+static bool check()
+{
+    // delimiters at every offset and length, with partial ones around them
+    const char* delimiters[] = { "\n", "\r\n", "\r\n\r\n", "abcdefgh" };
+    std::vector<char> buf(300);
+    for (const char* d : delimiters) {
+        uint32_t dl = (uint32_t)strlen(d);
+        for (size_t len = 0; len < buf.size(); ++len) {
+            for (size_t pos = 0; pos + dl <= len; pos += 7) {
+                for (size_t i = 0; i < buf.size(); ++i) {
+                    buf[i] = (i % 5 == 0) ? d[0] : (char)('A' + i % 23);
+                }
+                memcpy(buf.data() + pos, d, dl);
+                const char* p = buf.data();
+                const char* expect = find_delimiter_scalar(p, len, d, dl);
+                if (find_delimiter(p, len, d, dl) != expect) {
+                    return false;
+                }
+                ::iovec iov[3] = { { (void*)p, len / 3 }, { (void*)(p + len / 3), 1 },
+                    { (void*)(p + len / 3 + 1), len - len / 3 - 1 } };
+                int64_t offset = expect == nullptr ? -1 : expect - p;
+                if (len > 0 && find_delimiter(iov, 3, d, dl) != offset) {
+                    return false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    uint64_t total_mb = 512;
+    int32_t opt = 0;
+    while ((opt = getopt(argc, argv, "t:")) != -1) {
+        if (opt == 't') {
+            total_mb = strtoull(optarg, nullptr, 10);
+        }
+    }
+    uint64_t total = total_mb << 20;
+    if (! check()) {
+        printf("delimiter scan mismatch\n");
+        return 1;
+    }
+    printf("find_delimiter implementation: %s\n", delimiter_scanner_impl_name());
+    printf("%10s %20s %16s\n", "line bytes", "find_delimiter GB/s", "memchr GB/s");
+    const size_t buffer_size = 1 << 16;
+    std::vector<char> buf(buffer_size);
+    const size_t line_sizes[] = { 16, 64, 256, 4096 };
+    for (size_t line : line_sizes) {
+        for (size_t i = 0; i < buf.size(); ++i) {
+            buf[i] = (char)('a' + i % 26);
+        }
+        for (size_t i = line; i <= buf.size(); i += line) {
+            buf[i - 2] = '\r';
+            buf[i - 1] = '\n';
+        }
+        const char* p = buf.data();
+        if (count_simd(p, buffer_size) != count_memchr(p, buffer_size)) {
+            printf("line count mismatch\n");
+            return 1;
+        }
+        double simd = measure(total, buffer_size, [p, buffer_size]() { return count_simd(p, buffer_size); });
+        double scalar = measure(total, buffer_size, [p, buffer_size]() { return count_memchr(p, buffer_size); });
+        printf("%10zu %20.2f %16.2f\n", line, simd, scalar);
+    }
+    // a 64KB read task scattered over 4KB buffers with the delimiter at its end
+    memset(buf.data(), 'x', buf.size());
+    buf[buf.size() - 2] = '\r';
+    buf[buf.size() - 1] = '\n';
+    std::vector<::iovec> iov(16);
+    for (size_t i = 0; i < iov.size(); ++i) {
+        iov[i].iov_base = buf.data() + i * 4096;
+        iov[i].iov_len = 4096;
+    }
+    const ::iovec* v = iov.data();
+    double simd = measure(total, buffer_size, [v]() { return (uint64_t)find_delimiter(v, 16, "\r\n", 2); });
+    printf("%10s %20.2f %16s\n", "16x4KB iov", simd, "-");
+    return 0;
+}
@@ -0,0 +1,255 @@
+/****************************************************************************************
+ * @file dispatch_bench.cpp
+ * @brief cost of dispatch per ready fd with many fds registered in one loop
+ * @author Liu Hua Jun
+ * @email wojiaoliuhuajun@126.com
+ * @license Use of this source code is governed by The GNU Affero General Public License Version 3
+ *          which can be found in the LICENSE file
+ *
+ * Registers n eventfds in one loop, then each round makes k of them readable, spread over the
+ * whole fd range, and times dispatch of them. With read tasks every fd has a pending read which
+ * its callback submits again, without tasks the reads are done and dispatch only marks the fds
+ * readable, which reads nothing but the hot part of event_action. Rounds run with warm caches
+ * and with caches evicted before dispatch, the case of a loop with more event_action objects
+ * than fit in cache. Cache misses of the loop thread are read with perf_event_open where the
+ * kernel exposes hardware counters.
+ * usage: dispatch_bench [-n fd_count] [-r rounds]
+ ***************************************************************************************/
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include "event/epoll.h"
+#include "util/util.h"
+
+using namespace stable_infra::event;
+
+/**
+ * @brief hardware cache misses of this thread in user space, unavailable in most virtual machines
+ */
+class miss_counter
+{
+    public:
+        miss_counter() {
+            perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = PERF_COUNT_HW_CACHE_MISSES;
+            attr.disabled = 1;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            fd_ = (fd_t)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        }
+        ~miss_counter() {
+            STABLE_INFRA_SAFE_CLOSE_FD(fd_);
+        }
+        bool is_valid() const {
+            return fd_ != INVALID_FD;
+        }
+        void start() {
+            if (fd_ != INVALID_FD) {
+                ioctl(fd_, PERF_EVENT_IOC_RESET, 0);
+                ioctl(fd_, PERF_EVENT_IOC_ENABLE, 0);
+            }
+        }
+        uint64_t stop() {
+            uint64_t value = 0;
+            if (fd_ != INVALID_FD) {
+                ioctl(fd_, PERF_EVENT_IOC_DISABLE, 0);
+                if (read(fd_, &value, sizeof(value)) != sizeof(value)) {
+                    value = 0;
+                }
+            }
+            return value;
+        }
+
+    private:
+        fd_t fd_{ INVALID_FD };
+};
+
+static volatile char sink = 0;
+
+struct bench_result
+{
+    double ns_per_fd_{ 0 };
+    double misses_per_fd_{ 0 };
+};
+
+/**
+ * @brief write a buffer larger than last level cache
+ */
+static void evict_caches(std::vector<char>& buf)
+{
+    for (size_t i = 0; i < buf.size(); i += 64) {
+        buf[i] = (char)(buf[i] + 1);
+    }
+    sink = buf[buf.size() / 2];
+}
+
+int main(int argc, char** argv)
+{
+    uint32_t fd_cnt = 100000;
+    uint32_t rounds = 20;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:r:")) != -1) {
+        if (opt == 'n') {
+            fd_cnt = (uint32_t)strtoul(optarg, nullptr, 10);
+        } else if (opt == 'r') {
+            rounds = (uint32_t)strtoul(optarg, nullptr, 10);
+        }
+    }
+    if (fd_cnt == 0 || rounds == 0) {
+        printf("usage: dispatch_bench [-n fd_count] [-r rounds]\n");
+        return 1;
+    }
+
+    rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max = (rlim_t)fd_cnt + 1024;
+    if (setrlimit(RLIMIT_NOFILE, &limit) != 0) {
+        getrlimit(RLIMIT_NOFILE, &limit);
+        if (limit.rlim_cur < (rlim_t)fd_cnt + 64) {
+            fd_cnt = (uint32_t)(limit.rlim_cur - 64);
+            printf("RLIMIT_NOFILE is %lu, fd count is reduced to %u\n", (unsigned long)limit.rlim_cur, fd_cnt);
+        }
+    }
+
+    std::vector<fd_t> fds;
+    fds.reserve(fd_cnt);
+    for (uint32_t i = 0; i < fd_cnt; ++i) {
+        fd_t fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (fd < 0) {
+            printf("eventfd failed after %u fds\n", i);
+            fd_cnt = i;
+            break;
+        }
+        fds.push_back(fd);
+    }
+    if (fd_cnt == 0) {
+        return 1;
+    }
+
+    epoll loop;
+    loop.init();
+    // every fd reads its counter into its own iovec and submits the read again
+    std::vector<uint64_t> values(fd_cnt);
+    std::vector<::iovec> iovs(fd_cnt);
+    uint64_t done = 0;
+    bool is_resubmit = true;
+    std::vector<callback_t> cbs(fd_cnt);
+    for (uint32_t i = 0; i < fd_cnt; ++i) {
+        cbs[i] = [&, i](int32_t ret) {
+            ++done;
+            if (! is_resubmit) {
+                return;
+            }
+            iovs[i].iov_base = &values[i];
+            iovs[i].iov_len = sizeof(uint64_t);
+            loop.submit_async_read(fds[i], &iovs[i], 1, cbs[i]);
+        };
+        iovs[i].iov_base = &values[i];
+        iovs[i].iov_len = sizeof(uint64_t);
+        if (loop.submit_async_read(fds[i], &iovs[i], 1, cbs[i]) != 0) {
+            printf("submit_async_read failed\n");
+            return 1;
+        }
+    }
+    loop.dispatch(0);
+
+    long llc = sysconf(_SC_LEVEL3_CACHE_SIZE);
+    std::vector<char> evict_buf(2 * (size_t)(llc > 0 ? llc : 32 << 20));
+    miss_counter counter;
+    auto run = [&](uint32_t ready_cnt, bool is_cold) {
+        bench_result result;
+        uint64_t total_ns = 0;
+        uint64_t total_misses = 0;
+        uint64_t one = 1;
+        uint32_t stride = fd_cnt / ready_cnt;
+        // first round warms up and is not counted
+        for (uint32_t r = 0; r <= rounds; ++r) {
+            for (uint32_t j = 0; j < ready_cnt; ++j) {
+                if (write(fds[(j * stride + r) % fd_cnt], &one, sizeof(one)) != sizeof(one)) {
+                    printf("eventfd write failed\n");
+                    exit(1);
+                }
+            }
+            if (is_cold) {
+                evict_caches(evict_buf);
+            }
+            done = 0;
+            counter.start();
+            uint64_t begin = stable_infra::util::monotonic_ns();
+            if (is_resubmit) {
+                while (done < ready_cnt) {
+                    loop.dispatch(0);
+                }
+            } else {
+                // fds are edge triggered, each dispatch takes up to EVENT_CNT of them
+                for (uint32_t i = 0; i <= ready_cnt / EVENT_CNT; ++i) {
+                    loop.dispatch(0);
+                }
+            }
+            uint64_t ns = stable_infra::util::monotonic_ns() - begin;
+            uint64_t misses = counter.stop();
+            if (r > 0) {
+                total_ns += ns;
+                total_misses += misses;
+            }
+        }
+        result.ns_per_fd_ = (double)total_ns / ((uint64_t)rounds * ready_cnt);
+        result.misses_per_fd_ = (double)total_misses / ((uint64_t)rounds * ready_cnt);
+        return result;
+    };
+    auto run_cases = [&]() {
+        printf("%10s %14s %16s %14s %16s\n", "ready fds", "warm ns/fd", "warm misses/fd", "cold ns/fd", "cold misses/fd");
+        const uint32_t ready_percents[] = { 1, 10, 100 };
+        for (auto percent : ready_percents) {
+            uint32_t ready_cnt = std::max(fd_cnt / 100 * percent, 1u);
+            auto warm = run(ready_cnt, false);
+            auto cold = run(ready_cnt, true);
+            if (counter.is_valid()) {
+                printf("%10u %14.1f %16.2f %14.1f %16.2f\n", ready_cnt, warm.ns_per_fd_, warm.misses_per_fd_,
+                       cold.ns_per_fd_, cold.misses_per_fd_);
+            } else {
+                printf("%10u %14.1f %16s %14.1f %16s\n", ready_cnt, warm.ns_per_fd_, "-", cold.ns_per_fd_, "-");
+            }
+        }
+    };
+
+    printf("fds: %u, event_action: %zu bytes, rounds: %u\n", fd_cnt, sizeof(event_action), rounds);
+    if (! counter.is_valid()) {
+        printf("hardware cache miss counter is not available, misses are not reported\n");
+    }
+    printf("with read tasks:\n");
+    run_cases();
+
+    // complete every read without submitting it again
+    is_resubmit = false;
+    uint64_t one = 1;
+    for (auto fd : fds) {
+        if (write(fd, &one, sizeof(one)) != sizeof(one)) {
+            printf("eventfd write failed\n");
+            return 1;
+        }
+    }
+    done = 0;
+    while (done < fd_cnt) {
+        loop.dispatch(0);
+    }
+    printf("without tasks:\n");
+    run_cases();
+
+    loop.close();
+    for (auto fd : fds) {
+        ::close(fd);
+    }
+    return 0;
+}
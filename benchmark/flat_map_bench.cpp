@@ -0,0 +1,122 @@
+/****************************************************************************************
+ * @file flat_map_bench.cpp
+ * @brief lookup cost of flat_map against std::unordered_map and std::map
+ * @author Liu Hua Jun
+ * @email wojiaoliuhuajun@126.com
+ * @license Use of this source code is governed by The GNU Affero General Public License Version 3
+ *          which can be found in the LICENSE file
+ *
+ * Inserts 10k, 1M and 10M scattered keys, then reports ns per successful and failed lookup
+ * in random order and estimated heap bytes per key. std::map is skipped above 1M keys.
+ * usage: flat_map_bench [-n lookups_per_case] [-m max_keys]
+ ***************************************************************************************/
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <random>
+#include <algorithm>
+#include "data_struct/flat_map.h"
+#include "util/util.h"
+
+using namespace stable_infra::data_struct;
+
+typedef void* value_t;
+
+static volatile uint64_t sink = 0;
+
+/**
+ * @brief ns per lookup of keys, in the order given
+ */
+template<typename MAP>
+static double measure(const MAP& map, const std::vector<uint32_t>& keys, uint64_t lookup_cnt)
+{
+    uint64_t found = 0;
+    size_t idx = 0;
+    uint64_t begin = stable_infra::util::monotonic_ns();
+    for (uint64_t i = 0; i < lookup_cnt; ++i) {
+        // a division per lookup would cost as much as a cached lookup
+        auto iter = map.find(keys[idx]);
+        if (++idx == keys.size()) {
+            idx = 0;
+        }
+        if (iter != map.end()) {
+            found += (uint64_t)(uintptr_t)iter->second;
+        }
+    }
+    uint64_t ns = stable_infra::util::monotonic_ns() - begin;
+    sink = sink + found;
+    return (double)ns / lookup_cnt;
+}
+
+/**
+ * @brief heap bytes, libstdc++ nodes hold a next pointer (unordered_map) or three pointers
+ *        and a color (map) besides the pair
+ */
+static uint64_t memory_usage(const flat_map<uint32_t, value_t>& map)
+{
+    return map.memory_usage();
+}
+
+static uint64_t memory_usage(const std::unordered_map<uint32_t, value_t>& map)
+{
+    return map.size() * (sizeof(std::pair<uint32_t, value_t>) + sizeof(void*)) + map.bucket_count() * sizeof(void*);
+}
+
+static uint64_t memory_usage(const std::map<uint32_t, value_t>& map)
+{
+    return map.size() * (sizeof(std::pair<uint32_t, value_t>) + 4 * sizeof(void*));
+}
+
+template<typename MAP>
+static void run(const char* name, const std::vector<uint32_t>& keys, const std::vector<uint32_t>& order,
+    const std::vector<uint32_t>& misses, uint64_t lookup_cnt)
+{
+    MAP map;
+    for (uint32_t i = 0; i < keys.size(); ++i) {
+        map[keys[i]] = (value_t)(uintptr_t)(i + 1);
+    }
+    double hit_ns = measure(map, order, lookup_cnt);
+    double miss_ns = measure(map, misses, lookup_cnt);
+    printf("%10zu %16s %12.1f %12.1f %14.1f\n", keys.size(), name, hit_ns, miss_ns,
+        (double)memory_usage(map) / keys.size());
+}
+
+int main(int argc, char** argv)
+{
+    uint64_t lookup_cnt = 10000000;
+    uint32_t max_keys = 10000000;
+    int32_t opt = 0;
+    while ((opt = getopt(argc, argv, "n:m:")) != -1) {
+        if (opt == 'n') {
+            lookup_cnt = strtoull(optarg, nullptr, 10);
+        } else if (opt == 'm') {
+            max_keys = (uint32_t)strtoul(optarg, nullptr, 10);
+        }
+    }
+    printf("%10s %16s %12s %12s %14s\n", "keys", "map", "hit ns", "miss ns", "bytes/key");
+    const uint32_t key_cnts[] = { 10000, 1000000, 10000000 };
+    std::mt19937 rng(1);
+    for (uint32_t key_cnt : key_cnts) {
+        if (key_cnt > max_keys) {
+            break;
+        }
+        // odd multiplier permutes uint32, keys are distinct and scattered, misses are even
+        std::vector<uint32_t> hits(key_cnt);
+        std::vector<uint32_t> misses(key_cnt);
+        for (uint32_t i = 0; i < key_cnt; ++i) {
+            hits[i] = (i * 2 + 1) * 2654435761u;
+            misses[i] = (i * 2 + 2) * 2654435761u;
+        }
+        std::vector<uint32_t> order(hits);
+        std::shuffle(order.begin(), order.end(), rng);
+        run<flat_map<uint32_t, value_t>>("flat_map", hits, order, misses, lookup_cnt);
+        run<std::unordered_map<uint32_t, value_t>>("unordered_map", hits, order, misses, lookup_cnt);
+        if (key_cnt <= 1000000) {
+            run<std::map<uint32_t, value_t>>("map", hits, order, misses, lookup_cnt);
+        }
+    }
+    return 0;
+}
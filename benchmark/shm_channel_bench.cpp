@@ -0,0 +1,258 @@
+/****************************************************************************************
+ * @file shm_channel_bench.cpp
+ * @brief message rate of shm_channel against loopback tcp between two processes
+ * @author Liu Hua Jun
+ * @email wojiaoliuhuajun@126.com
+ * @license Use of this source code is governed by The GNU Affero General Public License Version 3
+ *          which can be found in the LICENSE file
+ *
+ * A child process reads n messages of s bytes which the parent streams with up to w writes in
+ * flight, through shm_channel and through submit_async_write/read on a loopback tcp
+ * connection. Each run reports messages per second until the child has read all of them, and
+ * for shm_channel the eventfd writes made by the writer per message.
+ * usage: shm_channel_bench [-n message_count] [-s message_bytes] [-w writes_in_flight]
+ ***************************************************************************************/
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <functional>
+#include "event/epoll.h"
+#include "event/shm_channel.h"
+#include "util/util.h"
+
+using namespace stable_infra::event;
+
+using submit_func = std::function<int32_t(::iovec* buffer, const callback_t& cb)>;
+
+/**
+ * @brief write syscalls made by this process, sendmsg of sockets is not counted by kernel
+ */
+static uint64_t get_write_syscalls()
+{
+    char name[32];
+    unsigned long long value = 0;
+    uint64_t syscw = 0;
+    FILE* fp = fopen("/proc/self/io", "r");
+    if (fp == nullptr) {
+        return 0;
+    }
+    while (fscanf(fp, "%31s %llu", name, &value) == 2) {
+        if (strcmp(name, "syscw:") == 0) {
+            syscw = value;
+        }
+    }
+    fclose(fp);
+    return syscw;
+}
+
+/**
+ * @brief keep up to window writes in flight until msg_cnt messages are written
+ * @return failed writes
+ */
+static uint64_t run_writer(epoll& loop, const submit_func& submit, uint64_t msg_cnt, uint32_t msg_size, uint32_t window)
+{
+    std::vector<char> msg(msg_size, 'x');
+    std::vector<::iovec> iovs(window);
+    uint64_t submitted = 0;
+    uint64_t done = 0;
+    uint64_t failed = 0;
+    std::function<void(uint32_t)> submit_one = [&](uint32_t slot) {
+        // the poll advances iovec of a partial write, each write in flight has its own
+        iovs[slot].iov_base = msg.data();
+        iovs[slot].iov_len = msg_size;
+        ++submitted;
+        auto ret = submit(&iovs[slot], [&, slot](int32_t ret) {
+            ++done;
+            failed += ret <= 0 ? 1 : 0;
+            if (submitted < msg_cnt) {
+                submit_one(slot);
+            }
+        });
+        if (ret != 0) {
+            ++done;
+            ++failed;
+        }
+    };
+    for (uint32_t i = 0; i < window && submitted < msg_cnt; ++i) {
+        submit_one(i);
+    }
+    while (done < msg_cnt) {
+        loop.dispatch(10);
+    }
+    return failed;
+}
+
+/**
+ * @brief read until total bytes or msg_cnt messages are received
+ */
+static void run_reader(epoll& loop, const submit_func& submit, uint64_t total, uint64_t msg_cnt)
+{
+    std::vector<char> buf(64 * 1024);
+    ::iovec iov;
+    uint64_t bytes = 0;
+    uint64_t msgs = 0;
+    bool is_closed = false;
+    std::function<void()> submit_one = [&]() {
+        iov.iov_base = buf.data();
+        iov.iov_len = buf.size();
+        submit(&iov, [&](int32_t ret) {
+            if (ret <= 0) {
+                is_closed = true;
+                return;
+            }
+            bytes += ret;
+            ++msgs;
+            if (bytes < total && msgs < msg_cnt) {
+                submit_one();
+            }
+        });
+    };
+    submit_one();
+    while (! is_closed && bytes < total && msgs < msg_cnt) {
+        loop.dispatch(10);
+    }
+}
+
+static bool create_tcp_pair(fd_t& client, fd_t& server)
+{
+    fd_t listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    if (listen_fd < 0 || bind(listen_fd, (sockaddr*)&addr, len) != 0 || listen(listen_fd, 1) != 0
+        || getsockname(listen_fd, (sockaddr*)&addr, &len) != 0) {
+        return false;
+    }
+    client = socket(AF_INET, SOCK_STREAM, 0);
+    bool is_ok = client >= 0 && connect(client, (sockaddr*)&addr, len) == 0;
+    server = is_ok ? accept(listen_fd, nullptr, nullptr) : INVALID_FD;
+    ::close(listen_fd);
+    if (server < 0) {
+        return false;
+    }
+    int one = 1;
+    setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    stable_infra::util::util_make_fd_nonblocking(client);
+    stable_infra::util::util_make_fd_nonblocking(server);
+    return true;
+}
+
+/**
+ * @brief time from the first write until child has read everything
+ */
+static double wait_child(pid_t pid, uint64_t begin)
+{
+    int status = 0;
+    waitpid(pid, &status, 0);
+    uint64_t ns = stable_infra::util::monotonic_ns() - begin;
+    if (! WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        return -1;
+    }
+    return (double)ns;
+}
+
+static void bench_shm(uint64_t msg_cnt, uint32_t msg_size, uint32_t window)
+{
+    auto loop = std::make_shared<epoll>();
+    loop->init();
+    shm_channel writer(loop);
+    if (writer.create(4 << 20) != RET_SUC) {
+        printf("shm_channel create failed\n");
+        return;
+    }
+    fd_t mem_fd, notify_fd0, notify_fd1;
+    writer.get_fds(mem_fd, notify_fd0, notify_fd1);
+    pid_t pid = fork();
+    if (pid == 0) {
+        auto child_loop = std::make_shared<epoll>();
+        child_loop->init();
+        shm_channel reader(child_loop);
+        if (reader.attach(dup(mem_fd), dup(notify_fd0), dup(notify_fd1)) != RET_SUC) {
+            _exit(1);
+        }
+        run_reader(*child_loop, [&reader](::iovec* buffer, const callback_t& cb) {
+            return reader.submit_async_read(buffer, 1, cb);
+        }, msg_cnt * msg_size, msg_cnt);
+        _exit(0);
+    }
+    uint64_t syscw = get_write_syscalls();
+    uint64_t begin = stable_infra::util::monotonic_ns();
+    auto failed = run_writer(*loop, [&writer](::iovec* buffer, const callback_t& cb) {
+        return writer.submit_async_write(buffer, 1, cb);
+    }, msg_cnt, msg_size, window);
+    syscw = get_write_syscalls() - syscw;
+    double ns = wait_child(pid, begin);
+    if (failed > 0 || ns < 0) {
+        printf("%-12s failed\n", "shm_channel");
+        return;
+    }
+    printf("%-12s %14.2f %18.4f\n", "shm_channel", msg_cnt * 1e3 / ns, (double)syscw / msg_cnt);
+}
+
+static void bench_tcp(uint64_t msg_cnt, uint32_t msg_size, uint32_t window)
+{
+    fd_t client = INVALID_FD;
+    fd_t server = INVALID_FD;
+    if (! create_tcp_pair(client, server)) {
+        printf("loopback tcp connection failed\n");
+        return;
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        ::close(client);
+        epoll child_loop;
+        child_loop.init();
+        run_reader(child_loop, [&child_loop, server](::iovec* buffer, const callback_t& cb) {
+            return child_loop.submit_async_read(server, buffer, 1, cb);
+        }, msg_cnt * msg_size, UINT64_MAX);
+        _exit(0);
+    }
+    ::close(server);
+    epoll loop;
+    loop.init();
+    uint64_t begin = stable_infra::util::monotonic_ns();
+    auto failed = run_writer(loop, [&loop, client](::iovec* buffer, const callback_t& cb) {
+        return loop.submit_async_write(client, buffer, 1, cb);
+    }, msg_cnt, msg_size, window);
+    double ns = wait_child(pid, begin);
+    ::close(client);
+    if (failed > 0 || ns < 0) {
+        printf("%-12s failed\n", "tcp");
+        return;
+    }
+    printf("%-12s %14.2f %18s\n", "tcp", msg_cnt * 1e3 / ns, "-");
+}
+
+int main(int argc, char** argv)
+{
+    uint64_t msg_cnt = 1000000;
+    uint32_t msg_size = 64;
+    uint32_t window = 64;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:s:w:")) != -1) {
+        if (opt == 'n') {
+            msg_cnt = strtoull(optarg, nullptr, 10);
+        } else if (opt == 's') {
+            msg_size = (uint32_t)strtoul(optarg, nullptr, 10);
+        } else if (opt == 'w') {
+            window = (uint32_t)strtoul(optarg, nullptr, 10);
+        }
+    }
+    if (msg_cnt == 0 || msg_size == 0 || msg_size > 64 * 1024 || window == 0) {
+        printf("usage: shm_channel_bench [-n message_count] [-s message_bytes(1-65536)] [-w writes_in_flight]\n");
+        return 1;
+    }
+    printf("%llu messages of %u bytes, %u writes in flight\n", (unsigned long long)msg_cnt, msg_size, window);
+    printf("%-12s %14s %18s\n", "path", "M msg/s", "eventfd writes/msg");
+    bench_shm(msg_cnt, msg_size, window);
+    bench_tcp(msg_cnt, msg_size, window);
+    return 0;
+}
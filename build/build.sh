@@ -14,17 +14,20 @@ function usage()
 {
     echo "
 Usage: sh build.sh [-j parallel_count]           Parallel compile. make -j \$parallel_count
+                   [-b]                          Build benchmarks into ./build/bin
     "
 }
 
 parallel_count=1
-while getopts "hj:" opt;
+cmake_options=""
+while getopts "hj:b" opt;
 do
     case ${opt} in
         h)  usage
             exit 0
             ;;
         j)  parallel_count=${OPTARG};;
+        b)  cmake_options="${cmake_options} -DBENCHMARK_SWITCH=ON";;
         ?)  echo "unknown parameter"
             usage
             exit -1
@@ -39,8 +42,8 @@ check_ret "make -p build"
 cd build
 check_ret "cd build"
 
-cmake ../../
-check_ret "cmake ../../"
+cmake ${cmake_options} ../../
+check_ret "cmake ${cmake_options} ../../"
 
 make -j ${parallel_count}
 check_ret "make -j ${parallel_count}"
@@ -13,4 +13,6 @@ extern thread_local int32_t error_no;
 enum ERROR_NO
 {
     READER_EVENT_NOT_RELEASE = 1,
+    WRITE_QUEUE_FULL = 2,         ///< queued write bytes of fd or loop reach the hard limit
+    MSG_TOO_LARGE = 3,            ///< a message does not fit in the read buffer and is kept
 };
@@ -31,5 +31,6 @@ enum class FD_TYPE: uint32_t {
     TCP_FD = 1,
     UDP_FD = 2,
     GENERAL_FD = 3,  // 包括 FILE_FD, SIGNAL_FD, EVENT_FD, TIMER_FD
+    UNIX_FD = 4,     // AF_UNIX stream or seqpacket socket
     UNKNOWN_FD = 8
 };
@@ -0,0 +1,157 @@
+/****************************************************************************************
+ * @file buffer_chain.h
+ * @brief chain of reference counted buffer segments for zero copy message assembly
+ * @author Liu Hua Jun
+ * @email wojiaoliuhuajun@126.com
+ * @license Use of this source code is governed by The GNU Affero General Public License Version 3
+ *          which can be found in the LICENSE file
+ ***************************************************************************************/
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <vector>
+#include <sys/uio.h>
+
+/// bytes of a slab block including its header, blocks of this size are cached per thread
+#define BUFFER_BLOCK_SIZE 4096
+
+/**
+ * @brief stable_infra namespace
+ */
+namespace stable_infra {
+    /**
+     * @brief data structure namespace
+     */
+    namespace data_struct {
+        /**
+         * @brief header of a block, data follows it
+         * Slab blocks have BUFFER_BLOCK_SIZE bytes in total and are recycled through thread
+         * caches, bigger blocks are allocated for their size and freed when released.
+         */
+        struct buffer_block
+        {
+            std::atomic<uint32_t> ref_cnt_;
+            uint32_t capacity_;  ///< bytes of data
+            uint32_t used_;      ///< bytes of data written, only an exclusive owner writes after it
+            uint32_t is_slab_;
+
+            inline char* data() {
+                return reinterpret_cast<char*>(this + 1);
+            }
+
+            /**
+             * @brief a block with at least capacity bytes of data and one reference
+             */
+            static buffer_block* alloc(uint32_t capacity);
+            static inline void add_ref(buffer_block* block) {
+                block->ref_cnt_.fetch_add(1, std::memory_order_relaxed);
+            }
+            /**
+             * @brief drop one reference, the block is recycled with the last one
+             */
+            static void release(buffer_block* block);
+        };
+
+        /**
+         * @brief bytes held as a list of segments of shared blocks
+         * Copying, slicing and splitting a chain share blocks by reference counts instead of
+         * copying bytes, so a header can be prepended to a payload and one payload can be sent to
+         * many fds without memcpy. Segments are kept as contiguous iovecs which writev takes as is.
+         * Prepending and appending segments are amortized O(1).
+         * @note a chain is not thread safe, different chains sharing blocks may be used by
+         *       different threads
+         */
+        class buffer_chain
+        {
+            public:
+                buffer_chain() = default;
+                buffer_chain(const buffer_chain& other);
+                buffer_chain(buffer_chain&& other) noexcept;
+                buffer_chain& operator=(const buffer_chain& other);
+                buffer_chain& operator=(buffer_chain&& other) noexcept;
+                ~buffer_chain();
+
+                /**
+                 * @brief copy bytes to the end, free space of the last block is used first
+                 */
+                void append(const void* data, size_t len);
+
+                /**
+                 * @brief copy bytes to a new segment at the front, e.g. a protocol header
+                 */
+                void prepend(const void* data, size_t len);
+
+                /**
+                 * @brief share all segments of other at the end or the front, no bytes are copied
+                 */
+                void append(const buffer_chain& other);
+                void append(buffer_chain&& other);
+                void prepend(const buffer_chain& other);
+
+                /**
+                 * @brief reserve len contiguous bytes at the end to be filled by the caller
+                 * @return writable pointer, valid until the chain is changed
+                 */
+                char* append_space(uint32_t len);
+
+                /**
+                 * @brief a chain sharing len bytes from offset, no bytes are copied
+                 * @note the range is clamped to the chain
+                 */
+                buffer_chain slice(uint64_t offset, uint64_t len) const;
+
+                /**
+                 * @brief remove the first len bytes and return them as a chain
+                 */
+                buffer_chain split(uint64_t len);
+
+                /**
+                 * @brief drop the first len bytes, blocks no longer referenced are released
+                 */
+                void consume(uint64_t len);
+
+                /**
+                 * @brief copy all bytes to dest which has size() bytes at least
+                 */
+                void copy_to(void* dest) const;
+
+                void clear();
+
+                inline uint64_t size() const {
+                    return size_;
+                }
+                inline bool empty() const {
+                    return size_ == 0;
+                }
+                inline uint32_t iov_cnt() const {
+                    return (uint32_t)(iov_.size() - head_);
+                }
+                /**
+                 * @brief segments as iovecs, valid until the chain is changed
+                 */
+                inline ::iovec* iov() {
+                    return iov_.data() + head_;
+                }
+                inline const ::iovec* iov() const {
+                    return iov_.data() + head_;
+                }
+            private:
+                /**
+                 * @brief add a segment, the reference of block is taken over
+                 */
+                void push_back(buffer_block* block, char* data, size_t len);
+                void push_front(buffer_block* block, char* data, size_t len);
+
+                /**
+                 * @brief last block if this chain owns it alone and its last segment ends at used_
+                 */
+                buffer_block* writable_tail() const;
+
+                std::vector<::iovec> iov_;           ///< segments from head_, free room before it
+                std::vector<buffer_block*> blocks_;  ///< block of each segment
+                uint32_t head_{ 0 };                 ///< index of first segment
+                uint64_t size_{ 0 };                 ///< bytes of all segments
+        };
+    }
+}
@@ -0,0 +1,173 @@
+/**
+ * @file chase_lev_deque.h
+ * @brief lock free work stealing deque
+ * @author Liu Hua Jun
+ * @email wojiaoliuhuajun@126.com
+ * @license Use of this source code is governed by The GNU Affero General Public License Version 3
+ *          which can be found in the LICENSE file
+ */
+#pragma once
+#include <stdint.h>
+#include <atomic>
+#include <vector>
+#include <type_traits>
+#include "../common/const_variable.h"
+
+/**
+ * @brief stable_infra namespace
+ */
+namespace stable_infra {
+    /**
+     * @brief data structure namespace
+     */
+    namespace data_struct {
+        /**
+         * @brief Chase-Lev work stealing deque
+         * The owner thread push()es and take()s at the bottom, any other thread steal()s at the top.
+         * The buffer grows when it is full, old buffers are released in destruction because a
+         * thief may still read them.
+         * (Le, Pop, Cohen, Zappa Nardelli. Correct and Efficient Work-Stealing for Weak Memory Models)
+         * @note VALUE_TYPE must be a pointer type
+         */
+        template<typename VALUE_TYPE>
+        class chase_lev_deque
+        {
+            static_assert(std::is_pointer<VALUE_TYPE>::value, "VALUE_TYPE must be a pointer type");
+            private:
+                struct buffer
+                {
+                    explicit buffer(int64_t capacity)
+                        : capacity_(capacity), mask_(capacity - 1), slots_(new std::atomic<VALUE_TYPE>[capacity])
+                    {
+                    }
+                    ~buffer()
+                    {
+                        delete [] slots_;
+                    }
+                    inline VALUE_TYPE get(int64_t i) const
+                    {
+                        return slots_[i & mask_].load(std::memory_order_relaxed);
+                    }
+                    inline void put(int64_t i, VALUE_TYPE value)
+                    {
+                        slots_[i & mask_].store(value, std::memory_order_relaxed);
+                    }
+                    int64_t capacity_;
+                    int64_t mask_;
+                    std::atomic<VALUE_TYPE>* slots_;
+                };
+            public:
+                /**
+                 * @brief construction function
+                 * @param[in] capacity initial capacity, must be power of 2
+                 */
+                explicit chase_lev_deque(int64_t capacity = 1024)
+                {
+                    buffer_.store(new buffer(capacity), std::memory_order_relaxed);
+                }
+
+                /**
+                 * @brief destruction function
+                 */
+                ~chase_lev_deque()
+                {
+                    delete buffer_.load(std::memory_order_relaxed);
+                    for (auto old : retired_) {
+                        delete old;
+                    }
+                }
+
+                chase_lev_deque(const chase_lev_deque&) = delete;
+                chase_lev_deque& operator=(const chase_lev_deque&) = delete;
+
+                /**
+                 * @brief push at bottom, only called by owner
+                 */
+                void push(VALUE_TYPE value)
+                {
+                    int64_t b = bottom_.load(std::memory_order_relaxed);
+                    int64_t t = top_.load(std::memory_order_acquire);
+                    buffer* buf = buffer_.load(std::memory_order_relaxed);
+                    if (b - t > buf->capacity_ - 1) {
+                        buf = grow(buf, t, b);
+                    }
+                    buf->put(b, value);
+                    std::atomic_thread_fence(std::memory_order_release);
+                    bottom_.store(b + 1, std::memory_order_relaxed);
+                }
+
+                /**
+                 * @brief take at bottom, only called by owner
+                 * @return value, nullptr if empty
+                 */
+                VALUE_TYPE take()
+                {
+                    int64_t b = bottom_.load(std::memory_order_relaxed) - 1;
+                    buffer* buf = buffer_.load(std::memory_order_relaxed);
+                    bottom_.store(b, std::memory_order_relaxed);
+                    std::atomic_thread_fence(std::memory_order_seq_cst);
+                    int64_t t = top_.load(std::memory_order_relaxed);
+                    if (t > b) {
+                        // empty
+                        bottom_.store(b + 1, std::memory_order_relaxed);
+                        return nullptr;
+                    }
+                    VALUE_TYPE value = buf->get(b);
+                    if (t == b) {
+                        // last one, race with thieves
+                        if (! top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+                            value = nullptr;
+                        }
+                        bottom_.store(b + 1, std::memory_order_relaxed);
+                    }
+                    return value;
+                }
+
+                /**
+                 * @brief steal at top, called by any thread
+                 * @return value, nullptr if empty or lost a race
+                 */
+                VALUE_TYPE steal()
+                {
+                    int64_t t = top_.load(std::memory_order_acquire);
+                    std::atomic_thread_fence(std::memory_order_seq_cst);
+                    int64_t b = bottom_.load(std::memory_order_acquire);
+                    if (t >= b) {
+                        return nullptr;
+                    }
+                    buffer* buf = buffer_.load(std::memory_order_acquire);
+                    VALUE_TYPE value = buf->get(t);
+                    if (! top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+                        return nullptr;
+                    }
+                    return value;
+                }
+
+                /**
+                 * @brief approximate count of values
+                 */
+                int64_t size() const
+                {
+                    int64_t b = bottom_.load(std::memory_order_relaxed);
+                    int64_t t = top_.load(std::memory_order_relaxed);
+                    return b > t ? b - t : 0;
+                }
+            private:
+                buffer* grow(buffer* old, int64_t t, int64_t b)
+                {
+                    buffer* buf = new buffer(old->capacity_ * 2);
+                    for (int64_t i = t; i < b; ++i) {
+                        buf->put(i, old->get(i));
+                    }
+                    retired_.push_back(old);
+                    buffer_.store(buf, std::memory_order_release);
+                    return buf;
+                }
+            private:
+                alignas(ALIGN_SIZE) std::atomic<int64_t> top_{ 0 };    ///< written by thieves
+                alignas(ALIGN_SIZE) std::atomic<int64_t> bottom_{ 0 }; ///< written by owner
+                std::atomic<buffer*> buffer_{ nullptr };
+                std::vector<buffer*> retired_;                         ///< buffers replaced by grow()
+        };
+    }
+}
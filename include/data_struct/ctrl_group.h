@@ -0,0 +1,151 @@
+/****************************************************************************************
+ * @file ctrl_group.h
+ * @brief control bytes of open addressing tables, probed a group at a time
+ * @author Liu Hua Jun
+ * @email wojiaoliuhuajun@126.com
+ * @license Use of this source code is governed by The GNU Affero General Public License Version 3
+ *          which can be found in the LICENSE file
+ ***************************************************************************************/
+#pragma once
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define CTRL_GROUP_NEON
+#endif
+
+/// slots probed by one comparison, tables keep capacity a multiple of it
+#define CTRL_GROUP_SIZE 16
+
+/// slot is never used, a probe stops at a group with an empty slot
+#define CTRL_EMPTY   ((int8_t)-128)
+
+/// slot is erased, a probe goes on over it and insertion may reuse it
+#define CTRL_DELETED ((int8_t)-2)
+
+/**
+ * @brief stable_infra namespace
+ */
+namespace stable_infra {
+    /**
+     * @brief data structure namespace
+     */
+    namespace data_struct {
+        /**
+         * @brief one group of control bytes
+         * A full slot keeps 7 bits of its hash, empty and deleted slots are negative, so one
+         * group is compared with a hash in a few instructions before any key is touched.
+         * Results are bitmasks, bit i is slot i of the group. SSE2 or NEON compares a group at once,
+         * other cpus use a portable loop.
+         */
+        class ctrl_group
+        {
+            public:
+                explicit ctrl_group(const int8_t* ctrl)
+                {
+#if defined(__SSE2__)
+                    ctrl_ = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ctrl));
+#elif defined(CTRL_GROUP_NEON)
+                    ctrl_ = vld1q_s8(ctrl);
+#else
+                    memcpy(ctrl_, ctrl, CTRL_GROUP_SIZE);
+#endif
+                }
+
+                /**
+                 * @brief slots whose hash tag equals h2
+                 */
+                uint32_t match(int8_t h2) const
+                {
+#if defined(__SSE2__)
+                    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(ctrl_, _mm_set1_epi8(h2)));
+#elif defined(CTRL_GROUP_NEON)
+                    return to_mask(vceqq_s8(ctrl_, vdupq_n_s8(h2)));
+#else
+                    uint32_t mask = 0;
+                    for (uint32_t i = 0; i < CTRL_GROUP_SIZE; ++i) {
+                        mask |= (uint32_t)(ctrl_[i] == h2) << i;
+                    }
+                    return mask;
+#endif
+                }
+
+                uint32_t match_empty() const
+                {
+                    return match(CTRL_EMPTY);
+                }
+
+                /**
+                 * @brief slots an insertion may take
+                 */
+                uint32_t match_free() const
+                {
+#if defined(__SSE2__)
+                    // empty and deleted are the only values below -1
+                    return (uint32_t)_mm_movemask_epi8(_mm_cmpgt_epi8(_mm_set1_epi8(-1), ctrl_));
+#elif defined(CTRL_GROUP_NEON)
+                    return to_mask(vcltq_s8(ctrl_, vdupq_n_s8(-1)));
+#else
+                    uint32_t mask = 0;
+                    for (uint32_t i = 0; i < CTRL_GROUP_SIZE; ++i) {
+                        mask |= (uint32_t)(ctrl_[i] < -1) << i;
+                    }
+                    return mask;
+#endif
+                }
+
+                /**
+                 * @brief index of lowest slot in a mask, mask must not be 0
+                 */
+                static uint32_t lowest(uint32_t mask)
+                {
+                    return (uint32_t)__builtin_ctz(mask);
+                }
+            private:
+#if defined(__SSE2__)
+                __m128i ctrl_;
+#elif defined(CTRL_GROUP_NEON)
+                /**
+                 * @brief NEON has no movemask, keep one bit of each lane and add lanes of each half
+                 */
+                static uint32_t to_mask(uint8x16_t cmp)
+                {
+                    static const uint8_t bits[16] = { 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+                    uint8x16_t masked = vandq_u8(cmp, vld1q_u8(bits));
+                    return (uint32_t)vaddv_u8(vget_low_u8(masked)) | ((uint32_t)vaddv_u8(vget_high_u8(masked)) << 8);
+                }
+
+                int8x16_t ctrl_;
+#else
+                int8_t ctrl_[CTRL_GROUP_SIZE];
+#endif
+        };
+
+        /**
+         * @brief split a hash into the group to start probing at and the 7 bits tag
+         */
+        inline int8_t ctrl_h2(uint64_t hash)
+        {
+            return (int8_t)(hash & 0x7f);
+        }
+
+        inline uint64_t ctrl_h1(uint64_t hash)
+        {
+            return hash >> 7;
+        }
+
+        /**
+         * @brief spread bits of a weak hash, e.g. std::hash of an integer, over the h1 and h2 bits
+         */
+        inline uint64_t ctrl_mix(uint64_t v)
+        {
+            v *= 0x9E3779B97F4A7C15ull;
+            v ^= v >> 32;
+            v *= 0xD6E8FEB86659FD93ull;
+            return v ^ (v >> 32);
+        }
+    }
+}
@@ -0,0 +1,347 @@
+/****************************************************************************************
+ * @file flat_map.h
+ * @brief open addressing hash map with group probed control bytes
+ * @author Liu Hua Jun
+ * @email wojiaoliuhuajun@126.com
+ * @license Use of this source code is governed by The GNU Affero General Public License Version 3
+ *          which can be found in the LICENSE file
+ ***************************************************************************************/
+#pragma once
+#include <stdint.h>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <functional>
+#include <iterator>
+#include <type_traits>
+#include "ctrl_group.h"
+#include "../util/macros_func.h"
+
+/**
+ * @brief stable_infra namespace
+ */
+namespace stable_infra {
+    /**
+     * @brief data structure namespace
+     */
+    namespace data_struct {
+        /**
+         * @brief flat hash map
+         * Pairs are kept in one array and found by comparing 7 bits hash tags of 16 slots at once
+         * (SSE2 or NEON), so a lookup usually touches one control group and one pair instead of
+         * following bucket and node pointers. No memory is allocated until the first insertion.
+         * The subset of std::unordered_map used by opt_map is provided.
+         * @note KEY and VALUE must be default constructible, iterators and references are
+         *       invalidated by insertion
+         */
+        template<typename KEY, typename VALUE, typename HASH = std::hash<KEY>>
+        class flat_map
+        {
+            public:
+                typedef std::pair<KEY, VALUE> value_type;
+
+                template<bool IS_CONST>
+                class basic_iterator
+                {
+                    typedef typename std::conditional<IS_CONST, const flat_map*, flat_map*>::type map_pointer;
+                    public:
+                        typedef std::forward_iterator_tag iterator_category;
+                        typedef typename flat_map::value_type value_type;
+                        typedef std::ptrdiff_t difference_type;
+                        typedef typename std::conditional<IS_CONST, const value_type*, value_type*>::type pointer;
+                        typedef typename std::conditional<IS_CONST, const value_type&, value_type&>::type reference;
+
+                        basic_iterator(map_pointer map, uint32_t pos)
+                            : map_(map), pos_(pos)
+                        {
+                        }
+                        // iterator converts to const_iterator
+                        template<bool OTHER_CONST, typename = typename std::enable_if<IS_CONST && !OTHER_CONST>::type>
+                        basic_iterator(const basic_iterator<OTHER_CONST>& other)
+                            : map_(other.map_), pos_(other.pos_)
+                        {
+                        }
+                        reference operator*() const {
+                            return map_->slots_[pos_];
+                        }
+                        pointer operator->() const {
+                            return &map_->slots_[pos_];
+                        }
+                        basic_iterator& operator++() {
+                            pos_ = map_->next_full(pos_ + 1);
+                            return *this;
+                        }
+                        basic_iterator operator++(int) {
+                            auto old = *this;
+                            ++*this;
+                            return old;
+                        }
+                        bool operator==(const basic_iterator& other) const {
+                            return pos_ == other.pos_;
+                        }
+                        bool operator!=(const basic_iterator& other) const {
+                            return pos_ != other.pos_;
+                        }
+                        /**
+                         * @brief slot of the pair, see from_slot
+                         */
+                        inline uint32_t slot() const {
+                            return pos_;
+                        }
+                    private:
+                        template<bool> friend class basic_iterator;
+                        map_pointer map_;
+                        uint32_t pos_;
+                };
+                typedef basic_iterator<false> iterator;
+                typedef basic_iterator<true> const_iterator;
+
+                /**
+                 * @param hash hasher, e.g. one with a per map seed
+                 */
+                explicit flat_map(uint32_t capacity = 0, const HASH& hash = HASH())
+                    : hash_(hash)
+                {
+                    if (capacity > 0) {
+                        reserve(capacity);
+                    }
+                }
+
+                iterator begin() {
+                    return iterator(this, next_full(0));
+                }
+                iterator end() {
+                    return iterator(this, slot_cnt());
+                }
+                const_iterator begin() const {
+                    return const_iterator(this, next_full(0));
+                }
+                const_iterator end() const {
+                    return const_iterator(this, slot_cnt());
+                }
+
+                iterator find(const KEY& key) {
+                    return iterator(this, find_pos(key, hash_of(key)));
+                }
+                const_iterator find(const KEY& key) const {
+                    return const_iterator(this, find_pos(key, hash_of(key)));
+                }
+
+                /**
+                 * @return false if key exists, the value is not changed
+                 */
+                bool insert(const KEY& key, const VALUE& value) {
+                    bool is_new = false;
+                    auto pos = find_or_prepare(key, is_new);
+                    if (is_new) {
+                        slots_[pos].second = value;
+                    }
+                    return is_new;
+                }
+
+                VALUE& operator[](const KEY& key) {
+                    bool is_new = false;
+                    return slots_[find_or_prepare(key, is_new)].second;
+                }
+
+                /**
+                 * @brief find key, a pair with a default value is inserted if not found
+                 * @return pair and true if inserted
+                 */
+                std::pair<iterator, bool> try_emplace(const KEY& key) {
+                    bool is_new = false;
+                    auto pos = find_or_prepare(key, is_new);
+                    return std::make_pair(iterator(this, pos), is_new);
+                }
+
+                /**
+                 * @return pairs erased, 0 or 1
+                 */
+                size_t erase(const KEY& key) {
+                    auto pos = find_pos(key, hash_of(key));
+                    STABLE_INFRA_IF_TRUE_RETURN_CODE(pos == slot_cnt(), 0);
+                    erase_pos(pos);
+                    return 1;
+                }
+
+                /**
+                 * @brief erase the pair at it, other iterators stay valid
+                 * @return iterator of the next pair
+                 */
+                iterator erase(iterator it) {
+                    erase_pos(it.slot());
+                    return iterator(this, next_full(it.slot() + 1));
+                }
+
+                /**
+                 * @brief first pair at or after slot pos, to resume a scan of the slots across calls
+                 */
+                iterator from_slot(uint32_t pos) {
+                    return iterator(this, next_full(std::min(pos, slot_cnt())));
+                }
+
+                /**
+                 * @brief slots of the table, a power of two, 0 before the first insertion
+                 */
+                inline uint32_t slot_count() const {
+                    return slot_cnt();
+                }
+
+                /**
+                 * @brief grow so that cnt pairs can be inserted without allocation
+                 */
+                void reserve(uint32_t cnt) {
+                    // keep load factor under 7/8
+                    uint64_t need = (uint64_t)cnt * 8 / 7 + 1;
+                    uint32_t new_cnt = CTRL_GROUP_SIZE;
+                    while (new_cnt < need) {
+                        new_cnt <<= 1;
+                    }
+                    if (new_cnt > slot_cnt()) {
+                        rehash(new_cnt);
+                    }
+                }
+
+                /**
+                 * @brief remove all pairs and release memory
+                 */
+                void clear() {
+                    std::vector<int8_t>().swap(ctrl_);
+                    std::vector<value_type>().swap(slots_);
+                    size_ = 0;
+                    deleted_cnt_ = 0;
+                }
+
+                inline size_t size() const {
+                    return size_;
+                }
+                inline bool empty() const {
+                    return size_ == 0;
+                }
+                inline uint64_t memory_usage() const {
+                    return ctrl_.capacity() + slots_.capacity() * sizeof(value_type);
+                }
+            private:
+                inline uint32_t slot_cnt() const {
+                    return (uint32_t)ctrl_.size();
+                }
+
+                inline uint64_t hash_of(const KEY& key) const {
+                    return ctrl_mix((uint64_t)hash_(key));
+                }
+
+                void erase_pos(uint32_t pos) {
+                    // destroyed after the table is consistent, its destructor may use this map,
+                    // key may refer into it and is not used below
+                    value_type removed(std::move(slots_[pos]));
+                    slots_[pos] = value_type();
+                    // a group which was never full has stopped every probe, no tombstone is needed
+                    uint32_t base = pos & ~(uint32_t)(CTRL_GROUP_SIZE - 1);
+                    if (ctrl_group(ctrl_.data() + base).match_empty() != 0) {
+                        ctrl_[pos] = CTRL_EMPTY;
+                    } else {
+                        ctrl_[pos] = CTRL_DELETED;
+                        ++deleted_cnt_;
+                    }
+                    --size_;
+                }
+
+                uint32_t next_full(uint32_t pos) const {
+                    while (pos < slot_cnt() && ctrl_[pos] < 0) {
+                        ++pos;
+                    }
+                    return pos;
+                }
+
+                /**
+                 * @brief groups are probed triangularly, which visits every group as group count
+                 *        is a power of two
+                 * @return slot count if not found
+                 */
+                uint32_t find_pos(const KEY& key, uint64_t hash) const {
+                    STABLE_INFRA_IF_TRUE_RETURN_CODE(size_ == 0, slot_cnt());
+                    auto h2 = ctrl_h2(hash);
+                    uint32_t group_mask = slot_cnt() / CTRL_GROUP_SIZE - 1;
+                    uint32_t group = (uint32_t)ctrl_h1(hash) & group_mask;
+                    for (uint32_t step = 1; step <= group_mask + 1; ++step) {
+                        uint32_t base = group * CTRL_GROUP_SIZE;
+                        ctrl_group g(ctrl_.data() + base);
+                        for (auto mask = g.match(h2); mask != 0; mask &= mask - 1) {
+                            auto pos = base + ctrl_group::lowest(mask);
+                            if (STABLE_INFRA_LIKELY(slots_[pos].first == key)) {
+                                return pos;
+                            }
+                        }
+                        if (STABLE_INFRA_LIKELY(g.match_empty() != 0)) {
+                            break;
+                        }
+                        group = (group + step) & group_mask;
+                    }
+                    return slot_cnt();
+                }
+
+                /**
+                 * @brief first empty or deleted slot on the probe sequence, growth keeps one
+                 */
+                uint32_t find_free(uint64_t hash) const {
+                    uint32_t group_mask = slot_cnt() / CTRL_GROUP_SIZE - 1;
+                    uint32_t group = (uint32_t)ctrl_h1(hash) & group_mask;
+                    for (uint32_t step = 1; ; ++step) {
+                        uint32_t base = group * CTRL_GROUP_SIZE;
+                        auto mask = ctrl_group(ctrl_.data() + base).match_free();
+                        if (mask != 0) {
+                            return base + ctrl_group::lowest(mask);
+                        }
+                        group = (group + step) & group_mask;
+                    }
+                }
+
+                /**
+                 * @return slot of key, a slot with the key and a default value is taken if not found
+                 */
+                uint32_t find_or_prepare(const KEY& key, bool& is_new) {
+                    auto hash = hash_of(key);
+                    auto pos = find_pos(key, hash);
+                    is_new = (pos == slot_cnt());
+                    STABLE_INFRA_IF_TRUE_RETURN_CODE(!is_new, pos);
+                    uint32_t growth_limit = slot_cnt() - slot_cnt() / 8;
+                    if (STABLE_INFRA_UNLIKELY(size_ + deleted_cnt_ >= growth_limit)) {
+                        // tombstones are dropped in place when most slots are erased
+                        rehash(slot_cnt() == 0 ? CTRL_GROUP_SIZE
+                            : (size_ * 2 >= growth_limit ? slot_cnt() * 2 : slot_cnt()));
+                    }
+                    pos = find_free(hash);
+                    if (ctrl_[pos] == CTRL_DELETED) {
+                        --deleted_cnt_;
+                    }
+                    ctrl_[pos] = ctrl_h2(hash);
+                    slots_[pos].first = key;
+                    ++size_;
+                    return pos;
+                }
+
+                void rehash(uint32_t new_cnt) {
+                    std::vector<int8_t> old_ctrl(new_cnt, CTRL_EMPTY);
+                    std::vector<value_type> old_slots(new_cnt);
+                    old_ctrl.swap(ctrl_);
+                    old_slots.swap(slots_);
+                    deleted_cnt_ = 0;
+                    for (uint32_t pos = 0; pos < old_ctrl.size(); ++pos) {
+                        if (old_ctrl[pos] < 0) {
+                            continue;
+                        }
+                        auto hash = hash_of(old_slots[pos].first);
+                        auto new_pos = find_free(hash);
+                        ctrl_[new_pos] = ctrl_h2(hash);
+                        slots_[new_pos] = std::move(old_slots[pos]);
+                    }
+                }
+
+                std::vector<int8_t> ctrl_;        ///< hash tags, CTRL_EMPTY or CTRL_DELETED of each slot
+                std::vector<value_type> slots_;
+                uint32_t size_{ 0 };
+                uint32_t deleted_cnt_{ 0 };
+                HASH hash_;
+        };
+    }
+}
@@ -0,0 +1,109 @@
+/**
+ * @file mpsc_queue.h
+ * @brief lock free multiple producers single consumer queue
+ * @author Liu Hua Jun
+ * @email wojiaoliuhuajun@126.com
+ * @license Use of this source code is governed by The GNU Affero General Public License Version 3
+ *          which can be found in the LICENSE file
+ */
+#pragma once
+#include <stdint.h>
+#include <atomic>
+#include <utility>
+#include "../common/const_variable.h"
+
+/**
+ * @brief stable_infra namespace
+ */
+namespace stable_infra {
+    /**
+     * @brief data structure namespace
+     */
+    namespace data_struct {
+        /**
+         * @brief intrusive node based mpsc queue (Vyukov)
+         * push() can be called by any thread, pop() only by one consumer thread.
+         * A push which is in progress may be invisible to pop() for a short time, so producers
+         * should notify the consumer after push() returns.
+         * @note VALUE_TYPE must be default constructible and movable
+         */
+        template<typename VALUE_TYPE>
+        class mpsc_queue
+        {
+            private:
+                struct node
+                {
+                    std::atomic<node*> next_{ nullptr };
+                    VALUE_TYPE value_{};
+                };
+            public:
+                /**
+                 * @brief construction function
+                 */
+                mpsc_queue()
+                {
+                    node* stub = new node();
+                    head_.store(stub, std::memory_order_relaxed);
+                    tail_ = stub;
+                }
+
+                /**
+                 * @brief destruction function
+                 */
+                ~mpsc_queue()
+                {
+                    VALUE_TYPE value;
+                    while (pop(value)) {
+                    }
+                    delete tail_;
+                }
+
+                mpsc_queue(const mpsc_queue&) = delete;
+                mpsc_queue& operator=(const mpsc_queue&) = delete;
+
+                /**
+                 * @brief push value, called by any thread
+                 * @param[in] value new value
+                 */
+                void push(VALUE_TYPE value)
+                {
+                    node* n = new node();
+                    n->value_ = std::move(value);
+                    node* prev = head_.exchange(n, std::memory_order_acq_rel);
+                    prev->next_.store(n, std::memory_order_release);
+                }
+
+                /**
+                 * @brief pop value, only called by consumer thread
+                 * @param[out] value popped value
+                 * @return result
+                 * @retval true successful
+                 * @retval false queue is empty
+                 */
+                bool pop(VALUE_TYPE& value)
+                {
+                    node* tail = tail_;
+                    node* next = tail->next_.load(std::memory_order_acquire);
+                    if (next == nullptr) {
+                        return false;
+                    }
+                    value = std::move(next->value_);
+                    next->value_ = VALUE_TYPE();
+                    tail_ = next;
+                    delete tail;
+                    return true;
+                }
+
+                /**
+                 * @brief if queue seems empty, exact only in consumer thread
+                 */
+                bool empty() const
+                {
+                    return tail_->next_.load(std::memory_order_acquire) == nullptr;
+                }
+            private:
+                alignas(ALIGN_SIZE) std::atomic<node*> head_; ///< last pushed node, written by producers
+                alignas(ALIGN_SIZE) node* tail_;              ///< stub node before first value, owned by consumer
+        };
+    }
+}
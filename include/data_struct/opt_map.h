@@ -13,6 +13,8 @@
 #include <map>
 #include <type_traits>
 #include <cstdlib>
+#include <algorithm>
+#include "flat_map.h"
 #include "../util/macros_func.h"
 
 /**
@@ -26,7 +28,8 @@ namespace stable_infra {
         /**
          * @brief optimized map
          * use vector and map to optimize performence, if key < array_size, vector will be used,
-         * Otherwise, map will be used.
+         * Otherwise, map will be used. The vector is allocated on the first insertion and grows
+         * by doubling up to ARRAY_SIZE, so a map with few small keys stays small.
          * @note VALUE_TYPE must be a pointer type
          *       KEY_TYPE must be an unsigned type
          */
@@ -38,13 +41,13 @@ namespace stable_infra {
             static_assert(std::is_unsigned<KEY_TYPE>::value, "KEY_TYPE must be a unsigned type");
             static_assert(std::is_same<MAP_TYPE, std::map<KEY_TYPE, VALUE_TYPE>>::value
                           || std::is_same<MAP_TYPE, std::unordered_map<KEY_TYPE, VALUE_TYPE>>::value
-                          , "MAP_TYPE must be std::map or std::unordered_map");
+                          || std::is_same<MAP_TYPE, flat_map<KEY_TYPE, VALUE_TYPE>>::value
+                          , "MAP_TYPE must be std::map, std::unordered_map or flat_map");
             public:
                 /**
                  * @brief construction function
                  */
                 opt_map() {
-                    vec_.resize(ARRAY_SIZE, nullptr);
                 }
 
                 /**
@@ -63,7 +66,7 @@ namespace stable_infra {
                 const VALUE_TYPE& find(const KEY_TYPE& key) const
                 {
                     if (key < ARRAY_SIZE) {
-                        return vec_[key];
+                        return key < vec_.size() ? vec_[key] : null_value_;
                     } else {
                         auto iter = map_.find(key);
                         if (iter != map_.end()) {
@@ -87,6 +90,7 @@ namespace stable_infra {
                         return false;
                     }
                     if (key < ARRAY_SIZE) {
+                        grow(key);
                         if (vec_[key] == nullptr) {
                             vec_[key] = value;
                             return true;
@@ -108,7 +112,9 @@ namespace stable_infra {
                 void erase(KEY_TYPE key)
                 {
                     if (key < ARRAY_SIZE) {
-                        vec_[key] = nullptr;
+                        if (key < vec_.size()) {
+                            vec_[key] = nullptr;
+                        }
                     } else {
                         map_.erase(key);
                     }
@@ -116,23 +122,73 @@ namespace stable_infra {
 
                 VALUE_TYPE& operator [] (KEY_TYPE key) {
                     if (key < ARRAY_SIZE) {
+                        grow(key);
                         return vec_[key];
                     } else {
                         return map_[key];
                     }
                 }
 
+                /**
+                 * @brief visit all values
+                 * @param[in] func called with (key, value) for each stored value
+                 */
+                template<typename FUNC>
+                void for_each(FUNC&& func) const
+                {
+                    for (uint32_t i = 0; i < vec_.size(); ++i) {
+                        if (vec_[i] != nullptr) {
+                            func((KEY_TYPE)i, vec_[i]);
+                        }
+                    }
+                    for (auto& kv : map_) {
+                        if (kv.second != nullptr) {
+                            func(kv.first, kv.second);
+                        }
+                    }
+                }
+
+                /**
+                 * @brief approximate bytes allocated by this map itself, values are not included
+                 */
+                uint64_t memory_usage() const
+                {
+                    return vec_.capacity() * sizeof(VALUE_TYPE) + map_memory_usage(map_);
+                }
+
                 /**
                  * @brief clear all data
                  */
                 void clear()
                 {
-                    vec_.clear();
-                    vec_.resize(ARRAY_SIZE, nullptr);
+                    std::vector<VALUE_TYPE>().swap(vec_);
                     map_.clear();
                 }
             private:
-                std::vector<VALUE_TYPE> vec_; ///< if key < ARRAY_SIZE, this vector will be used, index is key
+                /**
+                 * @brief make vec_ cover key, key must be less than ARRAY_SIZE
+                 */
+                inline void grow(KEY_TYPE key)
+                {
+                    if (STABLE_INFRA_UNLIKELY(key >= vec_.size())) {
+                        uint64_t new_size = std::max<uint64_t>(std::max<uint64_t>((uint64_t)key + 1, vec_.size() * 2), 64);
+                        vec_.resize(std::min<uint64_t>(new_size, ARRAY_SIZE), nullptr);
+                    }
+                }
+
+                template<typename MAP>
+                static uint64_t map_memory_usage(const MAP& map)
+                {
+                    // a map node holds the pair and about two pointers of bookkeeping
+                    return map.size() * (sizeof(typename MAP::value_type) + 2 * sizeof(void*));
+                }
+
+                static uint64_t map_memory_usage(const flat_map<KEY_TYPE, VALUE_TYPE>& map)
+                {
+                    return map.memory_usage();
+                }
+
+                std::vector<VALUE_TYPE> vec_; ///< if key < ARRAY_SIZE, this vector will be used, index is key, grown on demand
                 MAP_TYPE map_;                ///< if key >= ARRAY_SIZE, this map will be used
                 VALUE_TYPE null_value_{ nullptr }; ///< nullptr for return reference
         };
@@ -0,0 +1,49 @@
+/****************************************************************************************
+ * @file crc32c.h
+ * @brief crc32c (Castagnoli) with hardware instructions selected at run time
+ * @author Liu Hua Jun
+ * @email wojiaoliuhuajun@126.com
+ * @license Use of this source code is governed by The GNU Affero General Public License Version 3
+ *          which can be found in the LICENSE file
+ ***************************************************************************************/
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+/**
+ * @brief stable_infra namespace
+ */
+namespace stable_infra {
+    /**
+     * @brief encrypt namespace
+     * Checksums and hashes
+     */
+    namespace encrypt {
+        /**
+         * @brief crc32c of a buffer
+         * SSE4.2 crc32 on x86_64 or ARMv8 crc32c instructions are used when cpu supports them,
+         * otherwise a slicing-by-8 table is used. Results of all implementations are the same.
+         * @param data buffer
+         * @param len bytes of buffer
+         * @param crc result of previous bytes to continue with, 0 for the first buffer
+         * @return crc32c
+         */
+        uint32_t crc32c(const void* data, size_t len, uint32_t crc = 0);
+
+        /**
+         * @brief crc32c of scattered buffers as if they were contiguous, e.g. buffers of a read task
+         */
+        uint32_t crc32c(const ::iovec* iov, uint32_t iov_cnt, uint32_t crc = 0);
+
+        /**
+         * @brief table implementation, used when cpu has no crc instruction
+         */
+        uint32_t crc32c_software(const void* data, size_t len, uint32_t crc = 0);
+
+        /**
+         * @brief name of selected implementation, "sse4.2", "armv8" or "software"
+         */
+        const char* crc32c_impl_name();
+    }
+}
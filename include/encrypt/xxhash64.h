@@ -0,0 +1,56 @@
+/****************************************************************************************
+ * @file xxhash64.h
+ * @brief XXH64 hash, one shot and streaming over scattered buffers
+ * @author Liu Hua Jun
+ * @email wojiaoliuhuajun@126.com
+ * @license Use of this source code is governed by The GNU Affero General Public License Version 3
+ *          which can be found in the LICENSE file
+ ***************************************************************************************/
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+/**
+ * @brief stable_infra namespace
+ */
+namespace stable_infra {
+    /**
+     * @brief encrypt namespace
+     * Checksums and hashes
+     */
+    namespace encrypt {
+        /**
+         * @brief streaming XXH64, results equal to the reference implementation
+         * Buffers may be split anywhere, only a partial 32 bytes stripe is copied.
+         */
+        class xxhash64
+        {
+            public:
+                explicit xxhash64(uint64_t seed = 0);
+                void reset(uint64_t seed = 0);
+                void update(const void* data, size_t len);
+                void update(const ::iovec* iov, uint32_t iov_cnt);
+                /**
+                 * @brief hash of bytes so far, the state is not changed
+                 */
+                uint64_t digest() const;
+            private:
+                uint64_t acc_[4];
+                uint64_t total_len_{ 0 };
+                uint8_t stripe_[32];       ///< bytes of a partial stripe
+                uint32_t stripe_len_{ 0 };
+                uint64_t seed_{ 0 };
+        };
+
+        /**
+         * @brief XXH64 of a buffer
+         */
+        uint64_t xxh64(const void* data, size_t len, uint64_t seed = 0);
+
+        /**
+         * @brief XXH64 of scattered buffers as if they were contiguous
+         */
+        uint64_t xxh64(const ::iovec* iov, uint32_t iov_cnt, uint64_t seed = 0);
+    }
+}
@@ -0,0 +1,167 @@
+/****************************************************************************************
+ * @file connection_pool.h
+ * @brief pool of outbound tcp connections of one event loop
+ * @author Liu Hua Jun
+ * @email wojiaoliuhuajun@126.com
+ * @license Use of this source code is governed by The GNU Affero General Public License Version 3
+ *          which can be found in the LICENSE file
+ ***************************************************************************************/
+#pragma once
+#include <stdint.h>
+#include <memory>
+#include <vector>
+#include <functional>
+#include <sys/socket.h>
+#include "poll_base.h"
+#include "event_common.h"
+#include "../common/type_def.h"
+#include "../data_struct/flat_map.h"
+
+/**
+ * @brief stable_infra namespace
+ */
+namespace stable_infra {
+    /**
+     * @brief event namespace
+     * All event driven codes are in this namespace
+     */
+    namespace event {
+        /**
+         * @brief limits of a connection_pool
+         */
+        struct connection_pool_options
+        {
+            uint32_t max_idle_per_backend_{ 32 };          ///< idle connections kept for one backend,
+                                                           ///< the oldest is closed when one more is released
+            uint64_t idle_timeout_ns_{ 60000000000ull };   ///< connections idle for longer are closed by
+                                                           ///< evict_idle, 0 keeps them
+            bool is_no_delay_{ true };                     ///< set TCP_NODELAY on new connections
+        };
+
+        /**
+         * @brief counters of a connection_pool
+         */
+        struct connection_pool_stats
+        {
+            uint64_t connect_cnt_{ 0 };  ///< connections made
+            uint64_t reuse_cnt_{ 0 };    ///< acquisitions served by idle connections
+            uint64_t evict_cnt_{ 0 };    ///< idle connections closed as dead, expired or beyond the limit
+            uint32_t idle_cnt_{ 0 };     ///< idle connections now
+            uint32_t busy_cnt_{ 0 };     ///< connections acquired or connecting now
+        };
+
+        /// invoked with a connected fd, INVALID_FD if connecting failed
+        using pool_connect_callback_t = std::function<void(fd_t)>;
+
+        /**
+         * @brief outbound connections of one loop keyed by backend address
+         * Idle connections of a backend are a stack, the one released last is reused first, so
+         * busy backends keep a few warm connections (cwnd, caches of both ends) and the cold ones
+         * at the bottom expire. An idle connection is checked by one MSG_PEEK recv before reuse,
+         * one closed by the backend or with unexpected bytes is evicted instead of handed out.
+         * Idle connections stay registered in the loop, reusing one costs no epoll_ctl.
+         * @note not thread safe, a pool is used in the thread of its loop, which must be
+         *       EPOLL_MODE::EXCLUSIVE, and destroyed after its connect callbacks ran
+         */
+        class connection_pool
+        {
+            public:
+                /**
+                 * @param loop loop of all connections
+                 * @param options limits
+                 */
+                explicit connection_pool(const std::shared_ptr<poll_base>& loop,
+                        const connection_pool_options& options = connection_pool_options());
+                /**
+                 * @brief close idle connections, acquired connections are left to their users
+                 */
+                ~connection_pool();
+
+                connection_pool(const connection_pool&) = delete;
+                connection_pool& operator=(const connection_pool&) = delete;
+            public:
+                /**
+                 * @brief get a connection to a backend
+                 * @param[in] addr backend address, AF_INET or AF_INET6
+                 * @param[in] addr_len bytes of addr
+                 * @param[out] fd idle connection reused at once
+                 * @param[in] cb invoked when a new connection is made
+                 * @return result of acquiring
+                 * @retval 1 an idle connection is reused, fd is set and cb is not invoked
+                 * @retval 0 connecting, cb will be invoked
+                 * @retval -1 failed
+                 */
+                int32_t acquire(const ::sockaddr* addr, socklen_t addr_len, fd_t& fd, const pool_connect_callback_t& cb);
+                /**
+                 * @brief give back an acquired connection
+                 * The connection must have no pending task, a request must be answered completely.
+                 * An acquired connection is closed by release(fd, false), not by the user.
+                 * @param[in] fd acquired connection
+                 * @param[in] is_reusable false closes it, e.g. after a protocol error or a timeout
+                 */
+                void release(fd_t fd, bool is_reusable = true);
+                /**
+                 * @brief close idle connections which expired or were closed by the backend
+                 * Call it periodically in loop thread.
+                 * @return count of closed connections
+                 */
+                uint32_t evict_idle();
+
+                void get_stats(connection_pool_stats& stats) const;
+            private:
+                enum class CONN_STATE : uint8_t
+                {
+                    CONNECTING = 0,
+                    BUSY = 1,
+                    IDLE = 2,
+                };
+
+                struct conn_info
+                {
+                    peer_address backend_;
+                    CONN_STATE state_{ CONN_STATE::CONNECTING };
+                };
+
+                struct idle_conn
+                {
+                    fd_t fd_;
+                    uint64_t idle_ns_; ///< release time
+                };
+
+                /**
+                 * @brief idle connections of one backend, the newest at the back
+                 */
+                struct backend
+                {
+                    std::vector<idle_conn> idle_;
+                };
+
+                struct backend_hash
+                {
+                    inline size_t operator()(const peer_address& key) const {
+                        return (size_t)key.hash(0);
+                    }
+                };
+
+                /**
+                 * @brief false if the backend has closed it or sent bytes nobody asked for
+                 */
+                static bool is_alive(fd_t fd);
+                int32_t connect(const ::sockaddr* addr, socklen_t addr_len, const peer_address& key,
+                        const pool_connect_callback_t& cb);
+                /**
+                 * @brief remove fd from loop and pool and close it
+                 */
+                void close_conn(fd_t fd);
+            private:
+                std::shared_ptr<poll_base> loop_;
+                connection_pool_options options_;
+                stable_infra::data_struct::flat_map<peer_address, backend, backend_hash> backends_;
+                stable_infra::data_struct::flat_map<fd_t, conn_info> conns_; ///< connections made by this pool
+                uint64_t connect_cnt_{ 0 };
+                uint64_t reuse_cnt_{ 0 };
+                uint64_t evict_cnt_{ 0 };
+                uint32_t idle_cnt_{ 0 };
+        };
+    }
+}
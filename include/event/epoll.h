@@ -12,9 +12,12 @@
 #include <memory>
 #include <sys/epoll.h>
 #include <deque>
-#include <list>
+#include <vector>
+#include <mutex>
+#include <atomic>
 #include "poll_base.h"
 #include "../data_struct/opt_map.h"
+#include "../data_struct/mpsc_queue.h"
 #include "../common/const_variable.h"
 #include "event_action.h"
 
@@ -24,6 +27,9 @@
 /// max fd which can be optimized 
 #define MAX_FD 100000
 
+/// event count receive from epoll once by each thread in shared mode, small to spread fds across threads
+#define SHARED_EVENT_CNT 16
+
 #if !defined(EPOLL_CLOEXEC)
 /// Flags for epoll_create1
 #define EPOLL_CLOEXEC O_CLOEXEC
@@ -55,6 +61,15 @@ namespace stable_infra {
 #define EV_ET (uint16_t)(stable_infra::event::EVENT::EV_ET)
         };
 
+        /**
+         * @brief how threads dispatch one epoll
+         */
+        enum class EPOLL_MODE : uint8_t
+        {
+            EXCLUSIVE = 0,      ///< one thread dispatches, fds are registered edge triggered
+            SHARED_ONESHOT = 1, ///< many threads dispatch one epoll set, fds are registered with EPOLLONESHOT
+        };
+
         class event_action;
         /**
          * @brief event information
@@ -68,7 +83,8 @@ namespace stable_infra {
                  */
                 event_info()
                 {
-                    event_action_ptr_ = std::make_shared<event_action>();
+                    // event_action is cache line aligned, std::make_shared can not honor it in c++11
+                    event_action_ptr_ = std::shared_ptr<event_action>(new event_action());
                 }
             public:
                 fd_t fd_{ -1 };                                     ///< file discriptor
@@ -86,8 +102,13 @@ namespace stable_infra {
             public:
                 /**
                  * @brief construction function
+                 * @param mode EPOLL_MODE::SHARED_ONESHOT lets several threads call dispatch() on this epoll.
+                 *        A ready fd is owned by the thread which got it until its callbacks return, then
+                 *        that thread re-arms it for its pending tasks. Operations may be submitted from any
+                 *        thread, a task submitted while another thread owns the fd is queued by the owner
+                 *        after its callbacks return, so one fd is never handled by two threads at once.
                  */
-                epoll();
+                explicit epoll(EPOLL_MODE mode = EPOLL_MODE::EXCLUSIVE);
                 /**
                  * @brief destruction function
                  */
@@ -109,7 +130,7 @@ namespace stable_infra {
                  * @brief Dispatch event
                  * Dispatch events and invoke callback functions
                  * @return result of dispatching
-                 * @retval 0 successful
+                 * @retval >=0 successful, count of completions appended to completion queue
                  * @retval -1 failed
                  */
                 virtual int32_t dispatch(int32_t timeout) override;
@@ -121,10 +142,192 @@ namespace stable_infra {
 
                 virtual int32_t submit_async_read(fd_t fd, ::iovec* buffer, uint32_t buffer_iov_cnt, const std::function<void(int32_t)>& cb) override;
 
-                virtual int32_t submit_async_accept(fd_t listen_fd, ::iovec* buffer, uint32_t buffer_iov_cnt, const std::function<void(int32_t)>& cb) override;
+                /**
+                 * @brief accept one connection, only supported by EPOLL_MODE::EXCLUSIVE
+                 */
+                virtual int32_t submit_async_accept(fd_t listen_fd, const std::function<void(int32_t)>& cb) override;
+
+                /**
+                 * @brief set accept limits, only supported by EPOLL_MODE::EXCLUSIVE
+                 */
+                virtual int32_t set_accept_limit(const accept_limit& limit) override;
+
+                virtual void get_accept_stats(accept_stats& stats) const override;
 
                 virtual int32_t submit_async_write(fd_t fd, ::iovec* buffer, uint32_t buffer_iov_cnt, const std::function<void(int32_t)>& cb) override;
+
+                virtual int32_t submit_async_write(fd_t fd, stable_infra::data_struct::buffer_chain&& chain, const std::function<void(int32_t)>& cb) override;
+
+                virtual int32_t submit_async_connect(fd_t fd, const ::sockaddr* addr, socklen_t addr_len,
+                        const void* data, uint32_t data_len, const std::function<void(int32_t)>& cb) override;
+
+                /**
+                 * @brief completion queue variants, not supported by EPOLL_MODE::SHARED_ONESHOT
+                 */
+                virtual int32_t submit_async_read_cq(fd_t fd, ::iovec* buffer, uint32_t buffer_iov_cnt, uint64_t tag) override;
+
+                virtual int32_t submit_async_write_cq(fd_t fd, ::iovec* buffer, uint32_t buffer_iov_cnt, uint64_t tag) override;
+
+                virtual int32_t submit_async_recvmsg_cq(fd_t fd, ::msghdr* msg, uint64_t tag) override;
+
+                virtual int32_t submit_async_sendmsg_cq(fd_t fd, ::msghdr* msg, uint64_t tag) override;
+
+                virtual int32_t submit_async_write_cq(fd_t fd, stable_infra::data_struct::buffer_chain&& chain, uint64_t tag) override;
+
+                virtual int32_t submit_batch(submit_entry* entries, uint32_t cnt) override;
+
+                virtual const completion* get_completions(uint32_t& cnt) const override;
+
+                virtual void clear_completions() override;
+
+                virtual int32_t submit_async_read_frame(fd_t fd, const frame_spec& spec, const frame_callback& cb) override;
+
+                virtual int32_t submit_async_recvmsg(fd_t fd, ::msghdr* msg, const std::function<void(int32_t)>& cb) override;
+
+                virtual int32_t submit_async_sendmsg(fd_t fd, ::msghdr* msg, const std::function<void(int32_t)>& cb) override;
+
+                virtual int32_t adopt_fd(fd_t fd, FD_TYPE type) override;
+
+                /**
+                 * @brief set optimistic io, not supported by EPOLL_MODE::SHARED_ONESHOT
+                 */
+                virtual int32_t set_optimistic_io(bool is_optimistic) override;
+
+                /**
+                 * @brief run func in loop thread, in EPOLL_MODE::SHARED_ONESHOT it runs in one of dispatching threads
+                 */
+                virtual int32_t post(const pending_func& func) override;
+
+                /**
+                 * @brief set priority class of fd, ignored by EPOLL_MODE::SHARED_ONESHOT
+                 */
+                virtual int32_t set_priority(fd_t fd, EVENT_PRIORITY priority) override;
+
+                virtual void set_priority_policy(const priority_policy& policy) override;
+
+                virtual void get_priority_stats(priority_stats& stats) const override;
+
+                virtual int32_t set_write_watermark(fd_t fd, uint64_t low, uint64_t high, uint64_t hard_limit,
+                        const std::function<void(bool)>& cb) override;
+
+                /**
+                 * @brief set loop watermarks, not supported by EPOLL_MODE::SHARED_ONESHOT
+                 */
+                virtual int32_t set_loop_write_watermark(uint64_t low, uint64_t high, uint64_t hard_limit,
+                        const std::function<void(bool)>& cb) override;
+
+                virtual int32_t set_low_latency_write(fd_t fd, uint32_t lowat) override;
+
+                virtual uint64_t get_queued_write_bytes(fd_t fd) const override;
+
+                virtual uint64_t get_loop_queued_write_bytes() const override;
+
+                /**
+                 * @brief set rate limits of fd, not supported by EPOLL_MODE::SHARED_ONESHOT
+                 */
+                virtual int32_t set_rate_limit(fd_t fd, const rate_limit& read_limit, const rate_limit& write_limit) override;
+
+                /**
+                 * @brief set rate groups of fd, not supported by EPOLL_MODE::SHARED_ONESHOT
+                 * A group is not thread safe, keep fds of a group in one epoll.
+                 */
+                virtual int32_t set_rate_group(fd_t fd, const std::shared_ptr<rate_group>& read_group,
+                        const std::shared_ptr<rate_group>& write_group) override;
+
+                /**
+                 * @brief set loop rate limit, not supported by EPOLL_MODE::SHARED_ONESHOT
+                 */
+                virtual int32_t set_loop_rate_limit(const rate_limit& write_limit) override;
+
+                /**
+                 * @brief remove fd and drop its pending tasks, not supported by EPOLL_MODE::SHARED_ONESHOT
+                 *        since another thread may be running callbacks of fd
+                 */
+                virtual int32_t remove_fd(fd_t fd) override;
+
+                /**
+                 * @brief move fd to another epoll, both must be EPOLL_MODE::EXCLUSIVE
+                 */
+                virtual int32_t migrate_fd(fd_t fd, const std::shared_ptr<poll_base>& target,
+                        const std::function<void(int32_t)>& cb) override;
+
+                virtual void get_load_stats(load_stats& stats) const override;
+
+                /**
+                 * @brief migrate the most active fds to target, used by loop_balancer
+                 * Runs in loop thread by post. Only fds marked by set_movable are picked, by servicing
+                 * count since last call until about fraction of the count is moved, then all counts are
+                 * reset. Both loops must be EPOLL_MODE::EXCLUSIVE.
+                 * @param[in] target poll object which receives fds
+                 * @param[in] fraction part of activity to move, in (0, 1]
+                 * @param[in] max_cnt max fds to move
+                 * @param[in] cb invoked for each moved fd like cb of migrate_fd, can be nullptr
+                 * @return result of requesting
+                 * @retval 0 successful
+                 * @retval -1 failed
+                 */
+                int32_t shed_load(const std::shared_ptr<poll_base>& target, double fraction, uint32_t max_cnt,
+                        const std::function<void(fd_t, int32_t)>& cb);
+
+                /**
+                 * @brief let shed_load move fd, no fd is moved by default
+                 * Only mark fds whose owner submits to whatever loop holds them now. fds used by
+                 * fd_channel, shm_channel or connection_pool keep their poll and must not be marked,
+                 * fds in a rate_group are never moved. Only in EPOLL_MODE::EXCLUSIVE.
+                 * @param[in] fd file discriptor, registered if not yet
+                 * @param[in] is_movable false keeps fd in this loop
+                 * @return result of setting
+                 * @retval 0 successful
+                 * @retval -1 failed
+                 */
+                int32_t set_movable(fd_t fd, bool is_movable);
+
+                /**
+                 * @brief let read and write callbacks publish their fd while running, used by loop_watchdog
+                 * Runs in loop thread by post, only in EPOLL_MODE::EXCLUSIVE.
+                 * @param[in] is_enabled false stops publishing
+                 * @return result of requesting
+                 * @retval 0 successful
+                 * @retval -1 failed
+                 */
+                int32_t set_callback_watch(bool is_enabled);
+
+                /**
+                 * @brief callback running now, can be read by any thread
+                 * @return running_callback::state_, 0 if no callback is running or the loop is not watched
+                 */
+                inline uint64_t get_running_callback() const {
+                    return running_callback_.state_.load(std::memory_order_relaxed);
+                }
+
+                virtual void get_memory_stats(memory_stats& stats) const override;
             private:
+                /**
+                 * @brief fd waiting in ready queue
+                 */
+                struct ready_entry
+                {
+                    event_action* action_;
+                    uint64_t ready_ns_; ///< return time of epoll_wait which queued it
+                };
+                /**
+                 * @brief find event_info of fd, create it if not exist
+                 * @param fd file discriptor
+                 * @param type fd type of new event_info, UNKNOWN_FD means detecting it by get_fd_type
+                 * @return event_info, nullptr if fd type is unknown
+                 */
+                event_info* get_event_info(fd_t fd, FD_TYPE type);
+                /**
+                 * @brief queue one task of fd and register event if needed
+                 * @param event EV_READ or EV_WRITE
+                 */
+                int32_t add_task(event_info* evt_info_ptr, uint16_t event, task t, const callback_t& cb);
+                /**
+                 * @brief queue a write task of chain, chain is moved into the task unless it fails
+                 *        before queuing
+                 */
+                int32_t add_chain_task(event_info* evt_info_ptr, stable_infra::data_struct::buffer_chain& chain,
+                    task t, const callback_t& cb);
                 /**
                  * @brief make changed event effective
                  */
@@ -134,16 +337,169 @@ namespace stable_infra {
                  * @param evt_info_ptr event_info object for one fd
                  */
                 void apply_one_change(event_info* evt_info_ptr);
+                /**
+                 * @brief unregister fd and take its event_info out of this loop, fd keeps its state
+                 * @return event_info, nullptr if fd is not registered
+                 */
+                event_info::pointer_t detach_event_info(fd_t fd);
+                /**
+                 * @brief register a detached event_info of another loop
+                 * @return result
+                 * @retval true successful
+                 * @retval false fd is registered already
+                 */
+                bool attach_event_info(const event_info::pointer_t& evt_info_ptr);
+                /**
+                 * @brief detach fd in this loop thread and attach it in target thread
+                 */
+                void do_migrate(fd_t fd, const std::shared_ptr<epoll>& target, const std::function<void(int32_t)>& cb);
+                /**
+                 * @brief increase a counter which is only written by loop thread
+                 */
+                static inline void add_counter(std::atomic<uint64_t>& counter, uint64_t value) {
+                    counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+                }
+                /**
+                 * @brief queue fd to ready queue of its priority class once
+                 */
+                void push_ready(event_action* evt_action_ptr);
+                /**
+                 * @brief service ready fds by priority_policy_
+                 */
                 void do_pending_tasks();
+                /**
+                 * @brief service the first cnt fds of one priority class
+                 */
+                void service_class(uint32_t priority, uint32_t cnt);
                 void do_read(const task& t);
+                /**
+                 * @brief shorten timeout of epoll_wait to the first refill time of throttled fds
+                 */
+                int32_t get_throttle_timeout(int32_t timeout) const;
+                /**
+                 * @brief queue throttled fds whose refill time has come
+                 */
+                void expire_throttles(uint64_t now_ns);
+                /**
+                 * @brief let fd check its changed rate limits
+                 */
+                void recheck_rate(event_action* evt_action_ptr);
+                /**
+                 * @brief take a listen fd out of epoll while accepted connections are over the limit
+                 */
+                void pause_accept(event_action* evt_action_ptr);
+                /**
+                 * @brief put paused listen fds back to epoll if accepted connections have dropped enough
+                 */
+                void resume_accept();
+                /**
+                 * @brief stop counting an accepted fd which leaves the loop
+                 */
+                void release_accepted(event_action* evt_action_ptr);
+                /**
+                 * @brief add an optimistic fd to epoll after one of its tasks would block
+                 */
+                void register_blocked(event_action* evt_action_ptr);
+                /**
+                 * @brief create eventfd for post and wait for it
+                 */
+                bool init_wakeup();
+                /**
+                 * @brief run posted functions, invoked when wakeup eventfd is readable
+                 */
+                void on_wakeup(int32_t res);
+                /**
+                 * @brief dispatch of EPOLL_MODE::SHARED_ONESHOT
+                 */
+                int32_t dispatch_shared(int32_t timeout);
+                /**
+                 * @brief arm a oneshot fd for its pending tasks
+                 * @param evt_action_ptr event_action of fd
+                 * @param is_in_epoll if fd has been added to epoll
+                 * @return result
+                 * @retval true fd is in epoll
+                 * @retval false failed
+                 */
+                bool rearm_oneshot(event_action* evt_action_ptr, bool is_in_epoll);
+                /**
+                 * @brief queue tasks handed off to fd while it was owned, called by the owner with mtx_ locked
+                 * @param failed callbacks of tasks which can not be queued, invoked by caller after unlocking
+                 */
+                void take_handoff_tasks(event_action* evt_action_ptr, std::vector<callback_t>& failed);
+                /**
+                 * @brief lock of fd table, only locked in EPOLL_MODE::SHARED_ONESHOT
+                 */
+                class mode_lock_guard
+                {
+                    public:
+                        mode_lock_guard(epoll& ep)
+                            : mtx_(ep.mode_ == EPOLL_MODE::SHARED_ONESHOT ? &ep.mtx_ : nullptr)
+                        {
+                            if (mtx_ != nullptr) {
+                                mtx_->lock();
+                            }
+                        }
+                        ~mode_lock_guard()
+                        {
+                            if (mtx_ != nullptr) {
+                                mtx_->unlock();
+                            }
+                        }
+                    private:
+                        std::mutex* mtx_;
+                };
             private:
                 std::unique_ptr<epoll_event[]> events_ptr_; ///< used for receive active events
                 fd_t epfd_{ INVALID_FD }; ///< epoll fd
                 /**< event information for each fd */
-                stable_infra::data_struct::opt_map<event_info::pointer_t, uint32_t, MAX_FD> fd_to_event_info_;
-                std::list<event_info*> evt_change_lst_; ///< event_info which has been changed
+                stable_infra::data_struct::opt_map<event_info::pointer_t, uint32_t, MAX_FD,
+                    stable_infra::data_struct::flat_map<uint32_t, event_info::pointer_t>> fd_to_event_info_;
+                std::vector<event_info*> evt_change_lst_; ///< event_info which has been changed, kept for reuse
                 int32_t errno_{ 0 };
-                std::deque<event_action*> ready_events_{};
+                std::deque<ready_entry> ready_events_[PRIORITY_CNT]; ///< ready fds of each priority class
+                uint32_t ready_popped_[PRIORITY_CNT]{}; ///< entries ever popped from each ready queue, wraps
+                uint64_t ready_ns_{ 0 };                             ///< return time of last epoll_wait
+                priority_policy priority_policy_;
+                priority_stats priority_stats_;
+                write_queue_state loop_write_state_; ///< queued write bytes of EPOLL_MODE::EXCLUSIVE
+                std::vector<completion> completions_; ///< completion queue of EPOLL_MODE::EXCLUSIVE
+                std::vector<event_info::pointer_t> removed_; ///< removed fds, freed in next dispatch
+                throttle_timer_heap throttle_timers_; ///< refill times of throttled fds
+                token_bucket loop_write_bucket_;      ///< write limit of all fds
+                bool is_optimistic_io_{ false };      ///< if tasks of fds out of epoll are tried at once
+                bool is_callback_watched_{ false };   ///< if callbacks publish their fd to running_callback_
+                running_callback running_callback_;   ///< callback running in EPOLL_MODE::EXCLUSIVE
+                accept_state accept_state_;           ///< admission of accepted connections of EPOLL_MODE::EXCLUSIVE
+                /**
+                 * @brief load counters written by loop thread
+                 */
+                struct load_counters
+                {
+                    std::atomic<uint64_t> busy_ns_{ 0 };
+                    std::atomic<uint64_t> iteration_cnt_{ 0 };
+                    std::atomic<uint64_t> serviced_cnt_{ 0 };
+                    std::atomic<uint64_t> migrated_in_cnt_{ 0 };
+                    std::atomic<uint64_t> migrated_out_cnt_{ 0 };
+                };
+                load_counters load_;
+                EPOLL_MODE mode_{ EPOLL_MODE::EXCLUSIVE };
+                std::mutex mtx_; ///< guards fd table in EPOLL_MODE::SHARED_ONESHOT
+                /**
+                 * @brief task submitted to an fd owned by another thread of EPOLL_MODE::SHARED_ONESHOT
+                 */
+                struct handoff_task
+                {
+                    event_info* evt_info_;
+                    uint16_t event_;
+                    task task_;
+                    callback_t cb_;
+                };
+                std::vector<handoff_task> handoff_tasks_; ///< guarded by mtx_
+                stable_infra::data_struct::mpsc_queue<pending_func> posted_funcs_; ///< functions posted by other threads
+                std::atomic<bool> wakeup_pending_{ false }; ///< if wakeup eventfd has been written and not drained
+                fd_t wakeup_fd_{ INVALID_FD };              ///< eventfd to wake up dispatch
+                uint64_t wakeup_cnt_{ 0 };                  ///< read buffer of wakeup eventfd
+                ::iovec wakeup_iov_{ &wakeup_cnt_, sizeof(wakeup_cnt_) };
         };
     }
 }
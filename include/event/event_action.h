@@ -8,11 +8,28 @@
  ***************************************************************************************/
 #pragma once
 #include <vector>
+#include <algorithm>
+#include <memory>
 #include <deque>
+#include <cstddef>
+#include <sys/socket.h>
 #include "event_common.h"
+#include "event_tracer.h"
+#include "rate_limiter.h"
 #include "../common/type_def.h"
+#include "../common/const_variable.h"
+
+/// a chain write task wrote what the rate limit or IOV_MAX allows, the rest goes in the next pass
+#define CHAIN_WRITE_THROTTLED 1
+
+/// accept task result when budget or ACCEPT_OVERLOAD::PAUSE stops accepting, the listen fd stays readable
+#define ACCEPT_DEFERRED 2
 
 namespace stable_infra {
+    namespace data_struct {
+        class buffer_chain;
+    }
+
     namespace event {
         using callback_t = std::function<void(int32_t)>;
 
@@ -41,24 +58,195 @@ namespace stable_infra {
                     : buffer_(buffer), buffer_iov_cnt_(buffer_iov_cnt)
                 {
                 }
+                explicit task(::msghdr* msg)
+                    : msg_(msg)
+                {
+                }
+                /**
+                 * @brief write task of a chain, the task owns it and deletes it on completion
+                 */
+                explicit task(stable_infra::data_struct::buffer_chain* chain)
+                    : chain_(chain)
+                {
+                }
+                /**
+                 * @brief connect task, completes when the socket is connected
+                 * @param[in] sent_bytes bytes of data sent with SYN by TCP Fast Open
+                 */
+                static inline task connect_task(int32_t sent_bytes) {
+                    task t(nullptr, 0);
+                    t.connect_bytes_ = sent_bytes;
+                    return t;
+                }
+                /**
+                 * @brief accept task, completes with one accepted fd
+                 */
+                static inline task accept_task() {
+                    task t(nullptr, 0);
+                    t.is_accept_ = true;
+                    return t;
+                }
+                /**
+                 * @brief make it a completion queue task
+                 */
+                inline task& with_tag(uint64_t tag) {
+                    tag_ = tag;
+                    is_cq_ = true;
+                    return *this;
+                }
                 ::iovec* buffer_{ nullptr };
                 uint32_t buffer_iov_cnt_{ 0 };
+                uint32_t bytes_{ 0 };      ///< bytes of a write task, one write syscall moves less than 2GB
+                ::msghdr* msg_{ nullptr }; ///< if set, one recvmsg/sendmsg with this header is done instead of buffer_
+                uint64_t tag_{ 0 };        ///< user tag of completion
+                bool is_cq_{ false };      ///< if completion goes to completion queue instead of callback
+                stable_infra::data_struct::buffer_chain* chain_{ nullptr }; ///< if set, bytes of this chain are written
+                int32_t connect_bytes_{ -1 }; ///< if not negative, a connect task and bytes sent with SYN
+                bool is_accept_{ false };     ///< if an accept task of a listen fd
+        };
+
+        class frame_reader;
+        class event_action;
+
+        /// invoked with true when queued write bytes reach the high watermark, false when they fall to the low one
+        using watermark_callback_t = std::function<void(bool)>;
+
+        /**
+         * @brief watermarks of queued write bytes
+         */
+        struct write_watermark
+        {
+            uint64_t low_{ 0 };
+            uint64_t high_{ 0 };       ///< 0 means no watermark callback
+            uint64_t hard_limit_{ 0 }; ///< submitting beyond it fails, 0 means no limit
+            bool is_high_{ false };
+            watermark_callback_t cb_{ nullptr };
+
+            inline bool is_over_limit(uint64_t queued, uint64_t bytes) const {
+                return hard_limit_ > 0 && queued + bytes > hard_limit_;
+            }
+            inline void on_queued(uint64_t queued) {
+                if (high_ > 0 && ! is_high_ && queued >= high_) {
+                    is_high_ = true;
+                    if (cb_ != nullptr) {
+                        cb_(true);
+                    }
+                }
+            }
+            inline void on_released(uint64_t queued) {
+                if (is_high_ && queued <= low_) {
+                    is_high_ = false;
+                    if (cb_ != nullptr) {
+                        cb_(false);
+                    }
+                }
+            }
         };
 
-        class event_action
+        /**
+         * @brief queued write bytes of all fds in one loop
+         */
+        struct write_queue_state
+        {
+            uint64_t queued_bytes_{ 0 };
+            write_watermark watermark_;
+        };
+
+        /**
+         * @brief admission of accepted connections of one loop
+         */
+        struct accept_state
+        {
+            accept_limit limit_;
+            accept_stats stats_;
+            uint32_t budget_left_{ UINT32_MAX };  ///< accepts left in this dispatch
+            std::vector<event_action*> deferred_; ///< listen fds out of budget, serviced in next dispatch
+            std::vector<event_action*> paused_;   ///< listen fds taken out of epoll by ACCEPT_OVERLOAD::PAUSE
+            std::function<bool(fd_t, FD_TYPE)> register_fd_{ nullptr }; ///< registers an accepted fd in loop
+            std::function<void(event_action*)> pause_{ nullptr };       ///< takes a listen fd out of epoll
+
+            inline bool is_full() const {
+                return limit_.max_conn_ > 0 && stats_.conn_cnt_ >= limit_.max_conn_;
+            }
+            /**
+             * @brief if paused listen fds can come back, 1/8 of max_conn_ below it so they do not flap
+             */
+            inline bool can_resume() const {
+                return limit_.max_conn_ == 0
+                    || (uint64_t)stats_.conn_cnt_ + std::max<uint32_t>(limit_.max_conn_ / 8, 1) <= limit_.max_conn_;
+            }
+        };
+
+        /**
+         * @brief user callback running in a loop, written by loop thread and read by loop_watchdog
+         */
+        struct alignas(ALIGN_SIZE) running_callback
+        {
+            std::atomic<uint64_t> state_{ 0 }; ///< TRACE_PHASE in high 32 bits and fd in low 32 bits, 0 if none
+
+            inline void enter(fd_t fd, TRACE_PHASE phase) {
+                state_.store(((uint64_t)phase << 32) | (uint32_t)fd, std::memory_order_relaxed);
+            }
+            inline void leave() {
+                state_.store(0, std::memory_order_relaxed);
+            }
+        };
+
+        /**
+         * @brief rate limits of one fd, only allocated for limited fds
+         */
+        struct rate_limit_state
+        {
+            token_bucket read_bucket_;
+            token_bucket write_bucket_;
+            std::shared_ptr<rate_group> read_group_{ nullptr };
+            std::shared_ptr<rate_group> write_group_{ nullptr };
+            uint64_t deadline_ns_{ 0 }; ///< refill time the fd waits for, 0 if not throttled
+        };
+
+        /**
+         * @brief callbacks and pending tasks of one fd
+         * The object is split into a hot part and a cold part. The hot part is exactly one
+         * cache line and holds everything epoll::dispatch needs to decide whether there is
+         * work for this fd, so an active fd without pending tasks only touches one line.
+         * Callbacks, task queues and iovec scratch buffers live on the following lines.
+         * @note the object is ALIGN_SIZE aligned, create it with new instead of std::make_shared
+         */
+        class alignas(ALIGN_SIZE) event_action
         {
             public:
                 event_action();
                 ~event_action();
 
+                static void* operator new(std::size_t size);
+                static void operator delete(void* ptr);
+
                 void handle_events();
                 void set_fd_type(const FD_TYPE type);
+                inline void set_fd(fd_t fd) {
+                    hot_.fd_ = fd;
+                }
+                inline fd_t get_fd() const {
+                    return hot_.fd_;
+                }
+                /**
+                 * @brief register read event without read callback, used by frame and completion queue tasks
+                 */
+                inline void enable_reading() {
+                    hot_.events_ |= read_event_;
+                }
+                inline void enable_writing() {
+                    hot_.events_ |= write_event_;
+                }
+                inline void set_completion_queue(std::vector<completion>* completions) {
+                    completions_ = completions;
+                }
                 inline void set_read_callback(const callback_t& cb) {
-                    events_ |= read_event_; 
+                    hot_.events_ |= read_event_; 
                     read_callback_ = cb;
                 }
                 inline void set_write_callback(const callback_t& cb) {
-                    events_ |= write_event_;
+                    hot_.events_ |= write_event_;
                     write_callback_ = cb;
                 }
                 inline callback_t& get_read_callback() {
@@ -69,52 +257,368 @@ namespace stable_infra {
                 }
                 inline void add_read_task(const task& t) {
                     pending_read_task_.push_back(t);
+                    ++hot_.pending_read_cnt_;
                 }
                 inline void add_write_task(const task& t) {
                     pending_write_task_.push_back(t);
+                    ++hot_.pending_write_cnt_;
+                    queued_write_bytes_ += t.bytes_;
+                    if (loop_write_state_ != nullptr) {
+                        loop_write_state_->queued_bytes_ += t.bytes_;
+                        loop_write_state_->watermark_.on_queued(loop_write_state_->queued_bytes_);
+                    }
+                    if (write_watermark_ != nullptr) {
+                        write_watermark_->on_queued(queued_write_bytes_);
+                    }
+                }
+                /**
+                 * @brief check hard limits of fd and loop before queuing a write task
+                 */
+                inline bool can_queue_write(uint64_t bytes) const {
+                    return (write_watermark_ == nullptr || ! write_watermark_->is_over_limit(queued_write_bytes_, bytes))
+                        && (loop_write_state_ == nullptr
+                            || ! loop_write_state_->watermark_.is_over_limit(loop_write_state_->queued_bytes_, bytes));
+                }
+                inline uint64_t get_queued_write_bytes() const {
+                    return queued_write_bytes_;
+                }
+                /**
+                 * @brief move queued write bytes of this fd from old loop state to new one
+                 */
+                void set_loop_write_state(write_queue_state* state);
+                /**
+                 * @brief set watermarks of this fd, high_ and hard_limit_ are both 0 means removing them
+                 */
+                void set_write_watermark(const write_watermark& watermark);
+                /**
+                 * @brief set TCP_NOTSENT_LOWAT of this fd and cap each write by it, 0 restores both
+                 * @return 0 if set, -1 if fd is not tcp or setsockopt failed
+                 */
+                int32_t set_notsent_lowat(uint32_t lowat);
+                /**
+                 * @brief bytes referred by a task
+                 */
+                static uint64_t task_bytes(const task& t);
+                /**
+                 * @brief read tasks of this fd become frame tasks, created on first call
+                 */
+                void set_frame_reader(const frame_spec& spec, const frame_callback& cb);
+                /**
+                 * @brief if a whole frame has been read into frame buffer
+                 */
+                bool has_buffered_frame() const;
+                inline bool has_frame_reader() const {
+                    return frame_reader_ != nullptr;
+                }
+                /**
+                 * @brief set rate limits of this fd, rate_ of both 0 removes them
+                 */
+                void set_rate_limit(const rate_limit& read_limit, const rate_limit& write_limit);
+                /**
+                 * @brief join groups sharing token buckets, nullptr leaves the group
+                 */
+                void set_rate_group(const std::shared_ptr<rate_group>& read_group,
+                        const std::shared_ptr<rate_group>& write_group);
+                /**
+                 * @brief bucket limiting writes of all fds in loop, nullptr if loop is unlimited
+                 */
+                inline void set_loop_write_bucket(token_bucket* bucket) {
+                    loop_write_bucket_ = bucket;
+                }
+                inline void set_throttle_timers(throttle_timer_heap* timers) {
+                    throttle_timers_ = timers;
+                }
+                inline void set_accept_state(accept_state* state) {
+                    accept_state_ = state;
+                }
+                /**
+                 * @brief if accepted by an accept task, the connection is counted by accept_state of its loop
+                 */
+                inline void set_accepted(bool is_accepted) {
+                    is_accepted_ = is_accepted;
+                }
+                inline bool is_accepted() const {
+                    return is_accepted_;
+                }
+                /**
+                 * @brief if a thread of EPOLL_MODE::SHARED_ONESHOT is running its callbacks, guarded by lock of loop
+                 */
+                inline void set_owned(bool is_owned) {
+                    is_owned_ = is_owned;
+                }
+                inline bool is_owned() const {
+                    return is_owned_;
+                }
+                /**
+                 * @brief if epoll::shed_load may move it to another loop
+                 */
+                inline void set_movable(bool is_movable) {
+                    is_movable_ = is_movable;
+                }
+                inline bool is_movable() const {
+                    return is_movable_;
+                }
+                inline bool has_rate_group() const {
+                    return rate_limit_ != nullptr && (rate_limit_->read_group_ != nullptr || rate_limit_->write_group_ != nullptr);
+                }
+                /**
+                 * @brief slot publishing running callbacks, nullptr if loop is not watched
+                 */
+                inline void set_running_callback(running_callback* running) {
+                    running_callback_ = running;
+                }
+                /**
+                 * @brief refill time this fd waits for, 0 if not throttled
+                 */
+                inline uint64_t get_throttle_deadline() const {
+                    return rate_limit_ != nullptr ? rate_limit_->deadline_ns_ : 0;
+                }
+                inline void clear_throttle() {
+                    if (rate_limit_ != nullptr) {
+                        rate_limit_->deadline_ns_ = 0;
+                    }
+                }
+                /**
+                 * @brief let next handle_events try reading, a spurious try costs one EAGAIN
+                 */
+                inline void set_readable() {
+                    hot_.is_readable_ = true;
+                }
+                inline void set_writable() {
+                    hot_.is_writable_ = true;
+                }
+                /**
+                 * @brief fd is not added to epoll until one of its tasks would block
+                 */
+                inline void set_unregistered(bool is_unregistered) {
+                    hot_.is_unregistered_ = is_unregistered;
+                }
+                /**
+                 * @brief if an unregistered fd has a task waiting for readiness
+                 */
+                inline bool needs_registration() const {
+                    return hot_.is_unregistered_
+                        && ((hot_.pending_read_cnt_ > 0 && ! hot_.is_readable_)
+                            || (hot_.pending_write_cnt_ > 0 && ! hot_.is_writable_));
                 }
                 inline bool is_readable() const {
-                    return is_readable_;
+                    return hot_.is_readable_;
                 }
                 inline bool is_writable() const {
-                    return is_writable_;
+                    return hot_.is_writable_;
                 }
                 void set_ready_events(uint32_t events);
+                /**
+                 * @brief only record readiness, tasks are run later by handle_events
+                 * @return if there is a task which can run now
+                 */
+                inline bool mark_ready_events(uint32_t events) {
+                    // tasks of a failed or hung up fd run and fail instead of waiting forever
+                    hot_.is_readable_ = hot_.is_readable_ || (events & (read_event_ | error_event_ | close_event_));
+                    hot_.is_writable_ = hot_.is_writable_ || (events & (write_event_ | error_event_ | close_event_));
+                    return (hot_.is_readable_ && hot_.pending_read_cnt_ > 0)
+                        || (hot_.is_writable_ && hot_.pending_write_cnt_ > 0);
+                }
+                inline void set_priority(EVENT_PRIORITY priority) {
+                    hot_.priority_ = priority;
+                }
+                inline EVENT_PRIORITY get_priority() const {
+                    return hot_.priority_;
+                }
+                inline bool is_in_ready_queue() const {
+                    return hot_.is_in_ready_queue_;
+                }
+                inline void set_in_ready_queue(bool is_in) {
+                    hot_.is_in_ready_queue_ = is_in;
+                }
+                /**
+                 * @brief where it is queued, pos is the count of entries ever pushed to that ready queue before it
+                 */
+                inline void set_ready_slot(uint32_t priority, uint32_t pos) {
+                    ready_priority_ = (uint8_t)priority;
+                    ready_pos_ = pos;
+                }
+                inline uint32_t get_ready_priority() const {
+                    return ready_priority_;
+                }
+                inline uint32_t get_ready_pos() const {
+                    return ready_pos_;
+                }
+                /**
+                 * @brief count of servicing since last reset, used to pick busy fds for migration
+                 */
+                inline uint32_t get_active_cnt() const {
+                    return hot_.active_cnt_;
+                }
+                inline void add_active_cnt() {
+                    ++hot_.active_cnt_;
+                }
+                inline void reset_active_cnt() {
+                    hot_.active_cnt_ = 0;
+                }
+                /**
+                 * @brief a detached fd stops running tasks, even in the middle of handle_events
+                 */
+                inline void set_detached(bool is_detached) {
+                    hot_.is_detached_ = is_detached;
+                }
                 void set_write_callback(const callback& cb);
                 void set_close_callback(const callback& cb);
                 void set_error_callback(const callback& cb);
-                inline int32_t events() const { return events_; }
-                inline bool is_writing() const { return events_ & write_event_; }
-                inline bool is_reading() const { return events_ & read_event_; }
-                inline bool is_none_evt() const { return events_ == none_event_; }
+                inline int32_t events() const { return hot_.events_; }
+                /**
+                 * @brief epoll events needed by pending tasks
+                 */
+                inline uint32_t pending_events() const {
+                    return (hot_.pending_read_cnt_ > 0 ? read_event_ : none_event_)
+                        | (hot_.pending_write_cnt_ > 0 ? write_event_ : none_event_);
+                }
+                inline bool is_writing() const { return hot_.events_ & write_event_; }
+                inline bool is_reading() const { return hot_.events_ & read_event_; }
+                inline bool is_none_evt() const { return hot_.events_ == none_event_; }
                 void disable_reading();
                 void disable_writing();
                 void disable_closing();
                 void disable_error();
                 void disable_all();
+                /**
+                 * @brief add heap bytes held by task queues and iovec buffers of this object
+                 */
+                void get_memory_usage(uint64_t& task_queue_bytes, uint64_t& iov_buffer_bytes) const;
             private:
-                int32_t do_read_task(const task& t);
-                int32_t do_write_task(const task& t);
+                /**
+                 * @param limit max bytes to move, UINT64_MAX if the fd is not limited
+                 */
+                int32_t do_read_task(const task& t, uint64_t limit);
+                int32_t do_write_task(const task& t, uint64_t limit);
+                int32_t do_msg_task(const task& t, bool is_read, uint64_t limit);
+                /**
+                 * @brief write what the fd and limit take, the task completes when the chain is empty
+                 */
+                int32_t do_chain_task(const task& t, uint64_t limit);
+                /**
+                 * @brief complete a connect task once the socket is connected or failed
+                 */
+                int32_t do_connect_task(const task& t);
+                /**
+                 * @brief accept one admitted connection, connections beyond the limit are reset or wait
+                 */
+                int32_t do_accept_task(const task& t);
+                /**
+                 * @brief if reads or writes of this fd may be limited
+                 */
+                inline bool is_rate_limited(bool is_read) const {
+                    return rate_limit_ != nullptr || (! is_read && loop_write_bucket_ != nullptr);
+                }
+                /**
+                 * @brief max bytes of one write, token limit capped by TCP_NOTSENT_LOWAT
+                 */
+                inline uint64_t write_cap(uint64_t limit) const {
+                    return STABLE_INFRA_UNLIKELY(notsent_lowat_ > 0) ? std::min<uint64_t>(limit, notsent_lowat_) : limit;
+                }
+                /**
+                 * @brief take the token budget of next task
+                 * A task waits until every bucket has its bytes or a full bucket of tokens, then it
+                 * moves at most the tokens of the emptiest bucket.
+                 * @return max bytes to move, 0 if the fd is throttled until the refill time
+                 */
+                uint64_t acquire_tokens(const task& t, bool is_read);
+                /**
+                 * @brief charge moved bytes to the buckets checked by acquire_tokens
+                 */
+                void consume_tokens(bool is_read, int32_t bytes);
+                /**
+                 * @brief collect buckets limiting one direction
+                 * @return count of buckets
+                 */
+                uint32_t get_buckets(bool is_read, token_bucket* buckets[3]);
+                /**
+                 * @brief wait for refill time in loop timer heap
+                 */
+                void throttle(uint64_t deadline_ns);
+                /**
+                 * @brief write task is done, release its bytes before write callback
+                 */
+                void release_write(const task& t);
+                /**
+                 * @brief invoke callback or append to completion queue
+                 */
+                inline void complete(const task& t, int32_t ret, bool is_read) {
+                    if (t.is_cq_) {
+                        completions_->push_back(completion{ t.tag_, ret, hot_.fd_,
+                            t.msg_ != nullptr ? (is_read ? COMPLETION_OP::RECVMSG : COMPLETION_OP::SENDMSG)
+                                              : (is_read ? COMPLETION_OP::READ : COMPLETION_OP::WRITE) });
+                        return;
+                    }
+                    auto trace_ts = trace_begin();
+                    // the callback may detach this fd from its loop
+                    auto running = running_callback_;
+                    if (STABLE_INFRA_UNLIKELY(running != nullptr)) {
+                        running->enter(hot_.fd_, is_read ? TRACE_PHASE::READ_CALLBACK : TRACE_PHASE::WRITE_CALLBACK);
+                    }
+                    if (is_read) {
+                        read_callback_(ret);
+                    } else {
+                        write_callback_(ret);
+                    }
+                    if (STABLE_INFRA_UNLIKELY(running != nullptr)) {
+                        running->leave();
+                    }
+                    trace_end(trace_ts, is_read ? TRACE_PHASE::READ_CALLBACK : TRACE_PHASE::WRITE_CALLBACK, hot_.fd_, ret);
+                }
             private:
+                /**
+                 * @brief readiness state read on every wakeup
+                 */
+                struct alignas(ALIGN_SIZE) hot_state
+                {
+                    fd_t fd_{ -1 };
+                    int32_t events_{ 0 };
+                    fd_operations fd_ops_{};
+                    FD_TYPE fd_type_{ FD_TYPE::UNKNOWN_FD };
+                    uint32_t pending_read_cnt_{ 0 };  ///< size of pending_read_task_
+                    uint32_t pending_write_cnt_{ 0 }; ///< size of pending_write_task_
+                    bool is_readable_{ false };
+                    bool is_writable_{ false };
+                    bool is_in_ready_queue_{ false };                 ///< if queued in ready queue of epoll
+                    bool is_detached_{ false };                       ///< if removed from its loop
+                    EVENT_PRIORITY priority_{ EVENT_PRIORITY::NORMAL };
+                    bool is_unregistered_{ false };                   ///< tried optimistically, not added to epoll yet
+                    uint32_t active_cnt_{ 0 };                        ///< servicing count since last reset
+                };
+                static_assert(sizeof(hot_state) == ALIGN_SIZE, "hot_state must fit in one cache line");
+
                 static const int32_t none_event_;
                 static const int32_t read_event_;
                 static const int32_t write_event_;
                 static const int32_t error_event_;
                 static const int32_t close_event_;
-                fd_t fd_{ -1 };
-                int32_t events_{ 0 };
+                hot_state hot_;
+                // cold part, only touched when there is a task to run
                 callback_t read_callback_{nullptr};
                 callback_t write_callback_{nullptr};
                 callback close_callback_{nullptr};
                 callback error_callback_{nullptr};
                 std::deque<task> pending_read_task_{};
                 std::deque<task> pending_write_task_{};
-                bool is_readable_{ false };
-                bool is_writable_{ false };
-                FD_TYPE fd_type_{ FD_TYPE::UNKNOWN_FD };
-                fd_operations fd_ops_{};
                 std::vector<::iovec> read_iov_buffer_;
                 std::vector<::iovec> write_iov_buffer_;
+                uint64_t queued_write_bytes_{ 0 };                         ///< bytes of pending write tasks
+                uint32_t notsent_lowat_{ 0 };                              ///< max bytes of one write, 0 means no cap
+                std::unique_ptr<write_watermark> write_watermark_{ nullptr }; ///< only allocated when it is set
+                write_queue_state* loop_write_state_{ nullptr };           ///< owned by loop
+                std::unique_ptr<frame_reader> frame_reader_{ nullptr };     ///< only allocated in framing mode
+                std::vector<completion>* completions_{ nullptr };          ///< completion queue owned by loop
+                std::unique_ptr<rate_limit_state> rate_limit_{ nullptr };   ///< only allocated for limited fds
+                token_bucket* loop_write_bucket_{ nullptr };               ///< owned by loop, set when loop is limited
+                throttle_timer_heap* throttle_timers_{ nullptr };          ///< owned by loop
+                running_callback* running_callback_{ nullptr };            ///< owned by loop, set while loop is watched
+                accept_state* accept_state_{ nullptr };                    ///< owned by loop
+                bool is_accepted_{ false };                                ///< if counted in accept_state of its loop
+                bool is_owned_{ false };                                   ///< if a thread of shared loop is handling it
+                bool is_movable_{ false };                                 ///< if shed_load may move it
+                uint8_t ready_priority_{ 0 };                              ///< ready queue it is in, priority may change later
+                uint32_t ready_pos_{ 0 };                                  ///< position in ready queue, see set_ready_slot
         };
     }
 }
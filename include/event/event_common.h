@@ -7,8 +7,15 @@
  *          which can be found in the LICENSE file
  ***************************************************************************************/
 #pragma once
+#include <stdint.h>
 #include <functional>
 #include <memory>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "../common/type_def.h"
+#include "../util/delimiter_scanner.h"
+#include "../data_struct/ctrl_group.h"
 
 namespace stable_infra {
     namespace event {
@@ -18,6 +25,240 @@ namespace stable_infra {
 
         typedef std::function<void(void)> pending_func;
 
+        /**
+         * @brief bytes allocated by one poll object
+         * Heap sizes of standard containers are estimated from their sizes and capacities,
+         * memory allocated by user callables stored in std::function is not included.
+         */
+        struct memory_stats
+        {
+            uint64_t fd_cnt_{ 0 };           ///< registered fds
+            uint64_t fd_table_bytes_{ 0 };   ///< fd to event_info table
+            uint64_t event_bytes_{ 0 };      ///< event_info and event_action objects with their control blocks
+            uint64_t task_queue_bytes_{ 0 }; ///< pending read/write task queues
+            uint64_t iov_buffer_bytes_{ 0 }; ///< iovec scratch buffers of event_action
+            uint64_t loop_bytes_{ 0 };       ///< epoll_event array, change list and ready queue
+            uint64_t total_bytes_{ 0 };      ///< sum of all above
+        };
+
+        /// count of priority classes
+#define PRIORITY_CNT 3
+
+        /**
+         * @brief priority class of fd in ready queue
+         */
+        enum class EVENT_PRIORITY : uint8_t
+        {
+            HIGH = 0,   ///< control plane, heartbeat
+            NORMAL = 1, ///< default
+            LOW = 2,    ///< bulk data
+        };
+
+        /**
+         * @brief how ready fds of different classes are serviced in one dispatch
+         */
+        enum class PRIORITY_POLICY : uint8_t
+        {
+            STRICT = 0,   ///< all ready fds of a higher class before any fd of a lower class
+            WEIGHTED = 1, ///< round robin over classes, weights_[class] fds of a class per round
+        };
+
+        /**
+         * @brief priority servicing policy of one poll object
+         */
+        struct priority_policy
+        {
+            PRIORITY_POLICY policy_{ PRIORITY_POLICY::STRICT };
+            uint32_t weights_[PRIORITY_CNT]{ 8, 4, 1 }; ///< used by PRIORITY_POLICY::WEIGHTED, 0 is taken as 1
+            uint32_t budget_{ 0 };                      ///< max fds serviced in one dispatch, 0 means no limit,
+                                                        ///< fds beyond it are kept for next dispatch
+        };
+
+        /**
+         * @brief latency of one priority class
+         * Latency is measured from the return of epoll_wait which queued the fd to the start of its servicing.
+         */
+        struct priority_class_stats
+        {
+            uint64_t serviced_cnt_{ 0 };     ///< times fds of this class were serviced
+            uint64_t total_latency_ns_{ 0 }; ///< sum of latencies
+            uint64_t max_latency_ns_{ 0 };   ///< max latency
+        };
+
+        /**
+         * @brief latency of all priority classes, indexed by EVENT_PRIORITY
+         */
+        struct priority_stats
+        {
+            priority_class_stats classes_[PRIORITY_CNT];
+        };
+
+        /**
+         * @brief load counters of one poll object, can be read by any thread
+         */
+        struct load_stats
+        {
+            uint64_t busy_ns_{ 0 };          ///< time spent out of epoll_wait
+            uint64_t iteration_cnt_{ 0 };    ///< dispatch calls
+            uint64_t serviced_cnt_{ 0 };     ///< ready fds serviced
+            uint64_t migrated_in_cnt_{ 0 };  ///< fds moved in by migrate_fd
+            uint64_t migrated_out_cnt_{ 0 }; ///< fds moved out by migrate_fd
+        };
+
+        /**
+         * @brief what accepting does with connections beyond accept_limit::max_conn_
+         */
+        enum class ACCEPT_OVERLOAD : uint8_t
+        {
+            REJECT = 0, ///< accept and close at once with SO_LINGER 0, the peer gets RST instead of waiting
+            PAUSE = 1,  ///< take listen fds out of epoll, new connections wait in kernel backlog
+        };
+
+        /**
+         * @brief admission control of connections accepted by one poll object
+         */
+        struct accept_limit
+        {
+            uint32_t max_conn_{ 0 };                              ///< accepted connections in the loop, 0 means no cap
+            uint32_t budget_{ 0 };                                ///< accepts of all listen fds per dispatch, the rest
+                                                                  ///< wait for next dispatch, 0 means no budget
+            ACCEPT_OVERLOAD overload_{ ACCEPT_OVERLOAD::REJECT }; ///< handling of connections beyond max_conn_
+        };
+
+        /**
+         * @brief accept counters of one poll object
+         */
+        struct accept_stats
+        {
+            uint64_t accepted_cnt_{ 0 }; ///< connections handed to accept callbacks
+            uint64_t rejected_cnt_{ 0 }; ///< connections reset by ACCEPT_OVERLOAD::REJECT
+            uint64_t deferred_cnt_{ 0 }; ///< times listen fds were left to next dispatch by budget
+            uint64_t paused_cnt_{ 0 };   ///< times listen fds were taken out of epoll by ACCEPT_OVERLOAD::PAUSE
+            uint32_t conn_cnt_{ 0 };     ///< accepted connections in the loop now
+        };
+
+        /**
+         * @brief layout of a length prefixed frame header
+         * Frame size is the value of length field, plus header_size_ if length field does not count header.
+         * If delimiter_size_ is not 0, frames end with delimiter instead, e.g. "\r\n" of RESP lines,
+         * and header fields are ignored.
+         */
+        struct frame_spec
+        {
+            uint32_t header_size_{ 4 };              ///< bytes of header, length field is inside it
+            uint32_t length_offset_{ 0 };            ///< offset of length field in header
+            uint8_t length_size_{ 4 };               ///< bytes of length field, 1, 2, 4 or 8
+            bool is_big_endian_{ true };             ///< byte order of length field
+            bool is_length_include_header_{ false }; ///< if length field counts header
+            uint32_t max_frame_size_{ 16 << 20 };    ///< bigger frames fail the read
+            uint8_t delimiter_size_{ 0 };            ///< bytes of delimiter, 0 to DELIMITER_MAX_SIZE
+            char delimiter_[DELIMITER_MAX_SIZE]{};   ///< end of a delimited frame
+        };
+
+        /// invoked with one whole frame including header or delimiter, (nullptr, 0) if closed, (nullptr, -1) if failed
+        typedef std::function<void(const char*, int32_t)> frame_callback;
+
+        /**
+         * @brief operation of a completion
+         */
+        enum class COMPLETION_OP : uint8_t
+        {
+            READ = 0,    ///< submit_async_read_cq
+            WRITE = 1,   ///< submit_async_write_cq
+            RECVMSG = 2, ///< submit_async_recvmsg_cq
+            SENDMSG = 3, ///< submit_async_sendmsg_cq
+        };
+
+        /**
+         * @brief one completion of completion queue mode
+         */
+        struct completion
+        {
+            uint64_t tag_;     ///< tag given at submitting
+            int32_t result_;   ///< transferred bytes, 0 if closed, -1 if failed
+            int32_t fd_;       ///< file discriptor
+            COMPLETION_OP op_; ///< operation
+        };
+
+        /**
+         * @brief one operation of submit_batch, its completion goes to the completion queue
+         * Fields follow an io_uring submission entry, fd, opcode, buffers and user data, so a
+         * backend with submission rings can copy a batch into them and submit it at once.
+         */
+        struct submit_entry
+        {
+            submit_entry() = default;
+            /**
+             * @brief READ or WRITE of buffers
+             */
+            submit_entry(fd_t fd, COMPLETION_OP op, ::iovec* buffer, uint32_t buffer_iov_cnt, uint64_t tag)
+                : fd_(fd), op_(op), buffer_(buffer), buffer_iov_cnt_(buffer_iov_cnt), tag_(tag)
+            {
+            }
+            /**
+             * @brief RECVMSG or SENDMSG of a message
+             */
+            submit_entry(fd_t fd, COMPLETION_OP op, ::msghdr* msg, uint64_t tag)
+                : fd_(fd), op_(op), msg_(msg), tag_(tag)
+            {
+            }
+            fd_t fd_{ -1 };
+            COMPLETION_OP op_{ COMPLETION_OP::READ };
+            ::iovec* buffer_{ nullptr };    ///< buffers of READ and WRITE, valid until completion
+            uint32_t buffer_iov_cnt_{ 0 };
+            ::msghdr* msg_{ nullptr };      ///< message of RECVMSG and SENDMSG, valid until completion
+            uint64_t tag_{ 0 };             ///< user tag copied to completion
+            int32_t result_{ 0 };           ///< set by submit_batch, 0 queued, -1 failed
+        };
+
+        /**
+         * @brief normalized peer address
+         * IPv4 peers are kept as IPv4-mapped IPv6 addresses, so a dual stack socket and an IPv4
+         * socket give the same key for the same peer. Link local IPv6 peers keep the scope id.
+         */
+        struct peer_address
+        {
+            uint64_t addr_lo_{ 0 };   ///< bytes 0-7 of IPv6 address
+            uint64_t addr_hi_{ 0 };   ///< bytes 8-15 of IPv6 address
+            uint32_t scope_id_{ 0 };
+            uint16_t port_{ 0 };      ///< network byte order
+            uint16_t reserved_{ 0 };
+
+            /**
+             * @return false if family is neither AF_INET nor AF_INET6 or len is too short
+             */
+            bool from_sockaddr(const ::sockaddr* addr, socklen_t len);
+
+            /**
+             * @brief socket address of the peer, e.g. to reply or connect to
+             * @param is_ipv6_socket true gives IPv4-mapped addresses for a dual stack socket,
+             *        false gives AF_INET for IPv4 peers
+             * @return length of address
+             */
+            socklen_t to_sockaddr(::sockaddr_storage& addr, bool is_ipv6_socket) const;
+
+            bool is_ipv4() const;
+
+            inline bool operator==(const peer_address& other) const {
+                return addr_lo_ == other.addr_lo_ && addr_hi_ == other.addr_hi_
+                    && scope_id_ == other.scope_id_ && port_ == other.port_;
+            }
+
+            /**
+             * @brief hash with a seed, a per table seed keeps peers from choosing addresses
+             *        colliding in every process
+             */
+            inline uint64_t hash(uint64_t seed) const {
+                uint64_t h = mix(seed ^ addr_lo_);
+                h = mix(h ^ addr_hi_);
+                return mix(h ^ (((uint64_t)scope_id_ << 16) | port_));
+            }
+
+            static inline uint64_t mix(uint64_t v) {
+                return stable_infra::data_struct::ctrl_mix(v);
+            }
+        };
+
         /*
          * @breif get one io multiplexing object, such as epoll, poll, select, iocp
          * @return io multiplexing object pointer
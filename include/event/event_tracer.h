@@ -0,0 +1,178 @@
+/****************************************************************************************
+ * @file event_tracer.h
+ * @brief low overhead tracer of event loop phases
+ * @author Liu Hua Jun
+ * @email wojiaoliuhuajun@126.com
+ * @license Use of this source code is governed by The GNU Affero General Public License Version 3
+ *          which can be found in the LICENSE file
+ ***************************************************************************************/
+#pragma once
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include <chrono>
+#include "../common/type_def.h"
+#include "../common/const_variable.h"
+#include "../util/macros_func.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/// record count of each thread ring, must be power of 2
+#define TRACE_RING_SIZE 8192
+
+namespace stable_infra {
+    namespace event {
+        /**
+         * @brief traced phase of event loop
+         */
+        enum class TRACE_PHASE : uint8_t
+        {
+            EPOLL_WAIT = 1,     ///< blocked in epoll_wait, bytes is count of active events
+            APPLY_CHANGES = 2,  ///< epoll_ctl for changed events, bytes is count of changes
+            FD_READ = 3,        ///< read syscall loop in fd_io_operation, bytes is read result
+            FD_WRITE = 4,       ///< write syscall loop in fd_io_operation, bytes is write result
+            READ_CALLBACK = 5,  ///< user read callback
+            WRITE_CALLBACK = 6, ///< user write callback
+        };
+
+        /**
+         * @brief one traced event, timestamps are raw ticks of tracer::now()
+         */
+        struct trace_record
+        {
+            uint64_t begin_;
+            uint64_t duration_; ///< ticks, a 32 bit count would wrap on stalls longer than about one second
+            fd_t fd_;
+            int32_t bytes_;
+            TRACE_PHASE phase_;
+        };
+
+        /**
+         * @brief single writer ring of one thread
+         * The owner thread overwrites the oldest records, dumper copies records and drops the ones
+         * overwritten during copying.
+         */
+        struct alignas(ALIGN_SIZE) trace_ring
+        {
+            std::atomic<uint64_t> head_{ 0 };
+            int32_t tid_{ 0 };
+            trace_record records_[TRACE_RING_SIZE];
+        };
+
+        /**
+         * @brief event loop tracer
+         * Disabled by default. When enabled, every sample_interval-th loop iteration of each thread
+         * is traced into a per thread ring, nothing is allocated except the ring of a thread at its
+         * first record. Rings can be dumped at any time as Chrome/Perfetto trace json.
+         */
+        class tracer
+        {
+            public:
+                /**
+                 * @brief enable tracing
+                 * @param[in] sample_interval trace one loop iteration of every sample_interval iterations
+                 */
+                static void enable(uint32_t sample_interval = 1);
+                /**
+                 * @brief disable tracing, recorded events are kept for dumping
+                 */
+                static void disable();
+                static inline bool is_enabled() {
+                    return enabled_.load(std::memory_order_relaxed);
+                }
+                /**
+                 * @brief called by event loop at the beginning of each iteration
+                 * decide whether this iteration of current thread is sampled
+                 */
+                static inline void begin_iteration() {
+                    if (STABLE_INFRA_LIKELY(! is_enabled())) {
+                        sampling_ = false;
+                        return;
+                    }
+                    sampling_ = (++iteration_ % sample_interval_.load(std::memory_order_relaxed)) == 0;
+                }
+                static inline bool is_sampling() {
+                    return sampling_;
+                }
+                /**
+                 * @brief current raw tick
+                 */
+                static inline uint64_t now() {
+#if defined(__x86_64__) || defined(__i386__)
+                    return __rdtsc();
+#elif defined(__aarch64__)
+                    uint64_t tick;
+                    asm volatile("mrs %0, cntvct_el0" : "=r"(tick));
+                    return tick;
+#else
+                    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+                }
+                /**
+                 * @brief append one record to ring of current thread
+                 * @param[in] phase traced phase
+                 * @param[in] fd related fd, -1 if none
+                 * @param[in] bytes bytes or count related to the phase
+                 * @param[in] begin tick returned by now() when phase began
+                 */
+                static inline void record(TRACE_PHASE phase, fd_t fd, int32_t bytes, uint64_t begin) {
+                    auto end = now();
+                    trace_ring* ring = ring_;
+                    if (STABLE_INFRA_UNLIKELY(ring == nullptr)) {
+                        ring = create_ring();
+                    }
+                    auto head = ring->head_.load(std::memory_order_relaxed);
+                    auto& rec = ring->records_[head & (TRACE_RING_SIZE - 1)];
+                    rec.begin_ = begin;
+                    rec.duration_ = end - begin;
+                    rec.fd_ = fd;
+                    rec.bytes_ = bytes;
+                    rec.phase_ = phase;
+                    ring->head_.store(head + 1, std::memory_order_release);
+                }
+                /**
+                 * @brief dump records of all threads as Chrome trace json
+                 * @param[out] json trace json
+                 * @return count of dumped records
+                 */
+                static uint32_t dump_chrome_trace(std::string& json);
+                /**
+                 * @brief dump records of all threads as Chrome trace json file
+                 * @param[in] file_path output file
+                 * @return result
+                 * @retval RET_SUC successful
+                 * @retval RET_ERR failed
+                 */
+                static int32_t dump_chrome_trace_file(const std::string& file_path);
+            private:
+                static trace_ring* create_ring();
+            private:
+                static std::atomic<bool> enabled_;
+                static std::atomic<uint32_t> sample_interval_;
+                static thread_local trace_ring* ring_;
+                static thread_local bool sampling_;
+                static thread_local uint32_t iteration_;
+        };
+
+        /**
+         * @brief start tracing a phase
+         * @return begin tick, 0 if current iteration is not sampled
+         */
+        static inline uint64_t trace_begin()
+        {
+            return STABLE_INFRA_UNLIKELY(tracer::is_sampling()) ? tracer::now() : 0;
+        }
+
+        /**
+         * @brief finish tracing a phase started by trace_begin()
+         */
+        static inline void trace_end(uint64_t begin, TRACE_PHASE phase, fd_t fd, int32_t bytes)
+        {
+            if (STABLE_INFRA_UNLIKELY(begin != 0)) {
+                tracer::record(phase, fd, bytes, begin);
+            }
+        }
+    }
+}
@@ -0,0 +1,148 @@
+/****************************************************************************************
+ * @file fd_channel.h
+ * @brief pass fds between processes over AF_UNIX socket
+ * @author Liu Hua Jun
+ * @email wojiaoliuhuajun@126.com
+ * @license Use of this source code is governed by The GNU Affero General Public License Version 3
+ *          which can be found in the LICENSE file
+ ***************************************************************************************/
+#pragma once
+#include <stdint.h>
+#include <string>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <sys/socket.h>
+#include "poll_base.h"
+#include "../common/const_variable.h"
+#include "../common/type_def.h"
+
+/// max bytes of opaque state carried with each fd
+#define HANDOFF_STATE_SIZE 128
+
+/// max fds carried by one message, must be less than SCM_MAX_FD(253)
+#define HANDOFF_BATCH_SIZE 64
+
+namespace stable_infra {
+    namespace event {
+        /**
+         * @brief one fd to hand off and its state
+         */
+        struct handoff_item
+        {
+            fd_t fd_{ -1 };
+            FD_TYPE type_{ FD_TYPE::UNKNOWN_FD };
+            uint32_t state_len_{ 0 };
+            char state_[HANDOFF_STATE_SIZE];
+        };
+
+        /**
+         * @brief asynchronous fd passing channel
+         * fds are sent in batches of HANDOFF_BATCH_SIZE with SCM_RIGHTS over a SOCK_SEQPACKET
+         * AF_UNIX socket, each fd carries its type and a small opaque state. Received fds are
+         * adopted by the receiving poll with their type, so no fd type detection is needed.
+         * @note all functions must be called in the thread of poll
+         */
+        class fd_channel
+        {
+            public:
+                /**
+                 * @brief invoked for each received fd, item is nullptr if the channel is closed or failed
+                 */
+                using recv_callback_t = std::function<void(const handoff_item* item)>;
+                /**
+                 * @brief invoked once per successful send(), ret is count of sent fds, the first ret items
+                 *        are sent and the rest are still owned by the caller if it is less than cnt
+                 */
+                using send_callback_t = std::function<void(int32_t ret)>;
+
+                /**
+                 * @brief construction function
+                 * @param[in] poll poll which drives this channel
+                 * @param[in] sock connected AF_UNIX SOCK_SEQPACKET socket, owned by channel
+                 * @param[in] close_after_send close local fds after they are sent successfully, they are
+                 *            removed from poll first
+                 */
+                fd_channel(const std::shared_ptr<poll_base>& poll, fd_t sock, bool close_after_send = true);
+                ~fd_channel();
+
+                /**
+                 * @brief create a connected non-blocking socket pair for channel
+                 * @return RET_SUC or RET_ERR
+                 */
+                static int32_t create_pair(fd_t& sock1, fd_t& sock2);
+                /**
+                 * @brief listen on unix path, path started with '@' is in abstract namespace
+                 * @return listen fd, INVALID_FD if failed
+                 */
+                static fd_t listen_path(const std::string& path);
+                /**
+                 * @brief connect unix path, path started with '@' is in abstract namespace
+                 * @return connected non-blocking socket, INVALID_FD if failed
+                 */
+                static fd_t connect_path(const std::string& path);
+
+                /**
+                 * @brief send fds asynchronously
+                 * @param[in] items fds and states, copied before return
+                 * @param[in] cnt count of items
+                 * @param[in] cb invoked when all items are sent, a batch of them failed, or the channel is closed
+                 * @return RET_SUC if cb will be invoked, RET_ERR if nothing is queued and cb is not invoked
+                 */
+                int32_t send(const handoff_item* items, uint32_t cnt, const send_callback_t& cb);
+                /**
+                 * @brief start receiving fds, cb is invoked for each fd until the channel is closed
+                 * @return RET_SUC or RET_ERR
+                 */
+                int32_t start_receive(const recv_callback_t& cb);
+                /**
+                 * @brief close the channel socket, pending send() callbacks get the count sent so far and
+                 *        the receive callback gets nullptr
+                 */
+                void close();
+                inline fd_t get_fd() const { return sock_; }
+            private:
+                /**
+                 * @brief wire format of one fd
+                 */
+                struct wire_item
+                {
+                    uint32_t type_;
+                    uint32_t state_len_;
+                    char state_[HANDOFF_STATE_SIZE];
+                };
+                /**
+                 * @brief one message with up to HANDOFF_BATCH_SIZE fds
+                 */
+                struct batch
+                {
+                    ::msghdr msg_;
+                    ::iovec iov_;
+                    uint32_t cnt_{ 0 };
+                    wire_item items_[HANDOFF_BATCH_SIZE];
+                    fd_t fds_[HANDOFF_BATCH_SIZE];
+                    char ctrl_[CMSG_SPACE(sizeof(fd_t) * HANDOFF_BATCH_SIZE)];
+                    bool is_last_{ false };        ///< last batch of one send()
+                    send_callback_t cb_{ nullptr }; ///< only set in last batch
+                };
+                void prepare_msg(batch& b, bool is_send);
+                int32_t submit_front();
+                void on_sent(int32_t ret);
+                /**
+                 * @brief finish the first queued batch, a failed batch finishes the rest of its send()
+                 */
+                void complete_front(int32_t ret);
+                void on_received(int32_t ret);
+                int32_t submit_receive();
+            private:
+                std::shared_ptr<poll_base> poll_;
+                fd_t sock_{ INVALID_FD };
+                bool close_after_send_{ true };
+                std::deque<std::unique_ptr<batch>> send_batches_;
+                int32_t sent_cnt_{ 0 };  ///< fds sent by current send()
+                std::unique_ptr<batch> recv_batch_;
+                recv_callback_t recv_cb_{ nullptr };
+                bool is_receiving_{ false }; ///< a receive is queued in poll
+        };
+    }
+}
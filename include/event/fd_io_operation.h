@@ -18,6 +18,7 @@ namespace stable_infra {
 #define FD_TYPE_TCP      1
 #define FD_TYPE_UDP      2
 #define FD_TYPE_GENERAL   3
+#define FD_TYPE_UNIX      4
 
         template<uint32_t TYPE>
         class fd_io_operation
@@ -32,9 +33,10 @@ namespace stable_infra {
             {
                 uint32_t result = 0;
                 struct msghdr msg{};
-                msg.msg_iov = iov;
-                msg.msg_iovlen = iov_cnt;
                 while (true) {
+                    // move_iov may skip consumed iovecs
+                    msg.msg_iov = iov;
+                    msg.msg_iovlen = iov_cnt;
                     auto ret_recv = recvmsg(fd, &msg, 0);
                     if (ret_recv > 0) {
                         result += ret_recv;
@@ -44,8 +46,8 @@ namespace stable_infra {
                         }
                         continue;
                     } else if (ret_recv == 0) {
-                        // closed
-                        return 0;
+                        // closed, bytes read before are returned first and the next read reports it
+                        return result;
                     } else {
                         if (errno == EAGAIN
                             || errno == EWOULDBLOCK) {
@@ -67,9 +69,9 @@ namespace stable_infra {
             {
                 uint32_t result = 0;
                 struct msghdr msg{};
-                msg.msg_iov = iov;
-                msg.msg_iovlen = iov_cnt;
                 while (true) {
+                    msg.msg_iov = iov;
+                    msg.msg_iovlen = iov_cnt;
                     auto ret_w = sendmsg(fd, &msg, 0);
                     if (ret_w >= 0) {
                         result += ret_w;
@@ -95,17 +97,204 @@ namespace stable_infra {
             }
         };
 
+        /**
+         * @brief AF_UNIX stream or seqpacket socket, byte stream operations are the same as tcp
+         */
+        template<>
+        class fd_io_operation<FD_TYPE_UNIX> : public fd_io_operation<FD_TYPE_TCP>
+        {
+        };
+
+        /**
+         * @brief one message operations on any socket, used by msghdr tasks
+         * Unlike read_fd/write_fd, only one recvmsg/sendmsg is issued so message boundaries
+         * and ancillary data (SCM_RIGHTS) are kept.
+         */
+        class socket_msg_operation
+        {
+        public:
+            /**
+             * @return received bytes, 0 if closed, -1 if error
+             */
+            static int32_t recv_msg(fd_t fd, ::msghdr* msg, bool& is_empty)
+            {
+                is_empty = false;
+                while (true) {
+                    auto ret_recv = recvmsg(fd, msg, MSG_CMSG_CLOEXEC);
+                    if (ret_recv >= 0) {
+                        return ret_recv;
+                    }
+                    if (errno == EAGAIN
+                        || errno == EWOULDBLOCK) {
+                        is_empty = true;
+                        return 0;
+                    } else if (errno == EINTR) {
+                        continue;
+                    }
+                    return ret_recv;
+                }
+            }
+
+            /**
+             * @return sent bytes, -1 if error
+             */
+            static int32_t send_msg(fd_t fd, ::msghdr* msg, bool& is_full)
+            {
+                is_full = false;
+                while (true) {
+                    auto ret_w = sendmsg(fd, msg, MSG_NOSIGNAL);
+                    if (ret_w >= 0) {
+                        return ret_w;
+                    }
+                    if (errno == EAGAIN
+                        || errno == EWOULDBLOCK) {
+                        is_full = true;
+                        return 0;
+                    } else if (errno == EINTR) {
+                        continue;
+                    }
+                    return ret_w;
+                }
+            }
+        };
+
+        /**
+         * @brief non-blocking connect of a stream socket, used by connect tasks
+         */
+        class socket_connect_operation
+        {
+        public:
+            /**
+             * @brief send SYN, with data if a TCP Fast Open cookie of the peer is cached
+             * Without a cookie a plain SYN asking for one is sent and no data is taken. If fast open
+             * is disabled or not supported by the socket, a plain connect is done.
+             * @return bytes of data sent with SYN, -1 if error
+             */
+            static int32_t start(fd_t fd, const ::sockaddr* addr, socklen_t addr_len, const void* data, uint32_t data_len)
+            {
+                if (data != nullptr && data_len > 0) {
+                    while (true) {
+                        auto ret_w = sendto(fd, data, data_len, MSG_FASTOPEN | MSG_NOSIGNAL, addr, addr_len);
+                        if (ret_w >= 0) {
+                            return ret_w;
+                        }
+                        if (errno == EINPROGRESS) {
+                            return 0;
+                        } else if (errno == EINTR) {
+                            continue;
+                        } else if (errno != EOPNOTSUPP) {
+                            return -1;
+                        }
+                        break;
+                    }
+                }
+                // interrupted connect goes on in background like EINPROGRESS
+                if (connect(fd, addr, addr_len) == 0 || errno == EINPROGRESS || errno == EINTR) {
+                    return 0;
+                }
+                return -1;
+            }
+
+            /**
+             * @brief check a socket which started connecting
+             * @return 0 if connected or still connecting, -1 if failed with errno of the connect
+             */
+            static int32_t finish(fd_t fd, bool& is_connecting)
+            {
+                is_connecting = false;
+                int32_t err = 0;
+                socklen_t len = sizeof(err);
+                if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0) {
+                    return -1;
+                }
+                if (err != 0) {
+                    errno = err;
+                    return -1;
+                }
+                // no error is also reported while SYN is in flight, e.g. for a task tried before epoll
+                ::sockaddr_storage peer;
+                socklen_t peer_len = sizeof(peer);
+                if (getpeername(fd, reinterpret_cast<::sockaddr*>(&peer), &peer_len) == 0) {
+                    return 0;
+                }
+                if (errno == ENOTCONN) {
+                    is_connecting = true;
+                    return 0;
+                }
+                return -1;
+            }
+        };
+
+        /**
+         * @brief udp socket, one datagram per operation so boundaries are kept
+         * A read or write task on a connected udp socket moves one datagram, a datagram longer
+         * than buffers of a read task is truncated. Unconnected sockets use msghdr tasks or the
+         * batch operations with udp_session_table.
+         */
         template<>
             class fd_io_operation<FD_TYPE_UDP>
             {
             public:
                 static int32_t read_fd(fd_t fd, ::iovec* iov, uint32_t iov_cnt, bool& is_empty)
                 {
-                    return 0;
+                    struct msghdr msg{};
+                    msg.msg_iov = iov;
+                    msg.msg_iovlen = iov_cnt;
+                    return socket_msg_operation::recv_msg(fd, &msg, is_empty);
                 }
                 static int32_t write_fd(fd_t fd, ::iovec* iov, uint32_t iov_cnt, bool& is_full)
                 {
-                    return 0;
+                    struct msghdr msg{};
+                    msg.msg_iov = iov;
+                    msg.msg_iovlen = iov_cnt;
+                    return socket_msg_operation::send_msg(fd, &msg, is_full);
+                }
+
+                /**
+                 * @brief receive up to cnt datagrams by one recvmmsg
+                 * @note msg_namelen of each message is changed to the peer address length
+                 * @return datagrams received, 0 if socket is empty, -1 if error
+                 */
+                static int32_t recv_batch(fd_t fd, ::mmsghdr* msgs, uint32_t cnt, bool& is_empty)
+                {
+                    is_empty = false;
+                    while (true) {
+                        auto ret_recv = recvmmsg(fd, msgs, cnt, MSG_DONTWAIT, nullptr);
+                        if (ret_recv >= 0) {
+                            return ret_recv;
+                        }
+                        if (errno == EAGAIN
+                            || errno == EWOULDBLOCK) {
+                            is_empty = true;
+                            return 0;
+                        } else if (errno == EINTR) {
+                            continue;
+                        }
+                        return ret_recv;
+                    }
+                }
+
+                /**
+                 * @brief send up to cnt datagrams by one sendmmsg
+                 * @return datagrams sent, 0 if socket buffer is full, -1 if error
+                 */
+                static int32_t send_batch(fd_t fd, ::mmsghdr* msgs, uint32_t cnt, bool& is_full)
+                {
+                    is_full = false;
+                    while (true) {
+                        auto ret_w = sendmmsg(fd, msgs, cnt, MSG_DONTWAIT | MSG_NOSIGNAL);
+                        if (ret_w >= 0) {
+                            return ret_w;
+                        }
+                        if (errno == EAGAIN
+                            || errno == EWOULDBLOCK) {
+                            is_full = true;
+                            return 0;
+                        } else if (errno == EINTR) {
+                            continue;
+                        }
+                        return ret_w;
+                    }
                 }
             };
 
@@ -0,0 +1,112 @@
+/**
+ * @file frame_reader.h
+ * @brief length prefixed or delimited frame reader of one fd
+ * @author Liu Hua Jun
+ * @email wojiaoliuhuajun@126.com
+ * @license Use of this source code is governed by The GNU Affero General Public License Version 3
+ *          which can be found in the LICENSE file
+ */
+#pragma once
+#include <stdint.h>
+#include <vector>
+#include <sys/uio.h>
+#include "event_common.h"
+#include "../common/type_def.h"
+
+/// initial size of frame buffer
+#define FRAME_BUFFER_MIN 16384
+
+/// SO_RCVLOWAT is capped by it, kernel halves rcvbuf for it and a bigger value may never wake up
+#define FRAME_LOWAT_MAX (256 * 1024)
+
+/// read_frame result when read budget is used up before a whole frame
+#define FRAME_READ_THROTTLED 1
+
+/**
+ * @brief stable_infra namespace
+ */
+namespace stable_infra {
+    /**
+     * @brief event namespace
+     * All event driven codes are in this namespace
+     */
+    namespace event {
+        /**
+         * @brief assemble length prefixed or delimited frames of one fd into a contiguous buffer
+         * Bytes are read into a library owned buffer, a read may take several frames and the
+         * following ones are delivered from the buffer without syscalls. When a tcp fd blocks
+         * in the middle of a frame, SO_RCVLOWAT is set to the missing bytes so epoll only wakes
+         * up when the rest of the frame has arrived. It is changed only when it differs.
+         * Delimited frames are searched by find_delimiter, bytes of a partial frame are searched
+         * once, the next search starts where the last one stopped.
+         */
+        class frame_reader
+        {
+            public:
+                using read_func_t = int32_t (*)(fd_t fd, ::iovec* iov, uint32_t iov_cnt, bool& is_empty);
+                /**
+                 * @brief construction function
+                 * @param fd file discriptor
+                 * @param is_tcp if SO_RCVLOWAT can be used
+                 */
+                frame_reader(fd_t fd, bool is_tcp);
+            public:
+                inline void set_spec(const frame_spec& spec) {
+                    spec_ = spec;
+                    scanned_ = 0;
+                }
+                inline void set_callback(const frame_callback& cb) { cb_ = cb; }
+                /**
+                 * @brief deliver one frame to callback
+                 * @param read read function of fd
+                 * @param[in,out] budget max bytes to read from fd, decreased by bytes read
+                 * @return result
+                 * @retval 0 one frame, close or error is delivered
+                 * @retval FRAME_READ_THROTTLED budget is used up without a whole frame
+                 * @retval INT32_MAX fd would block without a whole frame
+                 */
+                int32_t read_frame(read_func_t read, uint64_t& budget);
+                /**
+                 * @brief if a whole frame is in buffer
+                 */
+                inline bool has_frame() const { return frame_size() > 0; }
+                /**
+                 * @brief heap bytes of frame buffer
+                 */
+                inline uint64_t memory_usage() const { return buffer_.capacity(); }
+            private:
+                /**
+                 * @brief size of frame at head of buffer
+                 * @return frame size, 0 if header or body is incomplete, -1 if header is invalid
+                 */
+                int64_t frame_size() const;
+                /**
+                 * @brief size of delimited frame at head of buffer, same results as frame_size
+                 */
+                int64_t delimited_size() const;
+                /**
+                 * @brief bytes to read into buffer from head of frame before the frame can be whole
+                 */
+                uint64_t needed_size() const;
+                /**
+                 * @brief decode frame size from a whole header at head of buffer
+                 */
+                uint64_t decode_size() const;
+                /**
+                 * @brief make room for needed bytes after data
+                 */
+                void reserve(uint64_t needed);
+                void set_lowat(uint32_t lowat);
+            private:
+                fd_t fd_{ -1 };
+                bool is_tcp_{ false };
+                frame_spec spec_;
+                frame_callback cb_{ nullptr };
+                std::vector<char> buffer_;
+                uint32_t begin_{ 0 }; ///< first byte of unconsumed data
+                uint32_t end_{ 0 };   ///< end of data
+                uint32_t lowat_{ 1 }; ///< SO_RCVLOWAT of fd
+                uint32_t scanned_{ 0 }; ///< bytes after begin_ known to start no delimiter
+        };
+    }
+}
@@ -0,0 +1,72 @@
+/**
+ * @file loop_balancer.h
+ * @brief move connections from busy event loops to idle ones
+ * @author Liu Hua Jun
+ * @email wojiaoliuhuajun@126.com
+ * @license Use of this source code is governed by The GNU Affero General Public License Version 3
+ *          which can be found in the LICENSE file
+ */
+#pragma once
+#include "../common/platform_define.h"
+#ifdef EVENT_EPOLL_EXIST
+#include <stdint.h>
+#include <memory>
+#include <vector>
+#include <functional>
+#include "epoll.h"
+
+/**
+ * @brief stable_infra namespace
+ */
+namespace stable_infra {
+    /**
+     * @brief event namespace
+     * All event driven codes are in this namespace
+     */
+    namespace event {
+        /**
+         * @brief rebalancer of several epoll loops running in their own threads
+         * Utilization of a loop is its busy time out of epoll_wait divided by wall time since last
+         * rebalance. When the busiest and the idlest loops differ more than threshold, the busiest
+         * one migrates its most active fds to the idlest one, about half of the difference each time.
+         * Only fds marked by epoll::set_movable are migrated.
+         */
+        class loop_balancer
+        {
+            public:
+                /**
+                 * @brief construction function
+                 * @param loops loops to balance, all in EPOLL_MODE::EXCLUSIVE
+                 * @param threshold min utilization difference which triggers migration, in (0, 1)
+                 * @param max_move max fds moved by one rebalance
+                 * @param migrated_cb invoked for each moved fd in the thread of its new loop, as (fd, 0),
+                 *        or (fd, -1) in the old loop thread if it stays, used to update routing of fd
+                 */
+                loop_balancer(const std::vector<std::shared_ptr<epoll>>& loops, double threshold = 0.2, uint32_t max_move = 16,
+                        const std::function<void(fd_t, int32_t)>& migrated_cb = nullptr);
+            public:
+                /**
+                 * @brief compare loops and request migration if needed, call it periodically from any thread
+                 * The first call only takes a sample.
+                 * @return result of rebalancing
+                 * @retval 1 migration is requested
+                 * @retval 0 loops are balanced
+                 * @retval -1 failed
+                 */
+                int32_t rebalance();
+                /**
+                 * @brief get utilization of each loop computed by last rebalance
+                 */
+                inline const std::vector<double>& get_utilization() const { return utilization_; }
+            private:
+                std::vector<std::shared_ptr<epoll>> loops_;
+                std::vector<load_stats> last_stats_; ///< load counters of last rebalance
+                std::vector<double> utilization_;    ///< utilization of last interval
+                uint64_t last_ns_{ 0 };              ///< time of last rebalance
+                double threshold_{ 0.2 };
+                uint32_t max_move_{ 16 };
+                std::function<void(fd_t, int32_t)> migrated_cb_{ nullptr };
+        };
+    }
+}
+#endif
@@ -0,0 +1,124 @@
+/**
+ * @file loop_watchdog.h
+ * @brief report event loops stalled by slow callbacks
+ * @author Liu Hua Jun
+ * @email wojiaoliuhuajun@126.com
+ * @license Use of this source code is governed by The GNU Affero General Public License Version 3
+ *          which can be found in the LICENSE file
+ */
+#pragma once
+#include "../common/platform_define.h"
+#ifdef EVENT_EPOLL_EXIST
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include "epoll.h"
+
+/**
+ * @brief stable_infra namespace
+ */
+namespace stable_infra {
+    /**
+     * @brief event namespace
+     * All event driven codes are in this namespace
+     */
+    namespace event {
+        /**
+         * @brief one stall of a loop
+         */
+        struct loop_stall
+        {
+            uint32_t loop_idx_{ 0 };                           ///< index of the loop given to loop_watchdog
+            fd_t fd_{ INVALID_FD };                            ///< fd whose callback is running, INVALID_FD if
+                                                               ///< the loop stalls out of read and write callbacks
+            TRACE_PHASE phase_{ TRACE_PHASE::READ_CALLBACK };  ///< READ_CALLBACK or WRITE_CALLBACK if fd_ is valid
+            uint64_t elapsed_ns_{ 0 };                         ///< time since the loop was last seen moving
+            uint64_t iteration_cnt_{ 0 };                      ///< dispatch calls of the loop before the stall
+            bool is_recovered_{ false };                       ///< false when threshold is exceeded,
+                                                               ///< true when the loop moves again
+        };
+
+        /// invoked in watchdog thread twice per stall, when it is detected and when the loop recovers
+        using stall_hook_t = std::function<void(const loop_stall&)>;
+
+        /**
+         * @brief watchdog thread of several epoll loops
+         * The heartbeat of a loop is its iteration count, stored relaxed once per dispatch. A loop which
+         * has not moved for threshold is stalled. Read and write callbacks of watched loops publish their
+         * fd with a relaxed store, so a stall names the fd and callback which blocks the loop.
+         * A loop which has not moved and runs no callback may be blocked in epoll_wait, it is woken by an
+         * empty post after half a threshold and is stalled only if it does not answer within threshold.
+         * @note time resolution is a quarter of threshold
+         */
+        class loop_watchdog
+        {
+            public:
+                /**
+                 * @brief construction function
+                 * @param loops loops to watch, all in EPOLL_MODE::EXCLUSIVE
+                 * @param threshold_ns time without progress which makes a stall
+                 * @param hook invoked with each stall and its recovery
+                 */
+                loop_watchdog(const std::vector<std::shared_ptr<epoll>>& loops, uint64_t threshold_ns,
+                        const stall_hook_t& hook);
+                /**
+                 * @brief destruction function, stops watching
+                 */
+                ~loop_watchdog();
+
+                loop_watchdog(const loop_watchdog&) = delete;
+                loop_watchdog& operator=(const loop_watchdog&) = delete;
+            public:
+                /**
+                 * @brief enable callback watch of loops and start watchdog thread
+                 * @return result of starting
+                 * @retval true successful
+                 * @retval false already started or invalid arguments
+                 */
+                bool start();
+                /**
+                 * @brief join watchdog thread and disable callback watch of loops
+                 */
+                void stop();
+                /**
+                 * @brief count of stalls detected since start
+                 */
+                inline uint64_t get_stall_cnt() const { return stall_cnt_.load(std::memory_order_relaxed); }
+            private:
+                /**
+                 * @brief what the watchdog saw of one loop
+                 */
+                struct loop_state
+                {
+                    uint64_t iteration_cnt_{ 0 };
+                    uint64_t running_{ 0 };       ///< running_callback::state_
+                    uint64_t since_ns_{ 0 };      ///< time the loop was last seen moving or was probed
+                    bool is_probed_{ false };     ///< if woken by post since last move
+                    bool is_stalled_{ false };    ///< if the stall has been reported
+                    loop_stall stall_;
+                };
+                void run();
+                /**
+                 * @brief check one loop, report a detected or ended stall
+                 */
+                void check(uint32_t idx, uint64_t now);
+            private:
+                std::vector<std::shared_ptr<epoll>> loops_;
+                std::vector<loop_state> states_;
+                uint64_t threshold_ns_{ 0 };
+                uint64_t interval_ns_{ 0 };   ///< period of checks
+                stall_hook_t hook_{ nullptr };
+                std::atomic<uint64_t> stall_cnt_{ 0 };
+                bool is_running_{ false };
+                std::mutex mtx_;
+                std::condition_variable cv_;  ///< wakes watchdog thread for stopping
+                std::thread thread_;
+        };
+    }
+}
+#endif
@@ -9,8 +9,11 @@
 #pragma once
 #include <stdint.h>
 #include <functional>
+#include <sys/socket.h>
 #include "event_common.h"
+#include "rate_limiter.h"
 #include "../common/type_def.h"
+#include "../data_struct/buffer_chain.h"
 
 /**
  * @brief stable_infra function namespace
@@ -52,15 +55,337 @@ namespace stable_infra {
 
                 virtual int32_t submit_async_read(fd_t fd, ::iovec* buffer, uint32_t buffer_iov_cnt, const std::function<void(int32_t)>& cb) = 0;
 
-                virtual int32_t submit_async_accept(fd_t listen_fd, ::iovec* buffer, uint32_t buffer_iov_cnt, const std::function<void(int32_t)>& cb) = 0;
+                /**
+                 * @brief accept one connection of a listening socket
+                 * The connection is accepted by accept4 as non-blocking and registered in this poll object
+                 * with the type of listen_fd. Submit again in cb for the next one, connections waiting
+                 * in backlog are accepted back to back. Admission is controlled by set_accept_limit,
+                 * an accepted connection counts until it is removed by remove_fd.
+                 * @param[in] listen_fd listening stream socket
+                 * @param[in] cb invoked with the accepted fd, -1 if accepting failed, e.g. with EMFILE,
+                 *            then the listen fd waits for the next connection
+                 * @return result of submitting
+                 * @retval 0 successful
+                 * @retval -1 failed
+                 */
+                virtual int32_t submit_async_accept(fd_t listen_fd, const std::function<void(int32_t)>& cb) = 0;
+
+                /**
+                 * @brief set admission control of connections accepted by this poll object
+                 * Beyond max_conn_ connections are reset at once or listen fds are taken out of epoll
+                 * until 1/8 of max_conn_ connections have been removed. budget_ bounds the accepts of
+                 * one dispatch, so a connection flood takes a bounded share of each loop iteration.
+                 * Call it in loop thread.
+                 * @param[in] limit limits, all 0 removes them
+                 * @return result of setting
+                 * @retval 0 successful
+                 * @retval -1 failed
+                 */
+                virtual int32_t set_accept_limit(const accept_limit& limit) = 0;
+
+                virtual void get_accept_stats(accept_stats& stats) const = 0;
 
                 virtual int32_t submit_async_write(fd_t fd, ::iovec* buffer, uint32_t buffer_iov_cnt, const std::function<void(int32_t)>& cb) = 0;
 
+                /**
+                 * @brief connect a non-blocking stream socket
+                 * With data, TCP Fast Open sends it with SYN when a cookie of the peer is cached, so a
+                 * request to a known server saves one round trip. Without a cookie no data is sent,
+                 * cb tells how many bytes went with SYN and the rest is written as usual after cb.
+                 * @param[in] fd non-blocking socket which is not connected
+                 * @param[in] addr peer address, used before returning
+                 * @param[in] addr_len bytes of addr
+                 * @param[in] data bytes to send with SYN, nullptr for a plain connect
+                 * @param[in] data_len bytes of data
+                 * @param[in] cb invoked with bytes of data sent with SYN when connected,
+                 *            -1 if failed with errno of the connect. It is the write callback of fd
+                 * @return result of submitting
+                 * @retval 0 successful
+                 * @retval -1 failed, errno is set if connecting failed at once
+                 */
+                virtual int32_t submit_async_connect(fd_t fd, const ::sockaddr* addr, socklen_t addr_len,
+                        const void* data, uint32_t data_len, const std::function<void(int32_t)>& cb) = 0;
+
+                /**
+                 * @brief write a buffer chain, the chain is owned by the loop until completion
+                 * Partial writes do not complete the task, the rest of the chain is written on the
+                 * next writable edge, and segments are released when it completes or the fd is
+                 * removed. Share one chain among fds by passing copies, no bytes are copied.
+                 * Each write takes at most IOV_MAX segments.
+                 * @param[in] fd file discriptor
+                 * @param[in] chain bytes to write, less than 2GB as the result is int32_t, it is kept
+                 *            by the caller if submitting fails
+                 * @param[in] cb invoked with bytes written, -1 if failed
+                 * @return result of submitting
+                 * @retval 0 successful
+                 * @retval -1 failed
+                 */
+                virtual int32_t submit_async_write(fd_t fd, stable_infra::data_struct::buffer_chain&& chain, const std::function<void(int32_t)>& cb) = 0;
+
+                /**
+                 * @brief completion queue variants of submit_async_read/write/recvmsg/sendmsg
+                 * Instead of invoking a callback, a completion with tag is appended to the completion
+                 * queue of this poll object. dispatch returns count of new completions, get them by
+                 * get_completions and release them by clear_completions.
+                 * @param[in] tag user tag copied to completion
+                 * @return result of submitting
+                 * @retval 0 successful
+                 * @retval -1 failed
+                 */
+                virtual int32_t submit_async_read_cq(fd_t fd, ::iovec* buffer, uint32_t buffer_iov_cnt, uint64_t tag) = 0;
+
+                virtual int32_t submit_async_write_cq(fd_t fd, ::iovec* buffer, uint32_t buffer_iov_cnt, uint64_t tag) = 0;
+
+                virtual int32_t submit_async_recvmsg_cq(fd_t fd, ::msghdr* msg, uint64_t tag) = 0;
+
+                virtual int32_t submit_async_sendmsg_cq(fd_t fd, ::msghdr* msg, uint64_t tag) = 0;
+
+                virtual int32_t submit_async_write_cq(fd_t fd, stable_infra::data_struct::buffer_chain&& chain, uint64_t tag) = 0;
+
+                /**
+                 * @brief submit many completion queue operations in one call
+                 * Fd lookups of consecutive entries of the same fd, change list growth and the
+                 * mode check are shared by the batch. Entries are queued in order, a failed entry
+                 * does not stop later ones.
+                 * @param[in,out] entries operations, result_ of each is set
+                 * @param[in] cnt count of entries
+                 * @return result of submitting
+                 * @retval >=0 count of queued entries
+                 * @retval -1 failed, completion queue is not supported
+                 */
+                virtual int32_t submit_batch(submit_entry* entries, uint32_t cnt) = 0;
+
+                /**
+                 * @brief get completions which are not cleared
+                 * @param[out] cnt count of completions
+                 * @return completion array, valid until clear_completions or next dispatch
+                 */
+                virtual const completion* get_completions(uint32_t& cnt) const = 0;
+
+                /**
+                 * @brief release all completions, the array memory is kept for reuse
+                 */
+                virtual void clear_completions() = 0;
+
+                /**
+                 * @brief read one length prefixed or delimited frame into a library owned contiguous buffer
+                 * After the first call all read tasks of fd are frame tasks. cb is invoked once per
+                 * whole frame, the pointer is valid until cb returns. Bytes after the frame are kept
+                 * for the following tasks.
+                 * @param[in] fd stream socket
+                 * @param[in] spec header layout or delimiter
+                 * @param[in] cb frame callback, can be nullptr after the first call to keep the old one
+                 * @return result of submitting
+                 * @retval 0 successful
+                 * @retval -1 failed
+                 */
+                virtual int32_t submit_async_read_frame(fd_t fd, const frame_spec& spec, const frame_callback& cb) = 0;
+
+                /**
+                 * @brief receive one message with recvmsg, ancillary data such as SCM_RIGHTS is kept
+                 * @param[in] fd socket
+                 * @param[in] msg message header, must be valid until cb is invoked
+                 * @param[in] cb invoked with received bytes, 0 if closed, -1 if failed
+                 * @return result of submitting
+                 * @retval 0 successful
+                 * @retval -1 failed
+                 */
+                virtual int32_t submit_async_recvmsg(fd_t fd, ::msghdr* msg, const std::function<void(int32_t)>& cb) = 0;
+
+                /**
+                 * @brief send one message with sendmsg
+                 * @param[in] fd socket
+                 * @param[in] msg message header, must be valid until cb is invoked
+                 * @param[in] cb invoked with sent bytes, -1 if failed
+                 * @return result of submitting
+                 * @retval 0 successful
+                 * @retval -1 failed
+                 */
+                virtual int32_t submit_async_sendmsg(fd_t fd, ::msghdr* msg, const std::function<void(int32_t)>& cb) = 0;
+
+                /**
+                 * @brief try tasks of fds which are not in epoll yet without waiting for readiness
+                 * A task submitted to such an fd runs in next dispatch without blocking in epoll,
+                 * the fd is added to epoll only when one of its tasks would block. It saves epoll_ctl
+                 * and one wait for fds which are usually ready, like request/response connections.
+                 * Pass the fd type by adopt_fd to skip get_fd_type as well.
+                 * @param[in] is_optimistic if it is enabled, disabled by default
+                 * @return result of setting
+                 * @retval 0 successful
+                 * @retval -1 failed
+                 */
+                virtual int32_t set_optimistic_io(bool is_optimistic) = 0;
+
+                /**
+                 * @brief register fd with a known type, get_fd_type is skipped for it
+                 * Used for fds received from other processes or loops whose type is already known.
+                 * @param[in] fd file discriptor
+                 * @param[in] type fd type
+                 * @return result of adopting
+                 * @retval 0 successful
+                 * @retval -1 failed
+                 */
+                virtual int32_t adopt_fd(fd_t fd, FD_TYPE type) = 0;
+
+                /**
+                 * @brief remove fd from this poll object, pending tasks are dropped without callbacks
+                 * Must be called in loop thread, calling it from callbacks of fd itself is safe.
+                 * fd is not closed.
+                 * @param[in] fd file discriptor
+                 * @return result of removing
+                 * @retval 0 successful
+                 * @retval -1 fd is not registered
+                 */
+                virtual int32_t remove_fd(fd_t fd) = 0;
+
+                /**
+                 * @brief move fd with its pending tasks, callbacks and state to another poll object
+                 * Can be called by any thread. fd leaves this loop in this loop thread and joins target
+                 * in target thread, pending tasks are neither lost nor run twice. Operations of fd should
+                 * be submitted to target after cb.
+                 * @param[in] fd file discriptor
+                 * @param[in] target poll object of the same kind
+                 * @param[in] cb invoked with 0 in target thread when fd has joined target,
+                 *            or with -1 in this loop thread when fd stays here, can be nullptr
+                 * @return result of requesting
+                 * @retval 0 successful
+                 * @retval -1 failed
+                 */
+                virtual int32_t migrate_fd(fd_t fd, const std::shared_ptr<poll_base>& target,
+                        const std::function<void(int32_t)>& cb) = 0;
+
+                /**
+                 * @brief get load counters, can be called by any thread
+                 * @param[out] stats load counters
+                 */
+                virtual void get_load_stats(load_stats& stats) const = 0;
+
+                /**
+                 * @brief run func in loop thread, can be called by any thread without locks
+                 * The loop is woken up if it is blocked in dispatch.
+                 * @param[in] func function to run
+                 * @return result of posting
+                 * @retval 0 successful
+                 * @retval -1 failed
+                 */
+                virtual int32_t post(const pending_func& func) = 0;
+
+                /**
+                 * @brief set priority class of fd, it decides the order of servicing ready fds
+                 * @param[in] fd file discriptor, registered if not yet
+                 * @param[in] priority priority class, EVENT_PRIORITY::NORMAL by default
+                 * @return result of setting
+                 * @retval 0 successful
+                 * @retval -1 failed
+                 */
+                virtual int32_t set_priority(fd_t fd, EVENT_PRIORITY priority) = 0;
+
+                /**
+                 * @brief set how ready fds of different priority classes are serviced
+                 * @param[in] policy servicing policy
+                 */
+                virtual void set_priority_policy(const priority_policy& policy) = 0;
+
+                /**
+                 * @brief get latency statistics of each priority class
+                 * @param[out] stats latency statistics
+                 */
+                virtual void get_priority_stats(priority_stats& stats) const = 0;
+
+                /**
+                 * @brief set watermarks of queued write bytes of fd
+                 * Bytes of a write task are queued from submitting until its write completes.
+                 * @param[in] fd file discriptor, registered if not yet
+                 * @param[in] low cb(false) is invoked when queued bytes fall to it after reaching high
+                 * @param[in] high cb(true) is invoked when queued bytes reach it, 0 means no callback
+                 * @param[in] hard_limit writes beyond it fail with error_no WRITE_QUEUE_FULL, 0 means no limit
+                 * @param[in] cb watermark callback, pause producing on true and resume on false
+                 * @return result of setting
+                 * @retval 0 successful
+                 * @retval -1 failed
+                 */
+                virtual int32_t set_write_watermark(fd_t fd, uint64_t low, uint64_t high, uint64_t hard_limit,
+                        const std::function<void(bool)>& cb) = 0;
+
+                /**
+                 * @brief set watermarks of queued write bytes of all fds in this poll object
+                 * Parameters are the same as set_write_watermark.
+                 */
+                virtual int32_t set_loop_write_watermark(uint64_t low, uint64_t high, uint64_t hard_limit,
+                        const std::function<void(bool)>& cb) = 0;
+
+                /**
+                 * @brief low latency streaming writes of a tcp fd
+                 * TCP_NOTSENT_LOWAT is set to lowat, the kernel takes no more bytes and epoll does not
+                 * signal writable while bytes not yet sent reach it. Each write is also capped by lowat
+                 * and completes with fewer bytes like a partial write, so unsent bytes in kernel stay
+                 * within lowat plus one write and one segment instead of the whole send buffer, and
+                 * newer bytes stay in user space where they can be replaced or dropped.
+                 * Chain writes continue with the rest of the chain.
+                 * @param[in] fd tcp socket, registered if not yet
+                 * @param[in] lowat bytes of not sent data, e.g. 16KB, 0 restores the system default
+                 * @return result of setting
+                 * @retval 0 successful
+                 * @retval -1 failed, fd is not tcp or setsockopt failed
+                 */
+                virtual int32_t set_low_latency_write(fd_t fd, uint32_t lowat) = 0;
+
+                /**
+                 * @brief get queued write bytes of fd, 0 if fd is not registered
+                 */
+                virtual uint64_t get_queued_write_bytes(fd_t fd) const = 0;
+
+                /**
+                 * @brief get queued write bytes of all fds in this poll object
+                 */
+                virtual uint64_t get_loop_queued_write_bytes() const = 0;
+
+                /**
+                 * @brief limit read and write rate of fd by token buckets
+                 * A limited read or write moves at most the tokens it has, a paced write completes with
+                 * fewer bytes like a partial write. Tasks beyond the budget are deferred to the refill
+                 * time. A throttled fd stops reading, so the peer is slowed down by tcp flow control.
+                 * @param[in] fd file discriptor, registered if not yet
+                 * @param[in] read_limit read limit, rate_ 0 means unlimited
+                 * @param[in] write_limit write limit, rate_ 0 means unlimited
+                 * @return result of setting
+                 * @retval 0 successful
+                 * @retval -1 failed
+                 */
+                virtual int32_t set_rate_limit(fd_t fd, const rate_limit& read_limit, const rate_limit& write_limit) = 0;
+
+                /**
+                 * @brief let fd share token buckets with other fds, in addition to its own limits
+                 * @param[in] fd file discriptor, registered if not yet
+                 * @param[in] read_group group limiting reads, nullptr leaves the group
+                 * @param[in] write_group group limiting writes, nullptr leaves the group
+                 * @return result of setting
+                 * @retval 0 successful
+                 * @retval -1 failed
+                 */
+                virtual int32_t set_rate_group(fd_t fd, const std::shared_ptr<rate_group>& read_group,
+                        const std::shared_ptr<rate_group>& write_group) = 0;
+
+                /**
+                 * @brief limit write rate of all fds in this poll object
+                 * @param[in] write_limit write limit, rate_ 0 means unlimited
+                 * @return result of setting
+                 * @retval 0 successful
+                 * @retval -1 failed
+                 */
+                virtual int32_t set_loop_rate_limit(const rate_limit& write_limit) = 0;
+
+                /**
+                 * @brief get bytes allocated by this poll object
+                 * @param[out] stats memory statistics
+                 */
+                virtual void get_memory_stats(memory_stats& stats) const = 0;
+
                 /**
                  * @brief Dispatch event interface
                  * Dispatch events and invoke callback functions
                  * @return result of dispatching
-                 * @retval 0 successful
+                 * @retval >=0 successful, count of completions appended to completion queue
                  * @retval -1 failed
                  */
                 virtual int32_t dispatch(int32_t timeout) = 0;
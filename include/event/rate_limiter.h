@@ -0,0 +1,154 @@
+/****************************************************************************************
+ * @file rate_limiter.h
+ * @brief token buckets limiting read and write rate of fds
+ * @author Liu Hua Jun
+ * @email wojiaoliuhuajun@126.com
+ * @license Use of this source code is governed by The GNU Affero General Public License Version 3
+ *          which can be found in the LICENSE file
+ ***************************************************************************************/
+#pragma once
+#include <stdint.h>
+#include <vector>
+#include <algorithm>
+#include "../util/util.h"
+
+/**
+ * @brief stable_infra namespace
+ */
+namespace stable_infra {
+    /**
+     * @brief event namespace
+     * All event driven codes are in this namespace
+     */
+    namespace event {
+        class event_action;
+
+        /**
+         * @brief rate limit setting
+         */
+        struct rate_limit
+        {
+            rate_limit(uint64_t rate = 0, uint64_t burst = 0)
+                : rate_(rate), burst_(burst)
+            {
+            }
+            uint64_t rate_{ 0 };  ///< bytes per second, 0 means unlimited
+            uint64_t burst_{ 0 }; ///< bucket size in bytes, 0 means bytes of 100ms
+        };
+
+        /**
+         * @brief token bucket in bytes, refilled by elapsed time when it is checked
+         * Tokens go negative when a message which can not be split exceeds them, the debt
+         * delays later operations so the rate is still kept.
+         */
+        struct token_bucket
+        {
+            uint64_t rate_{ 0 };    ///< bytes per second, 0 means unlimited
+            uint64_t burst_{ 0 };   ///< max tokens
+            double tokens_{ 0 };
+            uint64_t last_ns_{ 0 }; ///< time of last refill
+
+            inline void reset(const rate_limit& limit, uint64_t now_ns) {
+                rate_ = limit.rate_;
+                burst_ = limit.burst_ > 0 ? limit.burst_ : std::max<uint64_t>(limit.rate_ / 10, 1);
+                tokens_ = (double)burst_;
+                last_ns_ = now_ns;
+            }
+            inline bool is_limited() const {
+                return rate_ > 0;
+            }
+            inline void refill(uint64_t now_ns) {
+                if (now_ns > last_ns_) {
+                    tokens_ = std::min((double)burst_, tokens_ + (double)(now_ns - last_ns_) * rate_ / 1e9);
+                    last_ns_ = now_ns;
+                }
+            }
+            /**
+             * @brief time until tokens reach need, need is capped by burst
+             * @return nanoseconds, 0 if there are enough tokens
+             */
+            inline uint64_t wait_ns(uint64_t need) const {
+                double goal = (double)std::min(need, burst_);
+                return tokens_ >= goal ? 0 : (uint64_t)((goal - tokens_) * 1e9 / rate_) + 1;
+            }
+            inline void consume(uint64_t bytes) {
+                tokens_ -= (double)bytes;
+            }
+        };
+
+        /**
+         * @brief token bucket shared by a group of fds, e.g. all connections of one tenant
+         * @note not thread safe, fds of a group must be in one loop
+         */
+        class rate_group
+        {
+            public:
+                explicit rate_group(const rate_limit& limit) {
+                    bucket_.reset(limit, stable_infra::util::monotonic_ns());
+                }
+                inline void set_limit(const rate_limit& limit) {
+                    bucket_.reset(limit, stable_infra::util::monotonic_ns());
+                }
+                inline token_bucket& bucket() {
+                    return bucket_;
+                }
+            private:
+                token_bucket bucket_;
+        };
+
+        /**
+         * @brief refill deadlines of throttled fds, a binary min heap in a vector
+         * An fd has at most one live entry whose deadline equals the one recorded by the fd,
+         * other entries of it are stale and skipped when they are popped.
+         */
+        class throttle_timer_heap
+        {
+            public:
+                struct entry
+                {
+                    uint64_t deadline_ns_;
+                    event_action* action_;
+                };
+            public:
+                inline void push(uint64_t deadline_ns, event_action* action) {
+                    heap_.push_back(entry{ deadline_ns, action });
+                    std::push_heap(heap_.begin(), heap_.end(), &throttle_timer_heap::is_later);
+                }
+                inline bool empty() const {
+                    return heap_.empty();
+                }
+                inline uint64_t next_deadline() const {
+                    return heap_.front().deadline_ns_;
+                }
+                inline entry pop() {
+                    std::pop_heap(heap_.begin(), heap_.end(), &throttle_timer_heap::is_later);
+                    entry e = heap_.back();
+                    heap_.pop_back();
+                    return e;
+                }
+                /**
+                 * @brief drop all entries of an fd leaving the loop, O(n)
+                 */
+                inline void remove(event_action* action) {
+                    auto it = std::remove_if(heap_.begin(), heap_.end(),
+                            [action](const entry& e) { return e.action_ == action; });
+                    if (it != heap_.end()) {
+                        heap_.erase(it, heap_.end());
+                        std::make_heap(heap_.begin(), heap_.end(), &throttle_timer_heap::is_later);
+                    }
+                }
+                inline void clear() {
+                    heap_.clear();
+                }
+                inline uint64_t memory_usage() const {
+                    return heap_.capacity() * sizeof(entry);
+                }
+            private:
+                static inline bool is_later(const entry& a, const entry& b) {
+                    return a.deadline_ns_ > b.deadline_ns_;
+                }
+            private:
+                std::vector<entry> heap_;
+        };
+    }
+}
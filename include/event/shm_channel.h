@@ -0,0 +1,147 @@
+/****************************************************************************************
+ * @file shm_channel.h
+ * @brief shared memory message channel between co-located processes
+ * @author Liu Hua Jun
+ * @email wojiaoliuhuajun@126.com
+ * @license Use of this source code is governed by The GNU Affero General Public License Version 3
+ *          which can be found in the LICENSE file
+ ***************************************************************************************/
+#pragma once
+#include <stdint.h>
+#include <atomic>
+#include <deque>
+#include <vector>
+#include <memory>
+#include "poll_base.h"
+#include "event_action.h"
+#include "../common/type_def.h"
+#include "../common/const_variable.h"
+
+namespace stable_infra {
+    namespace event {
+        /**
+         * @brief control block of one direction, lives in shared memory
+         */
+        struct shm_ring_ctrl
+        {
+            alignas(ALIGN_SIZE) std::atomic<uint64_t> head_;             ///< written by producer
+            alignas(ALIGN_SIZE) std::atomic<uint64_t> tail_;             ///< written by consumer
+            alignas(ALIGN_SIZE) std::atomic<uint32_t> consumer_waiting_; ///< consumer sleeps until notified of data
+            std::atomic<uint32_t> producer_waiting_;                     ///< producer sleeps until notified of space
+        };
+
+        /**
+         * @brief header of shared memory, followed by data of two rings
+         */
+        struct shm_header
+        {
+            uint64_t magic_;
+            uint32_t capacity_;           ///< bytes of each ring, power of 2
+            std::atomic<uint32_t> closed_; ///< set when any side closes
+            shm_ring_ctrl rings_[2];      ///< rings_[i] is written by side i
+        };
+
+        /**
+         * @brief shared memory message channel
+         * Two SPSC byte rings (one per direction) in a memfd, readiness of each side is signalled
+         * through its eventfd which is watched by poll as GENERAL_FD. A side is only notified when
+         * it has declared itself waiting, so a busy consumer costs the producer no syscall.
+         * The creator calls create() and passes get_fds() to the peer process (e.g. by fd_channel),
+         * the peer calls attach() with them.
+         * Messages keep their boundaries, each read completes with exactly one message.
+         * @note all functions must be called in the thread of poll, the channel must outlive its
+         *       pending operations
+         */
+        class shm_channel
+        {
+            public:
+                explicit shm_channel(const std::shared_ptr<poll_base>& poll);
+                ~shm_channel();
+
+                /**
+                 * @brief create shared memory and eventfds, this side writes ring 0
+                 * @param[in] capacity bytes of each ring, rounded up to power of 2
+                 * @return RET_SUC or RET_ERR
+                 */
+                int32_t create(uint32_t capacity);
+                /**
+                 * @brief attach to shared memory created by peer, this side writes ring 1
+                 * fds are owned by the channel after successful return
+                 * @return RET_SUC or RET_ERR
+                 */
+                int32_t attach(fd_t mem_fd, fd_t notify_fd0, fd_t notify_fd1);
+                /**
+                 * @brief fds for peer to attach
+                 */
+                void get_fds(fd_t& mem_fd, fd_t& notify_fd0, fd_t& notify_fd1) const;
+
+                /**
+                 * @brief read one message
+                 * @param[in] buffer buffer for message, must be valid until cb is invoked
+                 * @param[in] buffer_iov_cnt count of iovec
+                 * @param[in] cb invoked with message bytes, 0 if peer closed, -1 if this side is closed or the
+                 *            peer corrupted the ring, or -1 with error_no MSG_TOO_LARGE if message is larger
+                 *            than buffer, the message is kept for the next read
+                 * @return RET_SUC or RET_ERR
+                 */
+                int32_t submit_async_read(::iovec* buffer, uint32_t buffer_iov_cnt, const callback_t& cb);
+                /**
+                 * @brief write buffer as one message
+                 * @param[in] buffer message, must be valid until cb is invoked
+                 * @param[in] buffer_iov_cnt count of iovec
+                 * @param[in] cb invoked with message bytes, -1 if channel is closed
+                 * @return RET_SUC or RET_ERR
+                 */
+                int32_t submit_async_write(::iovec* buffer, uint32_t buffer_iov_cnt, const callback_t& cb);
+                /**
+                 * @brief max bytes of one message
+                 */
+                inline uint32_t max_msg_size() const {
+                    return header_ == nullptr ? 0 : capacity_ / 2 - sizeof(uint32_t);
+                }
+                /**
+                 * @brief close the channel, pending reads and writes complete with -1
+                 */
+                void close();
+            private:
+                struct request
+                {
+                    ::iovec* buffer_;
+                    uint32_t buffer_iov_cnt_;
+                    callback_t cb_;
+                };
+                int32_t map(fd_t mem_fd, uint32_t capacity, bool is_creator);
+                int32_t watch();
+                void on_notify(int32_t ret);
+                void notify(uint32_t side);
+                void notify_self();
+                bool try_read(request& req, int32_t& ret);
+                bool try_write(request& req);
+                bool rx_has_data();
+                bool tx_has_space(uint32_t len);
+                void process();
+            private:
+                std::shared_ptr<poll_base> poll_;
+                fd_t mem_fd_{ INVALID_FD };
+                fd_t notify_fds_[2]{ INVALID_FD, INVALID_FD };
+                uint32_t side_{ 0 };                ///< this side writes rings_[side_]
+                shm_header* header_{ nullptr };
+                size_t map_size_{ 0 };
+                uint32_t capacity_{ 0 };            ///< bytes of each ring, header_->capacity_ is writable by peer
+                char* tx_data_{ nullptr };
+                char* rx_data_{ nullptr };
+                shm_ring_ctrl* tx_{ nullptr };
+                shm_ring_ctrl* rx_{ nullptr };
+                uint64_t cached_tx_tail_{ 0 };      ///< last seen consumer position of tx ring
+                uint64_t cached_rx_head_{ 0 };      ///< last seen producer position of rx ring
+                uint64_t notify_value_{ 0 };        ///< eventfd counter buffer
+                ::iovec notify_iov_;
+                bool is_self_notified_{ false };    ///< own eventfd is written and not read by poll yet
+                bool is_processing_{ false };
+                bool is_corrupted_{ false };        ///< a record of peer is out of ring, the channel is closed
+                std::deque<request> pending_reads_;
+                std::deque<request> pending_writes_;
+                std::vector<std::pair<callback_t, int32_t>> completed_writes_;
+        };
+    }
+}
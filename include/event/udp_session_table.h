@@ -0,0 +1,266 @@
+/****************************************************************************************
+ * @file udp_session_table.h
+ * @brief demultiplex datagrams of a connectionless udp socket to peer sessions
+ * @author Liu Hua Jun
+ * @email wojiaoliuhuajun@126.com
+ * @license Use of this source code is governed by The GNU Affero General Public License Version 3
+ *          which can be found in the LICENSE file
+ ***************************************************************************************/
+#pragma once
+#include <stdint.h>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "event_common.h"
+#include "../common/type_def.h"
+#include "../util/util.h"
+#include "../data_struct/flat_map.h"
+
+/**
+ * @brief stable_infra namespace
+ */
+namespace stable_infra {
+    /**
+     * @brief event namespace
+     * All event driven codes are in this namespace
+     */
+    namespace event {
+        /**
+         * @brief datagrams received by one recvmmsg
+         * Buffers, iovecs and address storage are allocated once, receiving and demultiplexing
+         * a batch does not allocate.
+         */
+        class udp_recv_batch
+        {
+            public:
+                /**
+                 * @param batch_cnt max datagrams of one recvmmsg
+                 * @param datagram_size buffer bytes of each datagram, longer ones are truncated
+                 */
+                udp_recv_batch(uint32_t batch_cnt = 64, uint32_t datagram_size = 2048);
+
+                /**
+                 * @return datagrams received, 0 if socket is empty, -1 if error
+                 */
+                int32_t recv(fd_t fd, bool& is_empty);
+
+                inline uint32_t size() const {
+                    return cnt_;
+                }
+                inline const ::sockaddr* peer(uint32_t i) const {
+                    return reinterpret_cast<const ::sockaddr*>(&addrs_[i]);
+                }
+                inline socklen_t peer_len(uint32_t i) const {
+                    return msgs_[i].msg_hdr.msg_namelen;
+                }
+                inline const uint8_t* data(uint32_t i) const {
+                    return buffer_.data() + (size_t)i * datagram_size_;
+                }
+                inline uint32_t data_len(uint32_t i) const {
+                    return msgs_[i].msg_len;
+                }
+                inline bool is_truncated(uint32_t i) const {
+                    return (msgs_[i].msg_hdr.msg_flags & MSG_TRUNC) != 0;
+                }
+            private:
+                uint32_t datagram_size_;
+                uint32_t cnt_{ 0 };
+                std::vector<uint8_t> buffer_;
+                std::vector<::iovec> iovs_;
+                std::vector<::sockaddr_storage> addrs_;
+                std::vector<::mmsghdr> msgs_;
+        };
+
+        /**
+         * @brief sessions of udp peers in a flat_map
+         * Slots are probed 16 at a time by comparing 7 bits hash tags (SSE2 when available),
+         * so a miss usually touches no key. Lookup and insertion do not allocate unless the table
+         * grows, reserve() avoids that on the hot path. Idle sessions are expired incrementally,
+         * each call scans a bounded number of slots.
+         * @note SESSION must be default constructible and movable, pointers returned are valid
+         *       until the next insertion or erase
+         * @note not thread safe, a table belongs to the loop of its socket
+         */
+        template<typename SESSION>
+        class udp_session_table
+        {
+            public:
+                /**
+                 * @param capacity sessions expected
+                 * @param idle_timeout_ns sessions idle for longer are expired, 0 disables expiry
+                 */
+                explicit udp_session_table(uint32_t capacity = 1024, uint64_t idle_timeout_ns = 30000000000ull)
+                    : sessions_(capacity, peer_hash(peer_address::mix(stable_infra::util::monotonic_ns() ^ (uint64_t)(uintptr_t)this))),
+                      idle_timeout_ns_(idle_timeout_ns)
+                {
+                }
+
+                /**
+                 * @param now_ns refresh activity time of the session when it is not 0
+                 * @return nullptr if not found
+                 */
+                SESSION* find(const peer_address& key, uint64_t now_ns = 0) {
+                    auto it = sessions_.find(key);
+                    STABLE_INFRA_IF_TRUE_RETURN_CODE(it == sessions_.end(), nullptr);
+                    if (now_ns != 0) {
+                        it->second.last_active_ns_ = now_ns;
+                    }
+                    return &it->second.session_;
+                }
+
+                SESSION* find(const ::sockaddr* addr, socklen_t len, uint64_t now_ns = 0) {
+                    peer_address key;
+                    STABLE_INFRA_IF_TRUE_RETURN_CODE(!key.from_sockaddr(addr, len), nullptr);
+                    return find(key, now_ns);
+                }
+
+                /**
+                 * @brief find session of peer, a default constructed one is inserted if not found
+                 * @param is_new true if inserted
+                 */
+                SESSION* insert(const peer_address& key, uint64_t now_ns, bool& is_new) {
+                    auto ret = sessions_.try_emplace(key);
+                    is_new = ret.second;
+                    ret.first->second.last_active_ns_ = now_ns;
+                    return &ret.first->second.session_;
+                }
+
+                /**
+                 * @return nullptr if address family is not supported
+                 */
+                SESSION* insert(const ::sockaddr* addr, socklen_t len, uint64_t now_ns, bool& is_new) {
+                    peer_address key;
+                    is_new = false;
+                    STABLE_INFRA_IF_TRUE_RETURN_CODE(!key.from_sockaddr(addr, len), nullptr);
+                    return insert(key, now_ns, is_new);
+                }
+
+                bool erase(const peer_address& key) {
+                    return sessions_.erase(key) != 0;
+                }
+
+                /**
+                 * @brief find or insert session of every datagram of a batch
+                 * @param cb called as cb(session, is_new, batch, index), datagrams of unsupported
+                 *        address families are skipped
+                 */
+                template<typename CALLBACK>
+                void demux(const udp_recv_batch& batch, uint64_t now_ns, CALLBACK&& cb) {
+                    for (uint32_t i = 0; i < batch.size(); ++i) {
+                        bool is_new = false;
+                        auto session = insert(batch.peer(i), batch.peer_len(i), now_ns, is_new);
+                        if (session != nullptr) {
+                            cb(*session, is_new, batch, i);
+                        }
+                    }
+                }
+
+                /**
+                 * @brief expire sessions idle longer than idle timeout
+                 * Scanning goes on from where the last call stopped, call it periodically, e.g.
+                 * from a loop timer, with a small max_scan_cnt to bound the time spent.
+                 * @param cb called as cb(key, session) before the session is erased
+                 * @return sessions expired
+                 */
+                template<typename CALLBACK>
+                uint32_t expire(uint64_t now_ns, uint32_t max_scan_cnt, CALLBACK&& cb) {
+                    uint32_t slot_cnt = sessions_.slot_count();
+                    STABLE_INFRA_IF_TRUE_RETURN_CODE(idle_timeout_ns_ == 0 || slot_cnt == 0, 0);
+                    max_scan_cnt = std::min(max_scan_cnt, slot_cnt);
+                    uint32_t begin = expire_cursor_ & (slot_cnt - 1);
+                    uint32_t end = begin + max_scan_cnt;
+                    uint32_t expired_cnt = expire_slots(begin, std::min(end, slot_cnt), now_ns, cb);
+                    if (end > slot_cnt) {
+                        expired_cnt += expire_slots(0, end - slot_cnt, now_ns, cb);
+                    }
+                    expire_cursor_ = end & (slot_cnt - 1);
+                    return expired_cnt;
+                }
+
+                /**
+                 * @param cb called as cb(key, session) for each session
+                 */
+                template<typename CALLBACK>
+                void for_each(CALLBACK&& cb) {
+                    for (auto& s : sessions_) {
+                        cb(const_cast<const peer_address&>(s.first), s.second.session_);
+                    }
+                }
+
+                /**
+                 * @brief grow so that cnt sessions can be inserted without allocation
+                 */
+                void reserve(uint32_t cnt) {
+                    sessions_.reserve(cnt);
+                }
+
+                /**
+                 * @brief remove all sessions, memory is kept
+                 */
+                void clear() {
+                    for (auto it = sessions_.begin(); it != sessions_.end(); ) {
+                        it = sessions_.erase(it);
+                    }
+                }
+
+                inline void set_idle_timeout(uint64_t idle_timeout_ns) {
+                    idle_timeout_ns_ = idle_timeout_ns;
+                }
+                inline uint32_t size() const {
+                    return (uint32_t)sessions_.size();
+                }
+                inline uint32_t capacity() const {
+                    return sessions_.slot_count() - sessions_.slot_count() / 8;
+                }
+                inline uint64_t memory_usage() const {
+                    return sessions_.memory_usage();
+                }
+            private:
+                struct entry
+                {
+                    uint64_t last_active_ns_{ 0 };
+                    SESSION session_;
+                };
+
+                struct peer_hash
+                {
+                    explicit peer_hash(uint64_t seed = 0)
+                        : seed_(seed)
+                    {
+                    }
+                    inline size_t operator()(const peer_address& key) const {
+                        return (size_t)key.hash(seed_);
+                    }
+                    uint64_t seed_;
+                };
+
+                typedef stable_infra::data_struct::flat_map<peer_address, entry, peer_hash> session_map;
+
+                /**
+                 * @brief expire sessions in slots [begin, end)
+                 */
+                template<typename CALLBACK>
+                uint32_t expire_slots(uint32_t begin, uint32_t end, uint64_t now_ns, CALLBACK& cb) {
+                    uint32_t expired_cnt = 0;
+                    auto it = sessions_.from_slot(begin);
+                    while (it != sessions_.end() && it.slot() < end) {
+                        auto& e = it->second;
+                        if (now_ns > e.last_active_ns_ && now_ns - e.last_active_ns_ > idle_timeout_ns_) {
+                            cb(const_cast<const peer_address&>(it->first), e.session_);
+                            it = sessions_.erase(it);
+                            ++expired_cnt;
+                        } else {
+                            ++it;
+                        }
+                    }
+                    return expired_cnt;
+                }
+
+                session_map sessions_;
+                uint32_t expire_cursor_{ 0 };  ///< next slot to check for expiry
+                uint64_t idle_timeout_ns_;
+        };
+    }
+}
@@ -0,0 +1,363 @@
+/****************************************************************************************
+ * @file async_logger.h
+ * @brief asynchronous logger, callers only format into a per thread ring
+ * @author Liu Hua Jun
+ * @email wojiaoliuhuajun@126.com
+ * @license Use of this source code is governed by The GNU Affero General Public License Version 3
+ *          which can be found in the LICENSE file
+ ***************************************************************************************/
+#pragma once
+#include <stdint.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <condition_variable>
+#include <type_traits>
+#include "../common/const_variable.h"
+#include "../util/macros_func.h"
+
+/// bytes of one log record in ring
+#define LOG_SLOT_SIZE 256
+
+/// max bytes of one formatted binary record
+#define LOG_LINE_MAX 1024
+
+/**
+ * @brief stable_infra namespace
+ */
+namespace stable_infra {
+    /**
+     * @brief log namespace
+     */
+    namespace log {
+        enum class LOG_LEVEL : uint8_t
+        {
+            DEBUG = 0,
+            INFO = 1,
+            WARN = 2,
+            ERROR = 3,
+            OFF = 4,
+        };
+
+        struct log_config
+        {
+            std::string path_;                 ///< appended log file, empty means stderr
+            LOG_LEVEL level_{ LOG_LEVEL::INFO };
+            uint32_t ring_slot_cnt_{ 1024 };   ///< records of each thread ring, rounded up to power of 2
+            uint32_t flush_interval_us_{ 1000 }; ///< max delay of writing a record
+        };
+
+        struct log_stats
+        {
+            uint64_t written_cnt_{ 0 }; ///< records written to output
+            uint64_t dropped_cnt_{ 0 }; ///< records dropped because ring was full
+            uint64_t ring_cnt_{ 0 };    ///< thread rings alive
+        };
+
+        /**
+         * @brief one log record, a slot of ring
+         * Text records hold the formatted message ended by '\n'. Binary records hold the
+         * arguments encoded by type, they are formatted by the writer thread with fmt_.
+         */
+        struct log_record
+        {
+            uint64_t ts_ns_;       ///< CLOCK_REALTIME
+            int64_t id_;           ///< caller context, e.g. fd
+            const char* file_;     ///< __FILE__
+            const char* fmt_;      ///< format of binary record, must be a string literal
+            uint32_t line_;
+            uint16_t size_;        ///< used bytes of payload_
+            LOG_LEVEL level_;
+            bool is_binary_;
+            char payload_[LOG_SLOT_SIZE - 40];
+        };
+        static_assert(sizeof(log_record) == LOG_SLOT_SIZE, "log_record must fill one slot");
+
+        /**
+         * @brief single producer single consumer ring of log records
+         * The owner thread claims and publishes slots, the writer thread releases them after
+         * writing. A full ring drops the record and counts it, the caller never blocks.
+         */
+        class alignas(ALIGN_SIZE) log_ring
+        {
+            public:
+                log_ring(uint32_t slot_cnt, int32_t tid);
+
+                static void* operator new(std::size_t size);
+                static void operator delete(void* ptr);
+
+                /**
+                 * @brief claim next slot, called by owner thread
+                 * @return slot, nullptr if ring is full
+                 */
+                inline log_record* claim() {
+                    uint64_t head = head_.load(std::memory_order_relaxed);
+                    if (STABLE_INFRA_UNLIKELY(head - cached_tail_ > mask_)) {
+                        cached_tail_ = tail_.load(std::memory_order_acquire);
+                        if (head - cached_tail_ > mask_) {
+                            dropped_cnt_.store(dropped_cnt_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+                            return nullptr;
+                        }
+                    }
+                    return &slots_[head & mask_];
+                }
+                /**
+                 * @brief make the claimed slot visible to writer thread
+                 */
+                inline void publish() {
+                    head_.store(head_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+                }
+                inline uint64_t readable_begin() const {
+                    return tail_.load(std::memory_order_relaxed);
+                }
+                inline uint64_t readable_end() const {
+                    return head_.load(std::memory_order_acquire);
+                }
+                inline const log_record& at(uint64_t index) const {
+                    return slots_[index & mask_];
+                }
+                /**
+                 * @brief give written slots back to owner thread
+                 */
+                inline void release(uint64_t new_tail) {
+                    tail_.store(new_tail, std::memory_order_release);
+                }
+                inline uint64_t get_dropped_cnt() const {
+                    return dropped_cnt_.load(std::memory_order_relaxed);
+                }
+                inline int32_t get_tid() const {
+                    return tid_;
+                }
+                /**
+                 * @brief owner thread has exited, the ring is freed after it is drained
+                 */
+                inline void set_orphan() {
+                    is_orphan_.store(true, std::memory_order_release);
+                }
+                inline bool is_orphan() const {
+                    return is_orphan_.load(std::memory_order_acquire);
+                }
+            public:
+                uint64_t reported_dropped_cnt_{ 0 }; ///< used by writer thread
+            private:
+                // written by owner thread
+                alignas(ALIGN_SIZE) std::atomic<uint64_t> head_{ 0 };
+                uint64_t cached_tail_{ 0 };
+                std::atomic<uint64_t> dropped_cnt_{ 0 };
+                // written by writer thread
+                alignas(ALIGN_SIZE) std::atomic<uint64_t> tail_{ 0 };
+                std::atomic<bool> is_orphan_{ false };
+                alignas(ALIGN_SIZE) uint64_t mask_;
+                int32_t tid_;
+                std::vector<log_record> slots_;
+        };
+
+        /**
+         * @brief type tags of binary arguments
+         */
+        enum class LOG_ARG : uint8_t
+        {
+            I64 = 1,
+            U64 = 2,
+            DBL = 3,
+            STR = 4,
+            PTR = 5,
+        };
+
+        /**
+         * @brief encode arguments of binary record, arguments which do not fit are dropped
+         */
+        class log_arg_encoder
+        {
+            public:
+                log_arg_encoder(char* buffer, uint32_t size)
+                    : buffer_(buffer), size_(size)
+                {
+                }
+                inline uint32_t used() const {
+                    return pos_;
+                }
+                inline void encode_all() {
+                }
+                template <typename T, typename... REST>
+                inline void encode_all(const T& arg, const REST&... rest) {
+                    encode(arg);
+                    encode_all(rest...);
+                }
+            private:
+                template <typename T>
+                inline typename std::enable_if<std::is_integral<T>::value && std::is_signed<T>::value>::type
+                encode(T v) {
+                    put_scalar(LOG_ARG::I64, (int64_t)v);
+                }
+                template <typename T>
+                inline typename std::enable_if<(std::is_integral<T>::value && ! std::is_signed<T>::value)
+                    || std::is_enum<T>::value>::type
+                encode(T v) {
+                    put_scalar(LOG_ARG::U64, (uint64_t)v);
+                }
+                template <typename T>
+                inline typename std::enable_if<std::is_floating_point<T>::value>::type
+                encode(T v) {
+                    put_scalar(LOG_ARG::DBL, (double)v);
+                }
+                template <typename T>
+                inline void encode(T* v) {
+                    put_scalar(LOG_ARG::PTR, (uintptr_t)v);
+                }
+                inline void encode(const char* v) {
+                    v == nullptr ? put_string("(null)", 6) : put_string(v, strlen(v));
+                }
+                inline void encode(char* v) {
+                    encode((const char*)v);
+                }
+                inline void encode(const std::string& v) {
+                    put_string(v.data(), v.size());
+                }
+                template <typename T>
+                inline void put_scalar(LOG_ARG tag, T v) {
+                    if (is_full_ || pos_ + 1 + sizeof(T) > size_) {
+                        // later arguments are dropped too, so they are not shifted
+                        is_full_ = true;
+                        return;
+                    }
+                    buffer_[pos_] = (char)tag;
+                    memcpy(buffer_ + pos_ + 1, &v, sizeof(T));
+                    pos_ += 1 + sizeof(T);
+                }
+                void put_string(const char* v, size_t len);
+            private:
+                char* buffer_;
+                uint32_t size_;
+                uint32_t pos_{ 0 };
+                bool is_full_{ false };
+        };
+
+        /**
+         * @brief process wide asynchronous logger
+         * Callers format into the ring of their thread without locks or allocation, the ring is
+         * created on the first record of a thread. One writer thread drains all rings every
+         * flush interval and writes records with writev, text records are written from ring
+         * slots directly.
+         */
+        class async_logger
+        {
+            public:
+                static async_logger& instance();
+                ~async_logger();
+            public:
+                /**
+                 * @brief set output and options, must be called before the first record
+                 * @return result
+                 * @retval 0 successful
+                 * @retval -1 logger has started or log file can not be opened
+                 */
+                int32_t init(const log_config& config);
+                /**
+                 * @brief drain all rings and stop writer thread, later records are dropped
+                 */
+                void stop();
+                /**
+                 * @brief wait until records published before the call are written
+                 */
+                void flush();
+                inline void set_level(LOG_LEVEL level) {
+                    level_.store((uint8_t)level, std::memory_order_relaxed);
+                }
+                inline bool is_enabled(LOG_LEVEL level) const {
+                    return (uint8_t)level >= level_.load(std::memory_order_relaxed);
+                }
+                void get_stats(log_stats& stats) const;
+                /**
+                 * @brief format a record in caller thread, message is truncated to one slot
+                 */
+                void log_text(LOG_LEVEL level, const char* file, uint32_t line, int64_t id, const char* fmt, ...)
+                    __attribute__((format(printf, 6, 7)));
+                /**
+                 * @brief copy arguments and format in writer thread
+                 * Integers, floating point numbers, pointers, strings and std::string are accepted,
+                 * '*' width or precision is not supported.
+                 * @param fmt printf format, must be a string literal
+                 */
+                template <typename... ARGS>
+                void log_binary(LOG_LEVEL level, const char* file, uint32_t line, int64_t id, const char* fmt,
+                        const ARGS&... args) {
+                    log_ring* ring = local_ring();
+                    if (STABLE_INFRA_UNLIKELY(ring == nullptr)) {
+                        return;
+                    }
+                    log_record* rec = ring->claim();
+                    if (STABLE_INFRA_UNLIKELY(rec == nullptr)) {
+                        return;
+                    }
+                    fill_header(rec, level, file, line, id);
+                    rec->fmt_ = fmt;
+                    rec->is_binary_ = true;
+                    log_arg_encoder encoder(rec->payload_, sizeof(rec->payload_));
+                    encoder.encode_all(args...);
+                    rec->size_ = (uint16_t)encoder.used();
+                    ring->publish();
+                }
+                /**
+                 * @brief format a binary record, used by writer thread
+                 * @return length of output without '\0'
+                 */
+                static size_t format_binary(const log_record& rec, char* out, size_t cap);
+            private:
+                async_logger();
+                async_logger(const async_logger&) = delete;
+                async_logger& operator=(const async_logger&) = delete;
+                inline log_ring* local_ring() {
+                    return STABLE_INFRA_LIKELY(tls_ring_ != nullptr) ? tls_ring_ : register_thread();
+                }
+                /**
+                 * @brief create ring of calling thread, start writer thread on first call
+                 * @return ring, nullptr if logger has stopped
+                 */
+                log_ring* register_thread();
+                static void fill_header(log_record* rec, LOG_LEVEL level, const char* file, uint32_t line, int64_t id);
+                void run();
+                /**
+                 * @brief write readable records of all rings
+                 * @return count of written records
+                 */
+                uint64_t drain();
+                uint64_t drain_ring(log_ring& ring);
+                /**
+                 * @brief format time, level, thread and location of a record
+                 * @return length of prefix
+                 */
+                size_t format_prefix(const log_record& rec, int32_t tid, char* out, size_t cap);
+                void write_all(::iovec* iov, uint32_t iov_cnt);
+            private:
+                static thread_local log_ring* tls_ring_;
+                std::atomic<uint8_t> level_{ (uint8_t)LOG_LEVEL::INFO };
+                log_config config_;
+                int32_t out_fd_{ 2 };
+                std::once_flag start_flag_;
+                std::atomic<bool> is_started_{ false };
+                std::atomic<bool> is_stopped_{ false };
+                std::thread writer_;
+                std::mutex mtx_;                   ///< guards new_rings_ and flush sequence
+                std::condition_variable cv_;       ///< wakes writer thread
+                std::condition_variable flush_cv_; ///< wakes flushing threads
+                std::vector<std::shared_ptr<log_ring>> new_rings_; ///< rings waiting for writer thread
+                uint64_t flush_req_{ 0 };
+                uint64_t flush_done_{ 0 };
+                // used by writer thread
+                std::vector<std::shared_ptr<log_ring>> rings_;
+                std::vector<::iovec> iov_;
+                std::vector<char> text_;   ///< prefixes and formatted binary records of a batch
+                uint64_t cached_sec_{ 0 }; ///< second of cached_time_
+                char cached_time_[32];     ///< "YYYY-mm-dd HH:MM:SS" of cached_sec_
+                std::atomic<uint64_t> written_cnt_{ 0 };
+                std::atomic<uint64_t> dropped_cnt_{ 0 };
+                std::atomic<uint64_t> ring_cnt_{ 0 };
+        };
+    }
+}
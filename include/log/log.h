@@ -0,0 +1,38 @@
+/****************************************************************************************
+ * @file log.h
+ * @brief log macros of stable_infra
+ * @author Liu Hua Jun
+ * @email wojiaoliuhuajun@126.com
+ * @license Use of this source code is governed by The GNU Affero General Public License Version 3
+ *          which can be found in the LICENSE file
+ ***************************************************************************************/
+#pragma once
+#include "async_logger.h"
+
+/// format in caller thread, id is the context of record, e.g. fd
+#define LOG_BASE(level, id, fmt, ...) \
+    do { \
+        auto& stable_infra_logger = stable_infra::log::async_logger::instance(); \
+        if (stable_infra_logger.is_enabled(level)) { \
+            stable_infra_logger.log_text(level, __FILE__, __LINE__, (int64_t)(id), fmt, ##__VA_ARGS__); \
+        } \
+    } while (0)
+
+/// copy arguments and format in writer thread, fmt must be a string literal
+#define LOG_BIN(level, id, fmt, ...) \
+    do { \
+        auto& stable_infra_logger = stable_infra::log::async_logger::instance(); \
+        if (stable_infra_logger.is_enabled(level)) { \
+            stable_infra_logger.log_binary(level, __FILE__, __LINE__, (int64_t)(id), fmt, ##__VA_ARGS__); \
+        } \
+    } while (0)
+
+#define LOG_BASE_DEBUG(id, fmt, ...) LOG_BASE(stable_infra::log::LOG_LEVEL::DEBUG, id, fmt, ##__VA_ARGS__)
+#define LOG_BASE_INFO(id, fmt, ...) LOG_BASE(stable_infra::log::LOG_LEVEL::INFO, id, fmt, ##__VA_ARGS__)
+#define LOG_BASE_WARN(id, fmt, ...) LOG_BASE(stable_infra::log::LOG_LEVEL::WARN, id, fmt, ##__VA_ARGS__)
+#define LOG_BASE_ERROR(id, fmt, ...) LOG_BASE(stable_infra::log::LOG_LEVEL::ERROR, id, fmt, ##__VA_ARGS__)
+
+#define LOG_BIN_DEBUG(id, fmt, ...) LOG_BIN(stable_infra::log::LOG_LEVEL::DEBUG, id, fmt, ##__VA_ARGS__)
+#define LOG_BIN_INFO(id, fmt, ...) LOG_BIN(stable_infra::log::LOG_LEVEL::INFO, id, fmt, ##__VA_ARGS__)
+#define LOG_BIN_WARN(id, fmt, ...) LOG_BIN(stable_infra::log::LOG_LEVEL::WARN, id, fmt, ##__VA_ARGS__)
+#define LOG_BIN_ERROR(id, fmt, ...) LOG_BIN(stable_infra::log::LOG_LEVEL::ERROR, id, fmt, ##__VA_ARGS__)
@@ -0,0 +1,138 @@
+/**
+ * @file work_stealing_pool.h
+ * @brief work stealing thread pool for cpu heavy works of event callbacks
+ * @author Liu Hua Jun
+ * @email wojiaoliuhuajun@126.com
+ * @license Use of this source code is governed by The GNU Affero General Public License Version 3
+ *          which can be found in the LICENSE file
+ */
+#pragma once
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "../common/const_variable.h"
+#include "../data_struct/chase_lev_deque.h"
+#include "../data_struct/mpsc_queue.h"
+#include "../event/poll_base.h"
+
+/**
+ * @brief stable_infra namespace
+ */
+namespace stable_infra {
+    /**
+     * @brief thread namespace
+     */
+    namespace thread {
+        /**
+         * @brief work stealing thread pool
+         * Each worker owns a Chase-Lev deque, works submitted by a worker go to its own deque and
+         * idle workers steal from the others. Works submitted by other threads (such as event loops)
+         * are spread round robin to per worker mpsc inboxes, so no queue is shared by all workers.
+         * Results go back to the event loop by poll_base::post, the loop never takes a lock.
+         */
+        class work_stealing_pool
+        {
+            public:
+                using work_t = std::function<void(void)>;
+                /**
+                 * @brief construction function
+                 * @param[in] thread_cnt count of workers, 0 means count of cpus
+                 */
+                explicit work_stealing_pool(uint32_t thread_cnt = 0);
+                /**
+                 * @brief destruction function, queued works are finished before return
+                 */
+                ~work_stealing_pool();
+
+                work_stealing_pool(const work_stealing_pool&) = delete;
+                work_stealing_pool& operator=(const work_stealing_pool&) = delete;
+            public:
+                /**
+                 * @brief start workers
+                 * @return result of starting
+                 * @retval true successful
+                 * @retval false already started
+                 */
+                bool start();
+                /**
+                 * @brief finish queued works and join workers
+                 */
+                void stop();
+                /**
+                 * @brief submit one work, can be called by any thread
+                 * @param[in] work work to run in pool
+                 * @return result of submitting
+                 * @retval 0 successful
+                 * @retval -1 pool is not running
+                 */
+                int32_t submit(const work_t& work);
+                /**
+                 * @brief run work in pool, then run done in loop thread
+                 * Typical usage is in a completion callback: pool.offload(loop, parse, reply).
+                 * @param[in] loop event loop which runs done
+                 * @param[in] work work to run in pool
+                 * @param[in] done invoked by loop after work returns, can be nullptr
+                 * @return result of submitting
+                 * @retval 0 successful
+                 * @retval -1 failed
+                 */
+                int32_t offload(const std::shared_ptr<stable_infra::event::poll_base>& loop, const work_t& work,
+                        const stable_infra::event::pending_func& done);
+                /**
+                 * @brief run work in pool, then pass its result to done in loop thread
+                 * RESULT can not be deduced from lambdas, call it as offload<RESULT>(...).
+                 */
+                template<typename RESULT>
+                int32_t offload(const std::shared_ptr<stable_infra::event::poll_base>& loop,
+                        const std::function<RESULT(void)>& work, const std::function<void(RESULT&)>& done)
+                {
+                    if (work == nullptr || done == nullptr) {
+                        return -1;
+                    }
+                    auto result = std::make_shared<RESULT>();
+                    return offload(loop, [work, result]() { *result = work(); }, [done, result]() { done(*result); });
+                }
+                /**
+                 * @brief get count of workers
+                 */
+                inline uint32_t get_thread_cnt() const { return thread_cnt_; }
+                /**
+                 * @brief get count of works which are stolen by idle workers
+                 */
+                inline uint64_t get_steal_cnt() const { return steal_cnt_.load(std::memory_order_relaxed); }
+            private:
+                /**
+                 * @brief state of one worker
+                 */
+                struct alignas(ALIGN_SIZE) worker
+                {
+                    stable_infra::data_struct::chase_lev_deque<work_t*> deque_; ///< owned works, stolen from top
+                    stable_infra::data_struct::mpsc_queue<work_t*> inbox_;      ///< works submitted by other threads
+                    std::thread thread_;
+                    uint64_t rand_state_{ 0 };                                  ///< for choosing victim
+
+                    /// worker is cache line aligned, plain new can not honor it in c++11
+                    static void* operator new(std::size_t size);
+                    static void operator delete(void* ptr);
+                };
+                void run(uint32_t index);
+                work_t* find_work(uint32_t index);
+                bool has_work(uint32_t index) const;
+                void wake_sleepers();
+            private:
+                uint32_t thread_cnt_{ 0 };
+                std::vector<std::unique_ptr<worker>> workers_;
+                std::atomic<bool> running_{ false };
+                std::atomic<uint32_t> next_inbox_{ 0 };   ///< round robin index for external submitting
+                std::atomic<uint32_t> sleepers_{ 0 };     ///< count of workers waiting on sleep_cv_
+                std::atomic<uint64_t> steal_cnt_{ 0 };
+                std::mutex sleep_mtx_;
+                std::condition_variable sleep_cv_;
+        };
+    }
+}
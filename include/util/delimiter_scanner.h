@@ -0,0 +1,61 @@
+/****************************************************************************************
+ * @file delimiter_scanner.h
+ * @brief search of message delimiters with simd instructions selected at run time
+ * @author Liu Hua Jun
+ * @email wojiaoliuhuajun@126.com
+ * @license Use of this source code is governed by The GNU Affero General Public License Version 3
+ *          which can be found in the LICENSE file
+ ***************************************************************************************/
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+/// max bytes of a delimiter, e.g. "\r\n" of RESP or "\r\n\r\n" of http headers
+#define DELIMITER_MAX_SIZE 8
+
+/**
+ * @brief stable_infra namespace
+ */
+namespace stable_infra {
+    /**
+     * @brief util namespace
+     */
+    namespace util {
+        /**
+         * @brief first occurrence of a delimiter in a buffer
+         * AVX2 or SSE2 on x86_64 and NEON on aarch64 compare 32 or 16 positions at once with the
+         * first and the last byte of delimiter, only positions matching both are compared in full.
+         * Results of all implementations are the same.
+         * @param data buffer
+         * @param len bytes of buffer
+         * @param delimiter delimiter bytes
+         * @param delimiter_len bytes of delimiter, 1 to DELIMITER_MAX_SIZE
+         * @return first byte of the first delimiter, nullptr if not found
+         */
+        const char* find_delimiter(const char* data, size_t len, const char* delimiter, uint32_t delimiter_len);
+
+        /**
+         * @brief first occurrence of a delimiter in scattered buffers as if they were contiguous,
+         *        e.g. buffers filled by a read task, a delimiter may cross buffers
+         * @param iov buffers
+         * @param iov_cnt count of buffers
+         * @param delimiter delimiter bytes
+         * @param delimiter_len bytes of delimiter, 1 to DELIMITER_MAX_SIZE
+         * @param offset bytes to skip before searching
+         * @return offset of the first delimiter from the first byte of iov, -1 if not found
+         */
+        int64_t find_delimiter(const ::iovec* iov, uint32_t iov_cnt, const char* delimiter, uint32_t delimiter_len,
+                uint64_t offset = 0);
+
+        /**
+         * @brief plain implementation, used when cpu has no simd instruction
+         */
+        const char* find_delimiter_scalar(const char* data, size_t len, const char* delimiter, uint32_t delimiter_len);
+
+        /**
+         * @brief name of selected implementation, "avx2", "sse2", "neon" or "scalar"
+         */
+        const char* delimiter_scanner_impl_name();
+    }
+}
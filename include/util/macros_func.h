@@ -11,9 +11,15 @@
 #if __GNUC__ >= 3 || (__GNUC__ == 2 && __GNUC_MINOR__ > 91)
 #define STABLE_INFRA_LIKELY(x) __builtin_expect(!!(x), 1)
 #define STABLE_INFRA_UNLIKELY(x) __builtin_expect(!!(x), 0)
+/// prefetch the cache line of addr for reading
+#define STABLE_INFRA_PREFETCH(addr) __builtin_prefetch((addr), 0, 3)
+/// prefetch the cache line of addr for writing
+#define STABLE_INFRA_PREFETCH_W(addr) __builtin_prefetch((addr), 1, 3)
 #else
 #define STABLE_INFRA_LIKELY(x) (x)
 #define STABLE_INFRA_UNLIKELY(x) (x)
+#define STABLE_INFRA_PREFETCH(addr)
+#define STABLE_INFRA_PREFETCH_W(addr)
 #endif
 
 #define STABLE_INFRA_CHECK_SUC(expr, ret) \
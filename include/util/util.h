@@ -13,6 +13,7 @@
 #include <thread>
 #include <string.h>
 #include <vector>
+#include <time.h>
 #include "../common/platform_define.h"
 #include "../util/macros_func.h"
 #include "../common/const_variable.h"
@@ -33,5 +34,31 @@ namespace stable_infra {
         int32_t move_iov(::iovec*& iov, uint32_t& iov_cnt, uint32_t move_size);
 
         FD_TYPE get_fd_type(int fd);
+
+        /**
+         * @brief get monotonic time in nanoseconds, vdso call without syscall on linux
+         */
+        inline uint64_t monotonic_ns()
+        {
+            ::timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+        }
+
+        /**
+         * @brief estimate heap bytes of a std::deque
+         * libstdc++ allocates elements in 512 bytes nodes and keeps a node map of at least 8 pointers,
+         * even an empty deque holds one node.
+         */
+        template<typename DEQUE_TYPE>
+        inline uint64_t deque_memory_usage(const DEQUE_TYPE& q)
+        {
+            const uint64_t node_bytes = 512;
+            const uint64_t elem_bytes = sizeof(typename DEQUE_TYPE::value_type);
+            const uint64_t per_node = elem_bytes < node_bytes ? node_bytes / elem_bytes : 1;
+            uint64_t nodes = q.size() / per_node + 1;
+            uint64_t map_slots = nodes + 2 > 8 ? nodes + 2 : 8;
+            return nodes * per_node * elem_bytes + map_slots * sizeof(void*);
+        }
     }
 }
@@ -0,0 +1,360 @@
+/****************************************************************************************
+ * @file buffer_chain.cpp
+ * @brief chain of reference counted buffer segments for zero copy message assembly
+ * @author Liu Hua Jun
+ * @email wojiaoliuhuajun@126.com
+ * @license Use of this source code is governed by The GNU Affero General Public License Version 3
+ *          which can be found in the LICENSE file
+ ***************************************************************************************/
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+#include <mutex>
+#include <algorithm>
+#include "../../include/data_struct/buffer_chain.h"
+#include "../../include/util/macros_func.h"
+
+/// data bytes of a slab block
+#define SLAB_CAPACITY (BUFFER_BLOCK_SIZE - sizeof(stable_infra::data_struct::buffer_block))
+
+/// max free slab blocks kept by one thread, half of them go to the depot when it is exceeded
+#define BLOCK_CACHE_CNT 256
+
+/// blocks moved between a thread cache and the depot at once
+#define BLOCK_DEPOT_BATCH 64
+
+/// max bytes of one block, bigger appends use several blocks
+#define MAX_BLOCK_CAPACITY (1u << 30)
+
+namespace stable_infra {
+    namespace data_struct {
+        /**
+         * @brief free slab blocks shared by threads, blocks released by a loop thread flow back
+         *        to threads which build chains
+         */
+        struct block_depot
+        {
+            std::mutex mtx_;
+            std::vector<buffer_block*> blocks_;
+        };
+
+        /// never destroyed, thread caches may be flushed into it after static destruction
+        static block_depot* depot = new block_depot;
+
+        /**
+         * @brief free slab blocks of one thread
+         */
+        struct block_cache
+        {
+            std::vector<buffer_block*> blocks_;
+
+            ~block_cache() {
+                std::lock_guard<std::mutex> lock(depot->mtx_);
+                depot->blocks_.insert(depot->blocks_.end(), blocks_.begin(), blocks_.end());
+            }
+        };
+
+        static thread_local block_cache cache;
+
+        buffer_block* buffer_block::alloc(uint32_t capacity)
+        {
+            void* mem = nullptr;
+            bool is_slab = capacity <= SLAB_CAPACITY;
+            if (is_slab) {
+                auto& blocks = cache.blocks_;
+                if (blocks.empty()) {
+                    std::lock_guard<std::mutex> lock(depot->mtx_);
+                    size_t cnt = std::min<size_t>(depot->blocks_.size(), BLOCK_DEPOT_BATCH);
+                    blocks.insert(blocks.end(), depot->blocks_.end() - cnt, depot->blocks_.end());
+                    depot->blocks_.resize(depot->blocks_.size() - cnt);
+                }
+                if (! blocks.empty()) {
+                    mem = blocks.back();
+                    blocks.pop_back();
+                } else {
+                    mem = malloc(BUFFER_BLOCK_SIZE);
+                }
+                capacity = SLAB_CAPACITY;
+            } else {
+                mem = malloc(sizeof(buffer_block) + capacity);
+            }
+            if (mem == nullptr) {
+                throw std::bad_alloc();
+            }
+            auto block = new (mem) buffer_block;
+            block->ref_cnt_.store(1, std::memory_order_relaxed);
+            block->capacity_ = capacity;
+            block->used_ = 0;
+            block->is_slab_ = is_slab ? 1 : 0;
+            return block;
+        }
+
+        void buffer_block::release(buffer_block* block)
+        {
+            if (block->ref_cnt_.fetch_sub(1, std::memory_order_acq_rel) != 1) {
+                return;
+            }
+            if (! block->is_slab_) {
+                free(block);
+                return;
+            }
+            auto& blocks = cache.blocks_;
+            blocks.push_back(block);
+            if (STABLE_INFRA_UNLIKELY(blocks.size() > BLOCK_CACHE_CNT)) {
+                std::lock_guard<std::mutex> lock(depot->mtx_);
+                depot->blocks_.insert(depot->blocks_.end(), blocks.end() - BLOCK_DEPOT_BATCH, blocks.end());
+                blocks.resize(blocks.size() - BLOCK_DEPOT_BATCH);
+            }
+        }
+
+        buffer_chain::buffer_chain(const buffer_chain& other)
+            : iov_(other.iov_.begin() + other.head_, other.iov_.end()),
+            blocks_(other.blocks_.begin() + other.head_, other.blocks_.end()),
+            size_(other.size_)
+        {
+            for (auto block : blocks_) {
+                buffer_block::add_ref(block);
+            }
+        }
+
+        buffer_chain::buffer_chain(buffer_chain&& other) noexcept
+            : iov_(std::move(other.iov_)), blocks_(std::move(other.blocks_)),
+            head_(other.head_), size_(other.size_)
+        {
+            other.iov_.clear();
+            other.blocks_.clear();
+            other.head_ = 0;
+            other.size_ = 0;
+        }
+
+        buffer_chain& buffer_chain::operator=(const buffer_chain& other)
+        {
+            if (this != &other) {
+                buffer_chain copy(other);
+                *this = std::move(copy);
+            }
+            return *this;
+        }
+
+        buffer_chain& buffer_chain::operator=(buffer_chain&& other) noexcept
+        {
+            if (this != &other) {
+                clear();
+                iov_.swap(other.iov_);
+                blocks_.swap(other.blocks_);
+                std::swap(head_, other.head_);
+                std::swap(size_, other.size_);
+            }
+            return *this;
+        }
+
+        buffer_chain::~buffer_chain()
+        {
+            clear();
+        }
+
+        void buffer_chain::push_back(buffer_block* block, char* data, size_t len)
+        {
+            iov_.push_back(::iovec{ data, len });
+            blocks_.push_back(block);
+            size_ += len;
+        }
+
+        void buffer_chain::push_front(buffer_block* block, char* data, size_t len)
+        {
+            if (head_ == 0) {
+                // room grows with the chain, so prepending stays amortized O(1)
+                uint32_t room = std::max<uint32_t>(4, iov_cnt());
+                iov_.insert(iov_.begin(), room, ::iovec{ nullptr, 0 });
+                blocks_.insert(blocks_.begin(), room, nullptr);
+                head_ = room;
+            }
+            --head_;
+            iov_[head_] = ::iovec{ data, len };
+            blocks_[head_] = block;
+            size_ += len;
+        }
+
+        buffer_block* buffer_chain::writable_tail() const
+        {
+            STABLE_INFRA_IF_TRUE_RETURN_CODE(iov_cnt() == 0, nullptr);
+            auto block = blocks_.back();
+            auto& last = iov_.back();
+            if (block->ref_cnt_.load(std::memory_order_acquire) != 1
+                    || (char*)last.iov_base + last.iov_len != block->data() + block->used_) {
+                return nullptr;
+            }
+            return block;
+        }
+
+        void buffer_chain::append(const void* data, size_t len)
+        {
+            const char* p = static_cast<const char*>(data);
+            auto tail = writable_tail();
+            if (tail != nullptr && tail->used_ < tail->capacity_) {
+                size_t n = std::min<size_t>(len, tail->capacity_ - tail->used_);
+                memcpy(tail->data() + tail->used_, p, n);
+                tail->used_ += (uint32_t)n;
+                iov_.back().iov_len += n;
+                size_ += n;
+                p += n;
+                len -= n;
+            }
+            while (len > 0) {
+                auto block = buffer_block::alloc((uint32_t)std::min<size_t>(len, MAX_BLOCK_CAPACITY));
+                size_t n = std::min<size_t>(len, block->capacity_);
+                memcpy(block->data(), p, n);
+                block->used_ = (uint32_t)n;
+                push_back(block, block->data(), n);
+                p += n;
+                len -= n;
+            }
+        }
+
+        void buffer_chain::prepend(const void* data, size_t len)
+        {
+            STABLE_INFRA_IF_TRUE_RETURN(len == 0);
+            const char* p = static_cast<const char*>(data);
+            // fill blocks from the end so that bytes keep their order
+            while (len > 0) {
+                size_t n = std::min<size_t>(len, MAX_BLOCK_CAPACITY);
+                auto block = buffer_block::alloc((uint32_t)n);
+                memcpy(block->data(), p + len - n, n);
+                block->used_ = (uint32_t)n;
+                push_front(block, block->data(), n);
+                len -= n;
+            }
+        }
+
+        void buffer_chain::append(const buffer_chain& other)
+        {
+            if (this == &other) {
+                buffer_chain copy(other);
+                append(std::move(copy));
+                return;
+            }
+            for (uint32_t i = other.head_; i < other.iov_.size(); ++i) {
+                buffer_block::add_ref(other.blocks_[i]);
+                push_back(other.blocks_[i], (char*)other.iov_[i].iov_base, other.iov_[i].iov_len);
+            }
+        }
+
+        void buffer_chain::append(buffer_chain&& other)
+        {
+            if (empty()) {
+                *this = std::move(other);
+                return;
+            }
+            for (uint32_t i = other.head_; i < other.iov_.size(); ++i) {
+                // references are taken over
+                push_back(other.blocks_[i], (char*)other.iov_[i].iov_base, other.iov_[i].iov_len);
+            }
+            other.iov_.clear();
+            other.blocks_.clear();
+            other.head_ = 0;
+            other.size_ = 0;
+        }
+
+        void buffer_chain::prepend(const buffer_chain& other)
+        {
+            if (this == &other) {
+                buffer_chain copy(other);
+                prepend(copy);
+                return;
+            }
+            for (uint32_t i = (uint32_t)other.iov_.size(); i > other.head_; --i) {
+                buffer_block::add_ref(other.blocks_[i - 1]);
+                push_front(other.blocks_[i - 1], (char*)other.iov_[i - 1].iov_base, other.iov_[i - 1].iov_len);
+            }
+        }
+
+        char* buffer_chain::append_space(uint32_t len)
+        {
+            auto tail = writable_tail();
+            if (tail != nullptr && tail->capacity_ - tail->used_ >= len) {
+                char* p = tail->data() + tail->used_;
+                tail->used_ += len;
+                iov_.back().iov_len += len;
+                size_ += len;
+                return p;
+            }
+            auto block = buffer_block::alloc(len);
+            block->used_ = len;
+            push_back(block, block->data(), len);
+            return block->data();
+        }
+
+        buffer_chain buffer_chain::slice(uint64_t offset, uint64_t len) const
+        {
+            buffer_chain result;
+            for (uint32_t i = head_; i < iov_.size() && len > 0; ++i) {
+                uint64_t seg_len = iov_[i].iov_len;
+                if (offset >= seg_len) {
+                    offset -= seg_len;
+                    continue;
+                }
+                uint64_t n = std::min(seg_len - offset, len);
+                buffer_block::add_ref(blocks_[i]);
+                result.push_back(blocks_[i], (char*)iov_[i].iov_base + offset, n);
+                offset = 0;
+                len -= n;
+            }
+            return result;
+        }
+
+        buffer_chain buffer_chain::split(uint64_t len)
+        {
+            auto result = slice(0, len);
+            consume(len);
+            return result;
+        }
+
+        void buffer_chain::consume(uint64_t len)
+        {
+            while (len > 0 && head_ < iov_.size()) {
+                auto& front = iov_[head_];
+                if (front.iov_len > len) {
+                    front.iov_base = (char*)front.iov_base + len;
+                    front.iov_len -= len;
+                    size_ -= len;
+                    return;
+                }
+                len -= front.iov_len;
+                size_ -= front.iov_len;
+                buffer_block::release(blocks_[head_]);
+                blocks_[head_] = nullptr;
+                ++head_;
+            }
+            if (head_ == iov_.size()) {
+                iov_.clear();
+                blocks_.clear();
+                head_ = 0;
+            } else if (head_ > 16 && head_ > iov_cnt()) {
+                // a chain used as a queue does not keep growing its front room
+                iov_.erase(iov_.begin(), iov_.begin() + head_);
+                blocks_.erase(blocks_.begin(), blocks_.begin() + head_);
+                head_ = 0;
+            }
+        }
+
+        void buffer_chain::copy_to(void* dest) const
+        {
+            char* p = static_cast<char*>(dest);
+            for (uint32_t i = head_; i < iov_.size(); ++i) {
+                memcpy(p, iov_[i].iov_base, iov_[i].iov_len);
+                p += iov_[i].iov_len;
+            }
+        }
+
+        void buffer_chain::clear()
+        {
+            for (uint32_t i = head_; i < blocks_.size(); ++i) {
+                buffer_block::release(blocks_[i]);
+            }
+            iov_.clear();
+            blocks_.clear();
+            head_ = 0;
+            size_ = 0;
+        }
+    }
+}
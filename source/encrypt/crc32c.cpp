@@ -0,0 +1,260 @@
+/****************************************************************************************
+ * @file crc32c.cpp
+ * @brief crc32c (Castagnoli) with hardware instructions selected at run time
+ * @author Liu Hua Jun
+ * @email wojiaoliuhuajun@126.com
+ * @license Use of this source code is governed by The GNU Affero General Public License Version 3
+ *          which can be found in the LICENSE file
+ ***************************************************************************************/
+#include <string.h>
+#include "../../include/encrypt/crc32c.h"
+#include "../../include/util/macros_func.h"
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__)
+#include <sys/auxv.h>
+#include <arm_acle.h>
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1 << 7)
+#endif
+#endif
+
+/// reflected polynomial of crc32c
+#define CRC32C_POLY 0x82F63B78u
+
+/// bytes of each of three interleaved streams, crc instructions have a latency of three cycles
+#define CRC32C_BLOCK 256
+
+namespace stable_infra {
+    namespace encrypt {
+        typedef uint32_t (*crc_func_t)(uint32_t state, const uint8_t* p, size_t len);
+
+        /**
+         * @brief tables built once at load time
+         */
+        struct crc32c_tables
+        {
+            uint32_t slice_[8][256];     ///< slicing-by-8 table
+            uint32_t shift1_[4][256];    ///< append CRC32C_BLOCK zero bytes to a state
+            uint32_t shift2_[4][256];    ///< append 2 * CRC32C_BLOCK zero bytes to a state
+
+            crc32c_tables()
+            {
+                for (uint32_t i = 0; i < 256; ++i) {
+                    uint32_t c = i;
+                    for (uint32_t k = 0; k < 8; ++k) {
+                        c = (c & 1) ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+                    }
+                    slice_[0][i] = c;
+                }
+                for (uint32_t i = 0; i < 256; ++i) {
+                    for (uint32_t k = 1; k < 8; ++k) {
+                        slice_[k][i] = (slice_[k - 1][i] >> 8) ^ slice_[0][slice_[k - 1][i] & 0xff];
+                    }
+                }
+                build_shift(shift1_, CRC32C_BLOCK);
+                build_shift(shift2_, 2 * CRC32C_BLOCK);
+            }
+
+            /**
+             * @brief appending zero bytes is linear over states, tabulate it per byte of state
+             */
+            void build_shift(uint32_t table[4][256], size_t zero_cnt)
+            {
+                uint32_t basis[32];
+                for (uint32_t bit = 0; bit < 32; ++bit) {
+                    uint32_t state = 1u << bit;
+                    for (size_t i = 0; i < zero_cnt; ++i) {
+                        state = (state >> 8) ^ slice_[0][state & 0xff];
+                    }
+                    basis[bit] = state;
+                }
+                for (uint32_t k = 0; k < 4; ++k) {
+                    for (uint32_t b = 0; b < 256; ++b) {
+                        uint32_t v = 0;
+                        for (uint32_t bit = 0; bit < 8; ++bit) {
+                            if (b & (1u << bit)) {
+                                v ^= basis[k * 8 + bit];
+                            }
+                        }
+                        table[k][b] = v;
+                    }
+                }
+            }
+        };
+
+        static const crc32c_tables tables;
+
+        static inline uint32_t shift_state(const uint32_t table[4][256], uint32_t state)
+        {
+            return table[0][state & 0xff] ^ table[1][(state >> 8) & 0xff]
+                ^ table[2][(state >> 16) & 0xff] ^ table[3][state >> 24];
+        }
+
+        static uint32_t crc_software(uint32_t state, const uint8_t* p, size_t len)
+        {
+            while (len > 0 && ((uintptr_t)p & 7) != 0) {
+                state = (state >> 8) ^ tables.slice_[0][(state ^ *p++) & 0xff];
+                --len;
+            }
+            while (len >= 8) {
+                uint64_t v;
+                memcpy(&v, p, 8);
+                v ^= state;
+                state = tables.slice_[7][v & 0xff] ^ tables.slice_[6][(v >> 8) & 0xff]
+                    ^ tables.slice_[5][(v >> 16) & 0xff] ^ tables.slice_[4][(v >> 24) & 0xff]
+                    ^ tables.slice_[3][(v >> 32) & 0xff] ^ tables.slice_[2][(v >> 40) & 0xff]
+                    ^ tables.slice_[1][(v >> 48) & 0xff] ^ tables.slice_[0][v >> 56];
+                p += 8;
+                len -= 8;
+            }
+            while (len > 0) {
+                state = (state >> 8) ^ tables.slice_[0][(state ^ *p++) & 0xff];
+                --len;
+            }
+            return state;
+        }
+
+#if defined(__x86_64__)
+        __attribute__((target("sse4.2")))
+        static uint32_t crc_hardware(uint32_t state, const uint8_t* p, size_t len)
+        {
+            while (len > 0 && ((uintptr_t)p & 7) != 0) {
+                state = _mm_crc32_u8(state, *p++);
+                --len;
+            }
+            uint64_t s0 = state;
+            // three independent streams hide latency of crc32, their states are merged by shifting
+            while (len >= 3 * CRC32C_BLOCK) {
+                uint64_t s1 = 0;
+                uint64_t s2 = 0;
+                const uint8_t* p1 = p + CRC32C_BLOCK;
+                const uint8_t* p2 = p + 2 * CRC32C_BLOCK;
+                for (size_t i = 0; i < CRC32C_BLOCK; i += 8) {
+                    uint64_t v0;
+                    uint64_t v1;
+                    uint64_t v2;
+                    memcpy(&v0, p + i, 8);
+                    memcpy(&v1, p1 + i, 8);
+                    memcpy(&v2, p2 + i, 8);
+                    s0 = _mm_crc32_u64(s0, v0);
+                    s1 = _mm_crc32_u64(s1, v1);
+                    s2 = _mm_crc32_u64(s2, v2);
+                }
+                s0 = shift_state(tables.shift2_, (uint32_t)s0) ^ shift_state(tables.shift1_, (uint32_t)s1) ^ (uint32_t)s2;
+                p += 3 * CRC32C_BLOCK;
+                len -= 3 * CRC32C_BLOCK;
+            }
+            while (len >= 8) {
+                uint64_t v;
+                memcpy(&v, p, 8);
+                s0 = _mm_crc32_u64(s0, v);
+                p += 8;
+                len -= 8;
+            }
+            state = (uint32_t)s0;
+            while (len > 0) {
+                state = _mm_crc32_u8(state, *p++);
+                --len;
+            }
+            return state;
+        }
+
+        static bool has_crc_instruction()
+        {
+            return __builtin_cpu_supports("sse4.2");
+        }
+
+        static const char* hardware_name = "sse4.2";
+#elif defined(__aarch64__)
+        __attribute__((target("+crc")))
+        static uint32_t crc_hardware(uint32_t state, const uint8_t* p, size_t len)
+        {
+            while (len > 0 && ((uintptr_t)p & 7) != 0) {
+                state = __crc32cb(state, *p++);
+                --len;
+            }
+            // three independent streams hide latency of crc32c, their states are merged by shifting
+            while (len >= 3 * CRC32C_BLOCK) {
+                uint32_t s1 = 0;
+                uint32_t s2 = 0;
+                const uint8_t* p1 = p + CRC32C_BLOCK;
+                const uint8_t* p2 = p + 2 * CRC32C_BLOCK;
+                for (size_t i = 0; i < CRC32C_BLOCK; i += 8) {
+                    uint64_t v0;
+                    uint64_t v1;
+                    uint64_t v2;
+                    memcpy(&v0, p + i, 8);
+                    memcpy(&v1, p1 + i, 8);
+                    memcpy(&v2, p2 + i, 8);
+                    state = __crc32cd(state, v0);
+                    s1 = __crc32cd(s1, v1);
+                    s2 = __crc32cd(s2, v2);
+                }
+                state = shift_state(tables.shift2_, state) ^ shift_state(tables.shift1_, s1) ^ s2;
+                p += 3 * CRC32C_BLOCK;
+                len -= 3 * CRC32C_BLOCK;
+            }
+            while (len >= 8) {
+                uint64_t v;
+                memcpy(&v, p, 8);
+                state = __crc32cd(state, v);
+                p += 8;
+                len -= 8;
+            }
+            while (len > 0) {
+                state = __crc32cb(state, *p++);
+                --len;
+            }
+            return state;
+        }
+
+        static bool has_crc_instruction()
+        {
+            return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+        }
+
+        static const char* hardware_name = "armv8";
+#else
+        static uint32_t crc_hardware(uint32_t state, const uint8_t* p, size_t len)
+        {
+            return crc_software(state, p, len);
+        }
+
+        static bool has_crc_instruction()
+        {
+            return false;
+        }
+
+        static const char* hardware_name = "software";
+#endif
+
+        static const bool is_hardware = has_crc_instruction();
+        static const crc_func_t crc_impl = is_hardware ? &crc_hardware : &crc_software;
+
+        uint32_t crc32c(const void* data, size_t len, uint32_t crc)
+        {
+            return ~crc_impl(~crc, static_cast<const uint8_t*>(data), len);
+        }
+
+        uint32_t crc32c(const ::iovec* iov, uint32_t iov_cnt, uint32_t crc)
+        {
+            uint32_t state = ~crc;
+            for (uint32_t i = 0; i < iov_cnt; ++i) {
+                state = crc_impl(state, static_cast<const uint8_t*>(iov[i].iov_base), iov[i].iov_len);
+            }
+            return ~state;
+        }
+
+        uint32_t crc32c_software(const void* data, size_t len, uint32_t crc)
+        {
+            return ~crc_software(~crc, static_cast<const uint8_t*>(data), len);
+        }
+
+        const char* crc32c_impl_name()
+        {
+            return is_hardware ? hardware_name : "software";
+        }
+    }
+}
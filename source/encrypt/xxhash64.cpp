@@ -0,0 +1,194 @@
+/****************************************************************************************
+ * @file xxhash64.cpp
+ * @brief XXH64 hash, one shot and streaming over scattered buffers
+ * @author Liu Hua Jun
+ * @email wojiaoliuhuajun@126.com
+ * @license Use of this source code is governed by The GNU Affero General Public License Version 3
+ *          which can be found in the LICENSE file
+ ***************************************************************************************/
+#include <string.h>
+#include "../../include/encrypt/xxhash64.h"
+
+namespace stable_infra {
+    namespace encrypt {
+        static const uint64_t PRIME1 = 0x9E3779B185EBCA87ull;
+        static const uint64_t PRIME2 = 0xC2B2AE3D27D4EB4Full;
+        static const uint64_t PRIME3 = 0x165667B19E3779F9ull;
+        static const uint64_t PRIME4 = 0x85EBCA77C2B2AE63ull;
+        static const uint64_t PRIME5 = 0x27D4EB2F165667C5ull;
+
+        static inline uint64_t rotl(uint64_t v, uint32_t r)
+        {
+            return (v << r) | (v >> (64 - r));
+        }
+
+        static inline uint64_t read64(const uint8_t* p)
+        {
+            uint64_t v;
+            memcpy(&v, p, sizeof(v));
+            return v;
+        }
+
+        static inline uint32_t read32(const uint8_t* p)
+        {
+            uint32_t v;
+            memcpy(&v, p, sizeof(v));
+            return v;
+        }
+
+        static inline uint64_t mix_round(uint64_t acc, uint64_t input)
+        {
+            acc += input * PRIME2;
+            acc = rotl(acc, 31);
+            return acc * PRIME1;
+        }
+
+        static inline uint64_t merge_round(uint64_t acc, uint64_t val)
+        {
+            acc ^= mix_round(0, val);
+            return acc * PRIME1 + PRIME4;
+        }
+
+        /**
+         * @brief consume whole stripes
+         * @return bytes consumed
+         */
+        static inline size_t consume_stripes(uint64_t acc[4], const uint8_t* p, size_t len)
+        {
+            const uint8_t* begin = p;
+            uint64_t v1 = acc[0];
+            uint64_t v2 = acc[1];
+            uint64_t v3 = acc[2];
+            uint64_t v4 = acc[3];
+            while (len >= 32) {
+                v1 = mix_round(v1, read64(p));
+                v2 = mix_round(v2, read64(p + 8));
+                v3 = mix_round(v3, read64(p + 16));
+                v4 = mix_round(v4, read64(p + 24));
+                p += 32;
+                len -= 32;
+            }
+            acc[0] = v1;
+            acc[1] = v2;
+            acc[2] = v3;
+            acc[3] = v4;
+            return p - begin;
+        }
+
+        /**
+         * @brief mix tail bytes and avalanche
+         */
+        static inline uint64_t finalize(uint64_t h, const uint8_t* p, size_t len)
+        {
+            while (len >= 8) {
+                h ^= mix_round(0, read64(p));
+                h = rotl(h, 27) * PRIME1 + PRIME4;
+                p += 8;
+                len -= 8;
+            }
+            if (len >= 4) {
+                h ^= (uint64_t)read32(p) * PRIME1;
+                h = rotl(h, 23) * PRIME2 + PRIME3;
+                p += 4;
+                len -= 4;
+            }
+            while (len > 0) {
+                h ^= (*p++) * PRIME5;
+                h = rotl(h, 11) * PRIME1;
+                --len;
+            }
+            h ^= h >> 33;
+            h *= PRIME2;
+            h ^= h >> 29;
+            h *= PRIME3;
+            h ^= h >> 32;
+            return h;
+        }
+
+        static inline uint64_t converge(const uint64_t acc[4])
+        {
+            uint64_t h = rotl(acc[0], 1) + rotl(acc[1], 7) + rotl(acc[2], 12) + rotl(acc[3], 18);
+            h = merge_round(h, acc[0]);
+            h = merge_round(h, acc[1]);
+            h = merge_round(h, acc[2]);
+            return merge_round(h, acc[3]);
+        }
+
+        xxhash64::xxhash64(uint64_t seed)
+        {
+            reset(seed);
+        }
+
+        void xxhash64::reset(uint64_t seed)
+        {
+            seed_ = seed;
+            acc_[0] = seed + PRIME1 + PRIME2;
+            acc_[1] = seed + PRIME2;
+            acc_[2] = seed;
+            acc_[3] = seed - PRIME1;
+            total_len_ = 0;
+            stripe_len_ = 0;
+        }
+
+        void xxhash64::update(const void* data, size_t len)
+        {
+            const uint8_t* p = static_cast<const uint8_t*>(data);
+            total_len_ += len;
+            if (stripe_len_ > 0) {
+                size_t n = len < 32 - stripe_len_ ? len : 32 - stripe_len_;
+                memcpy(stripe_ + stripe_len_, p, n);
+                stripe_len_ += (uint32_t)n;
+                p += n;
+                len -= n;
+                if (stripe_len_ < 32) {
+                    return;
+                }
+                consume_stripes(acc_, stripe_, 32);
+                stripe_len_ = 0;
+            }
+            size_t n = consume_stripes(acc_, p, len);
+            if (len > n) {
+                memcpy(stripe_, p + n, len - n);
+                stripe_len_ = (uint32_t)(len - n);
+            }
+        }
+
+        void xxhash64::update(const ::iovec* iov, uint32_t iov_cnt)
+        {
+            for (uint32_t i = 0; i < iov_cnt; ++i) {
+                update(iov[i].iov_base, iov[i].iov_len);
+            }
+        }
+
+        uint64_t xxhash64::digest() const
+        {
+            uint64_t h = total_len_ >= 32 ? converge(acc_) : seed_ + PRIME5;
+            h += total_len_;
+            return finalize(h, stripe_, stripe_len_);
+        }
+
+        uint64_t xxh64(const void* data, size_t len, uint64_t seed)
+        {
+            const uint8_t* p = static_cast<const uint8_t*>(data);
+            uint64_t h = seed + PRIME5;
+            size_t n = 0;
+            if (len >= 32) {
+                uint64_t acc[4] = { seed + PRIME1 + PRIME2, seed + PRIME2, seed, seed - PRIME1 };
+                n = consume_stripes(acc, p, len);
+                h = converge(acc);
+            }
+            h += len;
+            return finalize(h, p + n, len - n);
+        }
+
+        uint64_t xxh64(const ::iovec* iov, uint32_t iov_cnt, uint64_t seed)
+        {
+            if (iov_cnt == 1) {
+                return xxh64(iov[0].iov_base, iov[0].iov_len, seed);
+            }
+            xxhash64 state(seed);
+            state.update(iov, iov_cnt);
+            return state.digest();
+        }
+    }
+}
@@ -0,0 +1,182 @@
+/****************************************************************************************
+ * @file connection_pool.cpp
+ * @brief pool of outbound tcp connections of one event loop
+ * @author Liu Hua Jun
+ * @email wojiaoliuhuajun@126.com
+ * @license Use of this source code is governed by The GNU Affero General Public License Version 3
+ *          which can be found in the LICENSE file
+ ***************************************************************************************/
+#include <errno.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "../../include/event/connection_pool.h"
+#include "../../include/util/util.h"
+#include "../../include/util/macros_func.h"
+
+namespace stable_infra {
+    namespace event {
+        connection_pool::connection_pool(const std::shared_ptr<poll_base>& loop, const connection_pool_options& options)
+            : loop_(loop), options_(options)
+        {
+        }
+
+        connection_pool::~connection_pool()
+        {
+            std::vector<fd_t> fds;
+            for (auto& conn : conns_) {
+                // a connecting fd is dropped with its task, the callback refers to this pool
+                if (conn.second.state_ != CONN_STATE::BUSY) {
+                    fds.push_back(conn.first);
+                }
+            }
+            for (auto fd : fds) {
+                close_conn(fd);
+            }
+        }
+
+        bool connection_pool::is_alive(fd_t fd)
+        {
+            char byte = 0;
+            while (true) {
+                auto ret = recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+                if (ret >= 0) {
+                    // 0 is FIN of the backend, bytes of an idle connection are a broken exchange
+                    return false;
+                }
+                if (errno == EINTR) {
+                    continue;
+                }
+                return errno == EAGAIN || errno == EWOULDBLOCK;
+            }
+        }
+
+        int32_t connection_pool::acquire(const ::sockaddr* addr, socklen_t addr_len, fd_t& fd,
+                const pool_connect_callback_t& cb)
+        {
+            peer_address key;
+            if (loop_ == nullptr || cb == nullptr || ! key.from_sockaddr(addr, addr_len)) {
+                return -1;
+            }
+            auto iter = backends_.find(key);
+            if (iter != backends_.end()) {
+                auto& idle = iter->second.idle_;
+                while (! idle.empty()) {
+                    fd_t idle_fd = idle.back().fd_;
+                    idle.pop_back();
+                    --idle_cnt_;
+                    if (! is_alive(idle_fd)) {
+                        ++evict_cnt_;
+                        close_conn(idle_fd);
+                        continue;
+                    }
+                    conns_[idle_fd].state_ = CONN_STATE::BUSY;
+                    ++reuse_cnt_;
+                    fd = idle_fd;
+                    return 1;
+                }
+            }
+            return connect(addr, addr_len, key, cb);
+        }
+
+        int32_t connection_pool::connect(const ::sockaddr* addr, socklen_t addr_len, const peer_address& key,
+                const pool_connect_callback_t& cb)
+        {
+            fd_t fd = socket(addr->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if (fd < 0) {
+                return -1;
+            }
+            if (options_.is_no_delay_) {
+                int32_t on = 1;
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+            }
+            if (loop_->adopt_fd(fd, FD_TYPE::TCP_FD) != 0) {
+                ::close(fd);
+                return -1;
+            }
+            auto& conn = conns_[fd];
+            conn.backend_ = key;
+            conn.state_ = CONN_STATE::CONNECTING;
+            auto ret = loop_->submit_async_connect(fd, addr, addr_len, nullptr, 0, [this, fd, cb](int32_t res) {
+                if (res < 0) {
+                    close_conn(fd);
+                    cb(INVALID_FD);
+                    return;
+                }
+                conns_[fd].state_ = CONN_STATE::BUSY;
+                cb(fd);
+            });
+            if (ret != 0) {
+                close_conn(fd);
+                return -1;
+            }
+            ++connect_cnt_;
+            return 0;
+        }
+
+        void connection_pool::release(fd_t fd, bool is_reusable)
+        {
+            auto iter = conns_.find(fd);
+            if (iter == conns_.end() || iter->second.state_ != CONN_STATE::BUSY) {
+                return;
+            }
+            if (! is_reusable || options_.max_idle_per_backend_ == 0 || loop_->get_queued_write_bytes(fd) > 0) {
+                close_conn(fd);
+                return;
+            }
+            iter->second.state_ = CONN_STATE::IDLE;
+            auto& idle = backends_[iter->second.backend_].idle_;
+            if (idle.size() >= options_.max_idle_per_backend_) {
+                // the coldest one goes, warm ones stay on top
+                fd_t oldest = idle.front().fd_;
+                idle.erase(idle.begin());
+                --idle_cnt_;
+                ++evict_cnt_;
+                close_conn(oldest);
+            }
+            idle.push_back(idle_conn{ fd, stable_infra::util::monotonic_ns() });
+            ++idle_cnt_;
+        }
+
+        uint32_t connection_pool::evict_idle()
+        {
+            uint64_t now = stable_infra::util::monotonic_ns();
+            std::vector<fd_t> closing;
+            for (auto& item : backends_) {
+                auto& idle = item.second.idle_;
+                uint32_t kept = 0;
+                for (uint32_t i = 0; i < idle.size(); ++i) {
+                    bool is_expired = options_.idle_timeout_ns_ > 0 && now - idle[i].idle_ns_ >= options_.idle_timeout_ns_;
+                    if (is_expired || ! is_alive(idle[i].fd_)) {
+                        closing.push_back(idle[i].fd_);
+                        continue;
+                    }
+                    idle[kept++] = idle[i];
+                }
+                idle.resize(kept);
+            }
+            for (auto fd : closing) {
+                close_conn(fd);
+            }
+            idle_cnt_ -= (uint32_t)closing.size();
+            evict_cnt_ += closing.size();
+            return (uint32_t)closing.size();
+        }
+
+        void connection_pool::close_conn(fd_t fd)
+        {
+            loop_->remove_fd(fd);
+            ::close(fd);
+            conns_.erase(fd);
+        }
+
+        void connection_pool::get_stats(connection_pool_stats& stats) const
+        {
+            stats.connect_cnt_ = connect_cnt_;
+            stats.reuse_cnt_ = reuse_cnt_;
+            stats.evict_cnt_ = evict_cnt_;
+            stats.idle_cnt_ = idle_cnt_;
+            stats.busy_cnt_ = (uint32_t)conns_.size() - idle_cnt_;
+        }
+    }
+}
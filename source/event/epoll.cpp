@@ -11,17 +11,52 @@
 #ifdef EVENT_EPOLL_EXIST
 #include <errno.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <algorithm>
 #include <sys/socket.h>
+#include <sys/eventfd.h>
+#include "../../include/common/err_no.h"
 #include "../../include/event/epoll.h"
 #include "../../include/event/event_common.h"
 #include "../../include/event/event_action.h"
+#include "../../include/event/event_tracer.h"
+#include "../../include/event/fd_io_operation.h"
+#include "../../include/log/log.h"
 #include "../../include/util/util.h"
 #include "../../include/util/macros_func.h"
 
 namespace stable_infra {
     namespace event {
-        epoll::epoll() {
+        /**
+         * @brief check if two callbacks wrap the same plain function
+         * Only plain function pointers can be compared, any other callable is treated as a new callback
+         */
+        static inline bool is_same_callback(const callback_t& new_cb, const callback_t& old_cb)
+        {
+            auto new_func = new_cb.target<void(*)(int32_t)>();
+            auto old_func = old_cb.target<void(*)(int32_t)>();
+            return new_func != nullptr && old_func != nullptr && *new_func == *old_func;
+        }
+
+        /// event_action whose callbacks are running in current thread, used by EPOLL_MODE::SHARED_ONESHOT
+        static thread_local event_action* owned_action = nullptr;
+
+        epoll::epoll(EPOLL_MODE mode)
+            : mode_(mode)
+        {
             events_ptr_ = std::unique_ptr<epoll_event[]>(new epoll_event[EVENT_CNT]);
+            accept_state_.register_fd_ = [this](fd_t fd, FD_TYPE type) {
+                auto evt_info_ptr = get_event_info(fd, type);
+                if (evt_info_ptr == nullptr) {
+                    return false;
+                }
+                if (! evt_info_ptr->event_action_ptr_->is_accepted()) {
+                    evt_info_ptr->event_action_ptr_->set_accepted(true);
+                    ++accept_state_.stats_.conn_cnt_;
+                }
+                return true;
+            };
+            accept_state_.pause_ = [this](event_action* evt_action_ptr) { pause_accept(evt_action_ptr); };
         }
 
         epoll::~epoll() {
@@ -34,91 +69,331 @@ namespace stable_infra {
             if (epfd_ == INVALID_FD) {
                 return false;
             }
+            if (! init_wakeup()) {
+                close();
+                return false;
+            }
             return true;
         }
 
-        int32_t epoll::submit_async_accept(fd_t listen_fd, ::iovec* buffer, uint32_t buffer_iov_cnt, const std::function<void(int32_t)>& cb)
+        bool epoll::init_wakeup()
         {
-            if (epfd_ == INVALID_FD || listen_fd < 0) {
+            wakeup_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (wakeup_fd_ == INVALID_FD) {
+                return false;
+            }
+            if (adopt_fd(wakeup_fd_, FD_TYPE::GENERAL_FD) != 0) {
+                return false;
+            }
+            return submit_async_read(wakeup_fd_, &wakeup_iov_, 1, [this](int32_t res) { on_wakeup(res); }) == 0;
+        }
+
+        void epoll::on_wakeup(int32_t res)
+        {
+            if (res <= 0) {
+                return;
+            }
+            // producers which come after this point write eventfd again
+            wakeup_pending_.store(false, std::memory_order_seq_cst);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            pending_func func;
+            while (posted_funcs_.pop(func)) {
+                func();
+            }
+            submit_async_read(wakeup_fd_, &wakeup_iov_, 1, nullptr);
+        }
+
+        int32_t epoll::post(const pending_func& func)
+        {
+            if (wakeup_fd_ == INVALID_FD || func == nullptr) {
                 return -1;
             }
-            auto evt_info_ptr = fd_to_event_info_.find(listen_fd);
-            bool is_evt_exist = true;
-            if (nullptr == evt_info_ptr) {
-                evt_info_ptr = std::make_shared<event_info>();
-                evt_info_ptr->fd_ = listen_fd;
-                evt_info_ptr->event_action_ptr_->set_fd_type(FD_TYPE::GENERAL_FD);
-                is_evt_exist = false;
+            posted_funcs_.push(func);
+            if (! wakeup_pending_.exchange(true, std::memory_order_seq_cst)) {
+                uint64_t one = 1;
+                if (::write(wakeup_fd_, &one, sizeof(one)) != sizeof(one) && errno != EAGAIN) {
+                    return -1;
+                }
+            }
+            return 0;
+        }
+
+        event_info* epoll::get_event_info(fd_t fd, FD_TYPE type)
+        {
+            auto& evt_info_ptr = fd_to_event_info_.find(fd);
+            if (nullptr != evt_info_ptr) {
+                return evt_info_ptr.get();
             }
-            if (cb != nullptr) {
-                auto new_cb = cb.target<void(*)(int32_t)>();
-                auto old_cb = evt_info_ptr->event_action_ptr_->get_read_callback().target<void(*)(int32_t)>();
-                if (new_cb != old_cb) {
-                    evt_info_ptr->event_action_ptr_->set_read_callback(cb);
+            if (type == FD_TYPE::UNKNOWN_FD) {
+                type = stable_infra::util::get_fd_type(fd);
+                if (type == FD_TYPE::UNKNOWN_FD) {
+                    return nullptr;
+                }
+            }
+            auto new_evt_info_ptr = std::make_shared<event_info>();
+            new_evt_info_ptr->fd_ = fd;
+            new_evt_info_ptr->event_action_ptr_->set_fd(fd);
+            new_evt_info_ptr->event_action_ptr_->set_fd_type(type);
+            if (mode_ == EPOLL_MODE::EXCLUSIVE) {
+                new_evt_info_ptr->event_action_ptr_->set_loop_write_state(&loop_write_state_);
+                new_evt_info_ptr->event_action_ptr_->set_completion_queue(&completions_);
+                new_evt_info_ptr->event_action_ptr_->set_throttle_timers(&throttle_timers_);
+                if (loop_write_bucket_.is_limited()) {
+                    new_evt_info_ptr->event_action_ptr_->set_loop_write_bucket(&loop_write_bucket_);
+                }
+                if (is_callback_watched_) {
+                    new_evt_info_ptr->event_action_ptr_->set_running_callback(&running_callback_);
                 }
+                new_evt_info_ptr->event_action_ptr_->set_accept_state(&accept_state_);
             }
-            if ((evt_info_ptr->events_ & EV_READ) == 0) {
+            STABLE_INFRA_ASSERT(fd_to_event_info_.insert(fd, new_evt_info_ptr));
+            return new_evt_info_ptr.get();
+        }
+
+        int32_t epoll::add_task(event_info* evt_info_ptr, uint16_t event, task t, const callback_t& cb)
+        {
+            auto evt_action_ptr = evt_info_ptr->event_action_ptr_.get();
+            if (mode_ == EPOLL_MODE::SHARED_ONESHOT && evt_action_ptr->is_owned() && owned_action != evt_action_ptr) {
+                // another thread is running its callbacks and touching its queues, that thread takes the task
+                handoff_tasks_.push_back(handoff_task{ evt_info_ptr, event, t, cb });
+                return 0;
+            }
+            if (event == EV_WRITE) {
+                uint64_t bytes = event_action::task_bytes(t);
+                if (! evt_action_ptr->can_queue_write(bytes)) {
+                    error_no = WRITE_QUEUE_FULL;
+                    return -1;
+                }
+                t.bytes_ = (uint32_t)std::min<uint64_t>(bytes, UINT32_MAX);
+            }
+            if (event == EV_READ) {
+                if (cb != nullptr && ! is_same_callback(cb, evt_action_ptr->get_read_callback())) {
+                    evt_action_ptr->set_read_callback(cb);
+                } else if (t.is_cq_) {
+                    evt_action_ptr->enable_reading();
+                }
+            } else {
+                if (cb != nullptr && ! is_same_callback(cb, evt_action_ptr->get_write_callback())) {
+                    evt_action_ptr->set_write_callback(cb);
+                } else if (t.is_cq_) {
+                    evt_action_ptr->enable_writing();
+                }
+            }
+            if (mode_ == EPOLL_MODE::SHARED_ONESHOT) {
+                evt_info_ptr->events_ |= event;
+                if (event == EV_READ) {
+                    evt_action_ptr->add_read_task(t);
+                } else {
+                    evt_action_ptr->add_write_task(t);
+                }
+                if (evt_action_ptr->is_owned()) {
+                    // submitted from its own callback, the owner thread re-arms it after callbacks
+                    return 0;
+                }
+                // no thread handles it, it is disarmed
+                evt_info_ptr->is_in_epoll_ = rearm_oneshot(evt_action_ptr, evt_info_ptr->is_in_epoll_);
+                return evt_info_ptr->is_in_epoll_ ? 0 : -1;
+            }
+            // an fd out of epoll is assumed ready, it is added when a task would block
+            bool is_optimistic = is_optimistic_io_ && ! evt_info_ptr->is_in_epoll_ && ! evt_info_ptr->is_in_change_list_;
+            if ((evt_info_ptr->events_ & event) == 0) {
                 // event changed
-                evt_info_ptr->events_ |= EV_READ | EV_ET;
-                if (! evt_info_ptr->is_in_change_list_) {
-                    evt_change_lst_.push_back(evt_info_ptr.get());
+                evt_info_ptr->events_ |= event | EV_ET;
+                if (is_optimistic) {
+                    evt_action_ptr->set_unregistered(true);
+                } else if (! evt_info_ptr->is_in_change_list_) {
+                    evt_change_lst_.push_back(evt_info_ptr);
                     evt_info_ptr->is_in_change_list_ = true;
                 }
             }
-            task t(buffer, buffer_iov_cnt); 
-            evt_info_ptr->event_action_ptr_->add_read_task(t);
-            if (! is_evt_exist) {
-                STABLE_INFRA_ASSERT(fd_to_event_info_.insert(listen_fd, evt_info_ptr));
+            bool is_ready = false;
+            if (event == EV_READ) {
+                evt_action_ptr->add_read_task(t);
+                if (is_optimistic) {
+                    evt_action_ptr->set_readable();
+                }
+                is_ready = evt_action_ptr->is_readable();
+            } else {
+                evt_action_ptr->add_write_task(t);
+                if (is_optimistic) {
+                    evt_action_ptr->set_writable();
+                }
+                is_ready = evt_action_ptr->is_writable();
+            }
+            if (is_ready) {
+                // edge has been consumed, run it in next dispatch
+                push_ready(evt_action_ptr);
+            }
+            return 0;
+        }
+
+        int32_t epoll::adopt_fd(fd_t fd, FD_TYPE type)
+        {
+            if (epfd_ == INVALID_FD || fd < 0 || type == FD_TYPE::UNKNOWN_FD) {
+                return -1;
             }
-            if (evt_info_ptr->event_action_ptr_->is_readable()) {
-                // let epoll to trigger
-                ready_events_.push_back(evt_info_ptr->event_action_ptr_.get());
+            mode_lock_guard lock(*this);
+            auto& evt_info_ptr = fd_to_event_info_.find(fd);
+            if (nullptr != evt_info_ptr) {
+                evt_info_ptr->event_action_ptr_->set_fd_type(type);
+                return 0;
             }
+            return get_event_info(fd, type) == nullptr ? -1 : 0;
+        }
+
+        int32_t epoll::set_optimistic_io(bool is_optimistic)
+        {
+            if (mode_ != EPOLL_MODE::EXCLUSIVE) {
+                return -1;
+            }
+            is_optimistic_io_ = is_optimistic;
             return 0;
         }
 
-        int32_t epoll::submit_async_write(fd_t fd, ::iovec* buffer, uint32_t buffer_iov_cnt, const std::function<void(int32_t)>& cb)
+        void epoll::register_blocked(event_action* evt_action_ptr)
         {
-            if (epfd_ == INVALID_FD || fd < 0) {
+            evt_action_ptr->set_unregistered(false);
+            auto& evt_info_ptr = fd_to_event_info_.find(evt_action_ptr->get_fd());
+            // the fd may have been removed by its callback
+            if (evt_info_ptr == nullptr || evt_info_ptr->event_action_ptr_.get() != evt_action_ptr
+                    || evt_info_ptr->is_in_change_list_) {
+                return;
+            }
+            // epoll reports current readiness of an added fd, an edge before it is not lost
+            evt_change_lst_.push_back(evt_info_ptr.get());
+            evt_info_ptr->is_in_change_list_ = true;
+        }
+
+        int32_t epoll::submit_async_accept(fd_t listen_fd, const std::function<void(int32_t)>& cb)
+        {
+            if (epfd_ == INVALID_FD || listen_fd < 0 || mode_ != EPOLL_MODE::EXCLUSIVE) {
                 return -1;
             }
-            auto evt_info_ptr = fd_to_event_info_.find(fd);
-            bool is_evt_exist = true;
-            if (nullptr == evt_info_ptr) {
-                evt_info_ptr = std::make_shared<event_info>();
-                evt_info_ptr->fd_ = fd;
-                auto fd_type = stable_infra::util::get_fd_type(fd);
-                if (fd_type == FD_TYPE::UNKNOWN_FD) {
-                    return -1;
-                }
-                evt_info_ptr->event_action_ptr_->set_fd_type(fd_type);
-                is_evt_exist = false;
+            auto evt_info_ptr = get_event_info(listen_fd, FD_TYPE::UNKNOWN_FD);
+            STABLE_INFRA_CHECK_SUC(nullptr != evt_info_ptr, -1);
+            return add_task(evt_info_ptr, EV_READ, task::accept_task(), cb);
+        }
+
+        int32_t epoll::set_accept_limit(const accept_limit& limit)
+        {
+            if (mode_ != EPOLL_MODE::EXCLUSIVE) {
+                return -1;
             }
-            if (cb != nullptr) {
-                auto new_cb = cb.target<void(*)(int32_t)>();
-                auto old_cb = evt_info_ptr->event_action_ptr_->get_write_callback().target<void(*)(int32_t)>();
-                if (new_cb != old_cb) {
-                    evt_info_ptr->event_action_ptr_->set_write_callback(cb);
+            accept_state_.limit_ = limit;
+            accept_state_.budget_left_ = limit.budget_ > 0 ? limit.budget_ : UINT32_MAX;
+            resume_accept();
+            return 0;
+        }
+
+        void epoll::get_accept_stats(accept_stats& stats) const
+        {
+            stats = accept_state_.stats_;
+        }
+
+        void epoll::pause_accept(event_action* evt_action_ptr)
+        {
+            auto& paused = accept_state_.paused_;
+            if (std::find(paused.begin(), paused.end(), evt_action_ptr) != paused.end()) {
+                return;
+            }
+            auto fd = evt_action_ptr->get_fd();
+            auto& evt_info_ptr = fd_to_event_info_.find(fd);
+            if (evt_info_ptr != nullptr && evt_info_ptr->is_in_epoll_) {
+                // no events keeps the registration, a connection flood does not wake up the loop
+                struct epoll_event ep_evt;
+                memset(&ep_evt, 0, sizeof(ep_evt));
+                ep_evt.data.ptr = (void*)evt_action_ptr;
+                if (epoll_ctl(epfd_, EPOLL_CTL_MOD, fd, &ep_evt) != 0) {
+                    // still armed, the next full accept tries again
+                    LOG_BASE_ERROR(fd, "pause accept failed, errno %d", errno);
+                    return;
                 }
             }
-            if ((evt_info_ptr->events_ & EV_WRITE) == 0) {
-                // event changed
-                evt_info_ptr->events_ |= EV_WRITE | EV_ET;
-                if (! evt_info_ptr->is_in_change_list_) {
-                    evt_change_lst_.push_back(evt_info_ptr.get());
-                    evt_info_ptr->is_in_change_list_ = true;
+            paused.push_back(evt_action_ptr);
+            ++accept_state_.stats_.paused_cnt_;
+        }
+
+        void epoll::resume_accept()
+        {
+            if (accept_state_.paused_.empty() || ! accept_state_.can_resume()) {
+                return;
+            }
+            std::vector<event_action*> paused;
+            paused.swap(accept_state_.paused_);
+            for (auto evt_action_ptr : paused) {
+                auto fd = evt_action_ptr->get_fd();
+                auto& evt_info_ptr = fd_to_event_info_.find(fd);
+                if (evt_info_ptr != nullptr && evt_info_ptr->is_in_epoll_) {
+                    struct epoll_event ep_evt;
+                    memset(&ep_evt, 0, sizeof(ep_evt));
+                    ep_evt.events = evt_action_ptr->events() | ((evt_info_ptr->events_ & EV_ET) ? EPOLLET : 0);
+                    ep_evt.data.ptr = (void*)evt_action_ptr;
+                    if (epoll_ctl(epfd_, EPOLL_CTL_MOD, fd, &ep_evt) != 0) {
+                        auto err = errno;
+                        LOG_BASE_ERROR(fd, "resume accept failed, errno %d", err);
+                        if (err == ENOMEM) {
+                            // still paused, retried by next dispatch
+                            accept_state_.paused_.push_back(evt_action_ptr);
+                            continue;
+                        }
+                        // not registered any more, e.g. closed without remove_fd, the next submission adds it
+                        evt_info_ptr->is_in_epoll_ = false;
+                        continue;
+                    }
                 }
+                // backlog was left when it was paused
+                if (evt_action_ptr->mark_ready_events(0)) {
+                    push_ready(evt_action_ptr);
+                }
+            }
+        }
+
+        void epoll::release_accepted(event_action* evt_action_ptr)
+        {
+            if (! evt_action_ptr->is_accepted() || mode_ != EPOLL_MODE::EXCLUSIVE) {
+                return;
             }
-            task t(buffer, buffer_iov_cnt); 
-            evt_info_ptr->event_action_ptr_->add_write_task(t);
-            if (! is_evt_exist) {
-                STABLE_INFRA_ASSERT(fd_to_event_info_.insert(fd, evt_info_ptr));
+            --accept_state_.stats_.conn_cnt_;
+            resume_accept();
+        }
+
+        int32_t epoll::submit_async_write(fd_t fd, ::iovec* buffer, uint32_t buffer_iov_cnt, const std::function<void(int32_t)>& cb)
+        {
+            if (epfd_ == INVALID_FD || fd < 0) {
+                return -1;
             }
-            if (evt_info_ptr->event_action_ptr_->is_writable()) {
-                // let epoll to trigger
-                ready_events_.push_back(evt_info_ptr->event_action_ptr_.get());
+            mode_lock_guard lock(*this);
+            auto evt_info_ptr = get_event_info(fd, FD_TYPE::UNKNOWN_FD);
+            STABLE_INFRA_CHECK_SUC(nullptr != evt_info_ptr, -1);
+            return add_task(evt_info_ptr, EV_WRITE, task(buffer, buffer_iov_cnt), cb);
+        }
+
+        int32_t epoll::submit_async_write(fd_t fd, stable_infra::data_struct::buffer_chain&& chain, const std::function<void(int32_t)>& cb)
+        {
+            if (epfd_ == INVALID_FD || fd < 0) {
+                return -1;
             }
-            return 0;
+            mode_lock_guard lock(*this);
+            auto evt_info_ptr = get_event_info(fd, FD_TYPE::UNKNOWN_FD);
+            STABLE_INFRA_CHECK_SUC(nullptr != evt_info_ptr, -1);
+            return add_chain_task(evt_info_ptr, chain, task(nullptr, 0), cb);
+        }
+
+        int32_t epoll::submit_async_connect(fd_t fd, const ::sockaddr* addr, socklen_t addr_len,
+                const void* data, uint32_t data_len, const std::function<void(int32_t)>& cb)
+        {
+            if (epfd_ == INVALID_FD || fd < 0 || addr == nullptr) {
+                return -1;
+            }
+            // SYN is sent before fd is registered, its completion is reported by the first writable edge
+            auto sent = socket_connect_operation::start(fd, addr, addr_len, data, data_len);
+            if (sent < 0) {
+                return -1;
+            }
+            mode_lock_guard lock(*this);
+            auto evt_info_ptr = get_event_info(fd, FD_TYPE::UNKNOWN_FD);
+            STABLE_INFRA_CHECK_SUC(nullptr != evt_info_ptr, -1);
+            return add_task(evt_info_ptr, EV_WRITE, task::connect_task(sent), cb);
         }
 
         int32_t epoll::submit_async_read(fd_t fd, ::iovec* buffer, uint32_t buffer_iov_cnt, const std::function<void(int32_t)>& cb)
@@ -126,43 +401,207 @@ namespace stable_infra {
             if (epfd_ == INVALID_FD || fd < 0) {
                 return -1;
             }
-            auto evt_info_ptr = fd_to_event_info_.find(fd);
-            bool is_evt_exist = true;
-            if (nullptr == evt_info_ptr) {
-                evt_info_ptr = std::make_shared<event_info>();
-                evt_info_ptr->fd_ = fd;
-                auto fd_type = stable_infra::util::get_fd_type(fd);
-                if (fd_type == FD_TYPE::UNKNOWN_FD) {
-                    return -1;
-                }
-                evt_info_ptr->event_action_ptr_->set_fd_type(fd_type);
-                is_evt_exist = false;
+            mode_lock_guard lock(*this);
+            auto evt_info_ptr = get_event_info(fd, FD_TYPE::UNKNOWN_FD);
+            STABLE_INFRA_CHECK_SUC(nullptr != evt_info_ptr, -1);
+            return add_task(evt_info_ptr, EV_READ, task(buffer, buffer_iov_cnt), cb);
+        }
+
+        int32_t epoll::submit_async_read_cq(fd_t fd, ::iovec* buffer, uint32_t buffer_iov_cnt, uint64_t tag)
+        {
+            if (epfd_ == INVALID_FD || fd < 0 || mode_ != EPOLL_MODE::EXCLUSIVE) {
+                return -1;
             }
-            if (cb != nullptr) {
-                auto new_cb = cb.target<void(*)(int32_t)>();
-                auto old_cb = evt_info_ptr->event_action_ptr_->get_read_callback().target<void(*)(int32_t)>();
-                if (new_cb != old_cb) {
-                    evt_info_ptr->event_action_ptr_->set_read_callback(cb);
-                }
+            auto evt_info_ptr = get_event_info(fd, FD_TYPE::UNKNOWN_FD);
+            STABLE_INFRA_CHECK_SUC(nullptr != evt_info_ptr, -1);
+            return add_task(evt_info_ptr, EV_READ, task(buffer, buffer_iov_cnt).with_tag(tag), nullptr);
+        }
+
+        int32_t epoll::submit_async_write_cq(fd_t fd, ::iovec* buffer, uint32_t buffer_iov_cnt, uint64_t tag)
+        {
+            if (epfd_ == INVALID_FD || fd < 0 || mode_ != EPOLL_MODE::EXCLUSIVE) {
+                return -1;
             }
-            if ((evt_info_ptr->events_ & EV_READ) == 0) {
-                // event changed
-                evt_info_ptr->events_ |= EV_READ | EV_ET;
-                if (! evt_info_ptr->is_in_change_list_) {
-                    evt_change_lst_.push_back(evt_info_ptr.get());
-                    evt_info_ptr->is_in_change_list_ = true;
+            auto evt_info_ptr = get_event_info(fd, FD_TYPE::UNKNOWN_FD);
+            STABLE_INFRA_CHECK_SUC(nullptr != evt_info_ptr, -1);
+            return add_task(evt_info_ptr, EV_WRITE, task(buffer, buffer_iov_cnt).with_tag(tag), nullptr);
+        }
+
+        int32_t epoll::submit_async_recvmsg_cq(fd_t fd, ::msghdr* msg, uint64_t tag)
+        {
+            if (epfd_ == INVALID_FD || fd < 0 || msg == nullptr || mode_ != EPOLL_MODE::EXCLUSIVE) {
+                return -1;
+            }
+            auto evt_info_ptr = get_event_info(fd, FD_TYPE::UNKNOWN_FD);
+            STABLE_INFRA_CHECK_SUC(nullptr != evt_info_ptr, -1);
+            return add_task(evt_info_ptr, EV_READ, task(msg).with_tag(tag), nullptr);
+        }
+
+        int32_t epoll::submit_async_sendmsg_cq(fd_t fd, ::msghdr* msg, uint64_t tag)
+        {
+            if (epfd_ == INVALID_FD || fd < 0 || msg == nullptr || mode_ != EPOLL_MODE::EXCLUSIVE) {
+                return -1;
+            }
+            auto evt_info_ptr = get_event_info(fd, FD_TYPE::UNKNOWN_FD);
+            STABLE_INFRA_CHECK_SUC(nullptr != evt_info_ptr, -1);
+            return add_task(evt_info_ptr, EV_WRITE, task(msg).with_tag(tag), nullptr);
+        }
+
+        int32_t epoll::submit_async_write_cq(fd_t fd, stable_infra::data_struct::buffer_chain&& chain, uint64_t tag)
+        {
+            if (epfd_ == INVALID_FD || fd < 0 || mode_ != EPOLL_MODE::EXCLUSIVE) {
+                return -1;
+            }
+            auto evt_info_ptr = get_event_info(fd, FD_TYPE::UNKNOWN_FD);
+            STABLE_INFRA_CHECK_SUC(nullptr != evt_info_ptr, -1);
+            return add_chain_task(evt_info_ptr, chain, task(nullptr, 0).with_tag(tag), nullptr);
+        }
+
+        int32_t epoll::add_chain_task(event_info* evt_info_ptr, stable_infra::data_struct::buffer_chain& chain,
+            task t, const callback_t& cb)
+        {
+            // the callback reports bytes written as int32_t
+            if (chain.size() > (uint64_t)INT32_MAX) {
+                return -1;
+            }
+            // the only failure before queuing, the caller keeps its chain
+            if (! evt_info_ptr->event_action_ptr_->can_queue_write(chain.size())) {
+                error_no = WRITE_QUEUE_FULL;
+                return -1;
+            }
+            // owned by the queued task from now on, even if re-arming a oneshot fd fails
+            t.chain_ = new stable_infra::data_struct::buffer_chain(std::move(chain));
+            return add_task(evt_info_ptr, EV_WRITE, t, cb);
+        }
+
+        int32_t epoll::submit_batch(submit_entry* entries, uint32_t cnt)
+        {
+            if (epfd_ == INVALID_FD || (entries == nullptr && cnt > 0) || mode_ != EPOLL_MODE::EXCLUSIVE) {
+                return -1;
+            }
+            // every entry may register a new fd, grow the change list once
+            evt_change_lst_.reserve(evt_change_lst_.size() + cnt);
+            int32_t queued_cnt = 0;
+            event_info* evt_info_ptr = nullptr;
+            fd_t last_fd = INVALID_FD;
+            for (uint32_t i = 0; i < cnt; ++i) {
+                auto& entry = entries[i];
+                entry.result_ = -1;
+                if (entry.fd_ < 0) {
+                    continue;
+                }
+                if (entry.fd_ != last_fd) {
+                    evt_info_ptr = get_event_info(entry.fd_, FD_TYPE::UNKNOWN_FD);
+                    last_fd = entry.fd_;
+                }
+                if (evt_info_ptr == nullptr) {
+                    continue;
+                }
+                bool is_msg = entry.op_ == COMPLETION_OP::RECVMSG || entry.op_ == COMPLETION_OP::SENDMSG;
+                if (is_msg && entry.msg_ == nullptr) {
+                    continue;
+                }
+                task t = is_msg ? task(entry.msg_) : task(entry.buffer_, entry.buffer_iov_cnt_);
+                uint16_t event = (entry.op_ == COMPLETION_OP::READ || entry.op_ == COMPLETION_OP::RECVMSG) ? EV_READ : EV_WRITE;
+                entry.result_ = add_task(evt_info_ptr, event, t.with_tag(entry.tag_), nullptr);
+                if (entry.result_ == 0) {
+                    ++queued_cnt;
                 }
             }
-            task t(buffer, buffer_iov_cnt); 
-            evt_info_ptr->event_action_ptr_->add_read_task(t);
-            if (! is_evt_exist) {
-                STABLE_INFRA_ASSERT(fd_to_event_info_.insert(fd, evt_info_ptr));
+            return queued_cnt;
+        }
+
+        const completion* epoll::get_completions(uint32_t& cnt) const
+        {
+            cnt = (uint32_t)completions_.size();
+            return completions_.data();
+        }
+
+        void epoll::clear_completions()
+        {
+            completions_.clear();
+        }
+
+        int32_t epoll::submit_async_read_frame(fd_t fd, const frame_spec& spec, const frame_callback& cb)
+        {
+            if (epfd_ == INVALID_FD || fd < 0) {
+                return -1;
+            }
+            if (spec.delimiter_size_ > 0) {
+                STABLE_INFRA_CHECK_SUC(spec.delimiter_size_ <= DELIMITER_MAX_SIZE
+                        && spec.max_frame_size_ >= spec.delimiter_size_, -1);
+            } else if (spec.header_size_ == 0 || spec.max_frame_size_ < spec.header_size_
+                    || (spec.length_size_ != 1 && spec.length_size_ != 2 && spec.length_size_ != 4 && spec.length_size_ != 8)
+                    || spec.length_offset_ + spec.length_size_ > spec.header_size_) {
+                return -1;
+            }
+            mode_lock_guard lock(*this);
+            auto evt_info_ptr = get_event_info(fd, FD_TYPE::UNKNOWN_FD);
+            STABLE_INFRA_CHECK_SUC(nullptr != evt_info_ptr, -1);
+            auto evt_action_ptr = evt_info_ptr->event_action_ptr_.get();
+            if (cb == nullptr && ! evt_action_ptr->has_frame_reader()) {
+                return -1;
             }
-            if (evt_info_ptr->event_action_ptr_->is_readable()) {
-                // let epoll to trigger
-                ready_events_.push_back(evt_info_ptr->event_action_ptr_.get());
+            evt_action_ptr->set_frame_reader(spec, cb);
+            auto ret = add_task(evt_info_ptr, EV_READ, task(nullptr, 0), nullptr);
+            if (ret == 0 && mode_ == EPOLL_MODE::EXCLUSIVE && ! evt_action_ptr->is_readable()
+                    && evt_action_ptr->has_buffered_frame()) {
+                // no edge will come for bytes already read
+                evt_action_ptr->set_readable();
+                push_ready(evt_action_ptr);
             }
-            return 0;
+            return ret;
+        }
+
+        int32_t epoll::submit_async_recvmsg(fd_t fd, ::msghdr* msg, const std::function<void(int32_t)>& cb)
+        {
+            if (epfd_ == INVALID_FD || fd < 0 || msg == nullptr) {
+                return -1;
+            }
+            mode_lock_guard lock(*this);
+            auto evt_info_ptr = get_event_info(fd, FD_TYPE::UNKNOWN_FD);
+            STABLE_INFRA_CHECK_SUC(nullptr != evt_info_ptr, -1);
+            return add_task(evt_info_ptr, EV_READ, task(msg), cb);
+        }
+
+        int32_t epoll::submit_async_sendmsg(fd_t fd, ::msghdr* msg, const std::function<void(int32_t)>& cb)
+        {
+            if (epfd_ == INVALID_FD || fd < 0 || msg == nullptr) {
+                return -1;
+            }
+            mode_lock_guard lock(*this);
+            auto evt_info_ptr = get_event_info(fd, FD_TYPE::UNKNOWN_FD);
+            STABLE_INFRA_CHECK_SUC(nullptr != evt_info_ptr, -1);
+            return add_task(evt_info_ptr, EV_WRITE, task(msg), cb);
+        }
+
+        void epoll::get_memory_stats(memory_stats& stats) const
+        {
+            stats = memory_stats();
+            // array part plus ctrl and slot arrays of flat_map, each counted once by capacity
+            stats.fd_table_bytes_ = fd_to_event_info_.memory_usage();
+            // a control block holds a vtable pointer and use/weak counts.
+            // event_info is created by std::make_shared and shares one allocation with it,
+            // event_action is created by new and owned through a separate control block
+            // which also keeps the pointer to it
+            const uint64_t counts_bytes = sizeof(void*) + 2 * sizeof(int32_t);
+            const uint64_t per_fd_bytes = (counts_bytes + sizeof(event_info))
+                + sizeof(event_action) + (counts_bytes + sizeof(void*));
+            fd_to_event_info_.for_each([&](uint32_t fd, const event_info::pointer_t& evt_info_ptr) {
+                ++stats.fd_cnt_;
+                evt_info_ptr->event_action_ptr_->get_memory_usage(stats.task_queue_bytes_, stats.iov_buffer_bytes_);
+            });
+            stats.event_bytes_ = stats.fd_cnt_ * per_fd_bytes;
+            stats.loop_bytes_ = EVENT_CNT * sizeof(epoll_event)
+                + evt_change_lst_.capacity() * sizeof(event_info*)
+                + stable_infra::util::deque_memory_usage(ready_events_[0])
+                + stable_infra::util::deque_memory_usage(ready_events_[1])
+                + stable_infra::util::deque_memory_usage(ready_events_[2])
+                + completions_.capacity() * sizeof(completion)
+                + throttle_timers_.memory_usage()
+                + (accept_state_.deferred_.capacity() + accept_state_.paused_.capacity()) * sizeof(event_action*);
+            stats.total_bytes_ = stats.fd_table_bytes_ + stats.event_bytes_ + stats.task_queue_bytes_
+                + stats.iov_buffer_bytes_ + stats.loop_bytes_;
         }
 
         void epoll::apply_one_change(event_info* evt_info_ptr)
@@ -178,6 +617,7 @@ namespace stable_infra {
                 if (evt_info_ptr->is_in_epoll_) {
                     op = EPOLL_CTL_DEL;
                 } else {
+                    release_accepted(evt_info_ptr->event_action_ptr_.get());
                     fd_to_event_info_.erase(evt_info_ptr->fd_);
                     return;
                 }
@@ -195,6 +635,7 @@ namespace stable_infra {
                     evt_info_ptr->is_in_epoll_ = true;
                     evt_info_ptr->is_in_change_list_ = false;
                 } else {
+                    release_accepted(evt_info_ptr->event_action_ptr_.get());
                     fd_to_event_info_.erase(evt_info_ptr->fd_);
                 }
                 return;
@@ -224,6 +665,7 @@ namespace stable_infra {
                     if (errno == ENOENT || errno == EBADF || errno == EPERM) {
                         // If a delete fails with one of these errors, that's fine too: we closed the fd
                         // before we got around to calling epoll_dispatch.
+                        release_accepted(evt_info_ptr->event_action_ptr_.get());
                         fd_to_event_info_.erase(evt_info_ptr->fd_);
                         return;
                     }
@@ -242,16 +684,150 @@ namespace stable_infra {
             }
         }
 
+        bool epoll::rearm_oneshot(event_action* evt_action_ptr, bool is_in_epoll)
+        {
+            // level triggered, the kernel reports it again if it is still ready
+            auto events = evt_action_ptr->pending_events();
+            if (events == 0) {
+                // stay disarmed, otherwise EPOLLHUP would be reported again and again
+                return is_in_epoll;
+            }
+            struct epoll_event ep_evt;
+            memset(&ep_evt, 0, sizeof(ep_evt));
+            ep_evt.events = events | EPOLLONESHOT;
+            ep_evt.data.ptr = (void*)evt_action_ptr;
+            auto fd = evt_action_ptr->get_fd();
+            int op = is_in_epoll ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+            if (epoll_ctl(epfd_, op, fd, &ep_evt) == 0) {
+                return true;
+            }
+            // see apply_one_change for the cases of retrying
+            if ((op == EPOLL_CTL_MOD && errno == ENOENT && epoll_ctl(epfd_, EPOLL_CTL_ADD, fd, &ep_evt) == 0)
+                || (op == EPOLL_CTL_ADD && errno == EEXIST && epoll_ctl(epfd_, EPOLL_CTL_MOD, fd, &ep_evt) == 0)) {
+                return true;
+            }
+            return false;
+        }
+
+        int32_t epoll::dispatch_shared(int32_t timeout)
+        {
+            epoll_event events[SHARED_EVENT_CNT];
+            auto trace_ts = trace_begin();
+            auto res = epoll_wait(epfd_, events, SHARED_EVENT_CNT, timeout);
+            trace_end(trace_ts, TRACE_PHASE::EPOLL_WAIT, INVALID_FD, res);
+            if (res == -1) {
+                if (errno != EINTR) {
+                    return (-1);
+                }
+                return (0);
+            }
+            std::vector<callback_t> failed;
+            for (auto i = 0; i < res; ++i) {
+                event_action* cb = static_cast<event_action*>(events[i].data.ptr);
+                STABLE_INFRA_ASSERT(nullptr != cb);
+                // oneshot: no other thread gets this fd until it is re-armed below
+                {
+                    std::lock_guard<std::mutex> lock(mtx_);
+                    if (cb->is_owned()) {
+                        // re-armed by a submitter before its owner claimed it, the owner re-arms it again
+                        // when its callbacks return and level triggering reports what is still ready
+                        continue;
+                    }
+                    cb->set_owned(true);
+                }
+                owned_action = cb;
+                cb->set_ready_events(events[i].events);
+                while ((cb->is_readable() && (cb->pending_events() & EPOLLIN))
+                       || (cb->is_writable() && (cb->pending_events() & EPOLLOUT))) {
+                    // tasks submitted by callbacks on a still ready fd
+                    cb->handle_events();
+                }
+                {
+                    // only the owner re-arms, after its callbacks have returned
+                    std::lock_guard<std::mutex> lock(mtx_);
+                    if (! handoff_tasks_.empty()) {
+                        take_handoff_tasks(cb, failed);
+                    }
+                    cb->set_owned(false);
+                    owned_action = nullptr;
+                    rearm_oneshot(cb, true);
+                }
+                for (auto& failed_cb : failed) {
+                    failed_cb(-1);
+                }
+                failed.clear();
+            }
+            return 0;
+        }
+
+        void epoll::take_handoff_tasks(event_action* evt_action_ptr, std::vector<callback_t>& failed)
+        {
+            size_t kept = 0;
+            for (size_t i = 0; i < handoff_tasks_.size(); ++i) {
+                auto& handoff = handoff_tasks_[i];
+                if (handoff.evt_info_->event_action_ptr_.get() != evt_action_ptr) {
+                    if (kept != i) {
+                        handoff_tasks_[kept] = std::move(handoff);
+                    }
+                    ++kept;
+                    continue;
+                }
+                // owned_action is still evt_action_ptr, so it is queued without re-arming
+                if (add_task(handoff.evt_info_, handoff.event_, handoff.task_, handoff.cb_) != 0) {
+                    // write queue is full, the submitter has got 0 already
+                    STABLE_INFRA_DELETE_OBJ(handoff.task_.chain_);
+                    auto& cb = handoff.cb_ != nullptr ? handoff.cb_ : evt_action_ptr->get_write_callback();
+                    if (cb != nullptr) {
+                        failed.push_back(cb);
+                    }
+                }
+            }
+            handoff_tasks_.erase(handoff_tasks_.begin() + kept, handoff_tasks_.end());
+        }
+
         int32_t epoll::dispatch(int32_t timeout)
         {
+            tracer::begin_iteration();
+            if (mode_ == EPOLL_MODE::SHARED_ONESHOT) {
+                return dispatch_shared(timeout);
+            }
+            size_t completion_cnt = completions_.size();
+            if (! removed_.empty()) {
+                // no callback of them is running now
+                removed_.clear();
+            }
+            accept_state_.budget_left_ = accept_state_.limit_.budget_ > 0 ? accept_state_.limit_.budget_ : UINT32_MAX;
+            if (STABLE_INFRA_UNLIKELY(! accept_state_.deferred_.empty())) {
+                // listen fds out of budget in last dispatch go before new edges
+                for (auto evt_action_ptr : accept_state_.deferred_) {
+                    if (evt_action_ptr->mark_ready_events(0)) {
+                        push_ready(evt_action_ptr);
+                    }
+                }
+                accept_state_.deferred_.clear();
+            }
+            if (STABLE_INFRA_UNLIKELY(! accept_state_.paused_.empty())) {
+                // normally resumed by closing connections, this retries a failed resume
+                resume_accept();
+            }
             if (! evt_change_lst_.empty()) {
+                auto trace_ts = trace_begin();
                 apply_changes();
+                trace_end(trace_ts, TRACE_PHASE::APPLY_CHANGES, INVALID_FD, (int32_t)evt_change_lst_.size());
                 evt_change_lst_.clear();
             }
-            if (! ready_events_.empty()) {
-                timeout = 0;
+            for (uint32_t i = 0; i < PRIORITY_CNT; ++i) {
+                if (! ready_events_[i].empty()) {
+                    timeout = 0;
+                    break;
+                }
+            }
+            if (! throttle_timers_.empty()) {
+                timeout = get_throttle_timeout(timeout);
             }
+            auto trace_ts = trace_begin();
             auto res = epoll_wait(epfd_, events_ptr_.get(), EVENT_CNT, timeout);
+            trace_end(trace_ts, TRACE_PHASE::EPOLL_WAIT, INVALID_FD, res);
 
             if (res == -1) {
                 if (errno != EINTR) {
@@ -261,15 +837,30 @@ namespace stable_infra {
             }
             STABLE_INFRA_ASSERT(res <= EVENT_CNT);
 
+            ready_ns_ = stable_infra::util::monotonic_ns();
+            if (! throttle_timers_.empty()) {
+                expire_throttles(ready_ns_);
+            }
+            if (res > 0) {
+                STABLE_INFRA_PREFETCH_W(events_ptr_[0].data.ptr);
+            }
             for (auto i = 0; i < res; ++i) {
                 event_action* cb = static_cast<event_action*>(events_ptr_[i].data.ptr);
                 STABLE_INFRA_ASSERT(nullptr != cb);
-                cb->set_ready_events(events_ptr_[i].events);
+                if (i + 1 < res) {
+                    // pull the hot line of the next event_action while handling this one
+                    STABLE_INFRA_PREFETCH_W(events_ptr_[i + 1].data.ptr);
+                }
+                if (cb->mark_ready_events(events_ptr_[i].events)) {
+                    push_ready(cb);
+                }
             }
 
             do_pending_tasks();
 
-            return 0;
+            add_counter(load_.iteration_cnt_, 1);
+            add_counter(load_.busy_ns_, stable_infra::util::monotonic_ns() - ready_ns_);
+            return (int32_t)(completions_.size() - completion_cnt);
         }
 
         void epoll::do_read(const task& t)
@@ -305,14 +896,469 @@ namespace stable_infra {
             //(read_callback_t*)task.cb_();
         }
 
+        void epoll::push_ready(event_action* evt_action_ptr)
+        {
+            if (evt_action_ptr->is_in_ready_queue()) {
+                return;
+            }
+            evt_action_ptr->set_in_ready_queue(true);
+            auto priority = (uint32_t)evt_action_ptr->get_priority();
+            auto& q = ready_events_[priority];
+            evt_action_ptr->set_ready_slot(priority, ready_popped_[priority] + (uint32_t)q.size());
+            q.push_back(ready_entry{ evt_action_ptr, ready_ns_ });
+        }
+
+        void epoll::service_class(uint32_t priority, uint32_t cnt)
+        {
+            if (cnt == 0) {
+                return;
+            }
+            auto& q = ready_events_[priority];
+            auto& stats = priority_stats_.classes_[priority];
+            // one clock read for a batch, fds of a batch are serviced back to back
+            uint64_t now = stable_infra::util::monotonic_ns();
+            add_counter(load_.serviced_cnt_, cnt);
+            for (uint32_t i = 0; i < cnt; ++i) {
+                ready_entry entry = q.front();
+                q.pop_front();
+                ++ready_popped_[priority];
+                if (entry.action_ == nullptr) {
+                    // removed or migrated after queuing
+                    continue;
+                }
+                uint64_t latency = now > entry.ready_ns_ ? now - entry.ready_ns_ : 0;
+                ++stats.serviced_cnt_;
+                stats.total_latency_ns_ += latency;
+                if (latency > stats.max_latency_ns_) {
+                    stats.max_latency_ns_ = latency;
+                }
+                // callbacks may queue it again
+                entry.action_->set_in_ready_queue(false);
+                entry.action_->add_active_cnt();
+                entry.action_->handle_events();
+                if (STABLE_INFRA_UNLIKELY(entry.action_->needs_registration())) {
+                    register_blocked(entry.action_);
+                }
+            }
+        }
+
         void epoll::do_pending_tasks()
         {
-            uint32_t ready_cnt = ready_events_.size();
-            for (uint32_t i = 0; i < ready_cnt; ++i) {
-                event_action* evt_action_ptr = ready_events_.front();
-                evt_action_ptr->handle_events();
-                ready_events_.pop_front();
+            // fds queued by callbacks of this round wait for next dispatch
+            uint32_t remain[PRIORITY_CNT];
+            uint32_t remain_total = 0;
+            for (uint32_t i = 0; i < PRIORITY_CNT; ++i) {
+                remain[i] = (uint32_t)ready_events_[i].size();
+                remain_total += remain[i];
+            }
+            uint32_t budget = priority_policy_.budget_ > 0 ? priority_policy_.budget_ : UINT32_MAX;
+            if (priority_policy_.policy_ == PRIORITY_POLICY::STRICT) {
+                for (uint32_t i = 0; i < PRIORITY_CNT && budget > 0; ++i) {
+                    uint32_t cnt = std::min(remain[i], budget);
+                    service_class(i, cnt);
+                    budget -= cnt;
+                }
+                return;
+            }
+            while (remain_total > 0 && budget > 0) {
+                for (uint32_t i = 0; i < PRIORITY_CNT && budget > 0; ++i) {
+                    uint32_t weight = std::max(priority_policy_.weights_[i], 1u);
+                    uint32_t cnt = std::min(std::min(remain[i], weight), budget);
+                    service_class(i, cnt);
+                    remain[i] -= cnt;
+                    remain_total -= cnt;
+                    budget -= cnt;
+                }
+            }
+        }
+
+        int32_t epoll::set_priority(fd_t fd, EVENT_PRIORITY priority)
+        {
+            if (epfd_ == INVALID_FD || fd < 0 || (uint32_t)priority >= PRIORITY_CNT) {
+                return -1;
+            }
+            mode_lock_guard lock(*this);
+            auto evt_info_ptr = get_event_info(fd, FD_TYPE::UNKNOWN_FD);
+            STABLE_INFRA_CHECK_SUC(nullptr != evt_info_ptr, -1);
+            // a fd already in ready queue is serviced by its old class once
+            evt_info_ptr->event_action_ptr_->set_priority(priority);
+            return 0;
+        }
+
+        int32_t epoll::set_write_watermark(fd_t fd, uint64_t low, uint64_t high, uint64_t hard_limit,
+                const std::function<void(bool)>& cb)
+        {
+            if (epfd_ == INVALID_FD || fd < 0 || low > high) {
+                return -1;
+            }
+            mode_lock_guard lock(*this);
+            auto evt_info_ptr = get_event_info(fd, FD_TYPE::UNKNOWN_FD);
+            STABLE_INFRA_CHECK_SUC(nullptr != evt_info_ptr, -1);
+            write_watermark watermark;
+            watermark.low_ = low;
+            watermark.high_ = high;
+            watermark.hard_limit_ = hard_limit;
+            watermark.cb_ = cb;
+            evt_info_ptr->event_action_ptr_->set_write_watermark(watermark);
+            return 0;
+        }
+
+        int32_t epoll::set_low_latency_write(fd_t fd, uint32_t lowat)
+        {
+            if (epfd_ == INVALID_FD || fd < 0) {
+                return -1;
+            }
+            mode_lock_guard lock(*this);
+            auto evt_info_ptr = get_event_info(fd, FD_TYPE::UNKNOWN_FD);
+            STABLE_INFRA_CHECK_SUC(nullptr != evt_info_ptr, -1);
+            return evt_info_ptr->event_action_ptr_->set_notsent_lowat(lowat);
+        }
+
+        int32_t epoll::set_loop_write_watermark(uint64_t low, uint64_t high, uint64_t hard_limit,
+                const std::function<void(bool)>& cb)
+        {
+            if (mode_ != EPOLL_MODE::EXCLUSIVE || low > high) {
+                return -1;
+            }
+            auto& watermark = loop_write_state_.watermark_;
+            watermark.low_ = low;
+            watermark.high_ = high;
+            watermark.hard_limit_ = hard_limit;
+            watermark.cb_ = cb;
+            watermark.is_high_ = false;
+            watermark.on_queued(loop_write_state_.queued_bytes_);
+            return 0;
+        }
+
+        uint64_t epoll::get_queued_write_bytes(fd_t fd) const
+        {
+            if (fd < 0) {
+                return 0;
+            }
+            auto& evt_info_ptr = fd_to_event_info_.find(fd);
+            return evt_info_ptr == nullptr ? 0 : evt_info_ptr->event_action_ptr_->get_queued_write_bytes();
+        }
+
+        uint64_t epoll::get_loop_queued_write_bytes() const
+        {
+            return loop_write_state_.queued_bytes_;
+        }
+
+        int32_t epoll::get_throttle_timeout(int32_t timeout) const
+        {
+            uint64_t now = stable_infra::util::monotonic_ns();
+            uint64_t deadline = throttle_timers_.next_deadline();
+            if (deadline <= now) {
+                return 0;
+            }
+            // round up, waking up before the refill time only throttles the fd again
+            uint64_t wait_ms = (deadline - now + 999999) / 1000000;
+            if (timeout < 0 || wait_ms < (uint64_t)timeout) {
+                return (int32_t)std::min<uint64_t>(wait_ms, INT32_MAX);
+            }
+            return timeout;
+        }
+
+        void epoll::expire_throttles(uint64_t now_ns)
+        {
+            while (! throttle_timers_.empty() && throttle_timers_.next_deadline() <= now_ns) {
+                auto entry = throttle_timers_.pop();
+                if (entry.action_->get_throttle_deadline() != entry.deadline_ns_) {
+                    // stale, the fd waits for another deadline or is not limited any more
+                    continue;
+                }
+                entry.action_->clear_throttle();
+                if (entry.action_->mark_ready_events(0)) {
+                    push_ready(entry.action_);
+                }
+            }
+        }
+
+        void epoll::recheck_rate(event_action* evt_action_ptr)
+        {
+            // a throttled fd may run now, otherwise it is throttled again with the new limits
+            evt_action_ptr->clear_throttle();
+            if (evt_action_ptr->mark_ready_events(0)) {
+                push_ready(evt_action_ptr);
+            }
+        }
+
+        int32_t epoll::set_rate_limit(fd_t fd, const rate_limit& read_limit, const rate_limit& write_limit)
+        {
+            if (epfd_ == INVALID_FD || fd < 0 || mode_ != EPOLL_MODE::EXCLUSIVE) {
+                return -1;
+            }
+            auto evt_info_ptr = get_event_info(fd, FD_TYPE::UNKNOWN_FD);
+            STABLE_INFRA_CHECK_SUC(nullptr != evt_info_ptr, -1);
+            auto evt_action_ptr = evt_info_ptr->event_action_ptr_.get();
+            evt_action_ptr->set_rate_limit(read_limit, write_limit);
+            recheck_rate(evt_action_ptr);
+            return 0;
+        }
+
+        int32_t epoll::set_rate_group(fd_t fd, const std::shared_ptr<rate_group>& read_group,
+                const std::shared_ptr<rate_group>& write_group)
+        {
+            if (epfd_ == INVALID_FD || fd < 0 || mode_ != EPOLL_MODE::EXCLUSIVE) {
+                return -1;
+            }
+            auto evt_info_ptr = get_event_info(fd, FD_TYPE::UNKNOWN_FD);
+            STABLE_INFRA_CHECK_SUC(nullptr != evt_info_ptr, -1);
+            auto evt_action_ptr = evt_info_ptr->event_action_ptr_.get();
+            evt_action_ptr->set_rate_group(read_group, write_group);
+            recheck_rate(evt_action_ptr);
+            return 0;
+        }
+
+        int32_t epoll::set_loop_rate_limit(const rate_limit& write_limit)
+        {
+            if (epfd_ == INVALID_FD || mode_ != EPOLL_MODE::EXCLUSIVE) {
+                return -1;
+            }
+            loop_write_bucket_.reset(write_limit, stable_infra::util::monotonic_ns());
+            token_bucket* bucket = loop_write_bucket_.is_limited() ? &loop_write_bucket_ : nullptr;
+            fd_to_event_info_.for_each([&](uint32_t fd, const event_info::pointer_t& evt_info_ptr) {
+                auto evt_action_ptr = evt_info_ptr->event_action_ptr_.get();
+                evt_action_ptr->set_loop_write_bucket(bucket);
+                recheck_rate(evt_action_ptr);
+            });
+            return 0;
+        }
+
+        event_info::pointer_t epoll::detach_event_info(fd_t fd)
+        {
+            auto& found = fd_to_event_info_.find(fd);
+            if (found == nullptr) {
+                return nullptr;
+            }
+            event_info::pointer_t evt_info_ptr = found;
+            auto evt_action_ptr = evt_info_ptr->event_action_ptr_.get();
+            if (evt_info_ptr->is_in_epoll_) {
+                struct epoll_event ep_evt;
+                memset(&ep_evt, 0, sizeof(ep_evt));
+                epoll_ctl(epfd_, EPOLL_CTL_DEL, fd, &ep_evt);
+                evt_info_ptr->is_in_epoll_ = false;
+            }
+            if (evt_info_ptr->is_in_change_list_) {
+                evt_change_lst_.erase(std::remove(evt_change_lst_.begin(), evt_change_lst_.end(), evt_info_ptr.get()),
+                    evt_change_lst_.end());
+                evt_info_ptr->is_in_change_list_ = false;
+            }
+            if (evt_action_ptr->is_in_ready_queue()) {
+                // do_pending_tasks may be iterating ready queues, only clear the entry
+                auto priority = evt_action_ptr->get_ready_priority();
+                auto& entry = ready_events_[priority][evt_action_ptr->get_ready_pos() - ready_popped_[priority]];
+                STABLE_INFRA_ASSERT(entry.action_ == evt_action_ptr);
+                entry.action_ = nullptr;
+                evt_action_ptr->set_in_ready_queue(false);
+            }
+            evt_action_ptr->set_loop_write_state(nullptr);
+            evt_action_ptr->set_completion_queue(nullptr);
+            if (evt_action_ptr->get_throttle_deadline() > 0) {
+                // checked again by the new loop
+                throttle_timers_.remove(evt_action_ptr);
+                evt_action_ptr->clear_throttle();
+            }
+            evt_action_ptr->set_throttle_timers(nullptr);
+            evt_action_ptr->set_loop_write_bucket(nullptr);
+            evt_action_ptr->set_running_callback(nullptr);
+            evt_action_ptr->set_accept_state(nullptr);
+            if (mode_ == EPOLL_MODE::EXCLUSIVE) {
+                auto& deferred = accept_state_.deferred_;
+                deferred.erase(std::remove(deferred.begin(), deferred.end(), evt_action_ptr), deferred.end());
+                auto& paused = accept_state_.paused_;
+                paused.erase(std::remove(paused.begin(), paused.end(), evt_action_ptr), paused.end());
+            }
+            fd_to_event_info_.erase(fd);
+            // the count goes with a migrated fd to its new loop
+            release_accepted(evt_action_ptr);
+            return evt_info_ptr;
+        }
+
+        bool epoll::attach_event_info(const event_info::pointer_t& evt_info_ptr)
+        {
+            fd_t fd = evt_info_ptr->fd_;
+            if (epfd_ == INVALID_FD || nullptr != fd_to_event_info_.find(fd)) {
+                return false;
+            }
+            STABLE_INFRA_CHECK_SUC(fd_to_event_info_.insert(fd, evt_info_ptr), false);
+            auto evt_action_ptr = evt_info_ptr->event_action_ptr_.get();
+            evt_action_ptr->set_detached(false);
+            evt_action_ptr->set_unregistered(false);
+            evt_action_ptr->set_loop_write_state(&loop_write_state_);
+            evt_action_ptr->set_completion_queue(&completions_);
+            evt_action_ptr->set_throttle_timers(&throttle_timers_);
+            if (loop_write_bucket_.is_limited()) {
+                evt_action_ptr->set_loop_write_bucket(&loop_write_bucket_);
+            }
+            if (is_callback_watched_) {
+                evt_action_ptr->set_running_callback(&running_callback_);
+            }
+            evt_action_ptr->set_accept_state(&accept_state_);
+            if (evt_action_ptr->is_accepted()) {
+                ++accept_state_.stats_.conn_cnt_;
+            }
+            if (evt_action_ptr->events() != 0) {
+                // added in next dispatch, epoll reports current readiness of an added fd
+                evt_change_lst_.push_back(evt_info_ptr.get());
+                evt_info_ptr->is_in_change_list_ = true;
+            }
+            if (evt_action_ptr->mark_ready_events(0)) {
+                // readiness of old loop has not been consumed
+                push_ready(evt_action_ptr);
+            }
+            return true;
+        }
+
+        int32_t epoll::remove_fd(fd_t fd)
+        {
+            if (epfd_ == INVALID_FD || fd < 0 || fd == wakeup_fd_ || mode_ != EPOLL_MODE::EXCLUSIVE) {
+                return -1;
+            }
+            auto evt_info_ptr = detach_event_info(fd);
+            STABLE_INFRA_CHECK_SUC(nullptr != evt_info_ptr, -1);
+            // its handle_events may be on the stack
+            evt_info_ptr->event_action_ptr_->set_detached(true);
+            removed_.push_back(evt_info_ptr);
+            return 0;
+        }
+
+        int32_t epoll::migrate_fd(fd_t fd, const std::shared_ptr<poll_base>& target,
+                const std::function<void(int32_t)>& cb)
+        {
+            if (epfd_ == INVALID_FD || fd < 0 || fd == wakeup_fd_ || mode_ != EPOLL_MODE::EXCLUSIVE) {
+                return -1;
+            }
+            auto target_ep = std::dynamic_pointer_cast<epoll>(target);
+            if (target_ep == nullptr || target_ep.get() == this || target_ep->mode_ != EPOLL_MODE::EXCLUSIVE) {
+                return -1;
+            }
+            // detach out of any callback of fd, so handle_events of fd is not on the stack
+            return post([this, fd, target_ep, cb]() { do_migrate(fd, target_ep, cb); });
+        }
+
+        void epoll::do_migrate(fd_t fd, const std::shared_ptr<epoll>& target, const std::function<void(int32_t)>& cb)
+        {
+            auto evt_info_ptr = detach_event_info(fd);
+            if (evt_info_ptr == nullptr) {
+                if (cb != nullptr) {
+                    cb(-1);
+                }
+                return;
+            }
+            epoll* source = this;
+            auto ret = target->post([source, target, evt_info_ptr, cb]() {
+                if (target->attach_event_info(evt_info_ptr)) {
+                    add_counter(target->load_.migrated_in_cnt_, 1);
+                    // counted in target thread, an atomic add keeps it from racing with source
+                    source->load_.migrated_out_cnt_.fetch_add(1, std::memory_order_relaxed);
+                    if (cb != nullptr) {
+                        cb(0);
+                    }
+                    return;
+                }
+                // give it back
+                source->post([source, evt_info_ptr, cb]() {
+                    source->attach_event_info(evt_info_ptr);
+                    if (cb != nullptr) {
+                        cb(-1);
+                    }
+                });
+            });
+            if (ret != 0) {
+                attach_event_info(evt_info_ptr);
+                if (cb != nullptr) {
+                    cb(-1);
+                }
+            }
+        }
+
+        int32_t epoll::shed_load(const std::shared_ptr<poll_base>& target, double fraction, uint32_t max_cnt,
+                const std::function<void(fd_t, int32_t)>& cb)
+        {
+            if (epfd_ == INVALID_FD || mode_ != EPOLL_MODE::EXCLUSIVE || fraction <= 0 || max_cnt == 0) {
+                return -1;
+            }
+            auto target_ep = std::dynamic_pointer_cast<epoll>(target);
+            if (target_ep == nullptr || target_ep.get() == this || target_ep->mode_ != EPOLL_MODE::EXCLUSIVE) {
+                return -1;
             }
+            return post([this, target_ep, fraction, max_cnt, cb]() {
+                std::vector<std::pair<uint32_t, fd_t>> active_fds;
+                uint64_t total = 0;
+                fd_to_event_info_.for_each([&](uint32_t fd, const event_info::pointer_t& evt_info_ptr) {
+                    auto evt_action_ptr = evt_info_ptr->event_action_ptr_.get();
+                    uint32_t active_cnt = evt_action_ptr->get_active_cnt();
+                    evt_action_ptr->reset_active_cnt();
+                    // fds of library components and rate groups keep their loop, only marked fds are moved
+                    if ((fd_t)fd != wakeup_fd_ && active_cnt > 0 && evt_action_ptr->is_movable()
+                        && ! evt_action_ptr->has_rate_group()) {
+                        active_fds.emplace_back(active_cnt, (fd_t)fd);
+                        total += active_cnt;
+                    }
+                });
+                std::sort(active_fds.begin(), active_fds.end(), std::greater<std::pair<uint32_t, fd_t>>());
+                uint64_t goal = (uint64_t)(total * std::min(fraction, 1.0));
+                uint64_t moved = 0;
+                for (uint32_t i = 0; i < active_fds.size() && i < max_cnt && moved < goal; ++i) {
+                    // skip fds which alone exceed the rest of goal, moving them only shifts the hot spot
+                    if (moved > 0 && moved + active_fds[i].first > goal + goal / 2) {
+                        continue;
+                    }
+                    fd_t fd = active_fds[i].second;
+                    std::function<void(int32_t)> fd_cb = nullptr;
+                    if (cb != nullptr) {
+                        fd_cb = [cb, fd](int32_t res) { cb(fd, res); };
+                    }
+                    do_migrate(fd, target_ep, fd_cb);
+                    moved += active_fds[i].first;
+                }
+            });
+        }
+
+        int32_t epoll::set_movable(fd_t fd, bool is_movable)
+        {
+            if (epfd_ == INVALID_FD || fd < 0 || fd == wakeup_fd_ || mode_ != EPOLL_MODE::EXCLUSIVE) {
+                return -1;
+            }
+            auto evt_info_ptr = get_event_info(fd, FD_TYPE::UNKNOWN_FD);
+            STABLE_INFRA_CHECK_SUC(nullptr != evt_info_ptr, -1);
+            evt_info_ptr->event_action_ptr_->set_movable(is_movable);
+            return 0;
+        }
+
+        int32_t epoll::set_callback_watch(bool is_enabled)
+        {
+            if (mode_ != EPOLL_MODE::EXCLUSIVE) {
+                return -1;
+            }
+            return post([this, is_enabled]() {
+                is_callback_watched_ = is_enabled;
+                running_callback* running = is_enabled ? &running_callback_ : nullptr;
+                fd_to_event_info_.for_each([&](uint32_t fd, const event_info::pointer_t& evt_info_ptr) {
+                    evt_info_ptr->event_action_ptr_->set_running_callback(running);
+                });
+                running_callback_.leave();
+            });
+        }
+
+        void epoll::get_load_stats(load_stats& stats) const
+        {
+            stats.busy_ns_ = load_.busy_ns_.load(std::memory_order_relaxed);
+            stats.iteration_cnt_ = load_.iteration_cnt_.load(std::memory_order_relaxed);
+            stats.serviced_cnt_ = load_.serviced_cnt_.load(std::memory_order_relaxed);
+            stats.migrated_in_cnt_ = load_.migrated_in_cnt_.load(std::memory_order_relaxed);
+            stats.migrated_out_cnt_ = load_.migrated_out_cnt_.load(std::memory_order_relaxed);
+        }
+
+        void epoll::set_priority_policy(const priority_policy& policy)
+        {
+            priority_policy_ = policy;
+        }
+
+        void epoll::get_priority_stats(priority_stats& stats) const
+        {
+            stats = priority_stats_;
         }
 
         void epoll::close()
@@ -320,8 +1366,11 @@ namespace stable_infra {
             if (epfd_ != INVALID_FD) {
                 STABLE_INFRA_SAFE_CLOSE_FD(epfd_);
                 epfd_ = INVALID_FD;
+                STABLE_INFRA_SAFE_CLOSE_FD(wakeup_fd_);
                 fd_to_event_info_.clear();
                 evt_change_lst_.clear();
+                removed_.clear();
+                throttle_timers_.clear();
             }
         }
 
@@ -6,12 +6,23 @@
  * @license Use of this source code is governed by The GNU Affero General Public License Version 3
  *          which can be found in the LICENSE file
  ***************************************************************************************/
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
 #include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <algorithm>
 #include <cstdio>
 #include <cstdlib>
+#include <limits>
+#include <new>
 #include "../../include/event/event_action.h"
 #include "../../include/util/macros_func.h"
 #include "../../include/event/fd_io_operation.h"
+#include "../../include/event/event_tracer.h"
+#include "../../include/event/frame_reader.h"
+#include "../../include/data_struct/buffer_chain.h"
 
 namespace stable_infra {
     namespace event {
@@ -27,90 +38,145 @@ namespace stable_infra {
 
         event_action::~event_action()
         {
+            // chains of tasks which never completed
+            for (auto& t : pending_write_task_) {
+                STABLE_INFRA_DELETE_OBJ(t.chain_);
+            }
+        }
+
+        void* event_action::operator new(std::size_t size)
+        {
+            void* ptr = nullptr;
+            if (posix_memalign(&ptr, ALIGN_SIZE, size) != 0) {
+                throw std::bad_alloc();
+            }
+            return ptr;
+        }
+
+        void event_action::operator delete(void* ptr)
+        {
+            free(ptr);
         }
 
 
         void event_action::disable_reading() 
         {
-            events_ &= ~read_event_;
+            hot_.events_ &= ~read_event_;
             read_callback_ = nullptr;
         }
 
         void event_action::disable_writing()
         {
-            events_ &= ~write_event_; 
+            hot_.events_ &= ~write_event_; 
             write_callback_ = nullptr;
         }
 
         void event_action::set_close_callback(const callback& cb)
         { 
-            events_ |= close_event_;
+            hot_.events_ |= close_event_;
             close_callback_ = cb;
         }
 
         void event_action::disable_closing()
         {
-            events_ &= ~close_event_; 
+            hot_.events_ &= ~close_event_; 
             close_callback_ = nullptr;
         }
 
         void event_action::set_error_callback(const callback& cb)
         { 
-            events_ |= error_event_;
+            hot_.events_ |= error_event_;
             error_callback_ = cb;
         }
 
         void event_action::disable_error()
         {
-            events_ &= ~error_event_; 
+            hot_.events_ &= ~error_event_; 
             error_callback_ = nullptr;
         }
 
         void event_action::disable_all() 
         {
-            events_ = none_event_; 
+            hot_.events_ = none_event_; 
             read_callback_ = nullptr;
             write_callback_ = nullptr;
             close_callback_ = nullptr; 
             error_callback_ = nullptr;
         }
         
+        void event_action::get_memory_usage(uint64_t& task_queue_bytes, uint64_t& iov_buffer_bytes) const
+        {
+            task_queue_bytes += stable_infra::util::deque_memory_usage(pending_read_task_)
+                + stable_infra::util::deque_memory_usage(pending_write_task_)
+                + (write_watermark_ != nullptr ? sizeof(write_watermark) : 0)
+                + (rate_limit_ != nullptr ? sizeof(rate_limit_state) : 0);
+            iov_buffer_bytes += (read_iov_buffer_.capacity() + write_iov_buffer_.capacity()) * sizeof(::iovec);
+            if (frame_reader_ != nullptr) {
+                iov_buffer_bytes += sizeof(frame_reader) + frame_reader_->memory_usage();
+            }
+        }
+
         void event_action::set_ready_events(uint32_t events)
         {
-            if (! is_readable_ && events & read_event_) {
-                is_readable_ = true;
+            if (! hot_.is_readable_ && events & (read_event_ | error_event_ | close_event_)) {
+                hot_.is_readable_ = true;
             }
-            if (! is_writable_ && events & write_event_) {
-                is_writable_ = true;
+            if (! hot_.is_writable_ && events & (write_event_ | error_event_ | close_event_)) {
+                hot_.is_writable_ = true;
             }
             handle_events();
         }
 
         void event_action::handle_events()
         {
-            if (is_readable_ && ! pending_read_task_.empty()) {
-                auto size = pending_read_task_.size();
-                for (uint32_t i = 0; i < size; ++i) {
-                    auto& t = pending_read_task_.front();
-                    auto ret = do_read_task(t);
-                    if (ret == INT32_MAX) {
-                        is_readable_ = false;
-                        pending_read_task_.push_back(t);
+            // pending counters live in the hot line, the task queues are only touched when there is work
+            while (hot_.is_readable_ && hot_.pending_read_cnt_ > 0 && ! hot_.is_detached_) {
+                uint64_t limit = UINT64_MAX;
+                if (STABLE_INFRA_UNLIKELY(is_rate_limited(true))) {
+                    // a throttled fd stops reading, the full socket buffer slows the peer down
+                    limit = acquire_tokens(pending_read_task_.front(), true);
+                    if (limit == 0) {
+                        break;
                     }
-                    pending_read_task_.pop_front();
                 }
+                auto ret = do_read_task(pending_read_task_.front(), limit);
+                if (ret == INT32_MAX) {
+                    // keep the task at the head, it will be retried on the next edge
+                    hot_.is_readable_ = false;
+                    break;
+                }
+                if (ret == FRAME_READ_THROTTLED) {
+                    // budget is used up in the middle of a frame, next acquire_tokens throttles it
+                    continue;
+                }
+                if (ret == ACCEPT_DEFERRED) {
+                    // backlog is not empty, the loop brings it back when accepting is allowed again
+                    break;
+                }
+                pending_read_task_.pop_front();
+                --hot_.pending_read_cnt_;
             }
-            if (is_writable_ && ! pending_write_task_.empty()) {
-                auto size = pending_write_task_.size();
-                for (uint32_t i = 0; i < size; ++i) {
-                    auto& t = pending_write_task_.front();
-                    auto ret = do_write_task(t);
-                    if (ret == INT32_MAX) {
-                        is_writable_ = false;
-                        pending_write_task_.push_back(t);
+            while (hot_.is_writable_ && hot_.pending_write_cnt_ > 0 && ! hot_.is_detached_) {
+                uint64_t limit = UINT64_MAX;
+                if (STABLE_INFRA_UNLIKELY(is_rate_limited(false))) {
+                    // deferred to the refill time, the fd stays writable
+                    limit = acquire_tokens(pending_write_task_.front(), false);
+                    if (limit == 0) {
+                        break;
                     }
-                    pending_write_task_.pop_front();
                 }
+                auto ret = do_write_task(pending_write_task_.front(), limit);
+                if (ret == INT32_MAX) {
+                    hot_.is_writable_ = false;
+                    break;
+                }
+                if (ret == CHAIN_WRITE_THROTTLED) {
+                    // the rest of the chain waits for tokens, next acquire_tokens throttles it,
+                    // or goes in the next write capped by TCP_NOTSENT_LOWAT or IOV_MAX
+                    continue;
+                }
+                pending_write_task_.pop_front();
+                --hot_.pending_write_cnt_;
             }
         }
 
@@ -131,6 +197,12 @@ namespace stable_infra {
                     ops.write = &fd_io_operation<FD_TYPE_UDP>::write_fd;
                     break;
                 }
+            case FD_TYPE::UNIX_FD:
+                {
+                    ops.read = &fd_io_operation<FD_TYPE_UNIX>::read_fd;
+                    ops.write = &fd_io_operation<FD_TYPE_UNIX>::write_fd;
+                    break;
+                }
             case FD_TYPE::GENERAL_FD:
                 {
                     ops.read = &fd_io_operation<FD_TYPE_GENERAL>::read_fd;
@@ -141,34 +213,406 @@ namespace stable_infra {
                 {
                 }
             }
-            fd_ops_ = ops;
-            fd_type_ = type;
+            hot_.fd_ops_ = ops;
+            hot_.fd_type_ = type;
+        }
+
+        /**
+         * @brief cut an iovec array to limit bytes
+         * @return count of iovec left
+         */
+        static uint32_t limit_iov(::iovec* iov, uint32_t iov_cnt, uint64_t limit)
+        {
+            for (uint32_t i = 0; i < iov_cnt; ++i) {
+                if (iov[i].iov_len >= limit) {
+                    iov[i].iov_len = limit;
+                    return i + 1;
+                }
+                limit -= iov[i].iov_len;
+            }
+            return iov_cnt;
         }
 
-        int32_t event_action::do_read_task(const task& t)
+        int32_t event_action::do_read_task(const task& t, uint64_t limit)
         {
+            if (STABLE_INFRA_UNLIKELY(frame_reader_ != nullptr)) {
+                uint64_t budget = limit;
+                auto ret = frame_reader_->read_frame(hot_.fd_ops_.read, budget);
+                if (limit != UINT64_MAX) {
+                    consume_tokens(true, (int32_t)(limit - budget));
+                }
+                return ret;
+            }
+            if (t.msg_ != nullptr) {
+                return do_msg_task(t, true, limit);
+            }
+            if (STABLE_INFRA_UNLIKELY(t.is_accept_)) {
+                return do_accept_task(t);
+            }
             if (STABLE_INFRA_UNLIKELY(t.buffer_iov_cnt_ > read_iov_buffer_.size())) {
                 read_iov_buffer_.resize(t.buffer_iov_cnt_);
             }
             memcpy((void*)read_iov_buffer_.data(), t.buffer_, sizeof(::iovec) * t.buffer_iov_cnt_);
+            uint32_t iov_cnt = t.buffer_iov_cnt_;
+            if (limit != UINT64_MAX) {
+                iov_cnt = limit_iov(read_iov_buffer_.data(), iov_cnt, limit);
+            }
             bool is_empty = false;
-            auto ret = fd_ops_.read(fd_, read_iov_buffer_.data(), t.buffer_iov_cnt_, is_empty);
+            auto trace_ts = trace_begin();
+            auto ret = hot_.fd_ops_.read(hot_.fd_, read_iov_buffer_.data(), iov_cnt, is_empty);
+            trace_end(trace_ts, TRACE_PHASE::FD_READ, hot_.fd_, ret);
             STABLE_INFRA_IF_TRUE_RETURN_CODE(is_empty && ret == 0, INT32_MAX);
-            read_callback_(ret);
+            if (limit != UINT64_MAX) {
+                consume_tokens(true, ret);
+            }
+            complete(t, ret, true);
             return 0;
         }
 
-        int32_t event_action::do_write_task(const task& t)
+        int32_t event_action::do_write_task(const task& t, uint64_t limit)
         {
+            if (t.msg_ != nullptr) {
+                return do_msg_task(t, false, limit);
+            }
+            if (t.chain_ != nullptr) {
+                return do_chain_task(t, limit);
+            }
+            if (STABLE_INFRA_UNLIKELY(t.connect_bytes_ >= 0)) {
+                return do_connect_task(t);
+            }
             if (STABLE_INFRA_UNLIKELY(t.buffer_iov_cnt_ > write_iov_buffer_.size())) {
-                read_iov_buffer_.resize(t.buffer_iov_cnt_);
+                write_iov_buffer_.resize(t.buffer_iov_cnt_);
             }
             memcpy((void*)write_iov_buffer_.data(), t.buffer_, sizeof(::iovec) * t.buffer_iov_cnt_);
+            uint32_t iov_cnt = t.buffer_iov_cnt_;
+            uint64_t cap = write_cap(limit);
+            if (cap != UINT64_MAX) {
+                // paced or low latency write completes with fewer bytes, like a partial write
+                iov_cnt = limit_iov(write_iov_buffer_.data(), iov_cnt, cap);
+            }
             bool is_full = false;
-            auto ret = fd_ops_.write(fd_, write_iov_buffer_.data(), t.buffer_iov_cnt_, is_full);
+            auto trace_ts = trace_begin();
+            auto ret = hot_.fd_ops_.write(hot_.fd_, write_iov_buffer_.data(), iov_cnt, is_full);
+            trace_end(trace_ts, TRACE_PHASE::FD_WRITE, hot_.fd_, ret);
             STABLE_INFRA_IF_TRUE_RETURN_CODE(is_full && ret == 0, INT32_MAX);
-            read_callback_(ret);
+            if (limit != UINT64_MAX) {
+                consume_tokens(false, ret);
+            }
+            release_write(t);
+            complete(t, ret, false);
+            return 0;
+        }
+
+        int32_t event_action::do_msg_task(const task& t, bool is_read, uint64_t limit)
+        {
+            int32_t ret = -1;
+            bool is_blocked = false;
+            auto trace_ts = trace_begin();
+            if (hot_.fd_type_ != FD_TYPE::GENERAL_FD) {
+                ret = is_read ? socket_msg_operation::recv_msg(hot_.fd_, t.msg_, is_blocked)
+                              : socket_msg_operation::send_msg(hot_.fd_, t.msg_, is_blocked);
+            }
+            trace_end(trace_ts, is_read ? TRACE_PHASE::FD_READ : TRACE_PHASE::FD_WRITE, hot_.fd_, ret);
+            STABLE_INFRA_IF_TRUE_RETURN_CODE(is_blocked && ret == 0, INT32_MAX);
+            if (limit != UINT64_MAX) {
+                // a message is not split, the buckets may go into debt
+                consume_tokens(is_read, ret);
+            }
+            if (! is_read) {
+                release_write(t);
+            }
+            complete(t, ret, is_read);
             return 0;
         }
+
+        int32_t event_action::do_chain_task(const task& t, uint64_t limit)
+        {
+            auto chain = t.chain_;
+            // write_fd moves iovecs, segments of the chain are kept as they are
+            uint32_t iov_cnt = chain->iov_cnt();
+            // sendmsg and writev fail with EMSGSIZE above IOV_MAX segments, the rest goes in the next pass
+            bool is_iov_capped = iov_cnt > IOV_MAX;
+            if (is_iov_capped) {
+                iov_cnt = IOV_MAX;
+            }
+            if (STABLE_INFRA_UNLIKELY(iov_cnt > write_iov_buffer_.size())) {
+                write_iov_buffer_.resize(iov_cnt);
+            }
+            memcpy((void*)write_iov_buffer_.data(), chain->iov(), sizeof(::iovec) * iov_cnt);
+            uint64_t cap = write_cap(limit);
+            if (cap != UINT64_MAX) {
+                iov_cnt = limit_iov(write_iov_buffer_.data(), iov_cnt, cap);
+            }
+            bool is_full = false;
+            auto trace_ts = trace_begin();
+            auto ret = hot_.fd_ops_.write(hot_.fd_, write_iov_buffer_.data(), iov_cnt, is_full);
+            trace_end(trace_ts, TRACE_PHASE::FD_WRITE, hot_.fd_, ret);
+            if (ret > 0) {
+                if (limit != UINT64_MAX) {
+                    consume_tokens(false, ret);
+                }
+                chain->consume(ret);
+            }
+            if (ret >= 0 && ! chain->empty()) {
+                if (is_full) {
+                    return INT32_MAX;
+                }
+                if (cap != UINT64_MAX || (is_iov_capped && ret > 0)) {
+                    // the next part goes after tokens or while the kernel takes more
+                    return CHAIN_WRITE_THROTTLED;
+                }
+            }
+            // bytes_ is the chain size at submitting, less than 2GB, see epoll::add_chain_task
+            int32_t result = ret < 0 ? ret : (int32_t)(t.bytes_ - chain->size());
+            release_write(t);
+            delete chain;
+            complete(t, result, false);
+            return 0;
+        }
+
+        int32_t event_action::do_accept_task(const task& t)
+        {
+            auto state = accept_state_;
+            while (true) {
+                if (state->budget_left_ == 0) {
+                    state->deferred_.push_back(this);
+                    ++state->stats_.deferred_cnt_;
+                    return ACCEPT_DEFERRED;
+                }
+                bool is_full = state->is_full();
+                if (is_full && state->limit_.overload_ == ACCEPT_OVERLOAD::PAUSE) {
+                    state->pause_(this);
+                    return ACCEPT_DEFERRED;
+                }
+                auto trace_ts = trace_begin();
+                fd_t fd = accept4(hot_.fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                trace_end(trace_ts, TRACE_PHASE::FD_READ, hot_.fd_, fd);
+                if (fd < 0) {
+                    if (errno == EINTR || errno == ECONNABORTED) {
+                        continue;
+                    }
+                    STABLE_INFRA_IF_TRUE_RETURN_CODE(errno == EAGAIN || errno == EWOULDBLOCK, INT32_MAX);
+                    // EMFILE and the like leave the connection in backlog, retried on the next edge
+                    // instead of spinning on a task submitted again by the callback
+                    hot_.is_readable_ = false;
+                    complete(t, -1, true);
+                    return 0;
+                }
+                if (state->limit_.budget_ > 0) {
+                    --state->budget_left_;
+                }
+                if (is_full) {
+                    // the peer fails fast instead of waiting for a loop which cannot serve it
+                    struct linger reset{ 1, 0 };
+                    setsockopt(fd, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
+                    ::close(fd);
+                    ++state->stats_.rejected_cnt_;
+                    continue;
+                }
+                // an accepted socket has the type of its listen socket, no get_fd_type
+                if (! state->register_fd_(fd, hot_.fd_type_)) {
+                    ::close(fd);
+                    complete(t, -1, true);
+                    return 0;
+                }
+                ++state->stats_.accepted_cnt_;
+                complete(t, fd, true);
+                return 0;
+            }
+        }
+
+        int32_t event_action::do_connect_task(const task& t)
+        {
+            bool is_connecting = false;
+            auto trace_ts = trace_begin();
+            auto ret = socket_connect_operation::finish(hot_.fd_, is_connecting);
+            trace_end(trace_ts, TRACE_PHASE::FD_WRITE, hot_.fd_, ret);
+            STABLE_INFRA_IF_TRUE_RETURN_CODE(is_connecting, INT32_MAX);
+            complete(t, ret == 0 ? t.connect_bytes_ : -1, false);
+            return 0;
+        }
+
+        void event_action::set_frame_reader(const frame_spec& spec, const frame_callback& cb)
+        {
+            if (frame_reader_ == nullptr) {
+                frame_reader_.reset(new frame_reader(hot_.fd_, hot_.fd_type_ == FD_TYPE::TCP_FD));
+                // frame callback replaces read callback
+                enable_reading();
+            }
+            frame_reader_->set_spec(spec);
+            if (cb != nullptr) {
+                frame_reader_->set_callback(cb);
+            }
+        }
+
+        bool event_action::has_buffered_frame() const
+        {
+            return frame_reader_ != nullptr && frame_reader_->has_frame();
+        }
+
+        void event_action::set_loop_write_state(write_queue_state* state)
+        {
+            if (loop_write_state_ != nullptr && queued_write_bytes_ > 0) {
+                loop_write_state_->queued_bytes_ -= queued_write_bytes_;
+                loop_write_state_->watermark_.on_released(loop_write_state_->queued_bytes_);
+            }
+            loop_write_state_ = state;
+            if (loop_write_state_ != nullptr && queued_write_bytes_ > 0) {
+                loop_write_state_->queued_bytes_ += queued_write_bytes_;
+                loop_write_state_->watermark_.on_queued(loop_write_state_->queued_bytes_);
+            }
+        }
+
+        void event_action::release_write(const task& t)
+        {
+            if (t.bytes_ == 0) {
+                return;
+            }
+            queued_write_bytes_ -= t.bytes_;
+            if (loop_write_state_ != nullptr) {
+                loop_write_state_->queued_bytes_ -= t.bytes_;
+                loop_write_state_->watermark_.on_released(loop_write_state_->queued_bytes_);
+            }
+            if (write_watermark_ != nullptr) {
+                write_watermark_->on_released(queued_write_bytes_);
+            }
+        }
+
+        void event_action::set_write_watermark(const write_watermark& watermark)
+        {
+            if (watermark.high_ == 0 && watermark.hard_limit_ == 0) {
+                write_watermark_.reset();
+                return;
+            }
+            write_watermark_.reset(new write_watermark(watermark));
+            write_watermark_->is_high_ = false;
+            // already above it
+            write_watermark_->on_queued(queued_write_bytes_);
+        }
+
+        int32_t event_action::set_notsent_lowat(uint32_t lowat)
+        {
+            STABLE_INFRA_CHECK_SUC(hot_.fd_type_ == FD_TYPE::TCP_FD, -1);
+            // 0 restores net.ipv4.tcp_notsent_lowat
+            STABLE_INFRA_CHECK_SUC(setsockopt(hot_.fd_, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat)) == 0, -1);
+            notsent_lowat_ = lowat;
+            return 0;
+        }
+
+        uint64_t event_action::task_bytes(const task& t)
+        {
+            if (t.chain_ != nullptr) {
+                return t.chain_->size();
+            }
+            const ::iovec* iov = t.buffer_;
+            uint64_t iov_cnt = t.buffer_iov_cnt_;
+            if (t.msg_ != nullptr) {
+                iov = t.msg_->msg_iov;
+                iov_cnt = t.msg_->msg_iovlen;
+            }
+            uint64_t bytes = 0;
+            for (uint64_t i = 0; i < iov_cnt; ++i) {
+                bytes += iov[i].iov_len;
+            }
+            return bytes;
+        }
+
+        void event_action::set_rate_limit(const rate_limit& read_limit, const rate_limit& write_limit)
+        {
+            if (read_limit.rate_ == 0 && write_limit.rate_ == 0
+                    && (rate_limit_ == nullptr || (rate_limit_->read_group_ == nullptr && rate_limit_->write_group_ == nullptr))) {
+                // a pending timer entry becomes stale
+                rate_limit_.reset();
+                return;
+            }
+            if (rate_limit_ == nullptr) {
+                rate_limit_.reset(new rate_limit_state());
+            }
+            uint64_t now = stable_infra::util::monotonic_ns();
+            rate_limit_->read_bucket_.reset(read_limit, now);
+            rate_limit_->write_bucket_.reset(write_limit, now);
+        }
+
+        void event_action::set_rate_group(const std::shared_ptr<rate_group>& read_group,
+                const std::shared_ptr<rate_group>& write_group)
+        {
+            if (rate_limit_ == nullptr) {
+                rate_limit_.reset(new rate_limit_state());
+            }
+            rate_limit_->read_group_ = read_group;
+            rate_limit_->write_group_ = write_group;
+        }
+
+        uint32_t event_action::get_buckets(bool is_read, token_bucket* buckets[3])
+        {
+            uint32_t cnt = 0;
+            if (rate_limit_ != nullptr) {
+                auto& own = is_read ? rate_limit_->read_bucket_ : rate_limit_->write_bucket_;
+                if (own.is_limited()) {
+                    buckets[cnt++] = &own;
+                }
+                auto& group = is_read ? rate_limit_->read_group_ : rate_limit_->write_group_;
+                if (group != nullptr && group->bucket().is_limited()) {
+                    buckets[cnt++] = &group->bucket();
+                }
+            }
+            if (! is_read && loop_write_bucket_ != nullptr) {
+                buckets[cnt++] = loop_write_bucket_;
+            }
+            return cnt;
+        }
+
+        uint64_t event_action::acquire_tokens(const task& t, bool is_read)
+        {
+            token_bucket* buckets[3];
+            uint32_t cnt = get_buckets(is_read, buckets);
+            if (cnt == 0 || throttle_timers_ == nullptr) {
+                return UINT64_MAX;
+            }
+            // size of a frame is unknown before reading, it waits for a full bucket
+            uint64_t bytes = is_read ? (frame_reader_ != nullptr ? UINT64_MAX : task_bytes(t)) : t.bytes_;
+            if (bytes == 0) {
+                return UINT64_MAX;
+            }
+            uint64_t now = stable_infra::util::monotonic_ns();
+            uint64_t wait = 0;
+            double tokens = std::numeric_limits<double>::infinity();
+            for (uint32_t i = 0; i < cnt; ++i) {
+                buckets[i]->refill(now);
+                wait = std::max(wait, buckets[i]->wait_ns(bytes));
+                tokens = std::min(tokens, buckets[i]->tokens_);
+            }
+            if (wait > 0) {
+                throttle(now + wait);
+                return 0;
+            }
+            // tokens are at least min(bytes, burst) here, a bucket in debt would have set wait
+            return tokens < 1 ? 1 : (uint64_t)tokens;
+        }
+
+        void event_action::consume_tokens(bool is_read, int32_t bytes)
+        {
+            if (bytes <= 0) {
+                return;
+            }
+            token_bucket* buckets[3];
+            uint32_t cnt = get_buckets(is_read, buckets);
+            for (uint32_t i = 0; i < cnt; ++i) {
+                buckets[i]->consume((uint64_t)bytes);
+            }
+        }
+
+        void event_action::throttle(uint64_t deadline_ns)
+        {
+            if (rate_limit_ == nullptr) {
+                // only limited by loop
+                rate_limit_.reset(new rate_limit_state());
+            }
+            // an earlier deadline is kept, the fd checks its buckets again then
+            if (rate_limit_->deadline_ns_ == 0 || deadline_ns < rate_limit_->deadline_ns_) {
+                rate_limit_->deadline_ns_ = deadline_ns;
+                throttle_timers_->push(deadline_ns, this);
+            }
+        }
     }
 }
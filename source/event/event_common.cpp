@@ -6,12 +6,69 @@
  * @license Use of this source code is governed by The GNU Affero General Public License Version 3
  *          which can be found in the LICENSE file
  ***************************************************************************************/
+#include <string.h>
 #include "../../include/common/platform_define.h"
 #include "../../include/event/event_common.h"
 #include "../../include/event/epoll.h"
 
 namespace stable_infra {
     namespace event {
+        /// bytes 0-11 of an IPv4-mapped IPv6 address in memory order, ::ffff:0:0/96
+        static const uint8_t ipv4_mapped_prefix[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+
+        bool peer_address::from_sockaddr(const ::sockaddr* addr, socklen_t len)
+        {
+            STABLE_INFRA_IF_TRUE_RETURN_CODE(addr == nullptr || len < (socklen_t)sizeof(::sa_family_t), false);
+            uint8_t bytes[16];
+            if (addr->sa_family == AF_INET) {
+                STABLE_INFRA_IF_TRUE_RETURN_CODE(len < (socklen_t)sizeof(::sockaddr_in), false);
+                auto in = reinterpret_cast<const ::sockaddr_in*>(addr);
+                memcpy(bytes, ipv4_mapped_prefix, sizeof(ipv4_mapped_prefix));
+                memcpy(bytes + 12, &in->sin_addr, 4);
+                port_ = in->sin_port;
+                scope_id_ = 0;
+            } else if (addr->sa_family == AF_INET6) {
+                STABLE_INFRA_IF_TRUE_RETURN_CODE(len < (socklen_t)sizeof(::sockaddr_in6), false);
+                auto in6 = reinterpret_cast<const ::sockaddr_in6*>(addr);
+                memcpy(bytes, &in6->sin6_addr, 16);
+                port_ = in6->sin6_port;
+                scope_id_ = in6->sin6_scope_id;
+            } else {
+                return false;
+            }
+            memcpy(&addr_lo_, bytes, 8);
+            memcpy(&addr_hi_, bytes + 8, 8);
+            reserved_ = 0;
+            return true;
+        }
+
+        bool peer_address::is_ipv4() const
+        {
+            uint8_t bytes[16];
+            memcpy(bytes, &addr_lo_, 8);
+            memcpy(bytes + 8, &addr_hi_, 8);
+            return memcmp(bytes, ipv4_mapped_prefix, sizeof(ipv4_mapped_prefix)) == 0;
+        }
+
+        socklen_t peer_address::to_sockaddr(::sockaddr_storage& addr, bool is_ipv6_socket) const
+        {
+            memset(&addr, 0, sizeof(addr));
+            if (!is_ipv6_socket && is_ipv4()) {
+                auto in = reinterpret_cast<::sockaddr_in*>(&addr);
+                in->sin_family = AF_INET;
+                in->sin_port = port_;
+                memcpy(&in->sin_addr, reinterpret_cast<const uint8_t*>(&addr_hi_) + 4, 4);
+                return sizeof(::sockaddr_in);
+            }
+            auto in6 = reinterpret_cast<::sockaddr_in6*>(&addr);
+            in6->sin6_family = AF_INET6;
+            in6->sin6_port = port_;
+            in6->sin6_scope_id = scope_id_;
+            memcpy(&in6->sin6_addr, &addr_lo_, 8);
+            memcpy(reinterpret_cast<uint8_t*>(&in6->sin6_addr) + 8, &addr_hi_, 8);
+            return sizeof(::sockaddr_in6);
+        }
+
         std::shared_ptr<poll_base> get_poll_obj()
         {
 #ifdef EVENT_EPOLL_EXIST
@@ -0,0 +1,158 @@
+/****************************************************************************************
+ * @file event_tracer.cpp
+ * @brief low overhead tracer of event loop phases
+ * @author Liu Hua Jun
+ * @email wojiaoliuhuajun@126.com
+ * @license Use of this source code is governed by The GNU Affero General Public License Version 3
+ *          which can be found in the LICENSE file
+ ***************************************************************************************/
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <mutex>
+#include <vector>
+#include <thread>
+#include "../../include/event/event_tracer.h"
+
+namespace stable_infra {
+    namespace event {
+        std::atomic<bool> tracer::enabled_{ false };
+        std::atomic<uint32_t> tracer::sample_interval_{ 1 };
+        thread_local trace_ring* tracer::ring_{ nullptr };
+        thread_local bool tracer::sampling_{ false };
+        thread_local uint32_t tracer::iteration_{ 0 };
+
+        static std::mutex rings_mtx;
+        static std::vector<trace_ring*> rings; ///< rings of all traced threads, never released
+        static uint64_t base_tick{ 0 };        ///< tick when tracer was enabled first time
+        static int64_t base_ns{ 0 };           ///< steady clock when tracer was enabled first time
+
+        static inline int64_t steady_ns()
+        {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+        }
+
+        static const char* phase_name(TRACE_PHASE phase)
+        {
+            switch (phase) {
+                case TRACE_PHASE::EPOLL_WAIT:
+                    return "epoll_wait";
+                case TRACE_PHASE::APPLY_CHANGES:
+                    return "apply_changes";
+                case TRACE_PHASE::FD_READ:
+                    return "fd_read";
+                case TRACE_PHASE::FD_WRITE:
+                    return "fd_write";
+                case TRACE_PHASE::READ_CALLBACK:
+                    return "read_callback";
+                case TRACE_PHASE::WRITE_CALLBACK:
+                    return "write_callback";
+                default:
+                    return "unknown";
+            }
+        }
+
+        void tracer::enable(uint32_t sample_interval)
+        {
+            {
+                std::lock_guard<std::mutex> lock(rings_mtx);
+                if (base_ns == 0) {
+                    base_tick = now();
+                    base_ns = steady_ns();
+                }
+            }
+            sample_interval_.store(sample_interval == 0 ? 1 : sample_interval, std::memory_order_relaxed);
+            enabled_.store(true, std::memory_order_relaxed);
+        }
+
+        void tracer::disable()
+        {
+            enabled_.store(false, std::memory_order_relaxed);
+        }
+
+        trace_ring* tracer::create_ring()
+        {
+            void* mem = nullptr;
+            STABLE_INFRA_ASSERT(posix_memalign(&mem, ALIGN_SIZE, sizeof(trace_ring)) == 0);
+            ring_ = new (mem) trace_ring();
+            ring_->tid_ = (int32_t)syscall(SYS_gettid);
+            std::lock_guard<std::mutex> lock(rings_mtx);
+            rings.push_back(ring_);
+            return ring_;
+        }
+
+        uint32_t tracer::dump_chrome_trace(std::string& json)
+        {
+            std::lock_guard<std::mutex> lock(rings_mtx);
+            json = "{\"traceEvents\":[";
+            if (base_ns == 0) {
+                json += "]}";
+                return 0;
+            }
+            // ticks are converted with the rate measured since the tracer was enabled
+            auto elapsed_ns = steady_ns() - base_ns;
+            if (elapsed_ns < 1000000) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                elapsed_ns = steady_ns() - base_ns;
+            }
+            double ticks_per_us = (double)(now() - base_tick) * 1000.0 / (double)elapsed_ns;
+            if (ticks_per_us <= 0) {
+                ticks_per_us = 1000.0;
+            }
+
+            uint32_t cnt = 0;
+            auto pid = (int32_t)getpid();
+            std::vector<trace_record> snapshot(TRACE_RING_SIZE);
+            char line[256];
+            for (auto ring : rings) {
+                auto head = ring->head_.load(std::memory_order_acquire);
+                uint64_t first = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+                for (auto i = first; i < head; ++i) {
+                    snapshot[i - first] = ring->records_[i & (TRACE_RING_SIZE - 1)];
+                }
+                // reads of the copy are ordered before reading head again
+                std::atomic_thread_fence(std::memory_order_acquire);
+                // records up to new_head - TRACE_RING_SIZE may be overwritten while copying, the last
+                // of them shares its slot with the record new_head which may be being written
+                auto new_head = ring->head_.load(std::memory_order_relaxed);
+                auto valid = first;
+                if (new_head >= TRACE_RING_SIZE && new_head - TRACE_RING_SIZE + 1 > valid) {
+                    valid = new_head - TRACE_RING_SIZE + 1;
+                }
+                for (auto i = valid; i < head; ++i) {
+                    auto& rec = snapshot[i - first];
+                    if (rec.begin_ < base_tick) {
+                        continue;
+                    }
+                    snprintf(line, sizeof(line),
+                             "%s{\"name\":\"%s\",\"cat\":\"event\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                             "\"pid\":%d,\"tid\":%d,\"args\":{\"fd\":%d,\"bytes\":%d}}",
+                             cnt == 0 ? "" : ",", phase_name(rec.phase_),
+                             (double)(rec.begin_ - base_tick) / ticks_per_us,
+                             (double)rec.duration_ / ticks_per_us,
+                             pid, ring->tid_, rec.fd_, rec.bytes_);
+                    json += line;
+                    ++cnt;
+                }
+            }
+            json += "]}";
+            return cnt;
+        }
+
+        int32_t tracer::dump_chrome_trace_file(const std::string& file_path)
+        {
+            std::string json;
+            dump_chrome_trace(json);
+            FILE* fp = fopen(file_path.c_str(), "w");
+            if (fp == nullptr) {
+                return RET_ERR;
+            }
+            auto ret = fwrite(json.data(), 1, json.size(), fp);
+            fclose(fp);
+            return ret == json.size() ? RET_SUC : RET_ERR;
+        }
+    }
+}
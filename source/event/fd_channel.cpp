@@ -0,0 +1,280 @@
+/****************************************************************************************
+ * @file fd_channel.cpp
+ * @brief pass fds between processes over AF_UNIX socket
+ * @author Liu Hua Jun
+ * @email wojiaoliuhuajun@126.com
+ * @license Use of this source code is governed by The GNU Affero General Public License Version 3
+ *          which can be found in the LICENSE file
+ ***************************************************************************************/
+#include <sys/un.h>
+#include <unistd.h>
+#include <cstring>
+#include <cstddef>
+#include <algorithm>
+#include <vector>
+#include "../../include/event/fd_channel.h"
+#include "../../include/util/util.h"
+#include "../../include/util/macros_func.h"
+
+namespace stable_infra {
+    namespace event {
+        static bool make_unix_addr(const std::string& path, ::sockaddr_un& addr, socklen_t& addr_len)
+        {
+            memset(&addr, 0, sizeof(addr));
+            addr.sun_family = AF_UNIX;
+            if (path.empty() || path.size() >= sizeof(addr.sun_path)) {
+                return false;
+            }
+            memcpy(addr.sun_path, path.data(), path.size());
+            if (path[0] == '@') {
+                // abstract namespace
+                addr.sun_path[0] = '\0';
+            }
+            addr_len = offsetof(::sockaddr_un, sun_path) + path.size();
+            return true;
+        }
+
+        fd_channel::fd_channel(const std::shared_ptr<poll_base>& poll, fd_t sock, bool close_after_send)
+            : poll_(poll), sock_(sock), close_after_send_(close_after_send)
+        {
+            recv_batch_.reset(new batch());
+        }
+
+        fd_channel::~fd_channel()
+        {
+            close();
+        }
+
+        int32_t fd_channel::create_pair(fd_t& sock1, fd_t& sock2)
+        {
+            fd_t socks[2];
+            if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, socks) != 0) {
+                return RET_ERR;
+            }
+            sock1 = socks[0];
+            sock2 = socks[1];
+            return RET_SUC;
+        }
+
+        fd_t fd_channel::listen_path(const std::string& path)
+        {
+            ::sockaddr_un addr;
+            socklen_t addr_len = 0;
+            STABLE_INFRA_CHECK_SUC(make_unix_addr(path, addr, addr_len), INVALID_FD);
+            fd_t fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            STABLE_INFRA_CHECK_SUC(fd != INVALID_FD, INVALID_FD);
+            if (bind(fd, (::sockaddr*)&addr, addr_len) != 0 || ::listen(fd, SOMAXCONN) != 0) {
+                STABLE_INFRA_SAFE_CLOSE_FD(fd);
+                return INVALID_FD;
+            }
+            return fd;
+        }
+
+        fd_t fd_channel::connect_path(const std::string& path)
+        {
+            ::sockaddr_un addr;
+            socklen_t addr_len = 0;
+            STABLE_INFRA_CHECK_SUC(make_unix_addr(path, addr, addr_len), INVALID_FD);
+            fd_t fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+            STABLE_INFRA_CHECK_SUC(fd != INVALID_FD, INVALID_FD);
+            // connecting a local unix socket does not wait for network, do it before non-blocking
+            if (connect(fd, (::sockaddr*)&addr, addr_len) != 0
+                || stable_infra::util::util_make_fd_nonblocking(fd) != RET_SUC) {
+                STABLE_INFRA_SAFE_CLOSE_FD(fd);
+                return INVALID_FD;
+            }
+            return fd;
+        }
+
+        void fd_channel::prepare_msg(batch& b, bool is_send)
+        {
+            memset(&b.msg_, 0, sizeof(b.msg_));
+            b.iov_.iov_base = b.items_;
+            b.iov_.iov_len = is_send ? sizeof(wire_item) * b.cnt_ : sizeof(b.items_);
+            b.msg_.msg_iov = &b.iov_;
+            b.msg_.msg_iovlen = 1;
+            b.msg_.msg_control = b.ctrl_;
+            if (! is_send) {
+                b.msg_.msg_controllen = sizeof(b.ctrl_);
+                return;
+            }
+            b.msg_.msg_controllen = CMSG_SPACE(sizeof(fd_t) * b.cnt_);
+            auto cmsg = CMSG_FIRSTHDR(&b.msg_);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(fd_t) * b.cnt_);
+            memcpy(CMSG_DATA(cmsg), b.fds_, sizeof(fd_t) * b.cnt_);
+        }
+
+        int32_t fd_channel::send(const handoff_item* items, uint32_t cnt, const send_callback_t& cb)
+        {
+            if (sock_ == INVALID_FD || items == nullptr || cnt == 0) {
+                return RET_ERR;
+            }
+            for (uint32_t i = 0; i < cnt; ++i) {
+                if (items[i].fd_ < 0 || items[i].state_len_ > HANDOFF_STATE_SIZE) {
+                    return RET_ERR;
+                }
+            }
+            // build all batches first, nothing is queued if any of them is invalid
+            std::vector<std::unique_ptr<batch>> batches;
+            batches.reserve((cnt + HANDOFF_BATCH_SIZE - 1) / HANDOFF_BATCH_SIZE);
+            for (uint32_t offset = 0; offset < cnt; offset += HANDOFF_BATCH_SIZE) {
+                std::unique_ptr<batch> b(new batch());
+                b->cnt_ = std::min<uint32_t>(cnt - offset, HANDOFF_BATCH_SIZE);
+                for (uint32_t i = 0; i < b->cnt_; ++i) {
+                    auto& item = items[offset + i];
+                    b->fds_[i] = item.fd_;
+                    b->items_[i].type_ = (uint32_t)item.type_;
+                    b->items_[i].state_len_ = item.state_len_;
+                    memcpy(b->items_[i].state_, item.state_, item.state_len_);
+                }
+                prepare_msg(*b, true);
+                batches.push_back(std::move(b));
+            }
+            batches.back()->is_last_ = true;
+            batches.back()->cb_ = cb;
+            bool is_idle = send_batches_.empty();
+            for (auto& b : batches) {
+                send_batches_.push_back(std::move(b));
+            }
+            // one batch is in flight, so a failed batch stops the rest of its send()
+            if (is_idle && submit_front() != RET_SUC) {
+                send_batches_.clear();
+                return RET_ERR;
+            }
+            return RET_SUC;
+        }
+
+        int32_t fd_channel::submit_front()
+        {
+            auto msg = &send_batches_.front()->msg_;
+            if (poll_->submit_async_sendmsg(sock_, msg, [this](int32_t ret) { on_sent(ret); }) != 0) {
+                return RET_ERR;
+            }
+            return RET_SUC;
+        }
+
+        void fd_channel::on_sent(int32_t ret)
+        {
+            STABLE_INFRA_IF_TRUE_RETURN(send_batches_.empty());
+            complete_front(ret);
+            while (! send_batches_.empty() && sock_ != INVALID_FD) {
+                if (submit_front() == RET_SUC) {
+                    return;
+                }
+                complete_front(-1);
+            }
+        }
+
+        void fd_channel::complete_front(int32_t ret)
+        {
+            std::unique_ptr<batch> b = std::move(send_batches_.front());
+            send_batches_.pop_front();
+            if (ret > 0) {
+                sent_cnt_ += b->cnt_;
+                if (close_after_send_) {
+                    for (uint32_t i = 0; i < b->cnt_; ++i) {
+                        // the peer keeps the file open, its epoll item would still point at this poll
+                        poll_->remove_fd(b->fds_[i]);
+                        ::close(b->fds_[i]);
+                    }
+                }
+            } else {
+                // batches after a failed one are not sent, their fds stay with the caller
+                while (! b->is_last_) {
+                    b = std::move(send_batches_.front());
+                    send_batches_.pop_front();
+                }
+            }
+            if (b->is_last_) {
+                auto sent_cnt = sent_cnt_;
+                sent_cnt_ = 0;
+                if (b->cb_ != nullptr) {
+                    b->cb_(sent_cnt);
+                }
+            }
+        }
+
+        int32_t fd_channel::start_receive(const recv_callback_t& cb)
+        {
+            if (sock_ == INVALID_FD || cb == nullptr) {
+                return RET_ERR;
+            }
+            recv_cb_ = cb;
+            return submit_receive();
+        }
+
+        int32_t fd_channel::submit_receive()
+        {
+            prepare_msg(*recv_batch_, false);
+            if (poll_->submit_async_recvmsg(sock_, &recv_batch_->msg_, [this](int32_t ret) { on_received(ret); }) != 0) {
+                return RET_ERR;
+            }
+            is_receiving_ = true;
+            return RET_SUC;
+        }
+
+        void fd_channel::on_received(int32_t ret)
+        {
+            is_receiving_ = false;
+            auto& b = *recv_batch_;
+            uint32_t fd_cnt = 0;
+            if (ret > 0) {
+                for (auto cmsg = CMSG_FIRSTHDR(&b.msg_); cmsg != nullptr; cmsg = CMSG_NXTHDR(&b.msg_, cmsg)) {
+                    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+                        continue;
+                    }
+                    uint32_t cnt = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(fd_t);
+                    cnt = std::min<uint32_t>(cnt, HANDOFF_BATCH_SIZE - fd_cnt);
+                    memcpy(b.fds_ + fd_cnt, CMSG_DATA(cmsg), sizeof(fd_t) * cnt);
+                    fd_cnt += cnt;
+                }
+            }
+            uint32_t item_cnt = ret > 0 ? (uint32_t)ret / sizeof(wire_item) : 0;
+            if (ret <= 0 || (b.msg_.msg_flags & (MSG_CTRUNC | MSG_TRUNC)) || fd_cnt != item_cnt) {
+                for (uint32_t i = 0; i < fd_cnt; ++i) {
+                    ::close(b.fds_[i]);
+                }
+                if (recv_cb_ != nullptr) {
+                    recv_cb_(nullptr);
+                }
+                return;
+            }
+            handoff_item item;
+            for (uint32_t i = 0; i < item_cnt; ++i) {
+                item.fd_ = b.fds_[i];
+                item.type_ = (FD_TYPE)b.items_[i].type_;
+                item.state_len_ = std::min<uint32_t>(b.items_[i].state_len_, HANDOFF_STATE_SIZE);
+                memcpy(item.state_, b.items_[i].state_, item.state_len_);
+                if (poll_->adopt_fd(item.fd_, item.type_) != 0) {
+                    // type is unknown or fd is invalid, let poll detect it on first submission
+                    item.type_ = FD_TYPE::UNKNOWN_FD;
+                }
+                recv_cb_(&item);
+            }
+            if (sock_ != INVALID_FD && submit_receive() != RET_SUC) {
+                recv_cb_(nullptr);
+            }
+        }
+
+        void fd_channel::close()
+        {
+            if (sock_ != INVALID_FD) {
+                // queued tasks point at this channel, drop them before the fd number can be reused
+                poll_->remove_fd(sock_);
+                STABLE_INFRA_SAFE_CLOSE_FD(sock_);
+            }
+            // each pending send() completes once with the count sent before, the rest are left to the caller
+            while (! send_batches_.empty()) {
+                complete_front(-1);
+            }
+            if (is_receiving_) {
+                is_receiving_ = false;
+                if (recv_cb_ != nullptr) {
+                    recv_cb_(nullptr);
+                }
+            }
+        }
+    }
+}
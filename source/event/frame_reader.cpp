@@ -0,0 +1,149 @@
+/**
+ * @file frame_reader.cpp
+ * @brief length prefixed or delimited frame reader of one fd
+ * @author Liu Hua Jun
+ * @email wojiaoliuhuajun@126.com
+ * @license Use of this source code is governed by The GNU Affero General Public License Version 3
+ *          which can be found in the LICENSE file
+ */
+#include <string.h>
+#include <algorithm>
+#include <sys/socket.h>
+#include "../../include/event/frame_reader.h"
+#include "../../include/event/event_tracer.h"
+
+namespace stable_infra {
+    namespace event {
+        frame_reader::frame_reader(fd_t fd, bool is_tcp)
+            : fd_(fd), is_tcp_(is_tcp)
+        {
+        }
+
+        uint64_t frame_reader::decode_size() const
+        {
+            const unsigned char* field = (const unsigned char*)buffer_.data() + begin_ + spec_.length_offset_;
+            uint64_t length = 0;
+            for (uint32_t i = 0; i < spec_.length_size_; ++i) {
+                uint32_t index = spec_.is_big_endian_ ? i : spec_.length_size_ - 1 - i;
+                length = (length << 8) | field[index];
+            }
+            return spec_.is_length_include_header_ ? length : length + spec_.header_size_;
+        }
+
+        int64_t frame_reader::delimited_size() const
+        {
+            uint32_t avail = std::min<uint32_t>(end_ - begin_, spec_.max_frame_size_);
+            const char* head = buffer_.data() + begin_;
+            const char* found = stable_infra::util::find_delimiter(head + scanned_, avail - scanned_,
+                    spec_.delimiter_, spec_.delimiter_size_);
+            if (found != nullptr) {
+                return found - head + spec_.delimiter_size_;
+            }
+            // max_frame_size_ bytes without delimiter
+            return avail == spec_.max_frame_size_ ? -1 : 0;
+        }
+
+        uint64_t frame_reader::needed_size() const
+        {
+            uint32_t avail = end_ - begin_;
+            if (spec_.delimiter_size_ > 0) {
+                // size is unknown, grow buffer by doubling up to the max frame
+                return std::min<uint64_t>(std::max<uint64_t>((uint64_t)avail * 2, FRAME_BUFFER_MIN),
+                        spec_.max_frame_size_);
+            }
+            // frame_size() has checked the header
+            return avail < spec_.header_size_ ? spec_.header_size_ : decode_size();
+        }
+
+        int64_t frame_reader::frame_size() const
+        {
+            if (spec_.delimiter_size_ > 0) {
+                return delimited_size();
+            }
+            uint32_t avail = end_ - begin_;
+            if (avail < spec_.header_size_) {
+                return 0;
+            }
+            uint64_t size = decode_size();
+            if (size < spec_.header_size_ || size > spec_.max_frame_size_) {
+                return -1;
+            }
+            return avail >= size ? (int64_t)size : 0;
+        }
+
+        void frame_reader::reserve(uint64_t needed)
+        {
+            if (begin_ > 0 && buffer_.size() - begin_ < needed + FRAME_BUFFER_MIN / 2) {
+                // move the incomplete frame to the front
+                memmove(buffer_.data(), buffer_.data() + begin_, end_ - begin_);
+                end_ -= begin_;
+                begin_ = 0;
+            }
+            uint64_t size = std::max<uint64_t>(needed, FRAME_BUFFER_MIN);
+            if (buffer_.size() - begin_ < size) {
+                buffer_.resize(begin_ + size);
+            }
+        }
+
+        void frame_reader::set_lowat(uint32_t lowat)
+        {
+            lowat = std::min<uint32_t>(std::max<uint32_t>(lowat, 1), FRAME_LOWAT_MAX);
+            if (! is_tcp_ || lowat == lowat_) {
+                return;
+            }
+            if (setsockopt(fd_, SOL_SOCKET, SO_RCVLOWAT, &lowat, sizeof(lowat)) == 0) {
+                lowat_ = lowat;
+            }
+        }
+
+        int32_t frame_reader::read_frame(read_func_t read, uint64_t& budget)
+        {
+            while (true) {
+                int64_t size = frame_size();
+                if (size > 0) {
+                    const char* frame = buffer_.data() + begin_;
+                    begin_ += (uint32_t)size;
+                    scanned_ = 0;
+                    if (begin_ == end_) {
+                        begin_ = end_ = 0;
+                    }
+                    auto trace_ts = trace_begin();
+                    cb_(frame, (int32_t)size);
+                    trace_end(trace_ts, TRACE_PHASE::READ_CALLBACK, fd_, (int32_t)size);
+                    return 0;
+                }
+                if (size < 0) {
+                    cb_(nullptr, -1);
+                    return 0;
+                }
+                uint64_t needed = needed_size();
+                if (spec_.delimiter_size_ > 0) {
+                    // a delimiter may start in the last bytes and end in the next read
+                    uint32_t avail = end_ - begin_;
+                    scanned_ = avail >= spec_.delimiter_size_ ? avail - spec_.delimiter_size_ + 1 : 0;
+                }
+                if (budget == 0) {
+                    return FRAME_READ_THROTTLED;
+                }
+                reserve(needed);
+                ::iovec iov{ buffer_.data() + end_, std::min<uint64_t>(buffer_.size() - end_, budget) };
+                bool is_empty = false;
+                auto trace_ts = trace_begin();
+                auto ret = read(fd_, &iov, 1, is_empty);
+                trace_end(trace_ts, TRACE_PHASE::FD_READ, fd_, ret);
+                if (ret > 0) {
+                    end_ += ret;
+                    budget -= (uint64_t)ret;
+                    continue;
+                }
+                if (ret == 0 && is_empty) {
+                    // wake up when the missing bytes have arrived, any byte may end a delimited frame
+                    set_lowat(spec_.delimiter_size_ > 0 ? 1 : (uint32_t)(needed - (end_ - begin_)));
+                    return INT32_MAX;
+                }
+                cb_(nullptr, ret < 0 ? -1 : 0);
+                return 0;
+            }
+        }
+    }
+}
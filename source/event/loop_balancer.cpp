@@ -0,0 +1,56 @@
+/**
+ * @file loop_balancer.cpp
+ * @brief move connections from busy event loops to idle ones
+ * @author Liu Hua Jun
+ * @email wojiaoliuhuajun@126.com
+ * @license Use of this source code is governed by The GNU Affero General Public License Version 3
+ *          which can be found in the LICENSE file
+ */
+#include "../../include/common/platform_define.h"
+#ifdef EVENT_EPOLL_EXIST
+#include "../../include/event/loop_balancer.h"
+#include "../../include/util/util.h"
+
+namespace stable_infra {
+    namespace event {
+        loop_balancer::loop_balancer(const std::vector<std::shared_ptr<epoll>>& loops, double threshold, uint32_t max_move,
+                const std::function<void(fd_t, int32_t)>& migrated_cb)
+            : loops_(loops), last_stats_(loops.size()), utilization_(loops.size(), 0.0),
+              threshold_(threshold), max_move_(max_move), migrated_cb_(migrated_cb)
+        {
+        }
+
+        int32_t loop_balancer::rebalance()
+        {
+            if (loops_.size() < 2) {
+                return -1;
+            }
+            uint64_t now = stable_infra::util::monotonic_ns();
+            bool is_first = last_ns_ == 0;
+            uint64_t interval = now - last_ns_;
+            last_ns_ = now;
+            uint32_t hot = 0;
+            uint32_t cold = 0;
+            for (uint32_t i = 0; i < loops_.size(); ++i) {
+                load_stats stats;
+                loops_[i]->get_load_stats(stats);
+                uint64_t busy = stats.busy_ns_ - last_stats_[i].busy_ns_;
+                last_stats_[i] = stats;
+                utilization_[i] = interval > 0 ? (double)busy / interval : 0.0;
+                if (utilization_[i] > utilization_[hot]) {
+                    hot = i;
+                }
+                if (utilization_[i] < utilization_[cold]) {
+                    cold = i;
+                }
+            }
+            if (is_first || utilization_[hot] - utilization_[cold] < threshold_) {
+                return 0;
+            }
+            // move half of the difference, activity of fds stands for their share of busy time
+            double fraction = (utilization_[hot] - utilization_[cold]) / (2 * utilization_[hot]);
+            return loops_[hot]->shed_load(loops_[cold], fraction, max_move_, migrated_cb_) == 0 ? 1 : -1;
+        }
+    }
+}
+#endif
@@ -0,0 +1,144 @@
+/**
+ * @file loop_watchdog.cpp
+ * @brief report event loops stalled by slow callbacks
+ * @author Liu Hua Jun
+ * @email wojiaoliuhuajun@126.com
+ * @license Use of this source code is governed by The GNU Affero General Public License Version 3
+ *          which can be found in the LICENSE file
+ */
+#include "../../include/common/platform_define.h"
+#ifdef EVENT_EPOLL_EXIST
+#include <algorithm>
+#include <chrono>
+#include "../../include/event/loop_watchdog.h"
+#include "../../include/util/util.h"
+
+/// min period of checks
+#define MIN_CHECK_INTERVAL_NS 1000000ull
+
+namespace stable_infra {
+    namespace event {
+        loop_watchdog::loop_watchdog(const std::vector<std::shared_ptr<epoll>>& loops, uint64_t threshold_ns,
+                const stall_hook_t& hook)
+            : loops_(loops), states_(loops.size()), threshold_ns_(threshold_ns),
+              interval_ns_(std::max<uint64_t>(threshold_ns / 4, MIN_CHECK_INTERVAL_NS)), hook_(hook)
+        {
+        }
+
+        loop_watchdog::~loop_watchdog()
+        {
+            stop();
+        }
+
+        bool loop_watchdog::start()
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            if (is_running_ || loops_.empty() || threshold_ns_ == 0 || hook_ == nullptr) {
+                return false;
+            }
+            for (uint32_t i = 0; i < loops_.size(); ++i) {
+                if (loops_[i] == nullptr || loops_[i]->set_callback_watch(true) != 0) {
+                    for (uint32_t j = 0; j < i; ++j) {
+                        loops_[j]->set_callback_watch(false);
+                    }
+                    return false;
+                }
+            }
+            uint64_t now = stable_infra::util::monotonic_ns();
+            for (uint32_t i = 0; i < loops_.size(); ++i) {
+                load_stats stats;
+                loops_[i]->get_load_stats(stats);
+                states_[i] = loop_state();
+                states_[i].iteration_cnt_ = stats.iteration_cnt_;
+                states_[i].since_ns_ = now;
+                states_[i].stall_.loop_idx_ = i;
+            }
+            is_running_ = true;
+            thread_ = std::thread([this]() { run(); });
+            return true;
+        }
+
+        void loop_watchdog::stop()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mtx_);
+                if (! is_running_) {
+                    return;
+                }
+                is_running_ = false;
+            }
+            cv_.notify_all();
+            if (thread_.joinable()) {
+                thread_.join();
+            }
+            for (auto& loop : loops_) {
+                loop->set_callback_watch(false);
+            }
+        }
+
+        void loop_watchdog::run()
+        {
+            std::unique_lock<std::mutex> lock(mtx_);
+            while (is_running_) {
+                cv_.wait_for(lock, std::chrono::nanoseconds(interval_ns_));
+                if (! is_running_) {
+                    break;
+                }
+                // the hook may be slow, stop() must not wait for it
+                lock.unlock();
+                uint64_t now = stable_infra::util::monotonic_ns();
+                for (uint32_t i = 0; i < loops_.size(); ++i) {
+                    check(i, now);
+                }
+                lock.lock();
+            }
+        }
+
+        void loop_watchdog::check(uint32_t idx, uint64_t now)
+        {
+            auto& loop = loops_[idx];
+            auto& state = states_[idx];
+            load_stats stats;
+            loop->get_load_stats(stats);
+            uint64_t running = loop->get_running_callback();
+            if (stats.iteration_cnt_ != state.iteration_cnt_ || running != state.running_) {
+                if (state.is_stalled_) {
+                    state.stall_.elapsed_ns_ = now - state.since_ns_;
+                    state.stall_.is_recovered_ = true;
+                    hook_(state.stall_);
+                }
+                state.iteration_cnt_ = stats.iteration_cnt_;
+                state.running_ = running;
+                state.since_ns_ = now;
+                state.is_probed_ = false;
+                state.is_stalled_ = false;
+                return;
+            }
+            if (state.is_stalled_) {
+                return;
+            }
+            if (running == 0 && ! state.is_probed_) {
+                // maybe idle in epoll_wait, a woken loop moves at once
+                if (now - state.since_ns_ >= threshold_ns_ / 2) {
+                    loop->post([]() {});
+                    state.is_probed_ = true;
+                    state.since_ns_ = now;
+                }
+                return;
+            }
+            if (now - state.since_ns_ < threshold_ns_) {
+                return;
+            }
+            state.is_stalled_ = true;
+            auto& stall = state.stall_;
+            stall.fd_ = running == 0 ? INVALID_FD : (fd_t)(uint32_t)running;
+            stall.phase_ = running == 0 ? TRACE_PHASE::READ_CALLBACK : (TRACE_PHASE)(running >> 32);
+            stall.elapsed_ns_ = now - state.since_ns_;
+            stall.iteration_cnt_ = state.iteration_cnt_;
+            stall.is_recovered_ = false;
+            stall_cnt_.fetch_add(1, std::memory_order_relaxed);
+            hook_(stall);
+        }
+    }
+}
+#endif
@@ -0,0 +1,427 @@
+/****************************************************************************************
+ * @file shm_channel.cpp
+ * @brief shared memory message channel between co-located processes
+ * @author Liu Hua Jun
+ * @email wojiaoliuhuajun@126.com
+ * @license Use of this source code is governed by The GNU Affero General Public License Version 3
+ *          which can be found in the LICENSE file
+ ***************************************************************************************/
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstring>
+#include <new>
+#include "../../include/event/shm_channel.h"
+#include "../../include/util/macros_func.h"
+#include "../../include/common/err_no.h"
+
+/// magic number of shared memory header
+#define SHM_MAGIC 0x53484d4348414e31ULL
+
+/// record length which means the rest of ring is skipped
+#define SHM_WRAP_MARK 0xFFFFFFFFu
+
+/// min bytes of each ring
+#define SHM_MIN_CAPACITY 4096
+
+namespace stable_infra {
+    namespace event {
+        static inline uint32_t record_size(uint32_t len)
+        {
+            return (sizeof(uint32_t) + len + 7) & ~7u;
+        }
+
+        static inline uint32_t iov_total(const ::iovec* iov, uint32_t iov_cnt)
+        {
+            uint64_t total = 0;
+            for (uint32_t i = 0; i < iov_cnt; ++i) {
+                total += iov[i].iov_len;
+            }
+            return total > UINT32_MAX ? UINT32_MAX : (uint32_t)total;
+        }
+
+        shm_channel::shm_channel(const std::shared_ptr<poll_base>& poll)
+            : poll_(poll)
+        {
+        }
+
+        shm_channel::~shm_channel()
+        {
+            close();
+        }
+
+        int32_t shm_channel::create(uint32_t capacity)
+        {
+            STABLE_INFRA_CHECK_SUC(header_ == nullptr, RET_ERR);
+            uint32_t cap = SHM_MIN_CAPACITY;
+            while (cap < capacity && cap < (1u << 30)) {
+                cap <<= 1;
+            }
+            fd_t mem_fd = memfd_create("stable_event_shm", MFD_CLOEXEC);
+            STABLE_INFRA_CHECK_SUC(mem_fd != INVALID_FD, RET_ERR);
+            if (ftruncate(mem_fd, PAGE_SIZE + 2 * (off_t)cap) != 0) {
+                STABLE_INFRA_SAFE_CLOSE_FD(mem_fd);
+                return RET_ERR;
+            }
+            notify_fds_[0] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            notify_fds_[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (notify_fds_[0] == INVALID_FD || notify_fds_[1] == INVALID_FD
+                || map(mem_fd, cap, true) != RET_SUC) {
+                STABLE_INFRA_SAFE_CLOSE_FD(mem_fd);
+                close();
+                return RET_ERR;
+            }
+            side_ = 0;
+            return watch();
+        }
+
+        int32_t shm_channel::attach(fd_t mem_fd, fd_t notify_fd0, fd_t notify_fd1)
+        {
+            STABLE_INFRA_CHECK_SUC(header_ == nullptr, RET_ERR);
+            struct stat st;
+            if (fstat(mem_fd, &st) != 0 || st.st_size <= PAGE_SIZE) {
+                return RET_ERR;
+            }
+            uint32_t cap = (uint32_t)((st.st_size - PAGE_SIZE) / 2);
+            // positions are masked by capacity
+            STABLE_INFRA_CHECK_SUC(cap >= SHM_MIN_CAPACITY && (cap & (cap - 1)) == 0, RET_ERR);
+            STABLE_INFRA_CHECK_SUC(map(mem_fd, cap, false) == RET_SUC, RET_ERR);
+            if (header_->magic_ != SHM_MAGIC || header_->capacity_ != cap) {
+                munmap(header_, map_size_);
+                header_ = nullptr;
+                mem_fd_ = INVALID_FD;
+                capacity_ = 0;
+                return RET_ERR;
+            }
+            notify_fds_[0] = notify_fd0;
+            notify_fds_[1] = notify_fd1;
+            side_ = 1;
+            return watch();
+        }
+
+        void shm_channel::get_fds(fd_t& mem_fd, fd_t& notify_fd0, fd_t& notify_fd1) const
+        {
+            mem_fd = mem_fd_;
+            notify_fd0 = notify_fds_[0];
+            notify_fd1 = notify_fds_[1];
+        }
+
+        int32_t shm_channel::map(fd_t mem_fd, uint32_t capacity, bool is_creator)
+        {
+            map_size_ = PAGE_SIZE + 2 * (size_t)capacity;
+            void* addr = mmap(nullptr, map_size_, PROT_READ | PROT_WRITE, MAP_SHARED, mem_fd, 0);
+            STABLE_INFRA_CHECK_SUC(addr != MAP_FAILED, RET_ERR);
+            static_assert(sizeof(shm_header) <= PAGE_SIZE, "shm_header must fit in one page");
+            if (is_creator) {
+                header_ = new (addr) shm_header();
+                header_->capacity_ = capacity;
+                header_->closed_.store(0, std::memory_order_relaxed);
+                for (auto& ring : header_->rings_) {
+                    ring.head_.store(0, std::memory_order_relaxed);
+                    ring.tail_.store(0, std::memory_order_relaxed);
+                    ring.consumer_waiting_.store(0, std::memory_order_relaxed);
+                    ring.producer_waiting_.store(0, std::memory_order_relaxed);
+                }
+                header_->magic_ = SHM_MAGIC;
+            } else {
+                header_ = (shm_header*)addr;
+            }
+            mem_fd_ = mem_fd;
+            // the peer can write the header, sizes and positions are checked against this copy
+            capacity_ = capacity;
+            return RET_SUC;
+        }
+
+        int32_t shm_channel::watch()
+        {
+            char* data = (char*)header_ + PAGE_SIZE;
+            tx_ = &header_->rings_[side_];
+            rx_ = &header_->rings_[1 - side_];
+            tx_data_ = data + side_ * capacity_;
+            rx_data_ = data + (1 - side_) * capacity_;
+            cached_tx_tail_ = tx_->tail_.load(std::memory_order_acquire);
+            cached_rx_head_ = rx_->head_.load(std::memory_order_acquire);
+            notify_iov_.iov_base = &notify_value_;
+            notify_iov_.iov_len = sizeof(notify_value_);
+            auto fd = notify_fds_[side_];
+            if (poll_->adopt_fd(fd, FD_TYPE::GENERAL_FD) != 0
+                || poll_->submit_async_read(fd, &notify_iov_, 1, [this](int32_t ret) { on_notify(ret); }) != 0) {
+                close();
+                return RET_ERR;
+            }
+            return RET_SUC;
+        }
+
+        void shm_channel::notify(uint32_t side)
+        {
+            uint64_t value = 1;
+            auto ret = ::write(notify_fds_[side], &value, sizeof(value));
+            (void)ret;
+        }
+
+        void shm_channel::notify_self()
+        {
+            // one eventfd write covers every submission until on_notify runs, i.e. once per loop iteration
+            STABLE_INFRA_IF_TRUE_RETURN(is_self_notified_);
+            is_self_notified_ = true;
+            notify(side_);
+        }
+
+        bool shm_channel::rx_has_data()
+        {
+            cached_rx_head_ = rx_->head_.load(std::memory_order_acquire);
+            return cached_rx_head_ != rx_->tail_.load(std::memory_order_relaxed);
+        }
+
+        bool shm_channel::tx_has_space(uint32_t len)
+        {
+            // a record may need the rest of ring as wrap padding, so require double size
+            cached_tx_tail_ = tx_->tail_.load(std::memory_order_acquire);
+            auto used = tx_->head_.load(std::memory_order_relaxed) - cached_tx_tail_;
+            return capacity_ - used >= 2 * (uint64_t)record_size(len);
+        }
+
+        bool shm_channel::try_write(request& req)
+        {
+            auto cap = capacity_;
+            auto len = iov_total(req.buffer_, req.buffer_iov_cnt_);
+            auto rec = record_size(len);
+            auto head = tx_->head_.load(std::memory_order_relaxed);
+            uint32_t pos = head & (cap - 1);
+            uint32_t contiguous = cap - pos;
+            uint64_t need = contiguous < rec ? (uint64_t)contiguous + rec : rec;
+            if (cap - (head - cached_tx_tail_) < need) {
+                cached_tx_tail_ = tx_->tail_.load(std::memory_order_acquire);
+                STABLE_INFRA_CHECK_SUC(cap - (head - cached_tx_tail_) >= need, false);
+            }
+            if (contiguous < rec) {
+                *(uint32_t*)(tx_data_ + pos) = SHM_WRAP_MARK;
+                head += contiguous;
+                pos = 0;
+            }
+            *(uint32_t*)(tx_data_ + pos) = len;
+            char* dst = tx_data_ + pos + sizeof(uint32_t);
+            for (uint32_t i = 0; i < req.buffer_iov_cnt_; ++i) {
+                memcpy(dst, req.buffer_[i].iov_base, req.buffer_[i].iov_len);
+                dst += req.buffer_[i].iov_len;
+            }
+            tx_->head_.store(head + rec, std::memory_order_release);
+            // pairs with the fence in process(), consumer either sees the data or is notified
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (tx_->consumer_waiting_.load(std::memory_order_relaxed) != 0
+                && tx_->consumer_waiting_.exchange(0) != 0) {
+                notify(1 - side_);
+            }
+            return true;
+        }
+
+        bool shm_channel::try_read(request& req, int32_t& ret)
+        {
+            auto cap = capacity_;
+            auto tail = rx_->tail_.load(std::memory_order_relaxed);
+            uint32_t len = 0;
+            uint32_t pos = 0;
+            while (true) {
+                if (tail == cached_rx_head_) {
+                    cached_rx_head_ = rx_->head_.load(std::memory_order_acquire);
+                    STABLE_INFRA_CHECK_SUC(tail != cached_rx_head_, false);
+                }
+                pos = tail & (cap - 1);
+                // records are 8 bytes aligned and never cross the end of ring
+                if (cached_rx_head_ - tail > cap || (pos & 7) != 0) {
+                    is_corrupted_ = true;
+                    return false;
+                }
+                len = *(uint32_t*)(rx_data_ + pos);
+                if (len != SHM_WRAP_MARK) {
+                    break;
+                }
+                tail += cap - pos;
+            }
+            if (len > cap - pos - sizeof(uint32_t) || cached_rx_head_ - tail < record_size(len)) {
+                is_corrupted_ = true;
+                return false;
+            }
+            if (len > iov_total(req.buffer_, req.buffer_iov_cnt_)) {
+                // the message stays in ring for a read with a larger buffer
+                error_no = MSG_TOO_LARGE;
+                ret = -1;
+                return true;
+            }
+            const char* src = rx_data_ + pos + sizeof(uint32_t);
+            uint32_t left = len;
+            for (uint32_t i = 0; i < req.buffer_iov_cnt_ && left > 0; ++i) {
+                auto n = std::min<uint32_t>(left, req.buffer_[i].iov_len);
+                memcpy(req.buffer_[i].iov_base, src, n);
+                src += n;
+                left -= n;
+            }
+            ret = (int32_t)len;
+            rx_->tail_.store(tail + record_size(len), std::memory_order_release);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (rx_->producer_waiting_.load(std::memory_order_relaxed) != 0
+                && rx_->producer_waiting_.exchange(0) != 0) {
+                notify(1 - side_);
+            }
+            return true;
+        }
+
+        int32_t shm_channel::submit_async_read(::iovec* buffer, uint32_t buffer_iov_cnt, const callback_t& cb)
+        {
+            STABLE_INFRA_CHECK_SUC(header_ != nullptr && cb != nullptr, RET_ERR);
+            request req{ buffer, buffer_iov_cnt, cb };
+            pending_reads_.push_back(req);
+            if (! is_processing_) {
+                // completions are always invoked from poll, never inside submitting
+                notify_self();
+            }
+            return RET_SUC;
+        }
+
+        int32_t shm_channel::submit_async_write(::iovec* buffer, uint32_t buffer_iov_cnt, const callback_t& cb)
+        {
+            STABLE_INFRA_CHECK_SUC(header_ != nullptr, RET_ERR);
+            request req{ buffer, buffer_iov_cnt, cb };
+            auto len = iov_total(buffer, buffer_iov_cnt);
+            STABLE_INFRA_CHECK_SUC(len <= max_msg_size(), RET_ERR);
+            if (pending_writes_.empty() && header_->closed_.load(std::memory_order_relaxed) == 0 && try_write(req)) {
+                // data is visible to peer now, only the completion is deferred
+                completed_writes_.emplace_back(cb, (int32_t)len);
+            } else {
+                pending_writes_.push_back(req);
+            }
+            if (! is_processing_) {
+                notify_self();
+            }
+            return RET_SUC;
+        }
+
+        void shm_channel::on_notify(int32_t ret)
+        {
+            is_self_notified_ = false;
+            process();
+            if (header_ != nullptr) {
+                poll_->submit_async_read(notify_fds_[side_], &notify_iov_, 1, nullptr);
+            }
+        }
+
+        void shm_channel::process()
+        {
+            STABLE_INFRA_IF_TRUE_RETURN(is_processing_ || header_ == nullptr);
+            is_processing_ = true;
+            std::vector<std::pair<callback_t, int32_t>> completed;
+            bool again = true;
+            while (again && header_ != nullptr) {
+                again = false;
+                completed.swap(completed_writes_);
+                for (auto& c : completed) {
+                    if (c.first != nullptr) {
+                        c.first(c.second);
+                    }
+                }
+                completed.clear();
+                int32_t ret = 0;
+                while (! pending_reads_.empty() && header_ != nullptr && try_read(pending_reads_.front(), ret)) {
+                    auto cb = std::move(pending_reads_.front().cb_);
+                    pending_reads_.pop_front();
+                    cb(ret);
+                }
+                while (! pending_writes_.empty() && header_ != nullptr && try_write(pending_writes_.front())) {
+                    auto& req = pending_writes_.front();
+                    auto len = iov_total(req.buffer_, req.buffer_iov_cnt_);
+                    auto cb = std::move(req.cb_);
+                    pending_writes_.pop_front();
+                    if (cb != nullptr) {
+                        cb((int32_t)len);
+                    }
+                }
+                if (header_ == nullptr) {
+                    // closed by a callback
+                    break;
+                }
+                if (is_corrupted_) {
+                    // the peer wrote a record out of ring, nothing after it can be trusted
+                    close();
+                    break;
+                }
+                if (header_->closed_.load(std::memory_order_acquire) != 0) {
+                    // peer closed, data already in ring has been delivered above
+                    while (! pending_reads_.empty()) {
+                        auto cb = std::move(pending_reads_.front().cb_);
+                        pending_reads_.pop_front();
+                        cb(0);
+                    }
+                    while (! pending_writes_.empty()) {
+                        auto cb = std::move(pending_writes_.front().cb_);
+                        pending_writes_.pop_front();
+                        if (cb != nullptr) {
+                            cb(-1);
+                        }
+                    }
+                    break;
+                }
+                // declare waiting, then check again so that no notification is lost
+                if (! pending_reads_.empty()) {
+                    rx_->consumer_waiting_.store(1, std::memory_order_relaxed);
+                    std::atomic_thread_fence(std::memory_order_seq_cst);
+                    if (rx_has_data()) {
+                        rx_->consumer_waiting_.store(0, std::memory_order_relaxed);
+                        again = true;
+                    }
+                }
+                if (! pending_writes_.empty()) {
+                    auto& req = pending_writes_.front();
+                    tx_->producer_waiting_.store(1, std::memory_order_relaxed);
+                    std::atomic_thread_fence(std::memory_order_seq_cst);
+                    if (tx_has_space(iov_total(req.buffer_, req.buffer_iov_cnt_))) {
+                        tx_->producer_waiting_.store(0, std::memory_order_relaxed);
+                        again = true;
+                    }
+                }
+                again = again || ! completed_writes_.empty();
+            }
+            is_processing_ = false;
+        }
+
+        void shm_channel::close()
+        {
+            if (header_ != nullptr) {
+                header_->closed_.store(1, std::memory_order_release);
+                notify(1 - side_);
+                munmap(header_, map_size_);
+                header_ = nullptr;
+                // the queued read of notify fd points at this channel, drop it before the fd number can be reused
+                poll_->remove_fd(notify_fds_[side_]);
+            }
+            STABLE_INFRA_SAFE_CLOSE_FD(mem_fd_);
+            STABLE_INFRA_SAFE_CLOSE_FD(notify_fds_[0]);
+            STABLE_INFRA_SAFE_CLOSE_FD(notify_fds_[1]);
+            tx_ = nullptr;
+            rx_ = nullptr;
+            capacity_ = 0;
+            is_self_notified_ = false;
+            is_corrupted_ = false;
+            // no completion comes from poll any more, callbacks may submit again and get RET_ERR
+            std::vector<std::pair<callback_t, int32_t>> completed;
+            completed.swap(completed_writes_);
+            std::deque<request> reads;
+            reads.swap(pending_reads_);
+            std::deque<request> writes;
+            writes.swap(pending_writes_);
+            for (auto& c : completed) {
+                if (c.first != nullptr) {
+                    c.first(c.second);
+                }
+            }
+            for (auto& req : reads) {
+                req.cb_(-1);
+            }
+            for (auto& req : writes) {
+                if (req.cb_ != nullptr) {
+                    req.cb_(-1);
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,45 @@
+/****************************************************************************************
+ * @file udp_session_table.cpp
+ * @brief demultiplex datagrams of a connectionless udp socket to peer sessions
+ * @author Liu Hua Jun
+ * @email wojiaoliuhuajun@126.com
+ * @license Use of this source code is governed by The GNU Affero General Public License Version 3
+ *          which can be found in the LICENSE file
+ ***************************************************************************************/
+#include <string.h>
+#include "../../include/event/udp_session_table.h"
+#include "../../include/event/fd_io_operation.h"
+
+namespace stable_infra {
+    namespace event {
+        udp_recv_batch::udp_recv_batch(uint32_t batch_cnt, uint32_t datagram_size)
+            : datagram_size_(datagram_size),
+            buffer_((size_t)batch_cnt * datagram_size),
+            iovs_(batch_cnt),
+            addrs_(batch_cnt),
+            msgs_(batch_cnt)
+        {
+            STABLE_INFRA_ASSERT(batch_cnt > 0 && datagram_size > 0);
+            memset(msgs_.data(), 0, sizeof(::mmsghdr) * batch_cnt);
+            for (uint32_t i = 0; i < batch_cnt; ++i) {
+                iovs_[i].iov_base = buffer_.data() + (size_t)i * datagram_size;
+                iovs_[i].iov_len = datagram_size;
+                msgs_[i].msg_hdr.msg_iov = &iovs_[i];
+                msgs_[i].msg_hdr.msg_iovlen = 1;
+                msgs_[i].msg_hdr.msg_name = &addrs_[i];
+            }
+        }
+
+        int32_t udp_recv_batch::recv(fd_t fd, bool& is_empty)
+        {
+            // recvmmsg writes back name length and flags, reset them for every batch
+            for (auto& m : msgs_) {
+                m.msg_hdr.msg_namelen = sizeof(::sockaddr_storage);
+                m.msg_hdr.msg_flags = 0;
+            }
+            auto ret = fd_io_operation<FD_TYPE_UDP>::recv_batch(fd, msgs_.data(), (uint32_t)msgs_.size(), is_empty);
+            cnt_ = ret > 0 ? (uint32_t)ret : 0;
+            return ret;
+        }
+    }
+}
@@ -0,0 +1,511 @@
+/****************************************************************************************
+ * @file async_logger.cpp
+ * @brief asynchronous logger, callers only format into a per thread ring
+ * @author Liu Hua Jun
+ * @email wojiaoliuhuajun@126.com
+ * @license Use of this source code is governed by The GNU Affero General Public License Version 3
+ *          which can be found in the LICENSE file
+ ***************************************************************************************/
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/syscall.h>
+#include <new>
+#include <chrono>
+#include <algorithm>
+#include "../../include/log/async_logger.h"
+#include "../../include/util/util.h"
+
+/// iovec count of one writev
+#define LOG_WRITE_IOV_CNT 512
+
+/// bytes of prefix of one record
+#define LOG_PREFIX_MAX 160
+
+namespace stable_infra {
+    namespace log {
+        static const char* level_names[] = { "DEBUG", "INFO ", "WARN ", "ERROR", "OFF  " };
+
+        /**
+         * @brief hold ring of a thread, mark it orphan when thread exits
+         */
+        struct ring_holder
+        {
+            std::shared_ptr<log_ring> ring_{ nullptr };
+            ~ring_holder()
+            {
+                if (ring_ != nullptr) {
+                    ring_->set_orphan();
+                }
+            }
+        };
+        static thread_local ring_holder tls_ring_holder;
+
+        thread_local log_ring* async_logger::tls_ring_ = nullptr;
+
+        log_ring::log_ring(uint32_t slot_cnt, int32_t tid)
+            : tid_(tid)
+        {
+            uint64_t cnt = 2;
+            while (cnt < slot_cnt) {
+                cnt <<= 1;
+            }
+            mask_ = cnt - 1;
+            slots_.resize(cnt);
+        }
+
+        void* log_ring::operator new(std::size_t size)
+        {
+            void* ptr = nullptr;
+            if (posix_memalign(&ptr, ALIGN_SIZE, size) != 0) {
+                throw std::bad_alloc();
+            }
+            return ptr;
+        }
+
+        void log_ring::operator delete(void* ptr)
+        {
+            free(ptr);
+        }
+
+        void log_arg_encoder::put_string(const char* v, size_t len)
+        {
+            if (is_full_ || pos_ + 1 + sizeof(uint16_t) >= size_) {
+                is_full_ = true;
+                return;
+            }
+            // a long string is truncated to the rest of payload
+            uint16_t n = (uint16_t)std::min<size_t>(len, size_ - pos_ - 1 - sizeof(uint16_t));
+            buffer_[pos_] = (char)LOG_ARG::STR;
+            memcpy(buffer_ + pos_ + 1, &n, sizeof(n));
+            memcpy(buffer_ + pos_ + 1 + sizeof(n), v, n);
+            pos_ += 1 + sizeof(n) + n;
+        }
+
+        async_logger& async_logger::instance()
+        {
+            static async_logger logger;
+            return logger;
+        }
+
+        async_logger::async_logger()
+        {
+            memset(cached_time_, 0, sizeof(cached_time_));
+        }
+
+        async_logger::~async_logger()
+        {
+            stop();
+        }
+
+        int32_t async_logger::init(const log_config& config)
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            if (is_started_.load(std::memory_order_acquire) || is_stopped_.load(std::memory_order_acquire)) {
+                return -1;
+            }
+            if (! config.path_.empty()) {
+                int32_t fd = ::open(config.path_.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+                if (fd < 0) {
+                    return -1;
+                }
+                if (out_fd_ != 2) {
+                    ::close(out_fd_);
+                }
+                out_fd_ = fd;
+            }
+            config_ = config;
+            set_level(config.level_);
+            return 0;
+        }
+
+        void async_logger::stop()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mtx_);
+                if (is_stopped_.exchange(true)) {
+                    return;
+                }
+                cv_.notify_all();
+            }
+            if (writer_.joinable()) {
+                writer_.join();
+            }
+            if (out_fd_ != 2) {
+                ::close(out_fd_);
+                out_fd_ = 2;
+            }
+        }
+
+        void async_logger::flush()
+        {
+            std::unique_lock<std::mutex> lock(mtx_);
+            if (! is_started_.load(std::memory_order_acquire) || is_stopped_.load(std::memory_order_acquire)) {
+                return;
+            }
+            uint64_t req = ++flush_req_;
+            cv_.notify_all();
+            flush_cv_.wait(lock, [this, req]() {
+                return flush_done_ >= req || is_stopped_.load(std::memory_order_acquire);
+            });
+        }
+
+        void async_logger::get_stats(log_stats& stats) const
+        {
+            stats.written_cnt_ = written_cnt_.load(std::memory_order_relaxed);
+            stats.dropped_cnt_ = dropped_cnt_.load(std::memory_order_relaxed);
+            stats.ring_cnt_ = ring_cnt_.load(std::memory_order_relaxed);
+        }
+
+        log_ring* async_logger::register_thread()
+        {
+            if (is_stopped_.load(std::memory_order_acquire)) {
+                return nullptr;
+            }
+            std::call_once(start_flag_, [this]() {
+                std::lock_guard<std::mutex> lock(mtx_);
+                text_.resize(LOG_WRITE_IOV_CNT * LOG_PREFIX_MAX + LOG_WRITE_IOV_CNT * LOG_LINE_MAX);
+                iov_.resize(LOG_WRITE_IOV_CNT);
+                is_started_.store(true, std::memory_order_release);
+                writer_ = std::thread(&async_logger::run, this);
+            });
+            std::shared_ptr<log_ring> ring(new log_ring(config_.ring_slot_cnt_, (int32_t)syscall(SYS_gettid)));
+            {
+                std::lock_guard<std::mutex> lock(mtx_);
+                new_rings_.push_back(ring);
+            }
+            ring_cnt_.fetch_add(1, std::memory_order_relaxed);
+            tls_ring_holder.ring_ = ring;
+            tls_ring_ = ring.get();
+            return tls_ring_;
+        }
+
+        void async_logger::fill_header(log_record* rec, LOG_LEVEL level, const char* file, uint32_t line, int64_t id)
+        {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            rec->ts_ns_ = (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+            rec->id_ = id;
+            rec->file_ = file;
+            rec->line_ = line;
+            rec->level_ = level;
+        }
+
+        void async_logger::log_text(LOG_LEVEL level, const char* file, uint32_t line, int64_t id, const char* fmt, ...)
+        {
+            log_ring* ring = local_ring();
+            if (STABLE_INFRA_UNLIKELY(ring == nullptr)) {
+                return;
+            }
+            log_record* rec = ring->claim();
+            if (STABLE_INFRA_UNLIKELY(rec == nullptr)) {
+                return;
+            }
+            fill_header(rec, level, file, line, id);
+            rec->fmt_ = nullptr;
+            rec->is_binary_ = false;
+            va_list args;
+            va_start(args, fmt);
+            int32_t len = vsnprintf(rec->payload_, sizeof(rec->payload_), fmt, args);
+            va_end(args);
+            // keep one byte for '\n', a long message is truncated
+            len = std::max(0, std::min(len, (int32_t)sizeof(rec->payload_) - 1));
+            rec->payload_[len] = '\n';
+            rec->size_ = (uint16_t)(len + 1);
+            ring->publish();
+        }
+
+        /**
+         * @brief decoded binary argument
+         */
+        struct log_arg
+        {
+            LOG_ARG tag_;
+            union {
+                int64_t i64_;
+                uint64_t u64_;
+                double dbl_;
+            };
+            const char* str_;
+            uint16_t len_;
+        };
+
+        /**
+         * @brief decode next argument
+         * @return false if there is no more argument
+         */
+        static bool next_arg(const char* buffer, uint32_t size, uint32_t& pos, log_arg& arg)
+        {
+            if (pos >= size) {
+                return false;
+            }
+            arg.tag_ = (LOG_ARG)buffer[pos];
+            if (arg.tag_ == LOG_ARG::STR) {
+                // a string printed by a numeric conversion is 0
+                arg.u64_ = 0;
+                memcpy(&arg.len_, buffer + pos + 1, sizeof(arg.len_));
+                arg.str_ = buffer + pos + 1 + sizeof(arg.len_);
+                pos += 1 + sizeof(arg.len_) + arg.len_;
+                return true;
+            }
+            memcpy(&arg.u64_, buffer + pos + 1, sizeof(arg.u64_));
+            pos += 1 + sizeof(arg.u64_);
+            return true;
+        }
+
+        size_t async_logger::format_binary(const log_record& rec, char* out, size_t cap)
+        {
+            if (cap == 0) {
+                return 0;
+            }
+            size_t len = 0;
+            uint32_t arg_pos = 0;
+            const char* p = rec.fmt_;
+            while (*p != '\0' && len + 1 < cap) {
+                if (*p != '%') {
+                    out[len++] = *p++;
+                    continue;
+                }
+                if (p[1] == '%') {
+                    out[len++] = '%';
+                    p += 2;
+                    continue;
+                }
+                // flags, width and precision are kept, length modifier is replaced by argument type
+                char spec[32];
+                size_t spec_len = 0;
+                spec[spec_len++] = *p++;
+                while (*p != '\0' && strchr("-+ #0123456789.", *p) != nullptr) {
+                    if (spec_len < sizeof(spec) - 4) {
+                        spec[spec_len++] = *p;
+                    }
+                    ++p;
+                }
+                while (*p != '\0' && strchr("hlLqjzt", *p) != nullptr) {
+                    ++p;
+                }
+                char conv = *p;
+                if (conv == '\0') {
+                    break;
+                }
+                ++p;
+                log_arg arg;
+                if (! next_arg(rec.payload_, rec.size_, arg_pos, arg)) {
+                    // missing or dropped argument
+                    out[len++] = '?';
+                    continue;
+                }
+                int32_t n = 0;
+                char* dst = out + len;
+                size_t room = cap - len;
+                switch (conv) {
+                    case 'd':
+                    case 'i':
+                    case 'u':
+                    case 'o':
+                    case 'x':
+                    case 'X':
+                    case 'c':
+                        {
+                            if (conv != 'c') {
+                                spec[spec_len++] = 'l';
+                                spec[spec_len++] = 'l';
+                            }
+                            spec[spec_len++] = conv;
+                            spec[spec_len] = '\0';
+                            long long v = arg.tag_ == LOG_ARG::DBL ? (long long)arg.dbl_ : (long long)arg.i64_;
+                            n = conv == 'c' ? snprintf(dst, room, spec, (int)v) : snprintf(dst, room, spec, v);
+                            break;
+                        }
+                    case 'f':
+                    case 'F':
+                    case 'e':
+                    case 'E':
+                    case 'g':
+                    case 'G':
+                    case 'a':
+                    case 'A':
+                        {
+                            spec[spec_len++] = conv;
+                            spec[spec_len] = '\0';
+                            double v = arg.tag_ == LOG_ARG::DBL ? arg.dbl_
+                                : (arg.tag_ == LOG_ARG::I64 ? (double)arg.i64_ : (double)arg.u64_);
+                            n = snprintf(dst, room, spec, v);
+                            break;
+                        }
+                    case 's':
+                        {
+                            if (arg.tag_ != LOG_ARG::STR) {
+                                n = snprintf(dst, room, "?");
+                                break;
+                            }
+                            // strings in payload are not terminated
+                            char str[LOG_SLOT_SIZE];
+                            memcpy(str, arg.str_, arg.len_);
+                            str[arg.len_] = '\0';
+                            spec[spec_len++] = 's';
+                            spec[spec_len] = '\0';
+                            n = snprintf(dst, room, spec, str);
+                            break;
+                        }
+                    case 'p':
+                        {
+                            spec[spec_len++] = 'p';
+                            spec[spec_len] = '\0';
+                            n = snprintf(dst, room, spec, (void*)(uintptr_t)arg.u64_);
+                            break;
+                        }
+                    default:
+                        {
+                            n = snprintf(dst, room, "?");
+                            break;
+                        }
+                }
+                if (n > 0) {
+                    len += std::min<size_t>((size_t)n, room - 1);
+                }
+            }
+            out[len] = '\0';
+            return len;
+        }
+
+        size_t async_logger::format_prefix(const log_record& rec, int32_t tid, char* out, size_t cap)
+        {
+            uint64_t sec = rec.ts_ns_ / 1000000000ull;
+            if (sec != cached_sec_) {
+                // localtime_r once a second
+                time_t t = (time_t)sec;
+                struct tm tm_val;
+                localtime_r(&t, &tm_val);
+                strftime(cached_time_, sizeof(cached_time_), "%Y-%m-%d %H:%M:%S", &tm_val);
+                cached_sec_ = sec;
+            }
+            const char* file = strrchr(rec.file_, '/');
+            file = file != nullptr ? file + 1 : rec.file_;
+            uint32_t level = std::min<uint32_t>((uint32_t)rec.level_, (uint32_t)LOG_LEVEL::OFF);
+            int32_t n = snprintf(out, cap, "%s.%06u %s %d %s:%u [%lld] ", cached_time_,
+                    (uint32_t)(rec.ts_ns_ % 1000000000ull / 1000), level_names[level], tid, file, rec.line_,
+                    (long long)rec.id_);
+            return n < 0 ? 0 : std::min<size_t>((size_t)n, cap - 1);
+        }
+
+        void async_logger::write_all(::iovec* iov, uint32_t iov_cnt)
+        {
+            while (iov_cnt > 0) {
+                ssize_t n = ::writev(out_fd_, iov, (int)iov_cnt);
+                if (n < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    // output is broken, the records are discarded
+                    return;
+                }
+                if (stable_infra::util::move_iov(iov, iov_cnt, (uint32_t)n) != 0) {
+                    return;
+                }
+            }
+        }
+
+        uint64_t async_logger::drain_ring(log_ring& ring)
+        {
+            uint64_t begin = ring.readable_begin();
+            uint64_t end = ring.readable_end();
+            uint32_t iov_cnt = 0;
+            size_t text_len = 0;
+            uint64_t dropped = ring.get_dropped_cnt();
+            if (dropped != ring.reported_dropped_cnt_) {
+                int32_t n = snprintf(text_.data(), LOG_PREFIX_MAX, "%s %d dropped %llu log records\n",
+                        level_names[(uint32_t)LOG_LEVEL::WARN], ring.get_tid(),
+                        (unsigned long long)(dropped - ring.reported_dropped_cnt_));
+                n = std::max(0, std::min(n, LOG_PREFIX_MAX - 1));
+                iov_[iov_cnt++] = ::iovec{ text_.data(), (size_t)n };
+                text_len += n;
+                dropped_cnt_.fetch_add(dropped - ring.reported_dropped_cnt_, std::memory_order_relaxed);
+                ring.reported_dropped_cnt_ = dropped;
+            }
+            uint64_t written = 0;
+            while (begin < end || iov_cnt > 0) {
+                uint64_t batch_begin = begin;
+                for (; begin < end && iov_cnt + 2 <= LOG_WRITE_IOV_CNT; ++begin) {
+                    const log_record& rec = ring.at(begin);
+                    char* prefix = text_.data() + text_len;
+                    size_t prefix_len = format_prefix(rec, ring.get_tid(), prefix, LOG_PREFIX_MAX);
+                    text_len += prefix_len;
+                    if (rec.is_binary_) {
+                        size_t body_len = format_binary(rec, text_.data() + text_len, LOG_LINE_MAX - 1);
+                        text_[text_len + body_len] = '\n';
+                        text_len += body_len + 1;
+                        iov_[iov_cnt++] = ::iovec{ prefix, prefix_len + body_len + 1 };
+                    } else {
+                        // text is written from the slot, it is released after writev
+                        iov_[iov_cnt++] = ::iovec{ prefix, prefix_len };
+                        iov_[iov_cnt++] = ::iovec{ const_cast<char*>(rec.payload_), rec.size_ };
+                    }
+                }
+                write_all(iov_.data(), iov_cnt);
+                written += begin - batch_begin;
+                ring.release(begin);
+                iov_cnt = 0;
+                text_len = 0;
+            }
+            return written;
+        }
+
+        uint64_t async_logger::drain()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mtx_);
+                if (! new_rings_.empty()) {
+                    rings_.insert(rings_.end(), new_rings_.begin(), new_rings_.end());
+                    new_rings_.clear();
+                }
+            }
+            uint64_t written = 0;
+            for (size_t i = 0; i < rings_.size();) {
+                // check orphan before draining, its owner published all records before exiting
+                bool is_orphan = rings_[i]->is_orphan();
+                written += drain_ring(*rings_[i]);
+                if (is_orphan) {
+                    rings_[i] = rings_.back();
+                    rings_.pop_back();
+                    ring_cnt_.fetch_sub(1, std::memory_order_relaxed);
+                    continue;
+                }
+                ++i;
+            }
+            written_cnt_.fetch_add(written, std::memory_order_relaxed);
+            return written;
+        }
+
+        void async_logger::run()
+        {
+            std::chrono::microseconds interval(std::max<uint32_t>(config_.flush_interval_us_, 1));
+            while (true) {
+                uint64_t req = 0;
+                bool is_stopped = false;
+                {
+                    std::unique_lock<std::mutex> lock(mtx_);
+                    cv_.wait_for(lock, interval, [this]() {
+                        return flush_req_ != flush_done_ || is_stopped_.load(std::memory_order_acquire);
+                    });
+                    req = flush_req_;
+                    is_stopped = is_stopped_.load(std::memory_order_acquire);
+                }
+                drain();
+                {
+                    std::lock_guard<std::mutex> lock(mtx_);
+                    flush_done_ = req;
+                }
+                flush_cv_.notify_all();
+                if (is_stopped) {
+                    break;
+                }
+            }
+        }
+    }
+}
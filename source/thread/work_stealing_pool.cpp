@@ -0,0 +1,220 @@
+/**
+ * @file work_stealing_pool.cpp
+ * @brief work stealing thread pool for cpu heavy works of event callbacks
+ * @author Liu Hua Jun
+ * @email wojiaoliuhuajun@126.com
+ * @license Use of this source code is governed by The GNU Affero General Public License Version 3
+ *          which can be found in the LICENSE file
+ */
+#include <stdlib.h>
+#include <chrono>
+#include <new>
+#include "../../include/thread/work_stealing_pool.h"
+
+/// rounds of yielding before an idle worker sleeps
+#define WORKER_SPIN_ROUNDS 64
+
+/// max sleep time of an idle worker, bounds latency of a missed notification
+#define WORKER_SLEEP_US 1000
+
+namespace stable_infra {
+    namespace thread {
+        /// pool of current worker thread, nullptr in other threads
+        static thread_local work_stealing_pool* current_pool = nullptr;
+        /// index of current worker thread
+        static thread_local uint32_t current_index = 0;
+
+        void* work_stealing_pool::worker::operator new(std::size_t size)
+        {
+            void* ptr = nullptr;
+            if (posix_memalign(&ptr, ALIGN_SIZE, size) != 0) {
+                throw std::bad_alloc();
+            }
+            return ptr;
+        }
+
+        void work_stealing_pool::worker::operator delete(void* ptr)
+        {
+            free(ptr);
+        }
+
+        work_stealing_pool::work_stealing_pool(uint32_t thread_cnt)
+            : thread_cnt_(thread_cnt)
+        {
+            if (thread_cnt_ == 0) {
+                thread_cnt_ = std::thread::hardware_concurrency();
+                if (thread_cnt_ == 0) {
+                    thread_cnt_ = 1;
+                }
+            }
+            for (uint32_t i = 0; i < thread_cnt_; ++i) {
+                workers_.emplace_back(new worker());
+                workers_.back()->rand_state_ = 0x9E3779B97F4A7C15ULL * (i + 1);
+            }
+        }
+
+        work_stealing_pool::~work_stealing_pool()
+        {
+            stop();
+            // works submitted while stopping
+            for (auto& w : workers_) {
+                work_t* work = nullptr;
+                while ((work = w->deque_.take()) != nullptr) {
+                    delete work;
+                }
+                while (w->inbox_.pop(work)) {
+                    delete work;
+                }
+            }
+        }
+
+        bool work_stealing_pool::start()
+        {
+            bool expected = false;
+            if (! running_.compare_exchange_strong(expected, true)) {
+                return false;
+            }
+            for (uint32_t i = 0; i < thread_cnt_; ++i) {
+                workers_[i]->thread_ = std::thread(&work_stealing_pool::run, this, i);
+            }
+            return true;
+        }
+
+        void work_stealing_pool::stop()
+        {
+            bool expected = true;
+            if (! running_.compare_exchange_strong(expected, false)) {
+                return;
+            }
+            {
+                std::lock_guard<std::mutex> lock(sleep_mtx_);
+                sleep_cv_.notify_all();
+            }
+            for (auto& w : workers_) {
+                if (w->thread_.joinable()) {
+                    w->thread_.join();
+                }
+            }
+        }
+
+        int32_t work_stealing_pool::submit(const work_t& work)
+        {
+            if (work == nullptr || ! running_.load(std::memory_order_acquire)) {
+                return -1;
+            }
+            work_t* item = new work_t(work);
+            if (current_pool == this) {
+                // spawned by a worker, keep it local for cache and let idle workers steal it
+                workers_[current_index]->deque_.push(item);
+            } else {
+                uint32_t index = next_inbox_.fetch_add(1, std::memory_order_relaxed) % thread_cnt_;
+                workers_[index]->inbox_.push(item);
+            }
+            wake_sleepers();
+            return 0;
+        }
+
+        int32_t work_stealing_pool::offload(const std::shared_ptr<stable_infra::event::poll_base>& loop, const work_t& work,
+                const stable_infra::event::pending_func& done)
+        {
+            if (loop == nullptr || work == nullptr) {
+                return -1;
+            }
+            std::shared_ptr<stable_infra::event::poll_base> origin = loop;
+            return submit([origin, work, done]() {
+                work();
+                if (done != nullptr) {
+                    origin->post(done);
+                }
+            });
+        }
+
+        void work_stealing_pool::wake_sleepers()
+        {
+            // pairs with the check of has_work under sleep_mtx_ in run
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (sleepers_.load(std::memory_order_relaxed) > 0) {
+                std::lock_guard<std::mutex> lock(sleep_mtx_);
+                // inbox can only be drained by its owner, so wake all of them
+                sleep_cv_.notify_all();
+            }
+        }
+
+        work_stealing_pool::work_t* work_stealing_pool::find_work(uint32_t index)
+        {
+            worker& self = *workers_[index];
+            work_t* work = self.deque_.take();
+            if (work != nullptr) {
+                return work;
+            }
+            while (self.inbox_.pop(work)) {
+                self.deque_.push(work);
+            }
+            work = self.deque_.take();
+            if (work != nullptr) {
+                return work;
+            }
+            // xorshift for a random first victim
+            self.rand_state_ ^= self.rand_state_ << 13;
+            self.rand_state_ ^= self.rand_state_ >> 7;
+            self.rand_state_ ^= self.rand_state_ << 17;
+            uint32_t start = static_cast<uint32_t>(self.rand_state_ % thread_cnt_);
+            for (uint32_t i = 0; i < thread_cnt_; ++i) {
+                uint32_t victim = (start + i) % thread_cnt_;
+                if (victim == index) {
+                    continue;
+                }
+                work = workers_[victim]->deque_.steal();
+                if (work != nullptr) {
+                    steal_cnt_.fetch_add(1, std::memory_order_relaxed);
+                    return work;
+                }
+            }
+            return nullptr;
+        }
+
+        bool work_stealing_pool::has_work(uint32_t index) const
+        {
+            if (! workers_[index]->inbox_.empty()) {
+                return true;
+            }
+            for (auto& w : workers_) {
+                if (w->deque_.size() > 0) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        void work_stealing_pool::run(uint32_t index)
+        {
+            current_pool = this;
+            current_index = index;
+            uint32_t idle_rounds = 0;
+            while (true) {
+                work_t* work = find_work(index);
+                if (work != nullptr) {
+                    (*work)();
+                    delete work;
+                    idle_rounds = 0;
+                    continue;
+                }
+                if (! running_.load(std::memory_order_acquire)) {
+                    break;
+                }
+                if (++idle_rounds < WORKER_SPIN_ROUNDS) {
+                    std::this_thread::yield();
+                    continue;
+                }
+                idle_rounds = 0;
+                std::unique_lock<std::mutex> lock(sleep_mtx_);
+                sleepers_.fetch_add(1, std::memory_order_seq_cst);
+                if (! has_work(index) && running_.load(std::memory_order_acquire)) {
+                    sleep_cv_.wait_for(lock, std::chrono::microseconds(WORKER_SLEEP_US));
+                }
+                sleepers_.fetch_sub(1, std::memory_order_relaxed);
+            }
+            current_pool = nullptr;
+        }
+    }
+}
@@ -0,0 +1,268 @@
+/****************************************************************************************
+ * @file delimiter_scanner.cpp
+ * @brief search of message delimiters with simd instructions selected at run time
+ * @author Liu Hua Jun
+ * @email wojiaoliuhuajun@126.com
+ * @license Use of this source code is governed by The GNU Affero General Public License Version 3
+ *          which can be found in the LICENSE file
+ ***************************************************************************************/
+#include <string.h>
+#include "../../include/util/delimiter_scanner.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+namespace stable_infra {
+    namespace util {
+        typedef const char* (*scan_func_t)(const char* p, size_t len, const char* d, uint32_t dl);
+
+        const char* find_delimiter_scalar(const char* data, size_t len, const char* delimiter, uint32_t delimiter_len)
+        {
+            if (len < delimiter_len) {
+                return nullptr;
+            }
+            const char* p = data;
+            const char* last = data + len - delimiter_len; // last possible start
+            while (p <= last) {
+                p = static_cast<const char*>(memchr(p, delimiter[0], last - p + 1));
+                if (p == nullptr) {
+                    return nullptr;
+                }
+                if (memcmp(p + 1, delimiter + 1, delimiter_len - 1) == 0) {
+                    return p;
+                }
+                ++p;
+            }
+            return nullptr;
+        }
+
+        /**
+         * @brief full compare of candidates at the set bits of mask, bit i is position p + i
+         */
+        static inline const char* verify(const char* p, uint32_t mask, const char* d, uint32_t dl)
+        {
+            // first and last bytes are already equal
+            if (dl <= 2) {
+                return p + __builtin_ctz(mask);
+            }
+            while (mask != 0) {
+                const char* candidate = p + __builtin_ctz(mask);
+                if (memcmp(candidate + 1, d + 1, dl - 2) == 0) {
+                    return candidate;
+                }
+                mask &= mask - 1;
+            }
+            return nullptr;
+        }
+
+#if defined(__x86_64__)
+        static const char* scan_sse2(const char* p, size_t len, const char* d, uint32_t dl)
+        {
+            const char* end = p + len;
+            if (len >= 16 + dl - 1) {
+                const __m128i first = _mm_set1_epi8(d[0]);
+                const __m128i last = _mm_set1_epi8(d[dl - 1]);
+                const char* stop = end - (dl - 1) - 16;
+                for (; p <= stop; p += 16) {
+                    __m128i head = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+                    __m128i tail = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + dl - 1));
+                    uint32_t mask = (uint32_t)_mm_movemask_epi8(
+                            _mm_and_si128(_mm_cmpeq_epi8(head, first), _mm_cmpeq_epi8(tail, last)));
+                    if (mask != 0) {
+                        const char* found = verify(p, mask, d, dl);
+                        if (found != nullptr) {
+                            return found;
+                        }
+                    }
+                }
+            }
+            return find_delimiter_scalar(p, end - p, d, dl);
+        }
+
+        __attribute__((target("avx2")))
+        static inline __m256i match_avx2(const char* p, uint32_t dl, __m256i first, __m256i last)
+        {
+            __m256i head = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+            __m256i tail = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + dl - 1));
+            return _mm256_and_si256(_mm256_cmpeq_epi8(head, first), _mm256_cmpeq_epi8(tail, last));
+        }
+
+        __attribute__((target("avx2")))
+        static const char* scan_avx2(const char* p, size_t len, const char* d, uint32_t dl)
+        {
+            const char* end = p + len;
+            if (len >= 32 + dl - 1) {
+                const __m256i first = _mm256_set1_epi8(d[0]);
+                const __m256i last = _mm256_set1_epi8(d[dl - 1]);
+                const char* stop = end - (dl - 1) - 32; // last start of a block
+                // short messages end in the first block
+                bool is_first = true;
+                while (p <= stop) {
+                    if (! is_first && p + 96 <= stop) {
+                        // skip 4 blocks at once while none holds the first byte of delimiter
+                        const __m256i* v = reinterpret_cast<const __m256i*>(p);
+                        __m256i any = _mm256_or_si256(
+                                _mm256_or_si256(_mm256_cmpeq_epi8(_mm256_loadu_si256(v), first),
+                                    _mm256_cmpeq_epi8(_mm256_loadu_si256(v + 1), first)),
+                                _mm256_or_si256(_mm256_cmpeq_epi8(_mm256_loadu_si256(v + 2), first),
+                                    _mm256_cmpeq_epi8(_mm256_loadu_si256(v + 3), first)));
+                        if (_mm256_testz_si256(any, any)) {
+                            p += 128;
+                            continue;
+                        }
+                    }
+                    uint32_t blocks = is_first ? 1 : 4;
+                    is_first = false;
+                    for (uint32_t i = 0; i < blocks && p <= stop; ++i, p += 32) {
+                        __m256i head = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+                        __m256i tail = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + dl - 1));
+                        uint32_t mask = (uint32_t)_mm256_movemask_epi8(
+                                _mm256_and_si256(_mm256_cmpeq_epi8(head, first), _mm256_cmpeq_epi8(tail, last)));
+                        if (mask != 0) {
+                            const char* found = verify(p, mask, d, dl);
+                            if (found != nullptr) {
+                                return found;
+                            }
+                        }
+                    }
+                }
+            }
+            // less than 32 positions are left
+            return scan_sse2(p, end - p, d, dl);
+        }
+
+        static scan_func_t select_impl(const char*& name)
+        {
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("avx2")) {
+                name = "avx2";
+                return &scan_avx2;
+            }
+            name = "sse2";
+            return &scan_sse2;
+        }
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+        static const char* scan_neon(const char* p, size_t len, const char* d, uint32_t dl)
+        {
+            const char* end = p + len;
+            if (len >= 16 + dl - 1) {
+                const uint8x16_t first = vdupq_n_u8((uint8_t)d[0]);
+                const uint8x16_t last = vdupq_n_u8((uint8_t)d[dl - 1]);
+                const char* stop = end - (dl - 1) - 16;
+                for (; p <= stop; p += 16) {
+                    uint8x16_t head = vld1q_u8(reinterpret_cast<const uint8_t*>(p));
+                    uint8x16_t tail = vld1q_u8(reinterpret_cast<const uint8_t*>(p + dl - 1));
+                    uint8x16_t eq = vandq_u8(vceqq_u8(head, first), vceqq_u8(tail, last));
+                    // narrowing shift leaves 4 bits per byte, there is no movemask on neon
+                    uint64_t nibbles = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+                    while (nibbles != 0) {
+                        const char* candidate = p + (__builtin_ctzll(nibbles) >> 2);
+                        if (dl <= 2 || memcmp(candidate + 1, d + 1, dl - 2) == 0) {
+                            return candidate;
+                        }
+                        nibbles &= ~(0xFull << ((candidate - p) * 4));
+                    }
+                }
+            }
+            return find_delimiter_scalar(p, end - p, d, dl);
+        }
+
+        static scan_func_t select_impl(const char*& name)
+        {
+            name = "neon";
+            return &scan_neon;
+        }
+#else
+        static scan_func_t select_impl(const char*& name)
+        {
+            name = "scalar";
+            return &find_delimiter_scalar;
+        }
+#endif
+
+        struct scan_impl
+        {
+            scan_impl() {
+                func_ = select_impl(name_);
+            }
+            scan_func_t func_;
+            const char* name_;
+        };
+
+        /**
+         * @brief chosen on first use, find_delimiter may be called by static initializers of other files
+         */
+        static const scan_impl& get_scan_impl()
+        {
+            static const scan_impl impl;
+            return impl;
+        }
+
+        const char* find_delimiter(const char* data, size_t len, const char* delimiter, uint32_t delimiter_len)
+        {
+            if (delimiter_len == 0 || delimiter_len > DELIMITER_MAX_SIZE) {
+                return nullptr;
+            }
+            return get_scan_impl().func_(data, len, delimiter, delimiter_len);
+        }
+
+        /**
+         * @brief if delimiter starts at byte pos of iov[idx] and continues into the following buffers
+         */
+        static bool match_across(const ::iovec* iov, uint32_t iov_cnt, uint32_t idx, size_t pos,
+                const char* d, uint32_t dl)
+        {
+            for (uint32_t i = 0; i < dl; ++i) {
+                while (pos >= iov[idx].iov_len) {
+                    pos -= iov[idx].iov_len;
+                    if (++idx == iov_cnt) {
+                        return false;
+                    }
+                }
+                if (static_cast<const char*>(iov[idx].iov_base)[pos] != d[i]) {
+                    return false;
+                }
+                ++pos;
+            }
+            return true;
+        }
+
+        int64_t find_delimiter(const ::iovec* iov, uint32_t iov_cnt, const char* delimiter, uint32_t delimiter_len,
+                uint64_t offset)
+        {
+            if (delimiter_len == 0 || delimiter_len > DELIMITER_MAX_SIZE) {
+                return -1;
+            }
+            auto scan = get_scan_impl().func_;
+            uint64_t base = 0; // offset of iov[i]
+            for (uint32_t i = 0; i < iov_cnt; base += iov[i].iov_len, ++i) {
+                size_t len = iov[i].iov_len;
+                if (base + len <= offset) {
+                    continue;
+                }
+                size_t begin = offset > base ? (size_t)(offset - base) : 0;
+                const char* seg = static_cast<const char*>(iov[i].iov_base);
+                const char* found = scan(seg + begin, len - begin, delimiter, delimiter_len);
+                if (found != nullptr) {
+                    return (int64_t)(base + (found - seg));
+                }
+                // delimiters crossing the end of this buffer start after any found inside it
+                size_t cross = len >= delimiter_len ? len - delimiter_len + 1 : 0;
+                for (size_t pos = cross > begin ? cross : begin; pos < len; ++pos) {
+                    if (match_across(iov, iov_cnt, i, pos, delimiter, delimiter_len)) {
+                        return (int64_t)(base + pos);
+                    }
+                }
+            }
+            return -1;
+        }
+
+        const char* delimiter_scanner_impl_name()
+        {
+            return get_scan_impl().name_;
+        }
+    }
+}
@@ -14,11 +14,16 @@
 #include <sys/stat.h>
 #include <dirent.h>
 #include <unistd.h>
+#include <netinet/in.h>
 #include <netinet/tcp.h>
 #endif
 #include <stdio.h>
 #include <chrono>
 #include "../../include/util/util.h"
+#include "../../include/common/err_no.h"
+#include "../../include/log/log.h"
+
+thread_local int32_t error_no = 0;
 
 namespace stable_infra {
     namespace util {
@@ -104,9 +109,24 @@ namespace stable_infra {
             struct stat st;
             if (fstat(fd, &st) == 0) {
                 if (S_ISSOCK(st.st_mode)) {
+                    // the protocol tells the common tcp and udp sockets apart in one call,
+                    // the type is only read for the others, e.g. AF_UNIX whose protocol is 0
+                    int protocol;
+                    socklen_t len = sizeof(protocol);
+                    if (getsockopt(fd, SOL_SOCKET, SO_PROTOCOL, &protocol, &len) != 0) {
+                        return FD_TYPE::UNKNOWN_FD;
+                    }
+                    if (protocol == IPPROTO_TCP) {
+                        return FD_TYPE::TCP_FD;
+                    } else if (protocol == IPPROTO_UDP) {
+                        return FD_TYPE::UDP_FD;
+                    }
                     int type;
-                    socklen_t len = sizeof(type);
+                    len = sizeof(type);
                     if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) == 0) {
+                        if (protocol == 0 && (type == SOCK_STREAM || type == SOCK_SEQPACKET)) {
+                            return FD_TYPE::UNIX_FD;
+                        }
                         if (type == SOCK_STREAM) {
                             return FD_TYPE::TCP_FD;
                         } else if (type == SOCK_DGRAM) {